@@ -0,0 +1,851 @@
+#include "aarch64_emulator.h"
+
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+const std::unordered_map<std::string, Mnemonic> MNEMONICS = {
+    {"mov", Mnemonic::MOV},     {"movk", Mnemonic::MOVK},
+    {"mvn", Mnemonic::MVN},     {"neg", Mnemonic::NEG},
+    {"add", Mnemonic::ADD},     {"sub", Mnemonic::SUB},
+    {"mul", Mnemonic::MUL},     {"sdiv", Mnemonic::SDIV},
+    {"msub", Mnemonic::MSUB},   {"madd", Mnemonic::MADD},
+    {"smull", Mnemonic::SMULL}, {"umull", Mnemonic::UMULL},
+    {"smulh", Mnemonic::SMULH}, {"umulh", Mnemonic::UMULH},
+    {"udiv", Mnemonic::UDIV},   {"and", Mnemonic::AND},
+    {"ands", Mnemonic::ANDS},   {"orr", Mnemonic::ORR},
+    {"eor", Mnemonic::EOR},     {"lsl", Mnemonic::LSL},
+    {"lsr", Mnemonic::LSR},     {"asr", Mnemonic::ASR},
+    {"adds", Mnemonic::ADDS},   {"subs", Mnemonic::SUBS},
+    {"tst", Mnemonic::TST},     {"cmp", Mnemonic::CMP},
+    {"cmn", Mnemonic::CMN},     {"ccmp", Mnemonic::CCMP},
+    {"ccmn", Mnemonic::CCMN},   {"cset", Mnemonic::CSET},
+    {"csetm", Mnemonic::CSETM}, {"csel", Mnemonic::CSEL},
+    {"csinc", Mnemonic::CSINC}, {"csinv", Mnemonic::CSINV},
+    {"csneg", Mnemonic::CSNEG}, {"cinc", Mnemonic::CINC},
+    {"cneg", Mnemonic::CNEG},   {"sxtb", Mnemonic::SXTB},
+    {"sxth", Mnemonic::SXTH},   {"sxtw", Mnemonic::SXTW},
+    {"uxtb", Mnemonic::UXTB},   {"uxth", Mnemonic::UXTH},
+    {"sbfx", Mnemonic::SBFX},   {"ubfx", Mnemonic::UBFX},
+    {"sbfiz", Mnemonic::SBFIZ}, {"ubfiz", Mnemonic::UBFIZ},
+    {"ldr", Mnemonic::LDR},     {"ldp", Mnemonic::LDP},
+    {"str", Mnemonic::STR},     {"stp", Mnemonic::STP},
+    {"b", Mnemonic::B},         {"cbz", Mnemonic::CBZ},
+    {"cbnz", Mnemonic::CBNZ},   {"tbz", Mnemonic::TBZ},
+    {"tbnz", Mnemonic::TBNZ},   {"ret", Mnemonic::RET}};
+
+// cs and cc are the other names of hs and lo
+const std::unordered_map<std::string, Condition> CONDITIONS = {
+    {"eq", Condition::EQ}, {"ne", Condition::NE}, {"hs", Condition::HS},
+    {"cs", Condition::HS}, {"lo", Condition::LO}, {"cc", Condition::LO},
+    {"mi", Condition::MI}, {"pl", Condition::PL}, {"vs", Condition::VS},
+    {"vc", Condition::VC}, {"hi", Condition::HI}, {"ls", Condition::LS},
+    {"ge", Condition::GE}, {"lt", Condition::LT}, {"gt", Condition::GT},
+    {"le", Condition::LE}};
+
+// Instructions whose last operand is a condition
+bool takes_condition(Mnemonic mnemonic) {
+  switch (mnemonic) {
+  case Mnemonic::CCMP:
+  case Mnemonic::CCMN:
+  case Mnemonic::CSET:
+  case Mnemonic::CSETM:
+  case Mnemonic::CSEL:
+  case Mnemonic::CSINC:
+  case Mnemonic::CSINV:
+  case Mnemonic::CSNEG:
+  case Mnemonic::CINC:
+  case Mnemonic::CNEG:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The shift an operand such as "lsl#2" (as split_operands leaves it) names
+Operand::Shift parse_shift(const std::string &text) {
+  std::string name = text.substr(0, 3);
+  if (text.size() < 4 || text[3] != '#') {
+    return Operand::Shift::NONE;
+  }
+  if (name == "lsl") {
+    return Operand::Shift::LSL;
+  }
+  if (name == "lsr") {
+    return Operand::Shift::LSR;
+  }
+  if (name == "asr") {
+    return Operand::Shift::ASR;
+  }
+  return Operand::Shift::NONE;
+}
+
+// Conditions are case-insensitive, as the assembler takes them
+Condition parse_condition(std::string text) {
+  for (char &c : text) {
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  }
+  auto found = CONDITIONS.find(text);
+  if (found == CONDITIONS.end()) {
+    throw std::runtime_error("Emulator has no condition '" + text + "'");
+  }
+  return found->second;
+}
+
+std::int64_t parse_immediate(const std::string &text) {
+  return std::stoll(text[0] == '#' ? text.substr(1) : text, nullptr, 0);
+}
+
+Operand parse_register(const std::string &text) {
+  Operand operand;
+  operand.kind = Operand::Kind::REGISTER;
+  operand.wide = true;
+
+  if (text == "fp") {
+    operand.reg = 29;
+  } else if (text == "lr") {
+    operand.reg = 30;
+  } else if (text == "sp") {
+    operand.reg = SP;
+  } else if (text == "xzr" || text == "wzr") {
+    operand.wide = text[0] == 'x';
+  } else if ((text[0] == 'w' || text[0] == 'x') && text.size() > 1) {
+    operand.reg = std::stoi(text.substr(1));
+    operand.wide = text[0] == 'x';
+  } else {
+    throw std::runtime_error("Emulator has no register '" + text + "'");
+  }
+  return operand;
+}
+
+Operand parse_operand(const std::string &text) {
+  if (text[0] == '#') {
+    Operand operand;
+    operand.value = parse_immediate(text);
+    return operand;
+  }
+  if (text[0] != '[') {
+    return parse_register(text);
+  }
+
+  // [base] or [base, #offset], with an optional ! after it
+  Operand operand;
+  std::size_t close = text.find(']');
+  std::string inside = text.substr(1, close - 1);
+  std::size_t comma = inside.find(',');
+
+  operand = parse_register(inside.substr(0, comma));
+  operand.kind = Operand::Kind::MEMORY;
+  if (comma != std::string::npos) {
+    std::size_t start = inside.find_first_not_of(' ', comma + 1);
+    operand.value = parse_immediate(inside.substr(start));
+  }
+  operand.pre_index = text.back() == '!';
+  return operand;
+}
+
+// Operands of one instruction, split on the commas outside brackets
+std::vector<std::string> split_operands(const std::string &text) {
+  std::vector<std::string> operands;
+  std::string current;
+  bool bracket = false;
+
+  for (char c : text) {
+    if (c == '[') {
+      bracket = true;
+    } else if (c == ']') {
+      bracket = false;
+    }
+    if (c == ',' && !bracket) {
+      operands.push_back(current);
+      current.clear();
+    } else if (c != ' ' || bracket) {
+      current += c;
+    }
+  }
+  if (!current.empty()) {
+    operands.push_back(current);
+  }
+  return operands;
+}
+
+// gcc writes immediates, memory offsets and shift amounts without their #
+std::string gnu_operand(const std::string &text) {
+  if (text.empty()) {
+    return text;
+  }
+  if (text[0] == '[') {
+    std::size_t comma = text.find(',');
+    if (comma == std::string::npos) {
+      return text;
+    }
+    std::size_t close = text.find(']');
+    std::string offset = text.substr(comma + 1, close - comma - 1);
+    offset.erase(0, offset.find_first_not_of(' '));
+    return text.substr(0, comma) + ", " + gnu_operand(offset) +
+           text.substr(close);
+  }
+  if (std::isdigit(static_cast<unsigned char>(text[0])) ||
+      (text[0] == '-' && text.size() > 1)) {
+    return "#" + text;
+  }
+  std::size_t space = text.find(' ');
+  if (space != std::string::npos &&
+      std::isdigit(static_cast<unsigned char>(text[space + 1]))) {
+    return text.substr(0, space + 1) + "#" + text.substr(space + 1);
+  }
+  return text;
+}
+
+} // namespace
+
+std::string from_gnu_syntax(const std::string &assembly) {
+  std::istringstream lines(assembly);
+  std::string line;
+  std::string rewritten;
+
+  while (std::getline(lines, line)) {
+    std::size_t comment = line.find("//");
+    if (comment != std::string::npos) {
+      line.erase(comment);
+      line.erase(line.find_last_not_of(" \t") + 1);
+    }
+
+    if (line == "main:") {
+      rewritten += "_main:\n";
+      continue;
+    }
+    if (line.size() < 2 || line[0] != '\t' || line[1] == '.') {
+      rewritten += line + "\n";
+      continue;
+    }
+
+    std::size_t tab = line.find('\t', 1);
+    std::string name = line.substr(1, tab == std::string::npos ? tab : tab - 1);
+    if (name.size() == 3 && name[0] == 'b' &&
+        CONDITIONS.count(name.substr(1)) > 0) {
+      name = "b." + name.substr(1);
+    }
+    rewritten += "\t" + name;
+
+    // Operands are separated by commas outside brackets
+    if (tab != std::string::npos) {
+      std::string operands = line.substr(tab + 1);
+      std::string current;
+      bool bracket = false;
+      bool first = true;
+      for (std::size_t i = 0; i <= operands.size(); ++i) {
+        char c = i < operands.size() ? operands[i] : ',';
+        if (c == '[') {
+          bracket = true;
+        } else if (c == ']') {
+          bracket = false;
+        }
+        if (c != ',' || bracket) {
+          current += c;
+          continue;
+        }
+        current.erase(0, current.find_first_not_of(' '));
+        rewritten += (first ? "\t" : ", ") + gnu_operand(current);
+        current.clear();
+        first = false;
+      }
+    }
+    rewritten += "\n";
+  }
+  return rewritten;
+}
+
+std::vector<EmulatedInstruction>
+decode(const std::string &assembly, int &entry, int &block_count) {
+  std::vector<EmulatedInstruction> program;
+  std::unordered_map<std::string, int> labels;
+  std::vector<std::string> targets;
+
+  std::istringstream lines(assembly);
+  std::string line;
+  block_count = 0;
+  bool block_open = false;
+
+  while (std::getline(lines, line)) {
+    if (line.size() < 2 || line[0] != '\t' || line[1] == '.') {
+      block_open = false;
+      if (!line.empty() && line.back() == ':') {
+        labels[line.substr(0, line.size() - 1)] =
+            static_cast<int>(program.size());
+      }
+      continue;
+    }
+
+    std::size_t tab = line.find('\t', 1);
+    std::string name = line.substr(1, tab == std::string::npos ? tab : tab - 1);
+    std::vector<std::string> operands =
+        tab == std::string::npos ? std::vector<std::string>()
+                                 : split_operands(line.substr(tab + 1));
+
+    EmulatedInstruction instruction;
+    std::string target;
+    if (name.rfind("b.", 0) == 0) {
+      instruction.mnemonic = Mnemonic::B_COND;
+      instruction.condition = parse_condition(name.substr(2));
+      target = operands.at(0);
+      operands.clear();
+    } else {
+      auto found = MNEMONICS.find(name);
+      if (found == MNEMONICS.end()) {
+        throw std::runtime_error("Emulator has no instruction '" + name + "'");
+      }
+      instruction.mnemonic = found->second;
+    }
+
+    if (instruction.mnemonic == Mnemonic::B) {
+      target = operands.at(0);
+      operands.clear();
+    } else if (instruction.mnemonic == Mnemonic::CBZ ||
+               instruction.mnemonic == Mnemonic::CBNZ) {
+      target = operands.at(1);
+      operands.pop_back();
+    } else if (instruction.mnemonic == Mnemonic::TBZ ||
+               instruction.mnemonic == Mnemonic::TBNZ) {
+      target = operands.at(2);
+      operands.pop_back();
+    } else if (takes_condition(instruction.mnemonic)) {
+      instruction.condition = parse_condition(operands.back());
+      operands.pop_back();
+    }
+
+    // A trailing "lsl #n", "lsr #n" or "asr #n" shifts the operand before
+    // it: the immediate of movk, and of add and sub, which large frames use
+    // to reach their slots, or a register in gcc's arithmetic and logic
+    Operand::Shift shift = Operand::Shift::NONE;
+    int shift_amount = 0;
+    if (operands.size() >= 3) {
+      shift = parse_shift(operands.back());
+    }
+    if (shift != Operand::Shift::NONE) {
+      shift_amount = static_cast<int>(
+          parse_immediate(operands.back().substr(operands.back().find('#'))));
+      operands.pop_back();
+    }
+
+    // A post-indexed access writes its register after the memory operand
+    if (!operands.empty() && operands.size() >= 2 &&
+        operands[operands.size() - 2][0] == '[') {
+      instruction.post_index = parse_immediate(operands.back());
+      operands.pop_back();
+    }
+
+    for (const std::string &operand : operands) {
+      instruction.operands.push_back(parse_operand(operand));
+    }
+    if (shift != Operand::Shift::NONE &&
+        instruction.mnemonic == Mnemonic::MOVK) {
+      // movk takes its shift as a third operand
+      Operand amount;
+      amount.value = shift_amount;
+      instruction.operands.push_back(amount);
+    } else if (shift != Operand::Shift::NONE) {
+      Operand &shifted = instruction.operands.back();
+      if (shifted.kind == Operand::Kind::IMMEDIATE &&
+          shift == Operand::Shift::LSL) {
+        shifted.value <<= shift_amount;
+      } else if (shifted.kind == Operand::Kind::REGISTER) {
+        shifted.shift = shift;
+        shifted.shift_amount = shift_amount;
+      } else {
+        throw std::runtime_error("Emulator cannot shift that operand");
+      }
+    }
+
+    if (!block_open) {
+      ++block_count;
+      block_open = true;
+      instruction.starts_block = true;
+    }
+    instruction.block = block_count - 1;
+
+    bool branch = !target.empty() || instruction.mnemonic == Mnemonic::RET;
+    if (branch) {
+      block_open = false;
+    }
+
+    program.push_back(std::move(instruction));
+    targets.push_back(target);
+  }
+
+  for (std::size_t i = 0; i < program.size(); ++i) {
+    if (!targets[i].empty()) {
+      auto found = labels.find(targets[i]);
+      if (found == labels.end()) {
+        throw std::runtime_error("Branch to unknown label " + targets[i]);
+      }
+      program[i].target = found->second;
+    }
+  }
+
+  auto main_label = labels.find("_main");
+  if (main_label == labels.end()) {
+    throw std::runtime_error("Assembly has no _main");
+  }
+  entry = main_label->second;
+  return program;
+}
+
+Emulation emulate(const std::vector<EmulatedInstruction> &program, int entry,
+                  int block_count) {
+  constexpr std::size_t STACK_SIZE = 1 << 20;
+  constexpr std::uint64_t STEP_LIMIT = 1ull << 32;
+
+  std::vector<unsigned char> stack(STACK_SIZE);
+  std::uint64_t registers[ZR + 1] = {};
+  registers[SP] = STACK_SIZE;
+
+  // Returning to this address ends the run
+  constexpr std::uint64_t RETURN_ADDRESS = ~0ull;
+  registers[30] = RETURN_ADDRESS;
+
+  bool n = false;
+  bool z = false;
+  bool c = false;
+  bool v = false;
+
+  // Shifts and division take the operand width into account
+  auto shift_amount = [](const Operand &width, std::uint64_t amount) {
+    return amount & (width.wide ? 63 : 31);
+  };
+  auto signed_value = [](const Operand &width, std::uint64_t value) {
+    return width.wide ? static_cast<std::int64_t>(value)
+                      : static_cast<std::int32_t>(value);
+  };
+
+  auto read = [&](const Operand &operand) -> std::uint64_t {
+    if (operand.kind == Operand::Kind::IMMEDIATE) {
+      return static_cast<std::uint64_t>(operand.value);
+    }
+    std::uint64_t value = operand.reg == ZR ? 0 : registers[operand.reg];
+    value = operand.wide ? value : static_cast<std::uint32_t>(value);
+
+    switch (operand.shift) {
+    case Operand::Shift::NONE:
+      return value;
+    case Operand::Shift::LSL:
+      value <<= operand.shift_amount;
+      break;
+    case Operand::Shift::LSR:
+      value >>= operand.shift_amount;
+      break;
+    case Operand::Shift::ASR:
+      value = static_cast<std::uint64_t>(signed_value(operand, value) >>
+                                         operand.shift_amount);
+      break;
+    }
+    return operand.wide ? value : static_cast<std::uint32_t>(value);
+  };
+
+  // Writing a w register clears the upper half of its x register
+  auto write = [&](const Operand &operand, std::uint64_t value) {
+    if (operand.reg != ZR) {
+      registers[operand.reg] =
+          operand.wide ? value : static_cast<std::uint32_t>(value);
+    }
+  };
+
+  auto address = [&](const Operand &operand, std::size_t size) {
+    std::uint64_t at = registers[operand.reg] + operand.value;
+    if (at + size > STACK_SIZE) {
+      throw std::runtime_error("Emulated access outside the stack");
+    }
+    return at;
+  };
+
+  // Sets the flags as subtracting b from a does, at the operand's width
+  auto compare = [&](const Operand &width, std::uint64_t a, std::uint64_t b) {
+    if (width.wide) {
+      std::uint64_t difference = a - b;
+      n = static_cast<std::int64_t>(difference) < 0;
+      z = difference == 0;
+      c = a >= b;
+      v = ((a ^ b) & (a ^ difference)) >> 63;
+    } else {
+      std::uint32_t a32 = static_cast<std::uint32_t>(a);
+      std::uint32_t b32 = static_cast<std::uint32_t>(b);
+      std::uint32_t difference = a32 - b32;
+      n = static_cast<std::int32_t>(difference) < 0;
+      z = difference == 0;
+      c = a32 >= b32;
+      v = ((a32 ^ b32) & (a32 ^ difference)) >> 31;
+    }
+  };
+
+  // Sets the flags as adding a and b does
+  auto add_flags = [&](const Operand &width, std::uint64_t a,
+                       std::uint64_t b) {
+    if (width.wide) {
+      std::uint64_t sum = a + b;
+      n = static_cast<std::int64_t>(sum) < 0;
+      z = sum == 0;
+      c = sum < a;
+      v = ((a ^ sum) & (b ^ sum)) >> 63;
+    } else {
+      std::uint32_t a32 = static_cast<std::uint32_t>(a);
+      std::uint32_t b32 = static_cast<std::uint32_t>(b);
+      std::uint32_t sum = a32 + b32;
+      n = static_cast<std::int32_t>(sum) < 0;
+      z = sum == 0;
+      c = sum < a32;
+      v = ((a32 ^ sum) & (b32 ^ sum)) >> 31;
+    }
+  };
+
+  // Sets the flags as a logical operation with this result does
+  auto logic_flags = [&](const Operand &width, std::uint64_t result) {
+    n = signed_value(width, result) < 0;
+    z = (width.wide ? result : static_cast<std::uint32_t>(result)) == 0;
+    c = false;
+    v = false;
+  };
+
+  auto set_flags = [&](std::int64_t flags) {
+    n = flags & 8;
+    z = flags & 4;
+    c = flags & 2;
+    v = flags & 1;
+  };
+
+  auto holds = [&](Condition condition) {
+    switch (condition) {
+    case Condition::EQ:
+      return z;
+    case Condition::NE:
+      return !z;
+    case Condition::HS:
+      return c;
+    case Condition::LO:
+      return !c;
+    case Condition::MI:
+      return n;
+    case Condition::PL:
+      return !n;
+    case Condition::VS:
+      return v;
+    case Condition::VC:
+      return !v;
+    case Condition::HI:
+      return c && !z;
+    case Condition::LS:
+      return !c || z;
+    case Condition::LT:
+      return n != v;
+    case Condition::LE:
+      return z || n != v;
+    case Condition::GT:
+      return !z && n == v;
+    case Condition::GE:
+      return n == v;
+    }
+    return false;
+  };
+
+  // The low 'bits' bits of a value, and the same sign extended
+  auto field = [](std::uint64_t value, std::int64_t bits) {
+    return bits >= 64 ? value : value & ((1ull << bits) - 1);
+  };
+  auto sign_extend = [](std::uint64_t value, std::int64_t bits) {
+    int unused = 64 - static_cast<int>(bits);
+    return static_cast<std::uint64_t>(
+        static_cast<std::int64_t>(value << unused) >> unused);
+  };
+
+  Emulation emulation;
+  emulation.block_runs.assign(block_count, 0);
+
+  std::size_t pc = entry;
+  while (true) {
+    if (pc >= program.size()) {
+      throw std::runtime_error("Emulated code ran past the end");
+    }
+    if (++emulation.retired > STEP_LIMIT) {
+      throw std::runtime_error("Emulated code did not return");
+    }
+
+    const EmulatedInstruction &instruction = program[pc];
+    const std::vector<Operand> &operands = instruction.operands;
+    if (instruction.starts_block) {
+      ++emulation.block_runs[instruction.block];
+    }
+    ++pc;
+
+    switch (instruction.mnemonic) {
+    case Mnemonic::MOV:
+      write(operands[0], read(operands[1]));
+      break;
+    case Mnemonic::MOVK: {
+      int shift = operands.size() > 2 ? static_cast<int>(operands[2].value) : 0;
+      std::uint64_t mask = 0xffffull << shift;
+      write(operands[0], (read(operands[0]) & ~mask) |
+                             (static_cast<std::uint64_t>(operands[1].value)
+                              << shift));
+      break;
+    }
+    case Mnemonic::MVN:
+      write(operands[0], ~read(operands[1]));
+      break;
+    case Mnemonic::NEG:
+      write(operands[0], 0 - read(operands[1]));
+      break;
+    case Mnemonic::ADD:
+      write(operands[0], read(operands[1]) + read(operands[2]));
+      break;
+    case Mnemonic::SUB:
+      write(operands[0], read(operands[1]) - read(operands[2]));
+      break;
+    case Mnemonic::MUL:
+      write(operands[0], read(operands[1]) * read(operands[2]));
+      break;
+    case Mnemonic::SDIV: {
+      // Division by zero gives 0, and the one overflowing quotient wraps
+      std::int64_t dividend = signed_value(operands[0], read(operands[1]));
+      std::int64_t divisor = signed_value(operands[0], read(operands[2]));
+      std::int64_t quotient = 0;
+      if (divisor == -1) {
+        quotient = static_cast<std::int64_t>(0 - static_cast<std::uint64_t>(dividend));
+      } else if (divisor != 0) {
+        quotient = dividend / divisor;
+      }
+      write(operands[0], static_cast<std::uint64_t>(quotient));
+      break;
+    }
+    case Mnemonic::MSUB:
+      write(operands[0],
+            read(operands[3]) - read(operands[1]) * read(operands[2]));
+      break;
+    case Mnemonic::MADD:
+      write(operands[0],
+            read(operands[3]) + read(operands[1]) * read(operands[2]));
+      break;
+    case Mnemonic::SMULL:
+      write(operands[0], static_cast<std::uint64_t>(
+                             signed_value(operands[1], read(operands[1])) *
+                             signed_value(operands[2], read(operands[2]))));
+      break;
+    case Mnemonic::UMULL:
+      write(operands[0], read(operands[1]) * read(operands[2]));
+      break;
+    case Mnemonic::SMULH: {
+      __int128 product =
+          static_cast<__int128>(static_cast<std::int64_t>(read(operands[1]))) *
+          static_cast<std::int64_t>(read(operands[2]));
+      write(operands[0], static_cast<std::uint64_t>(product >> 64));
+      break;
+    }
+    case Mnemonic::UMULH: {
+      unsigned __int128 product =
+          static_cast<unsigned __int128>(read(operands[1])) *
+          read(operands[2]);
+      write(operands[0], static_cast<std::uint64_t>(product >> 64));
+      break;
+    }
+    case Mnemonic::UDIV: {
+      std::uint64_t divisor = read(operands[2]);
+      write(operands[0], divisor == 0 ? 0 : read(operands[1]) / divisor);
+      break;
+    }
+    case Mnemonic::AND:
+      write(operands[0], read(operands[1]) & read(operands[2]));
+      break;
+    case Mnemonic::ANDS: {
+      std::uint64_t result = read(operands[1]) & read(operands[2]);
+      write(operands[0], result);
+      logic_flags(operands[0], result);
+      break;
+    }
+    case Mnemonic::TST:
+      logic_flags(operands[0], read(operands[0]) & read(operands[1]));
+      break;
+    case Mnemonic::ORR:
+      write(operands[0], read(operands[1]) | read(operands[2]));
+      break;
+    case Mnemonic::EOR:
+      write(operands[0], read(operands[1]) ^ read(operands[2]));
+      break;
+    case Mnemonic::LSL:
+      write(operands[0], read(operands[1])
+                             << shift_amount(operands[0], read(operands[2])));
+      break;
+    case Mnemonic::LSR:
+      write(operands[0], read(operands[1]) >>
+                             shift_amount(operands[0], read(operands[2])));
+      break;
+    case Mnemonic::ASR:
+      write(operands[0],
+            static_cast<std::uint64_t>(
+                signed_value(operands[0], read(operands[1])) >>
+                shift_amount(operands[0], read(operands[2]))));
+      break;
+    case Mnemonic::ADDS: {
+      std::uint64_t a = read(operands[1]);
+      std::uint64_t b = read(operands[2]);
+      write(operands[0], a + b);
+      add_flags(operands[0], a, b);
+      break;
+    }
+    case Mnemonic::SUBS: {
+      std::uint64_t a = read(operands[1]);
+      std::uint64_t b = read(operands[2]);
+      write(operands[0], a - b);
+      compare(operands[0], a, b);
+      break;
+    }
+    case Mnemonic::CMP:
+      compare(operands[0], read(operands[0]), read(operands[1]));
+      break;
+    case Mnemonic::CMN:
+      add_flags(operands[0], read(operands[0]), read(operands[1]));
+      break;
+    case Mnemonic::CCMP:
+      if (holds(instruction.condition)) {
+        compare(operands[0], read(operands[0]), read(operands[1]));
+      } else {
+        set_flags(operands[2].value);
+      }
+      break;
+    case Mnemonic::CCMN:
+      if (holds(instruction.condition)) {
+        add_flags(operands[0], read(operands[0]), read(operands[1]));
+      } else {
+        set_flags(operands[2].value);
+      }
+      break;
+    case Mnemonic::CSET:
+      write(operands[0], holds(instruction.condition) ? 1 : 0);
+      break;
+    case Mnemonic::CSETM:
+      write(operands[0], holds(instruction.condition) ? ~0ull : 0);
+      break;
+    case Mnemonic::CSEL:
+      write(operands[0], holds(instruction.condition) ? read(operands[1])
+                                                      : read(operands[2]));
+      break;
+    case Mnemonic::CSINC:
+      write(operands[0], holds(instruction.condition) ? read(operands[1])
+                                                      : read(operands[2]) + 1);
+      break;
+    case Mnemonic::CSINV:
+      write(operands[0], holds(instruction.condition) ? read(operands[1])
+                                                      : ~read(operands[2]));
+      break;
+    case Mnemonic::CSNEG:
+      write(operands[0], holds(instruction.condition) ? read(operands[1])
+                                                      : 0 - read(operands[2]));
+      break;
+    case Mnemonic::CINC:
+      write(operands[0], read(operands[1]) +
+                             (holds(instruction.condition) ? 1 : 0));
+      break;
+    case Mnemonic::CNEG:
+      write(operands[0], holds(instruction.condition) ? 0 - read(operands[1])
+                                                      : read(operands[1]));
+      break;
+    case Mnemonic::SXTB:
+      write(operands[0], sign_extend(read(operands[1]), 8));
+      break;
+    case Mnemonic::SXTH:
+      write(operands[0], sign_extend(read(operands[1]), 16));
+      break;
+    case Mnemonic::SXTW:
+      write(operands[0], sign_extend(read(operands[1]), 32));
+      break;
+    case Mnemonic::UXTB:
+      write(operands[0], field(read(operands[1]), 8));
+      break;
+    case Mnemonic::UXTH:
+      write(operands[0], field(read(operands[1]), 16));
+      break;
+    case Mnemonic::SBFX:
+      write(operands[0], sign_extend(read(operands[1]) >> operands[2].value,
+                                     operands[3].value));
+      break;
+    case Mnemonic::UBFX:
+      write(operands[0],
+            field(read(operands[1]) >> operands[2].value, operands[3].value));
+      break;
+    case Mnemonic::SBFIZ:
+      write(operands[0], sign_extend(read(operands[1]), operands[3].value)
+                             << operands[2].value);
+      break;
+    case Mnemonic::UBFIZ:
+      write(operands[0], field(read(operands[1]), operands[3].value)
+                             << operands[2].value);
+      break;
+    case Mnemonic::LDR:
+    case Mnemonic::LDP:
+    case Mnemonic::STR:
+    case Mnemonic::STP: {
+      const Operand &memory = operands.back();
+      std::size_t size = operands[0].wide ? 8 : 4;
+      std::uint64_t at = address(memory, size * (operands.size() - 1));
+
+      for (std::size_t i = 0; i + 1 < operands.size(); ++i) {
+        if (instruction.mnemonic == Mnemonic::LDR ||
+            instruction.mnemonic == Mnemonic::LDP) {
+          std::uint64_t value = 0;
+          std::memcpy(&value, &stack[at + i * size], size);
+          write(operands[i], value);
+        } else {
+          std::uint64_t value = read(operands[i]);
+          std::memcpy(&stack[at + i * size], &value, size);
+        }
+      }
+      if (memory.pre_index) {
+        registers[memory.reg] = at;
+      }
+      registers[memory.reg] += instruction.post_index;
+      break;
+    }
+    case Mnemonic::B:
+      pc = instruction.target;
+      break;
+    case Mnemonic::B_COND:
+      if (holds(instruction.condition)) {
+        pc = instruction.target;
+      }
+      break;
+    case Mnemonic::CBZ:
+      if (read(operands[0]) == 0) {
+        pc = instruction.target;
+      }
+      break;
+    case Mnemonic::CBNZ:
+      if (read(operands[0]) != 0) {
+        pc = instruction.target;
+      }
+      break;
+    case Mnemonic::TBZ:
+    case Mnemonic::TBNZ: {
+      bool set = (read(operands[0]) >> operands[1].value) & 1;
+      if (set == (instruction.mnemonic == Mnemonic::TBNZ)) {
+        pc = instruction.target;
+      }
+      break;
+    }
+    case Mnemonic::RET:
+      pc = registers[30];
+      break;
+    }
+
+    if (pc == RETURN_ADDRESS) {
+      break;
+    }
+  }
+
+  if (registers[SP] != STACK_SIZE) {
+    throw std::runtime_error("Emulated code left the stack unbalanced");
+  }
+  emulation.result = static_cast<std::int32_t>(registers[0]);
+  return emulation;
+}
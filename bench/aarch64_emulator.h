@@ -0,0 +1,143 @@
+#ifndef AARCH64_EMULATOR_H
+#define AARCH64_EMULATOR_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+A small emulator for the AArch64 code AstAssembly generates, for the
+benchmarks and the fuzzer to run it on a host that is not AArch64.
+
+It implements the instructions the code generator and the scheduler emit,
+and the integer ones gcc emits for the benchmark kernels, on a private
+stack, and counts what it retires by basic block (split the way
+estimate_cycles splits them). An instruction it does not know is an error
+rather than a guess.
+*/
+
+enum class Mnemonic {
+  MOV,
+  MOVK,
+  MVN,
+  NEG,
+  ADD,
+  SUB,
+  MUL,
+  SDIV,
+  MSUB,
+  MADD,
+  SMULL,
+  UMULL,
+  SMULH,
+  UMULH,
+  UDIV,
+  AND,
+  ANDS,
+  ORR,
+  EOR,
+  LSL,
+  LSR,
+  ASR,
+  ADDS,
+  SUBS,
+  TST,
+  CMP,
+  CMN,
+  CCMP,
+  CCMN,
+  CSET,
+  CSETM,
+  CSEL,
+  CSINC,
+  CSINV,
+  CSNEG,
+  CINC,
+  CNEG,
+  SXTB,
+  SXTH,
+  SXTW,
+  UXTB,
+  UXTH,
+  SBFX,
+  UBFX,
+  SBFIZ,
+  UBFIZ,
+  LDR,
+  LDP,
+  STR,
+  STP,
+  B,
+  B_COND,
+  CBZ,
+  CBNZ,
+  TBZ,
+  TBNZ,
+  RET
+};
+
+enum class Condition { EQ, NE, HS, LO, MI, PL, VS, VC, HI, LS, GE, LT, GT, LE };
+
+// Registers 0-30 are x0-x30 (fp is 29, lr 30), then sp and the zero register
+constexpr int SP = 31;
+constexpr int ZR = 32;
+
+struct Operand {
+  enum class Kind { REGISTER, IMMEDIATE, MEMORY };
+  enum class Shift { NONE, LSL, LSR, ASR };
+
+  Kind kind = Kind::IMMEDIATE;
+  int reg = ZR;
+  bool wide = false;
+
+  // The immediate, or the offset of a memory operand
+  std::int64_t value = 0;
+
+  // Memory operand written as [reg, #offset]!, which updates reg first
+  bool pre_index = false;
+
+  // Register operand followed by "lsl #n", "lsr #n" or "asr #n", shifted
+  // by n before it is used
+  Shift shift = Shift::NONE;
+  int shift_amount = 0;
+};
+
+struct EmulatedInstruction {
+  Mnemonic mnemonic;
+  Condition condition = Condition::EQ;
+  std::vector<Operand> operands;
+
+  // Index of the branch target, and the amount a post-indexed memory
+  // operand ([reg], #amount) adds to its register afterwards
+  int target = -1;
+  std::int64_t post_index = 0;
+
+  // The basic block it belongs to, counted the way estimate_cycles does,
+  // and whether it is the block's first instruction. Branches only go to
+  // labels, which start blocks, so a block runs when its first one does
+  int block = 0;
+  bool starts_block = false;
+};
+
+struct Emulation {
+  std::int32_t result = 0;
+  std::uint64_t retired = 0;
+  std::vector<std::uint64_t> block_runs;
+};
+
+// Decodes the instructions of the assembly, starting a new block at each
+// label or other line that is not an instruction and after each branch.
+// 'entry' is the index of _main
+std::vector<EmulatedInstruction>
+decode(const std::string &assembly, int &entry, int &block_count);
+
+// Rewrites gcc's spelling of AArch64 assembly into the one AstAssembly
+// writes, which decode and estimate_cycles read: immediates get their #,
+// conditional branches are written b.cond, and main is _main
+std::string from_gnu_syntax(const std::string &assembly);
+
+// Runs the function at 'entry' until it returns, on a stack of its own
+Emulation emulate(const std::vector<EmulatedInstruction> &program, int entry,
+                  int block_count);
+
+#endif
@@ -0,0 +1,358 @@
+#include "aarch64_emulator.h"
+#include "ast.h"
+#include "ast_factory.h"
+#include "bytecode.h"
+#include "codegen.h"
+#include "constant_propagation.h"
+#include "cse.h"
+#include "dead_code.h"
+#include "interpreter.h"
+#include "lex.h"
+#include "loop_optimization.h"
+#include "parser.h"
+#include "resolver.h"
+#include "scheduler.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+Measures the code AstAssembly generates on a corpus of kernels in the subset
+the compiler accepts.
+
+There is no native backend for the machine this runs on, so the AArch64 code
+runs on the emulator in aarch64_emulator.h. It counts instructions retired,
+and weights the scheduler's per-block cycle estimate (see scheduler.h) by
+how often each block ran. Code size is 4 bytes per instruction.
+
+When aarch64-linux-gnu-gcc is on the PATH, each kernel is also compiled
+with it at -O0 and -O2, and its assembly runs on the same emulator and is
+measured the same way, so the rows compare. Code the emulator cannot decode
+skips that row, giving the reason. Without the cross compiler the gcc rows
+are skipped, and the JSON says so: the host gcc emits x86-64, and nothing it
+could report is in the same unit as an emulated AArch64 count. Each kernel
+is still built with the host gcc at -O0 and -O2 and run, and its exit code,
+like every emulated result, must match the interpreter. Results are also
+written as JSON (codegen_bench.json, or the path given) to track optimizer
+work over time.
+*/
+
+struct Kernel {
+  const char *name;
+  const char *source;
+};
+
+// Results are masked to a byte, the part an exit code keeps, and every
+// intermediate value stays small so no kernel overflows in C either
+const Kernel KERNELS[] = {
+    {"sum of squares",
+     "int main() { int s = 0;"
+     " for (int i = 0; i < 3000000; i = i + 1) {"
+     " s = (s + (i & 1023) * (i & 1023)) & 65535; }"
+     " return s & 255; }"},
+    {"collatz",
+     "int main() { int steps = 0;"
+     " for (int n = 1; n < 10000; n = n + 1) { int x = n;"
+     " while (x != 1) {"
+     " x = (x % 2) * (3 * x + 1) + (1 - x % 2) * (x / 2);"
+     " steps = steps + 1; } }"
+     " return steps & 255; }"},
+    {"gcd",
+     "int main() { int s = 0;"
+     " for (int i = 1; i < 400; i = i + 1) {"
+     " for (int j = 1; j < 400; j = j + 1) {"
+     " int a = i; int b = j;"
+     " while (b != 0) { int t = a % b; a = b; b = t; }"
+     " s = s + a; } }"
+     " return s & 255; }"},
+    {"primes",
+     "int main() { int count = 0;"
+     " for (int n = 2; n < 40000; n = n + 1) {"
+     " int prime = 1; int d = 2;"
+     " while (d * d <= n && prime) { prime = n % d != 0; d = d + 1; }"
+     " count = count + prime; }"
+     " return count & 255; }"},
+    {"hash mix",
+     "int main() { int h = 7;"
+     " for (int i = 0; i < 2000000; i = i + 1) {"
+     " h = ((h ^ i) * 31 + (h >> 3)) & 1048575; }"
+     " return h & 255; }"},
+    {"predicates",
+     "int main() { int count = 0;"
+     " for (int i = 0; i < 1000; i = i + 1) {"
+     " for (int j = 0; j < 1000; j = j + 1) {"
+     " count = count + ((i % 3 == 0 || j % 5 == 0) && (i + j) % 7 != 0);"
+     " } }"
+     " return count & 255; }"},
+};
+
+std::unique_ptr<FunctionDecl> parse_kernel(const Kernel &kernel,
+                                           const std::vector<Token> &tokens,
+                                           ExprFactory &factory) {
+  Parser parser(tokens, factory);
+  std::unique_ptr<FunctionDecl> function = parser.parse();
+
+  Resolver resolver;
+  if (!parser.get_diagnostics().empty() || !resolver.resolve(function.get())) {
+    throw std::runtime_error(std::string(kernel.name) + " does not compile");
+  }
+  return function;
+}
+
+// Compiles the kernel the way the compiler does, returning the scheduled
+// assembly, and its result from the interpreter in 'result'
+std::string compile(const Kernel &kernel, std::int32_t &result) {
+  std::vector<Token> tokens = lex(kernel.source);
+  ExprFactory factory;
+  std::unique_ptr<FunctionDecl> function =
+      parse_kernel(kernel, tokens, factory);
+
+  BytecodeCompiler bytecode_compiler;
+  result = interpret(bytecode_compiler.compile(function.get()));
+
+  int changes;
+  do {
+    changes = propagate_constants(function.get());
+    changes += eliminate_dead_code(function.get());
+  } while (changes > 0);
+  optimize_loops(function.get());
+  eliminate_common_subexpressions(function.get());
+
+  std::ostringstream assembly;
+  AstAssembly codegen;
+  codegen.generate(function.get(), assembly);
+  return schedule_instructions(assembly.str());
+}
+
+const char CROSS_GCC[] = "aarch64-linux-gnu-gcc";
+
+struct Measurement {
+  std::int64_t retired = 0;
+  std::int64_t cycles = 0;
+  std::int64_t code_bytes = 0;
+};
+
+// Retired instructions and the estimated cycles of every block that ran,
+// with 4 bytes per instruction
+Measurement measure(const std::string &assembly, std::int32_t expected) {
+  int entry;
+  int block_count;
+  std::vector<EmulatedInstruction> program =
+      decode(assembly, entry, block_count);
+
+  CycleEstimate estimate = estimate_cycles(assembly);
+  if (static_cast<int>(estimate.blocks.size()) != block_count ||
+      estimate.instructions != static_cast<int>(program.size())) {
+    throw std::runtime_error("Emulator and scheduler disagree on the blocks");
+  }
+
+  Emulation emulation = emulate(program, entry, block_count);
+  if (emulation.result != expected) {
+    throw std::runtime_error("Emulated result " +
+                             std::to_string(emulation.result) +
+                             " differs from the interpreter's " +
+                             std::to_string(expected));
+  }
+
+  Measurement measurement;
+  measurement.retired = static_cast<std::int64_t>(emulation.retired);
+  for (int block = 0; block < block_count; ++block) {
+    measurement.cycles += static_cast<std::int64_t>(
+        emulation.block_runs[block] * estimate.blocks[block].cycles);
+  }
+  measurement.code_bytes = 4 * static_cast<std::int64_t>(program.size());
+  return measurement;
+}
+
+void build(const std::string &flags, const std::filesystem::path &source,
+           const std::filesystem::path &binary) {
+  std::string command = "gcc " + flags + " -w -o '" + binary.string() + "' '" +
+                        source.string() + "'";
+  if (std::system(command.c_str()) != 0) {
+    throw std::runtime_error("Failed to run: " + command);
+  }
+}
+
+// Builds the kernel with gcc at one optimization level and runs it, failing
+// unless it exits with the interpreter's result
+void check_gcc(const Kernel &kernel, const std::string &flags,
+               const std::filesystem::path &directory, std::int32_t expected) {
+  std::filesystem::path source = directory / "kernel.c";
+  std::filesystem::path binary = directory / "kernel";
+  std::ofstream(source) << kernel.source << "\n";
+  build(flags, source, binary);
+
+  int status = std::system(("'" + binary.string() + "'").c_str());
+  int exit_code = status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  if (exit_code != (expected & 255)) {
+    throw std::runtime_error("gcc " + flags + " exits with " +
+                             std::to_string(exit_code) +
+                             " where the interpreter returns " +
+                             std::to_string(expected));
+  }
+}
+
+bool cross_gcc_installed() {
+  std::string command = std::string("command -v ") + CROSS_GCC + " >/dev/null";
+  return std::system(command.c_str()) == 0;
+}
+
+// Compiles the kernel to assembly with the cross compiler and measures it
+// on the emulator. Returns the reason instead if the emulator cannot decode
+// it, and fails if it runs and disagrees with the interpreter
+std::string measure_cross_gcc(const Kernel &kernel, const std::string &flags,
+                              const std::filesystem::path &directory,
+                              std::int32_t expected, Measurement &measurement) {
+  std::filesystem::path source = directory / "kernel.c";
+  std::filesystem::path output = directory / "kernel.s";
+  std::ofstream(source) << kernel.source << "\n";
+
+  std::string command = std::string(CROSS_GCC) + " " + flags + " -S -w -o '" +
+                        output.string() + "' '" + source.string() + "'";
+  if (std::system(command.c_str()) != 0) {
+    throw std::runtime_error("Failed to run: " + command);
+  }
+
+  std::ifstream file(output);
+  std::stringstream text;
+  text << file.rdbuf();
+  std::string assembly = from_gnu_syntax(text.str());
+
+  try {
+    int entry;
+    int block_count;
+    decode(assembly, entry, block_count);
+  } catch (const std::runtime_error &e) {
+    return e.what();
+  }
+
+  try {
+    measurement = measure(assembly, expected);
+  } catch (const std::runtime_error &e) {
+    throw std::runtime_error(std::string(CROSS_GCC) + " " + flags + ": " +
+                             e.what());
+  }
+  return "";
+}
+
+// A string as a JSON string literal
+std::string json_string(const std::string &text) {
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+    }
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+std::string json_measurement(const Measurement &measurement) {
+  return "{\"instructions_retired\": " + std::to_string(measurement.retired) +
+         ", \"estimated_a72_cycles\": " + std::to_string(measurement.cycles) +
+         ", \"code_bytes\": " + std::to_string(measurement.code_bytes) + "}";
+}
+
+std::string describe(const Measurement &measurement) {
+  return std::to_string(measurement.retired) + " instructions, " +
+         std::to_string(measurement.cycles) + " A72 cycles, " +
+         std::to_string(measurement.code_bytes) + " bytes";
+}
+
+// Measures every kernel's code, and the cross compiler's if there is one,
+// failing if any of it or the host gcc's builds disagree with the
+// interpreter
+int main(int argc, char **argv) {
+  std::string json_path = argc > 1 ? argv[1] : "codegen_bench.json";
+  std::filesystem::path directory =
+      std::filesystem::temp_directory_path() /
+      ("codegen_bench." + std::to_string(getpid()));
+  std::filesystem::create_directories(directory);
+
+  bool cross = cross_gcc_installed();
+  std::ostringstream json;
+  json << "{";
+  if (!cross) {
+    std::string reason = std::string(CROSS_GCC) + " is not on the PATH";
+    std::cout << "Skipping the gcc rows: " << reason << "\n";
+    json << "\"gcc_emulated_aarch64\": "
+         << json_string("skipped: " + reason) << ",\n ";
+  }
+  json << "\"kernels\": [";
+
+  try {
+    bool first = true;
+    for (const Kernel &kernel : KERNELS) {
+      std::int32_t result;
+      std::string assembly = compile(kernel, result);
+
+      Measurement compiler;
+      try {
+        compiler = measure(assembly, result);
+      } catch (const std::runtime_error &e) {
+        throw std::runtime_error(std::string(kernel.name) + ": " + e.what());
+      }
+      check_gcc(kernel, "-O0", directory, result);
+      check_gcc(kernel, "-O2", directory, result);
+
+      std::cout << kernel.name << " (result " << result
+                << "): " << describe(compiler) << "\n";
+
+      json << (first ? "\n" : ",\n") << "  {\"name\": \"" << kernel.name
+           << "\", \"result\": " << result
+           << ",\n   \"emulated_aarch64\": " << json_measurement(compiler);
+      first = false;
+
+      if (!cross) {
+        json << "}";
+        continue;
+      }
+
+      json << ",\n   \"gcc_emulated_aarch64\": {";
+      for (const std::string level : {"-O0", "-O2"}) {
+        Measurement gcc;
+        std::string skipped;
+        try {
+          skipped = measure_cross_gcc(kernel, level, directory, result, gcc);
+        } catch (const std::runtime_error &e) {
+          throw std::runtime_error(std::string(kernel.name) + ": " + e.what());
+        }
+
+        // Keyed by the level without its dash, "O0" and "O2"
+        json << (level == "-O0" ? "" : ", ") << "\"" << level.substr(1)
+             << "\": ";
+        if (skipped.empty()) {
+          std::cout << "  gcc " << level << ": " << describe(gcc) << "\n";
+          json << json_measurement(gcc);
+        } else {
+          std::cout << "  gcc " << level << " skipped: " << skipped << "\n";
+          json << json_string("skipped: " + skipped);
+        }
+      }
+      json << "}}";
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    std::filesystem::remove_all(directory);
+    return EXIT_FAILURE;
+  }
+
+  std::filesystem::remove_all(directory);
+
+  json << "\n]}\n";
+  std::ofstream(json_path) << json.str();
+  std::cout << "Results written to " << json_path << "\n";
+
+  return EXIT_SUCCESS;
+}
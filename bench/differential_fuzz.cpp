@@ -0,0 +1,508 @@
+#include "aarch64_emulator.h"
+#include "ast.h"
+#include "ast_factory.h"
+#include "bytecode.h"
+#include "codegen.h"
+#include "constant_propagation.h"
+#include "cse.h"
+#include "dead_code.h"
+#include "diagnostic.h"
+#include "incremental.h"
+#include "interpreter.h"
+#include "lex.h"
+#include "loop_optimization.h"
+#include "parser.h"
+#include "program_generator.h"
+#include "resolver.h"
+#include "scheduler.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+Differential testing of the whole compiler on random programs.
+
+Each program from program_generator.h is well-defined C, so it has one
+right answer. The interpreter's result on the unoptimized tree is the
+reference, and the program is then compiled under each configuration below
+and its code run on the emulator in aarch64_emulator.h, which must return
+exactly the same 32-bit value. Every program is also built with gcc -O0 and
+run natively, and its exit code must match the reference's low byte, which
+checks the reference (and the generator) against a compiler we did not
+write.
+
+There is no native backend for the machine this runs on, so the emulator
+stands in for running our code; configurations differ only in the passes,
+so a mismatch in one of them points at that pass.
+
+The incremental compiler (incremental.h) is checked on a sequence of edits
+to the program: a statement inserted, a literal modified, the statement
+deleted, and then at once the literal put back and a declaration split in
+two. After each edit its code must match that of a fresh compile of the
+same source, up to label numbers, and the code of the last one, which means
+what the program does, is run as well.
+
+  differential_fuzz [--no-gcc] [programs [seed]]
+  differential_fuzz [--no-gcc] file.c...
+
+Programs that fail are saved as differential_fuzz.<seed>.<n>.c and the run
+exits with a failure. Given files, it checks those programs instead, which
+replays a saved failure. Throughput is reported for the in-process checks and
+the gcc builds separately, the former being what a pass change costs to
+validate.
+*/
+
+struct Configuration {
+  const char *name;
+  bool hash_cons;
+  bool optimize;
+  bool schedule;
+};
+
+const Configuration CONFIGURATIONS[] = {
+    {"unoptimized", false, false, false},
+    {"optimized", false, true, false},
+    {"scheduled", false, true, true},
+    {"hash-consed", true, true, true},
+};
+
+// Lexes, parses and resolves the source, throwing on any diagnostic. The
+// tree borrows from 'tokens' and 'factory'
+std::unique_ptr<FunctionDecl> front_end(const std::string &source,
+                                        std::vector<Token> &tokens,
+                                        ExprFactory &factory) {
+  tokens = lex(source);
+  Parser parser(tokens, factory);
+  std::unique_ptr<FunctionDecl> function = parser.parse();
+
+  Resolver resolver;
+  const std::vector<Diagnostic> *diagnostics = &parser.get_diagnostics();
+  if (diagnostics->empty() && !resolver.resolve(function.get())) {
+    diagnostics = &resolver.get_diagnostics();
+  }
+  if (!diagnostics->empty()) {
+    const Diagnostic &first = diagnostics->front();
+    throw std::runtime_error("rejected at " + std::to_string(first.line) +
+                             ":" + std::to_string(first.column) + ": " +
+                             first.message);
+  }
+  return function;
+}
+
+std::int32_t reference_result(const std::string &source) {
+  std::vector<Token> tokens;
+  ExprFactory factory;
+  std::unique_ptr<FunctionDecl> function = front_end(source, tokens, factory);
+
+  BytecodeCompiler bytecode_compiler;
+  return interpret(bytecode_compiler.compile(function.get()));
+}
+
+// Compiles the source under 'configuration' and runs the code
+std::int32_t emulated_result(const std::string &source,
+                             const Configuration &configuration) {
+  std::vector<Token> tokens;
+  ExprFactory factory(configuration.hash_cons);
+  std::unique_ptr<FunctionDecl> function = front_end(source, tokens, factory);
+
+  if (configuration.optimize) {
+    int changes;
+    do {
+      changes = propagate_constants(function.get());
+      changes += eliminate_dead_code(function.get());
+    } while (changes > 0);
+    optimize_loops(function.get());
+    eliminate_common_subexpressions(function.get());
+  }
+
+  std::ostringstream assembly;
+  AstAssembly codegen;
+  codegen.generate(function.get(), assembly);
+  std::string code = assembly.str();
+  if (configuration.schedule) {
+    code = schedule_instructions(code);
+  }
+
+  int entry;
+  int block_count;
+  std::vector<EmulatedInstruction> program = decode(code, entry, block_count);
+  return emulate(program, entry, block_count).result;
+}
+
+// The assembly with its labels numbered in order of appearance, as an
+// incremental compile numbers them on from where the previous one stopped
+std::string renumber_labels(const std::string &assembly) {
+  const std::string prefix = "_label_";
+  std::unordered_map<std::string, int> numbers;
+  std::string renumbered;
+
+  std::size_t next = 0;
+  for (std::size_t at = assembly.find(prefix); at != std::string::npos;
+       at = assembly.find(prefix, next)) {
+    std::size_t end = assembly.find_first_not_of("0123456789",
+                                                 at + prefix.size());
+    end = end == std::string::npos ? assembly.size() : end;
+    auto inserted = numbers.emplace(assembly.substr(at, end - at),
+                                    static_cast<int>(numbers.size()));
+    renumbered.append(assembly, next, at - next);
+    renumbered += prefix + std::to_string(inserted.first->second);
+    next = end;
+  }
+  renumbered.append(assembly, next, std::string::npos);
+  return renumbered;
+}
+
+// The edits of check_incremental, each a function of the lines before it.
+// An edit that finds nothing to change leaves them as they are
+using Lines = std::vector<std::string>;
+
+// A declaration of its own after the line opening the body
+Lines insert_statement(Lines lines) {
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    if (!lines[i].empty() && lines[i].back() == '{') {
+      lines.insert(lines.begin() + i + 1, "  int edited = 7;");
+      break;
+    }
+  }
+  return lines;
+}
+
+Lines delete_statement(Lines lines) {
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    if (lines[i] == "  int edited = 7;") {
+      lines.erase(lines.begin() + i);
+      break;
+    }
+  }
+  return lines;
+}
+
+// 'line' with one added to its first number
+std::string modify_literal(std::string line) {
+  for (std::size_t i = 0; i < line.size(); ++i) {
+    bool starts_number =
+        std::isdigit(static_cast<unsigned char>(line[i])) &&
+        (i == 0 || (!std::isalnum(static_cast<unsigned char>(line[i - 1])) &&
+                    line[i - 1] != '_'));
+    if (starts_number) {
+      std::size_t end = line.find_first_not_of("0123456789", i);
+      std::string digits = line.substr(i, end - i);
+      return line.replace(i, digits.size(),
+                          std::to_string(std::stol(digits) + 1));
+    }
+  }
+  return line;
+}
+
+// Replaces the first line that reads 'from'
+Lines replace_line(Lines lines, const std::string &from,
+                   const std::string &to) {
+  for (std::string &line : lines) {
+    if (line == from) {
+      line = to;
+      break;
+    }
+  }
+  return lines;
+}
+
+// The first 'int v = e;' becomes 'int v = 0;' and 'v = e;', which means
+// the same
+Lines split_declaration(Lines lines) {
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    const std::string &line = lines[i];
+    std::size_t start = line.find_first_not_of(' ');
+    std::size_t equals = line.find(" = ");
+    if (start == std::string::npos || line.compare(start, 4, "int ") != 0 ||
+        equals == std::string::npos || line.back() != ';') {
+      continue;
+    }
+
+    std::string indent = line.substr(0, start);
+    std::string name = line.substr(start + 4, equals - start - 4);
+    std::string value = line.substr(equals + 3);
+    lines[i] = indent + "int " + name + " = 0;";
+    lines.insert(lines.begin() + i + 1, indent + name + " = " + value);
+    break;
+  }
+  return lines;
+}
+
+std::string join(const Lines &lines) {
+  std::string source;
+  for (const std::string &line : lines) {
+    source += line + "\n";
+  }
+  return source;
+}
+
+// Compiles the source, then the edits of it in turn, with one incremental
+// compiler, and returns a description of every disagreement with a fresh
+// compile or, at the end, with the interpreter
+std::vector<std::string> check_incremental(const std::string &source,
+                                           std::int32_t expected) {
+  Lines lines;
+  std::istringstream stream(source);
+  for (std::string line; std::getline(stream, line);) {
+    lines.push_back(line);
+  }
+
+  struct Step {
+    const char *name;
+    Lines lines;
+  };
+  std::vector<Step> steps = {{"first compile", lines}};
+  std::string middle = lines.empty() ? "" : lines[lines.size() / 2];
+  std::string modified = modify_literal(middle);
+  steps.push_back({"insert", insert_statement(steps.back().lines)});
+  steps.push_back(
+      {"modify", replace_line(steps.back().lines, middle, modified)});
+  steps.push_back({"delete", delete_statement(steps.back().lines)});
+  steps.push_back({"modify back and split",
+                   split_declaration(
+                       replace_line(steps.back().lines, modified, middle))});
+
+  std::vector<std::string> failures;
+  IncrementalCompiler compiler;
+  for (const Step &step : steps) {
+    std::string edited = join(step.lines);
+    bool compiled = compiler.compile(edited);
+    if (&step == &steps.front()) {
+      // The first compile is a fresh one
+      continue;
+    }
+
+    IncrementalCompiler fresh;
+    bool fresh_compiled = fresh.compile(edited);
+
+    std::string name = std::string("incremental, ") + step.name;
+    if (compiled != fresh_compiled) {
+      failures.push_back(name + ": " +
+                         (compiled ? "compiles" : "does not compile") +
+                         ", unlike a fresh compile");
+    } else if (compiled && renumber_labels(compiler.get_assembly()) !=
+                               renumber_labels(fresh.get_assembly())) {
+      failures.push_back(name + ": code differs from a fresh compile");
+    }
+  }
+
+  try {
+    int entry;
+    int block_count;
+    std::vector<EmulatedInstruction> program =
+        decode(compiler.get_assembly(), entry, block_count);
+    std::int32_t result = emulate(program, entry, block_count).result;
+    if (result != expected) {
+      failures.push_back("incremental: returns " + std::to_string(result) +
+                         ", the interpreter " + std::to_string(expected));
+    }
+  } catch (const std::runtime_error &e) {
+    failures.push_back(std::string("incremental: ") + e.what());
+  }
+  return failures;
+}
+
+// Exit code of the source built by gcc -O0 and run natively
+int gcc_result(const std::string &source,
+               const std::filesystem::path &directory) {
+  std::filesystem::path source_path = directory / "program.c";
+  std::filesystem::path binary = directory / "program";
+  std::ofstream(source_path) << source;
+
+  std::string command = "gcc -O0 -w -o '" + binary.string() + "' '" +
+                        source_path.string() + "'";
+  if (std::system(command.c_str()) != 0) {
+    throw std::runtime_error("gcc rejected the program");
+  }
+
+  int status = std::system(("'" + binary.string() + "'").c_str());
+  if (status == -1 || !WIFEXITED(status)) {
+    throw std::runtime_error("gcc's binary did not exit normally");
+  }
+  return WEXITSTATUS(status);
+}
+
+// Checks one program, returning a description of every disagreement
+std::vector<std::string> check(const std::string &source, bool use_gcc,
+                               const std::filesystem::path &directory,
+                               double &gcc_seconds) {
+  std::vector<std::string> failures;
+  std::int32_t expected;
+  try {
+    expected = reference_result(source);
+  } catch (const std::runtime_error &e) {
+    return {std::string("interpreter: ") + e.what()};
+  }
+
+  for (const Configuration &configuration : CONFIGURATIONS) {
+    try {
+      std::int32_t result = emulated_result(source, configuration);
+      if (result != expected) {
+        failures.push_back(std::string(configuration.name) + ": returns " +
+                           std::to_string(result) + ", the interpreter " +
+                           std::to_string(expected));
+      }
+    } catch (const std::runtime_error &e) {
+      failures.push_back(std::string(configuration.name) + ": " + e.what());
+    }
+  }
+
+  std::vector<std::string> incremental = check_incremental(source, expected);
+  failures.insert(failures.end(), incremental.begin(), incremental.end());
+
+  if (use_gcc) {
+    auto start = std::chrono::steady_clock::now();
+    try {
+      int exit_code = gcc_result(source, directory);
+      if (exit_code != (expected & 255)) {
+        failures.push_back("gcc -O0: exits with " + std::to_string(exit_code) +
+                           ", the interpreter returns " +
+                           std::to_string(expected));
+      }
+    } catch (const std::runtime_error &e) {
+      failures.push_back(std::string("gcc -O0: ") + e.what());
+    }
+    gcc_seconds += std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  }
+  return failures;
+}
+
+const char *const USAGE =
+    "usage: differential_fuzz [--no-gcc] [programs [seed]]\n"
+    "       differential_fuzz [--no-gcc] file.c...\n";
+
+// Whether 'text' is a count small enough for a long and a seed
+bool is_count(const std::string &text) {
+  return !text.empty() && text.size() <= 9 &&
+         text.find_first_not_of("0123456789") == std::string::npos;
+}
+
+std::string read_program(const std::string &path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+void print_failures(const std::string &name,
+                    const std::vector<std::string> &failures) {
+  std::cerr << name << ":\n";
+  for (const std::string &failure : failures) {
+    std::cerr << "  " << failure << "\n";
+  }
+}
+
+int main(int argc, char **argv) {
+  bool use_gcc = true;
+  std::vector<std::string> counts;
+  std::vector<std::string> files;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--no-gcc") {
+      use_gcc = false;
+    } else if (arg[0] == '-') {
+      std::cerr << "Unknown option " << arg << "\n" << USAGE;
+      return EXIT_FAILURE;
+    } else if (is_count(arg) && files.empty()) {
+      counts.push_back(arg);
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+  long programs = counts.empty() ? 200 : std::stol(counts[0]);
+  std::uint32_t seed = counts.size() > 1 ? std::stoul(counts[1]) : 1;
+  if (counts.size() > 2 || (!counts.empty() && !files.empty()) ||
+      programs == 0) {
+    std::cerr << USAGE;
+    return EXIT_FAILURE;
+  }
+
+  std::filesystem::path directory =
+      std::filesystem::temp_directory_path() /
+      ("differential_fuzz." + std::to_string(getpid()));
+  std::filesystem::create_directories(directory);
+
+  long failed = 0;
+  double gcc_seconds = 0;
+
+  // Given programs are checked rather than generated ones, to replay a
+  // failure or to test a case by hand
+  if (!files.empty()) {
+    for (const std::string &file : files) {
+      std::vector<std::string> failures;
+      try {
+        failures = check(read_program(file), use_gcc, directory, gcc_seconds);
+      } catch (const std::runtime_error &e) {
+        failures.push_back(e.what());
+      }
+      if (failures.empty()) {
+        std::cout << file << ": ok\n";
+      } else {
+        ++failed;
+        print_failures(file, failures);
+      }
+    }
+    std::filesystem::remove_all(directory);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  std::mt19937 random(seed);
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < programs; ++i) {
+    std::string source = generate_program(random);
+    std::vector<std::string> failures =
+        check(source, use_gcc, directory, gcc_seconds);
+    if (failures.empty()) {
+      continue;
+    }
+
+    ++failed;
+    std::string saved = "differential_fuzz." + std::to_string(seed) + "." +
+                        std::to_string(i) + ".c";
+    std::ofstream(saved) << source;
+    print_failures(saved, failures);
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::filesystem::remove_all(directory);
+
+  double checking_seconds = seconds - gcc_seconds;
+  std::cout << programs << " programs in " << seconds << " s: "
+            << programs / seconds << " programs/s\n"
+            << "  in-process (interpreter and " << std::size(CONFIGURATIONS)
+            << " emulated configurations): " << programs / checking_seconds
+            << " programs/s\n";
+  if (use_gcc) {
+    std::cout << "  gcc -O0 build and run: " << programs / gcc_seconds
+              << " programs/s\n";
+  }
+  std::cout << failed << " of " << programs << " programs failed\n";
+
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,221 @@
+#include "ast.h"
+#include "ast_factory.h"
+#include "lex.h"
+#include "parser.h"
+#include "program_generator.h"
+#include "resolver.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+A fuzz target for the front end: lex() and Parser::parse(), then the
+Resolver on whatever parses without errors.
+
+Any input must come back as tokens and diagnostics, or as a LexError. A
+crash, a sanitizer report, another exception or a hang is a bug; a syntax
+error is not. Inputs of odd length are parsed through a hash-consing factory, so
+both ways of building the tree are covered.
+
+Configured with FUZZ_WITH_LIBFUZZER (which needs clang), libFuzzer drives
+LLVMFuzzerTestOneInput with coverage-guided inputs and reports its own
+executions per second:
+
+  cmake -DFUZZ_WITH_LIBFUZZER=ON -DCMAKE_CXX_COMPILER=clang++ ...
+  bench/fuzz_parser corpus/
+
+Otherwise this file has a driver of its own. 'fuzz_parser [inputs [seed]]'
+mutates programs from program_generator.h (dropping bytes and ranges,
+inserting tokens, copying ranges, truncating) so most inputs are nearly
+valid, runs each through the target, and reports inputs per second and how
+far they got. An input that crashes is saved to fuzz_parser.crash first,
+and 'fuzz_parser file...' runs files through the target to replay them.
+*/
+
+enum class Outcome { LEX_ERROR, SYNTAX_ERROR, RESOLVE_ERROR, ACCEPTED };
+
+Outcome run_front_end(std::string_view source, bool hash_cons) {
+  std::vector<Token> tokens;
+  try {
+    tokens = lex(source);
+  } catch (const LexError &) {
+    return Outcome::LEX_ERROR;
+  }
+
+  ExprFactory factory(hash_cons);
+  Parser parser(tokens, factory);
+  std::unique_ptr<FunctionDecl> function = parser.parse();
+  if (!parser.get_diagnostics().empty()) {
+    return Outcome::SYNTAX_ERROR;
+  }
+
+  Resolver resolver;
+  return resolver.resolve(function.get()) ? Outcome::ACCEPTED
+                                          : Outcome::RESOLVE_ERROR;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data,
+                                      std::size_t size) {
+  run_front_end(
+      std::string_view(reinterpret_cast<const char *>(data), size),
+      size % 2 == 1);
+  return 0;
+}
+
+#ifndef FUZZ_WITH_LIBFUZZER
+
+// Spellings of every token, and a few runs of them, for mutations to insert
+const char *const DICTIONARY[] = {
+    "{",           "}",      "(",          ")",          ";",
+    ",",           "-",      "~",          "!",          "+",
+    "*",           "/",      "%",          "&",          "|",
+    "^",           "<<",     ">>",         "=",          "&&",
+    "||",          "==",     "!=",         "<",          "<=",
+    ">",           ">=",     "int",        "x",          "0",
+    "2147483647",  "99999999999", "return", "void",      "while",
+    "for",         "int x = 1;", "x = x + 1;", "while (x) {", "for (;;)",
+    "return x;",   "((((",   "))))"};
+
+// The input being run, for the crash handler to save
+const std::string *current_input = nullptr;
+
+extern "C" void save_crash(int signal_number) {
+  if (current_input != nullptr) {
+    int file = open("fuzz_parser.crash", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file >= 0) {
+      ssize_t written =
+          write(file, current_input->data(), current_input->size());
+      (void)written;
+      close(file);
+    }
+  }
+  std::signal(signal_number, SIG_DFL);
+  std::raise(signal_number);
+}
+
+// Applies one to four random edits to 'input'
+void mutate(std::string &input, std::mt19937 &random) {
+  auto below = [&](std::size_t n) { return n == 0 ? 0 : random() % n; };
+
+  int edits = 1 + below(4);
+  for (int i = 0; i < edits; ++i) {
+    std::size_t at = below(input.size() + 1);
+    switch (below(6)) {
+    case 0: // Drop a byte or a short range
+      input.erase(at, 1 + below(8));
+      break;
+    case 1: // Insert a token
+      input.insert(at, std::string(" ") +
+                           DICTIONARY[below(std::size(DICTIONARY))] + " ");
+      break;
+    case 2: // Overwrite a byte with any byte
+      if (at < input.size()) {
+        input[at] = static_cast<char>(random());
+      }
+      break;
+    case 3: { // Copy a range elsewhere
+      std::size_t from = below(input.size());
+      input.insert(at, input.substr(from, 1 + below(32)));
+      break;
+    }
+    case 4: // Cut the input short
+      input.resize(at);
+      break;
+    default: // Swap two bytes
+      if (!input.empty()) {
+        std::swap(input[below(input.size())], input[below(input.size())]);
+      }
+      break;
+    }
+  }
+}
+
+std::string read_file(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error(std::string("Failed to open ") + path);
+  }
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+int main(int argc, char **argv) {
+  std::signal(SIGSEGV, save_crash);
+  std::signal(SIGABRT, save_crash);
+  std::signal(SIGFPE, save_crash);
+  std::signal(SIGBUS, save_crash);
+
+  char *end = nullptr;
+  long inputs = argc > 1 ? std::strtol(argv[1], &end, 10) : 200000;
+
+  // Replay files rather than generate inputs
+  if (argc > 1 && *end != '\0') {
+    for (int i = 1; i < argc; ++i) {
+      std::string input = read_file(argv[i]);
+      current_input = &input;
+      LLVMFuzzerTestOneInput(
+          reinterpret_cast<const std::uint8_t *>(input.data()), input.size());
+      std::cout << argv[i] << ": ok\n";
+    }
+    return EXIT_SUCCESS;
+  }
+
+  std::uint32_t seed = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1;
+  std::mt19937 random(seed);
+
+  // A new program every so often, mutated afresh for each input
+  constexpr int INPUTS_PER_PROGRAM = 16;
+  GeneratorOptions options;
+  options.max_statements = 6;
+  std::string program;
+
+  long outcomes[4] = {};
+  double front_end_seconds = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < inputs; ++i) {
+    if (i % INPUTS_PER_PROGRAM == 0) {
+      program = generate_program(random, options);
+    }
+    std::string input = program;
+    mutate(input, random);
+    current_input = &input;
+
+    auto run_start = std::chrono::steady_clock::now();
+    Outcome outcome = run_front_end(input, input.size() % 2 == 1);
+    front_end_seconds += std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - run_start)
+                             .count();
+    ++outcomes[static_cast<int>(outcome)];
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::cout << inputs << " inputs in " << seconds << " s: "
+            << inputs / seconds << " inputs/s, "
+            << inputs / front_end_seconds << " inputs/s in the front end\n"
+            << "  lexer errors:   " << outcomes[0] << "\n"
+            << "  syntax errors:  " << outcomes[1] << "\n"
+            << "  resolve errors: " << outcomes[2] << "\n"
+            << "  accepted:       " << outcomes[3] << "\n";
+  return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,127 @@
+#include "lex.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Roughly 'bytes' of generated statements. Lines vary from short to very
+// long, some use only ';' between statements, and every multi character
+// token appears, so chunks split in all the places a split can go wrong
+std::string generated_source(std::size_t bytes) {
+  const char *const fragments[] = {
+      "int alpha = 12345;", "beta=alpha<<3;",     "gamma = beta >= 7;",
+      "delta=gamma!=beta&&alpha||beta;",          "while (a <= b) { a = a + 1; }",
+      "epsilon = ~(a ^ b) % 97 / 3 - -4;",        "return x>>2 == y|z&w;",
+      "for (int i = 0; i < 10; i = i + 1) { s = s * i; }"};
+  const char *const separators[] = {" ", "", "\n", "\n\t", "  \n"};
+
+  std::mt19937 random(7);
+  std::string source = "int main() {\n";
+  source.reserve(bytes + 256);
+  while (source.size() < bytes) {
+    source += fragments[random() % std::size(fragments)];
+    source += separators[random() % std::size(separators)];
+  }
+  return source + "\nreturn 0; }\n";
+}
+
+bool same_token(const Token &a, const Token &b) {
+  return a.token_type == b.token_type && a.literal == b.literal &&
+         a.line == b.line && a.column == b.column && a.offset == b.offset &&
+         a.length == b.length;
+}
+
+// Index of the first token where the two streams differ, or -1
+long first_difference(const std::vector<Token> &expected,
+                      const std::vector<Token> &actual) {
+  for (std::size_t i = 0; i < expected.size() && i < actual.size(); ++i) {
+    if (!same_token(expected[i], actual[i])) {
+      return static_cast<long>(i);
+    }
+  }
+  if (expected.size() != actual.size()) {
+    return static_cast<long>(std::min(expected.size(), actual.size()));
+  }
+  return -1;
+}
+
+template <class Lex>
+double time_lexing(Lex lex_source, int iterations, std::vector<Token> &tokens) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    tokens = lex_source();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         iterations;
+}
+
+// Lexes 'source' on each thread count, splitting it into chunks of at least
+// 'min_chunk_size' bytes, and reports whether every result is token for token
+// the serial one
+bool check_equivalence(const std::string &source, std::size_t min_chunk_size) {
+  std::vector<Token> serial = lex(source);
+  for (unsigned threads : {2u, 3u, 64u}) {
+    std::vector<Token> parallel =
+        lex_parallel(source, threads, min_chunk_size);
+    long difference = first_difference(serial, parallel);
+    if (difference >= 0) {
+      std::cerr << source.size() << " bytes in chunks of at least "
+                << min_chunk_size << " on " << threads
+                << " threads: tokens differ from the serial lexer at token "
+                << difference << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Lexes the source serially and on each thread count, checking that every
+// parallel result is token for token the serial one. With --check, only
+// checks that on sources small enough to run as a test: one just over two
+// default chunks, and one with chunks of a few hundred bytes, which 3 and 64
+// threads really do split that many ways
+int main(int argc, char **argv) {
+  if (argc > 1 && std::string(argv[1]) == "--check") {
+    bool same = check_equivalence(generated_source(2 * LEX_MIN_CHUNK_SIZE + 64),
+                                  LEX_MIN_CHUNK_SIZE) &&
+                check_equivalence(generated_source(1 << 16), 256);
+    if (same) {
+      std::cout << "Parallel lexing matches the serial lexer\n";
+    }
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  int scale = argc > 1 ? std::atoi(argv[1]) : 1;
+  std::string source = generated_source(static_cast<std::size_t>(scale) << 24);
+
+  std::vector<Token> serial;
+  double serial_ms = time_lexing([&] { return lex(source); }, 3, serial);
+  std::cout << source.size() / (1 << 20) << " MiB, " << serial.size()
+            << " tokens: serial " << serial_ms << " ms\n";
+
+  unsigned cores = std::thread::hardware_concurrency();
+  for (unsigned threads : {2u, 3u, 4u, 8u, 16u, 64u, cores}) {
+    std::vector<Token> parallel;
+    double parallel_ms = time_lexing(
+        [&] { return lex_parallel(source, threads); }, 3, parallel);
+
+    long difference = first_difference(serial, parallel);
+    if (difference >= 0) {
+      std::cerr << threads << " threads: tokens differ from the serial lexer"
+                << " at token " << difference << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    std::cout << threads << " threads: " << parallel_ms << " ms ("
+              << serial_ms / parallel_ms << "x), identical\n";
+  }
+
+  return EXIT_SUCCESS;
+}
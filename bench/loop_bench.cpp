@@ -0,0 +1,167 @@
+#include "ast.h"
+#include "ast_factory.h"
+#include "bytecode.h"
+#include "codegen.h"
+#include "constant_propagation.h"
+#include "cse.h"
+#include "dead_code.h"
+#include "interpreter.h"
+#include "lex.h"
+#include "loop_optimization.h"
+#include "parser.h"
+#include "resolver.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Declares 'a' and 'b' through a loop, so constant propagation cannot know
+// them and fold the invariants away
+const char *const UNKNOWN_OPERANDS =
+    "int a = 0; int b = 3; while (a < 7) { a = a + 1; b = b + a; }";
+
+// A loop over 'n' iterations whose body mostly recomputes values that never
+// change in it
+std::string invariant_source(int n) {
+  return std::string("int main() { ") + UNKNOWN_OPERANDS +
+         " int s = 0;"
+         " for (int i = 0; i < " +
+         std::to_string(n) +
+         "; i = i + 1) {"
+         " s = s + (a * b - (a << 2)) + i + (a + b) * (a - b);"
+         " s = s ^ (a * b - (a << 2));"
+         " } return s & 255; }";
+}
+
+// Strided accesses on both sides of the step, where every use multiplies
+// the induction variable
+std::string induction_source(int n) {
+  return "int main() { int s = 0; int t = 0; int i = 0;"
+         " while (i * 12 < " +
+         std::to_string(n * 12) +
+         ") {"
+         " s = s + (i * 12 >> 3) - (i * 12 & 255);"
+         " i = i + 1;"
+         " t = t ^ i * 12;"
+         " } return (s + t) & 255; }";
+}
+
+// Nested loops, where the inner loop's invariants move out of both
+std::string nested_source(int n) {
+  return std::string("int main() { ") + UNKNOWN_OPERANDS +
+         " int s = 0;"
+         " for (int i = 0; i < " +
+         std::to_string(n) +
+         "; i = i + 1) {"
+         " for (int j = 0; j < 100; j = j + 1) {"
+         " s = s + j * 4 + (a * b + 1) * i + (j * 4 ^ (a * b));"
+         " } } return s & 255; }";
+}
+
+struct Compiled {
+  BytecodeFunction bytecode;
+  std::size_t instructions = 0;
+};
+
+// Compiles the source the way the compiler does, optionally with the loop
+// optimizations, to bytecode and to AArch64 assembly, counting the static
+// instructions of the latter
+Compiled compile(const std::string &source, bool optimize) {
+  std::vector<Token> tokens = lex(source);
+  ExprFactory factory;
+  Parser parser(tokens, factory);
+  std::unique_ptr<FunctionDecl> function = parser.parse();
+
+  Resolver resolver;
+  if (!parser.get_diagnostics().empty() || !resolver.resolve(function.get())) {
+    std::cerr << "Benchmark source does not compile" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  int changes;
+  do {
+    changes = propagate_constants(function.get());
+    changes += eliminate_dead_code(function.get());
+  } while (changes > 0);
+  if (optimize) {
+    optimize_loops(function.get());
+  }
+  eliminate_common_subexpressions(function.get());
+
+  Compiled compiled;
+  BytecodeCompiler bytecode_compiler;
+  compiled.bytecode = bytecode_compiler.compile(function.get());
+
+  std::ostringstream assembly;
+  AstAssembly codegen;
+  codegen.begin_function(function.get(), assembly);
+  for (auto &statement : function->body) {
+    codegen.generate_statement(statement.get(), assembly);
+  }
+
+  // Instructions are the tab-indented lines that are not directives
+  std::istringstream lines(assembly.str());
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (line.size() > 1 && line[0] == '\t' && line[1] != '.') {
+      ++compiled.instructions;
+    }
+  }
+
+  return compiled;
+}
+
+// Average time to run the function, and its result
+double time_runs(const BytecodeFunction &function, int iterations,
+                 std::int32_t &result) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    result = interpret(function);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         iterations;
+}
+
+// Runs the workload without and with the loop optimizations, which must not
+// change its result
+void run_benchmark(const std::string &name, const std::string &source,
+                   int iterations) {
+  Compiled baseline = compile(source, false);
+  Compiled optimized = compile(source, true);
+
+  std::int32_t baseline_result;
+  std::int32_t optimized_result;
+  double baseline_ms = time_runs(baseline.bytecode, iterations, baseline_result);
+  double optimized_ms =
+      time_runs(optimized.bytecode, iterations, optimized_result);
+
+  if (baseline_result != optimized_result) {
+    std::cerr << name << ": loop optimizations changed the result from "
+              << baseline_result << " to " << optimized_result << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  std::cout << name << ": " << baseline_ms << " -> " << optimized_ms
+            << " ms/run interpreted (" << baseline_ms / optimized_ms
+            << "x), " << baseline.instructions << " -> "
+            << optimized.instructions << " AArch64 instructions\n";
+}
+
+int main(int argc, char **argv) {
+  int scale = argc > 1 ? std::atoi(argv[1]) : 1;
+
+  run_benchmark("invariant 100k iterations", invariant_source(100000),
+                10 * scale);
+  run_benchmark("induction 100k iterations", induction_source(100000),
+                10 * scale);
+  run_benchmark("nested 1k x 100 iterations", nested_source(1000), 10 * scale);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+#include "ast.h"
+#include "lex.h"
+#include "operators.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+// The switch Parser::parse_operator used before the operator table
+OperationType switch_operator(TokenType op_token) {
+  switch (op_token) {
+  case TokenType::NEGATE:
+    return OperationType::NEGATE;
+  case TokenType::BITWISE:
+    return OperationType::BITWISE;
+  case TokenType::LOGIC_NEGATE:
+    return OperationType::LOGIC_NEGATE;
+  case TokenType::ADD:
+    return OperationType::ADD;
+  case TokenType::MULT:
+    return OperationType::MULT;
+  case TokenType::DIVIDE:
+    return OperationType::DIVIDE;
+  case TokenType::AND:
+    return OperationType::AND;
+  case TokenType::OR:
+    return OperationType::OR;
+  case TokenType::EQUAL:
+    return OperationType::EQUAL;
+  case TokenType::NOT_EQUAL:
+    return OperationType::NOT_EQUAL;
+  case TokenType::LESS_THAN:
+    return OperationType::LESS_THAN;
+  case TokenType::LESS_THAN_EQUAL:
+    return OperationType::LESS_THAN_EQUAL;
+  case TokenType::GREATER_THAN:
+    return OperationType::GREATER_THAN;
+  case TokenType::GREATER_THAN_EQUAL:
+    return OperationType::GREATER_THAN_EQUAL;
+  case TokenType::MODULO:
+    return OperationType::MODULO;
+  case TokenType::BITWISE_AND:
+    return OperationType::BITWISE_AND;
+  case TokenType::BITWISE_OR:
+    return OperationType::BITWISE_OR;
+  case TokenType::BITWISE_XOR:
+    return OperationType::BITWISE_XOR;
+  case TokenType::BITWISE_LEFT_SHIFT:
+    return OperationType::BITWISE_SHIFT_LEFT;
+  case TokenType::BITWISE_RIGHT_SHIFT:
+    return OperationType::BITWISE_SHIFT_RIGHT;
+  default:
+    throw std::runtime_error("Syntax Error: Expected an operator");
+  }
+}
+
+OperationType table_operator(TokenType op_token) {
+  const OperatorInfo *info = token_operator(op_token);
+  if (info == nullptr) {
+    throw std::runtime_error("Syntax Error: Expected an operator");
+  }
+  return info->op;
+}
+
+// How AstAssembly::visit(BinaryOpExpr) picked its code before the table:
+// a chain of comparisons choosing the group, then a switch within it. Gives
+// the instructions, the condition code, or "" for && and ||
+const char *switch_lowering(OperationType op) {
+  if (op == OperationType::ADD || op == OperationType::NEGATE ||
+      op == OperationType::MULT || op == OperationType::DIVIDE ||
+      op == OperationType::BITWISE_AND || op == OperationType::BITWISE_OR ||
+      op == OperationType::BITWISE_XOR || op == OperationType::MODULO) {
+    switch (op) {
+    case OperationType::ADD:
+      return "add\tw0, w1, w0";
+    case OperationType::NEGATE:
+      return "sub\tw0, w1, w0";
+    case OperationType::MULT:
+      return "mul\tw0, w1, w0";
+    case OperationType::DIVIDE:
+      return "sdiv\tw0, w1, w0";
+    case OperationType::BITWISE_AND:
+      return "and\tw0, w1, w0";
+    case OperationType::BITWISE_OR:
+      return "orr\tw0, w1, w0";
+    case OperationType::BITWISE_XOR:
+      return "eor\tw0, w1, w0";
+    default:
+      return "sdiv\tw2, w1, w0\n\tmsub\tw0, w0, w2, w1";
+    }
+  } else if (op == OperationType::EQUAL || op == OperationType::NOT_EQUAL ||
+             op == OperationType::LESS_THAN ||
+             op == OperationType::LESS_THAN_EQUAL ||
+             op == OperationType::GREATER_THAN ||
+             op == OperationType::GREATER_THAN_EQUAL) {
+    switch (op) {
+    case OperationType::EQUAL:
+      return "eq";
+    case OperationType::NOT_EQUAL:
+      return "ne";
+    case OperationType::LESS_THAN:
+      return "lt";
+    case OperationType::LESS_THAN_EQUAL:
+      return "le";
+    case OperationType::GREATER_THAN:
+      return "gt";
+    default:
+      return "ge";
+    }
+  } else if (op == OperationType::OR || op == OperationType::AND) {
+    return "";
+  } else if (op == OperationType::BITWISE_SHIFT_LEFT) {
+    return "lsl\tw0, w1, w0";
+  }
+  return "asr\tw0, w1, w0";
+}
+
+const char *table_lowering(OperationType op) {
+  const OperatorInfo &info = operator_info(op);
+  if (info.condition != nullptr) {
+    return info.condition;
+  }
+  return info.short_circuit ? "" : info.instructions;
+}
+
+// Best of five runs of 'lookup' over every element of 'inputs', in ns per
+// lookup. 'checksum' keeps the results alive
+template <class Input, class Lookup>
+double time_lookups(const std::vector<Input> &inputs, Lookup lookup,
+                    std::size_t &checksum) {
+  double best = 0;
+  for (int run = 0; run < 5; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    for (const Input &input : inputs) {
+      checksum += lookup(input);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() /
+                inputs.size();
+    best = run == 0 ? ns : std::min(best, ns);
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  std::size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1 << 22;
+
+  // Operators in random order, so the branches of neither version predict
+  // better than they would on real code
+  std::vector<TokenType> tokens;
+  std::vector<OperationType> binary;
+  for (const OperatorInfo &info : OPERATORS) {
+    if (info.precedence > 0) {
+      binary.push_back(info.op);
+    }
+  }
+  std::vector<OperationType> binary_stream;
+  std::mt19937 random(7);
+  for (std::size_t i = 0; i < count; ++i) {
+    tokens.push_back(OPERATORS[random() % OPERATORS.size()].token);
+    binary_stream.push_back(binary[random() % binary.size()]);
+  }
+
+  for (std::size_t i = 0; i < count; ++i) {
+    if (switch_operator(tokens[i]) != table_operator(tokens[i]) ||
+        std::strcmp(switch_lowering(binary_stream[i]),
+                    table_lowering(binary_stream[i])) != 0) {
+      std::cerr << "The table disagrees with the switches" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::size_t checksum = 0;
+  double switch_ns = time_lookups(
+      tokens,
+      [](TokenType type) {
+        return static_cast<std::size_t>(switch_operator(type));
+      },
+      checksum);
+  double table_ns = time_lookups(
+      tokens,
+      [](TokenType type) {
+        return static_cast<std::size_t>(table_operator(type));
+      },
+      checksum);
+  std::cout << "token to operator: switch " << switch_ns << " ns, table "
+            << table_ns << " ns (" << switch_ns / table_ns << "x)\n";
+
+  switch_ns = time_lookups(
+      binary_stream,
+      [](OperationType op) {
+        return reinterpret_cast<std::size_t>(switch_lowering(op));
+      },
+      checksum);
+  table_ns = time_lookups(
+      binary_stream,
+      [](OperationType op) {
+        return reinterpret_cast<std::size_t>(table_lowering(op));
+      },
+      checksum);
+  std::cout << "binary lowering:   switch " << switch_ns << " ns, table "
+            << table_ns << " ns (" << switch_ns / table_ns << "x)\n";
+
+  std::cout << "(checksum " << checksum % 1000 << ")\n";
+}
@@ -0,0 +1,310 @@
+#include "ast.h"
+#include "ast_factory.h"
+#include "ast_serialization.h"
+#include "lex.h"
+#include "parser.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Builds 'int main() { return 1 + 1 + ... + 1; }' with the given term count
+std::string flat_expression_source(int terms) {
+  std::string source = "int main() { return 1";
+  for (int i = 1; i < terms; ++i) {
+    source += " + 1";
+  }
+
+  return source + "; }";
+}
+
+// Builds 'int main() { return (1 + (1 + (... 1))); }' nested to the given depth
+std::string nested_expression_source(int depth) {
+  std::string source = "int main() { return ";
+  for (int i = 0; i < depth; ++i) {
+    source += "(1 + ";
+  }
+
+  source += "1";
+  source.append(depth, ')');
+
+  return source + "; }";
+}
+
+// Builds a return of the same few subexpressions repeated 'terms' times, the
+// shape of machine-generated inputs that hash-consing shares
+std::string redundant_expression_source(int terms) {
+  std::string source = "int main() { int a = 1; int b = 2; return 0";
+  for (int i = 0; i < terms; ++i) {
+    source += i % 2 == 0 ? " + (a * b - (a << 3))" : " ^ (b * b + (a & 7))";
+  }
+
+  return source + "; }";
+}
+
+// Average time to load the function back from an AST file (see
+// ast_serialization.h)
+double time_reloads(const FunctionDecl *function, int iterations) {
+  std::string path =
+      (std::filesystem::temp_directory_path() / "parser_bench.ast").string();
+  write_ast(function, path);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    LoadedAst loaded = read_ast(path);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  std::filesystem::remove(path);
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         iterations;
+}
+
+// Whether two expression trees are the same node for node. Pairs of nodes
+// are compared from a worklist, as parsed trees may be too deep to recurse
+bool same_expression(const ExprAST *a, const ExprAST *b) {
+  std::vector<std::pair<const ExprAST *, const ExprAST *>> pending{{a, b}};
+  while (!pending.empty()) {
+    auto [x, y] = pending.back();
+    pending.pop_back();
+    if (x == nullptr || y == nullptr) {
+      if (x != y) {
+        return false;
+      }
+      continue;
+    }
+    if (x->kind != y->kind) {
+      return false;
+    }
+
+    switch (x->kind) {
+    case ExprKind::INT_LITERAL:
+      if (static_cast<const IntLiteralExpr *>(x)->value !=
+          static_cast<const IntLiteralExpr *>(y)->value) {
+        return false;
+      }
+      break;
+    case ExprKind::VARIABLE:
+      if (static_cast<const VariableExpr *>(x)->name !=
+          static_cast<const VariableExpr *>(y)->name) {
+        return false;
+      }
+      break;
+    case ExprKind::UNARY_OP: {
+      auto *ux = static_cast<const UnaryOpExpr *>(x);
+      auto *uy = static_cast<const UnaryOpExpr *>(y);
+      if (ux->op != uy->op) {
+        return false;
+      }
+      pending.emplace_back(ux->expr.get(), uy->expr.get());
+      break;
+    }
+    case ExprKind::BINARY_OP: {
+      auto *bx = static_cast<const BinaryOpExpr *>(x);
+      auto *by = static_cast<const BinaryOpExpr *>(y);
+      if (bx->op != by->op) {
+        return false;
+      }
+      pending.emplace_back(bx->expr_one.get(), by->expr_one.get());
+      pending.emplace_back(bx->expr_two.get(), by->expr_two.get());
+      break;
+    }
+    case ExprKind::VARIABLE_ASSIGN: {
+      auto *ax = static_cast<const VariableAssignExpr *>(x);
+      auto *ay = static_cast<const VariableAssignExpr *>(y);
+      if (ax->var_name != ay->var_name) {
+        return false;
+      }
+      pending.emplace_back(ax->assign_expr.get(), ay->assign_expr.get());
+      break;
+    }
+    case ExprKind::TEMP_STORE:
+    case ExprKind::TEMP_LOAD:
+      // Parsed trees have no temporaries
+      return false;
+    }
+  }
+  return true;
+}
+
+bool same_statements(const std::vector<std::unique_ptr<StmtAST>> &a,
+                     const std::vector<std::unique_ptr<StmtAST>> &b);
+
+// Whether two statements are the same, down to where they start in the source
+bool same_statement(const StmtAST *a, const StmtAST *b) {
+  if (a->kind != b->kind || a->line != b->line || a->column != b->column) {
+    return false;
+  }
+
+  switch (a->kind) {
+  case StmtKind::VARIABLE_DECL: {
+    auto *x = static_cast<const VariableDeclStmt *>(a);
+    auto *y = static_cast<const VariableDeclStmt *>(b);
+    return x->type == y->type && x->name == y->name &&
+           same_expression(x->decl_expr.get(), y->decl_expr.get());
+  }
+  case StmtKind::RETURN:
+    return same_expression(static_cast<const ReturnStmt *>(a)->expr.get(),
+                           static_cast<const ReturnStmt *>(b)->expr.get());
+  case StmtKind::EXPR:
+    return same_expression(static_cast<const ExprStmt *>(a)->expr.get(),
+                           static_cast<const ExprStmt *>(b)->expr.get());
+  case StmtKind::BLOCK:
+    return same_statements(static_cast<const BlockStmt *>(a)->body,
+                           static_cast<const BlockStmt *>(b)->body);
+  case StmtKind::WHILE: {
+    auto *x = static_cast<const WhileStmt *>(a);
+    auto *y = static_cast<const WhileStmt *>(b);
+    return same_expression(x->cond.get(), y->cond.get()) &&
+           same_statement(x->body.get(), y->body.get());
+  }
+  }
+  return false;
+}
+
+bool same_statements(const std::vector<std::unique_ptr<StmtAST>> &a,
+                     const std::vector<std::unique_ptr<StmtAST>> &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    if (!same_statement(a[i].get(), b[i].get())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool same_function(const FunctionDecl *a, const FunctionDecl *b) {
+  if (a->name != b->name || a->return_type != b->return_type ||
+      a->parameters.size() != b->parameters.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < a->parameters.size(); ++i) {
+    if (!same_statement(a->parameters[i].get(), b->parameters[i].get())) {
+      return false;
+    }
+  }
+  return same_statements(a->body, b->body);
+}
+
+// Parses 'source', writes the tree to an AST file and reads it back, and
+// reports whether the loaded tree is the parsed one. A hash-consed parse
+// checks that shared subtrees come back as one copy per place they appear
+bool check_round_trip(const std::string &name, const std::string &source,
+                      bool hash_cons = false) {
+  std::vector<Token> tokens = lex(source);
+  ExprFactory factory(hash_cons);
+  Parser parser(tokens, factory);
+  std::unique_ptr<FunctionDecl> func = parser.parse();
+
+  std::string path =
+      (std::filesystem::temp_directory_path() / "parser_bench_check.ast")
+          .string();
+  write_ast(func.get(), path);
+  LoadedAst loaded = read_ast(path);
+  std::filesystem::remove(path);
+
+  if (!same_function(func.get(), loaded.function.get())) {
+    std::cerr << name << ": the tree read back from its AST file differs from "
+              << "the parsed one" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Lexes and parses the source repeatedly and reports the average time, and
+// for hash-consed parses how many expression nodes were actually allocated.
+// Other parses are also written as AST files, and the time to reload one is
+// compared to lexing and parsing the source
+void run_benchmark(const std::string &name, const std::string &source,
+                   int iterations, bool hash_cons = false) {
+  std::size_t token_count = 0;
+  std::size_t nodes_requested = 0;
+  std::size_t nodes_allocated = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < iterations; ++i) {
+    std::vector<Token> tokens = lex(source);
+    ExprFactory factory(hash_cons);
+    Parser parser(tokens, factory);
+    std::unique_ptr<FunctionDecl> func = parser.parse();
+
+    token_count = tokens.size();
+    nodes_requested = factory.nodes_requested();
+    nodes_allocated = factory.nodes_allocated();
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double total_ns =
+      std::chrono::duration<double, std::nano>(end - start).count();
+  double per_iteration_ms = total_ns / iterations / 1e6;
+  double per_token_ns = total_ns / iterations / token_count;
+
+  std::cout << name << ": " << token_count << " tokens, " << per_iteration_ms
+            << " ms/parse, " << per_token_ns << " ns/token";
+  if (hash_cons) {
+    std::cout << ", " << nodes_allocated << "/" << nodes_requested
+              << " nodes allocated";
+  }
+  if (!hash_cons) {
+    std::vector<Token> tokens = lex(source);
+    ExprFactory factory;
+    Parser parser(tokens, factory);
+    std::unique_ptr<FunctionDecl> func = parser.parse();
+
+    double reload_ms = time_reloads(func.get(), iterations);
+    std::cout << ", reloaded in " << reload_ms << " ms ("
+              << 100 * reload_ms / per_iteration_ms << "%)";
+  }
+  std::cout << "\n";
+}
+
+// Times each parse. With --check, instead round-trips small parses of each
+// shape, and the given source files, through AST files and checks every tree
+// comes back as it was parsed
+int main(int argc, char **argv) {
+  if (argc > 1 && std::string(argv[1]) == "--check") {
+    bool same = check_round_trip("flat", flat_expression_source(1000)) &&
+                check_round_trip("nested", nested_expression_source(1000)) &&
+                check_round_trip("redundant, hash-consed",
+                                 redundant_expression_source(100), true);
+    for (int i = 2; same && i < argc; ++i) {
+      std::ifstream file(argv[i]);
+      if (!file) {
+        std::cerr << "Could not open " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+      std::stringstream source;
+      source << file.rdbuf();
+      same = check_round_trip(argv[i], source.str());
+    }
+    if (same) {
+      std::cout << "Every tree reads back from its AST file as parsed\n";
+    }
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  int scale = argc > 1 ? std::atoi(argv[1]) : 1;
+
+  run_benchmark("flat 1k terms", flat_expression_source(1000), 2000 * scale);
+  run_benchmark("flat 100k terms", flat_expression_source(100000), 20 * scale);
+  run_benchmark("nested depth 1k", nested_expression_source(1000),
+                2000 * scale);
+  run_benchmark("nested depth 100k", nested_expression_source(100000),
+                20 * scale);
+  run_benchmark("redundant 10k terms", redundant_expression_source(10000),
+                20 * scale);
+  run_benchmark("redundant 10k terms, hash-consed",
+                redundant_expression_source(10000), 20 * scale, true);
+
+  return EXIT_SUCCESS;
+}
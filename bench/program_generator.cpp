@@ -0,0 +1,362 @@
+#include "program_generator.h"
+#include "ast.h"
+#include "operators.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+// Variables hold values no larger than this in magnitude, and expressions
+// larger than EXPRESSION_BOUND are reduced before they go further. Products
+// are kept under PRODUCT_BOUND, so no value comes near 2^31
+constexpr std::int64_t VARIABLE_BOUND = 65535;
+constexpr std::int64_t EXPRESSION_BOUND = 1 << 24;
+constexpr std::int64_t PRODUCT_BOUND = 1 << 30;
+
+// Binding power of literals, names and parenthesized expressions
+constexpr int PRIMARY = UNARY_PRECEDENCE + 1;
+
+struct Expression {
+  std::string text;
+  std::int64_t bound; // Of the magnitude of its value
+  int precedence;     // Of its outermost operator
+};
+
+struct Variable {
+  std::string name;
+  std::int64_t bound;
+  bool assignable; // Loop counters are not
+};
+
+struct Spelling {
+  OperationType op;
+  const char *text;
+};
+
+const Spelling BINARY_OPERATORS[] = {
+    {OperationType::ADD, "+"},
+    {OperationType::NEGATE, "-"},
+    {OperationType::MULT, "*"},
+    {OperationType::DIVIDE, "/"},
+    {OperationType::MODULO, "%"},
+    {OperationType::BITWISE_AND, "&"},
+    {OperationType::BITWISE_OR, "|"},
+    {OperationType::BITWISE_XOR, "^"},
+    {OperationType::BITWISE_SHIFT_LEFT, "<<"},
+    {OperationType::BITWISE_SHIFT_RIGHT, ">>"},
+    {OperationType::AND, "&&"},
+    {OperationType::OR, "||"},
+    {OperationType::EQUAL, "=="},
+    {OperationType::NOT_EQUAL, "!="},
+    {OperationType::LESS_THAN, "<"},
+    {OperationType::LESS_THAN_EQUAL, "<="},
+    {OperationType::GREATER_THAN, ">"},
+    {OperationType::GREATER_THAN_EQUAL, ">="},
+};
+
+// Literals the code generator treats specially (16-bit immediates and
+// wider ones, masks, shifts), besides small ones
+const std::int64_t INTERESTING_LITERALS[] = {
+    0, 1, 2, 7, 8, 31, 255, 256, 1023, 4095, 65535, 65536, 100000, 1 << 20};
+
+// Smallest power of two above 'bound'. Bitwise operators on values within
+// [-2^k, 2^k) stay within it
+std::int64_t bit_bound(std::int64_t bound) {
+  std::int64_t power = 1;
+  while (power <= bound) {
+    power <<= 1;
+  }
+  return power;
+}
+
+class Generator {
+public:
+  Generator(std::mt19937 &random, const GeneratorOptions &options)
+      : random(random), options(options) {}
+
+  std::string program() {
+    out += "int main() {\n";
+    scopes.emplace_back();
+    if (chance(options.large_frame_percent)) {
+      for (int i = 0; i < LARGE_FRAME_LOCALS; ++i) {
+        declaration(1, leaf());
+      }
+    }
+    statements(1, 0);
+    out += "  return " + expression(options.max_depth).text + ";\n";
+    out += "}\n";
+    return out;
+  }
+
+private:
+  std::mt19937 &random;
+  const GeneratorOptions &options;
+  std::string out;
+  std::vector<std::vector<Variable>> scopes;
+  int names = 0;
+
+  int below(int n) { return static_cast<int>(random() % n); }
+  bool chance(int percent) { return below(100) < percent; }
+
+  // A name not used before. Identifiers are letters only, and capitals
+  // keep it clear of the keywords
+  std::string fresh(char prefix) {
+    std::string name(1, prefix);
+    int n = names++;
+    do {
+      name += static_cast<char>('A' + n % 26);
+      n /= 26;
+    } while (n > 0);
+    return name;
+  }
+
+  void line(int indent, const std::string &text) {
+    out += std::string(2 * indent, ' ') + text + "\n";
+  }
+
+  std::vector<const Variable *> visible(bool assignable_only) const {
+    std::vector<const Variable *> variables;
+    for (const std::vector<Variable> &scope : scopes) {
+      for (const Variable &variable : scope) {
+        if (variable.assignable || !assignable_only) {
+          variables.push_back(&variable);
+        }
+      }
+    }
+    return variables;
+  }
+
+  static Expression primary(std::string text, std::int64_t bound) {
+    return {std::move(text), bound, PRIMARY};
+  }
+
+  // 'e' as an operand of an operator binding at 'precedence', in
+  // parentheses only where C needs them
+  static std::string operand(const Expression &e, int precedence,
+                             bool right) {
+    if (e.precedence > precedence || (e.precedence == precedence && !right)) {
+      return e.text;
+    }
+    return "(" + e.text + ")";
+  }
+
+  // 'e' brought within 'bound' by a mask or a remainder
+  Expression reduce(const Expression &e, std::int64_t bound) {
+    if (e.bound <= bound) {
+      return e;
+    }
+    // The largest power of two no more than bound + 1
+    std::int64_t modulus = bit_bound(bound + 1) / 2;
+    if (chance(50)) {
+      return primary("(" + operand(e, 5, false) + " & " +
+                         std::to_string(modulus - 1) + ")",
+                     modulus - 1);
+    }
+    return primary("(" + operand(e, 10, false) + " % " +
+                       std::to_string(modulus) + ")",
+                   modulus - 1);
+  }
+
+  Expression leaf() {
+    std::vector<const Variable *> variables = visible(false);
+    if (!variables.empty() && chance(60)) {
+      const Variable *variable = variables[below(variables.size())];
+      return primary(variable->name, variable->bound);
+    }
+    std::int64_t value =
+        chance(70) ? below(21)
+                   : INTERESTING_LITERALS[below(std::size(INTERESTING_LITERALS))];
+    return primary(std::to_string(value), value);
+  }
+
+  Expression unary(int depth) {
+    Expression e = expression(depth - 1);
+    std::string text = e.precedence == PRIMARY ? e.text : "(" + e.text + ")";
+    switch (below(3)) {
+    case 0:
+      return {"-" + text, e.bound, UNARY_PRECEDENCE};
+    case 1:
+      return {"~" + text, e.bound + 1, UNARY_PRECEDENCE};
+    default:
+      return {"!" + text, 1, UNARY_PRECEDENCE};
+    }
+  }
+
+  Expression binary(int depth) {
+    const Spelling &spelling =
+        BINARY_OPERATORS[below(std::size(BINARY_OPERATORS))];
+    OperationType op = spelling.op;
+    const OperatorInfo &info = operator_info(op);
+
+    Expression a = expression(depth - 1);
+    // Sometimes both sides alike, for common subexpression elimination
+    Expression b = chance(10) ? a : expression(depth - 1);
+    std::int64_t bound;
+
+    switch (op) {
+    case OperationType::ADD:
+    case OperationType::NEGATE:
+      bound = a.bound + b.bound;
+      break;
+    case OperationType::MULT:
+      while (a.bound * b.bound > PRODUCT_BOUND) {
+        if (a.bound >= b.bound) {
+          a = reduce(a, 1023);
+        } else {
+          b = reduce(b, 1023);
+        }
+      }
+      bound = a.bound * b.bound;
+      break;
+    case OperationType::DIVIDE:
+    case OperationType::MODULO:
+      b = primary("(" + operand(b, 3, false) + " | 1)", b.bound + 1);
+      bound = a.bound;
+      break;
+    case OperationType::BITWISE_AND:
+    case OperationType::BITWISE_OR:
+    case OperationType::BITWISE_XOR:
+      bound = bit_bound(std::max(a.bound, b.bound));
+      break;
+    case OperationType::BITWISE_SHIFT_LEFT:
+      a = primary("(" + operand(a, 5, false) + " & 1023)", 1023);
+      b = primary("(" + operand(b, 5, false) + " & 7)", 7);
+      bound = 1023 << 7;
+      break;
+    case OperationType::BITWISE_SHIFT_RIGHT:
+      b = primary("(" + operand(b, 5, false) + " & 7)", 7);
+      bound = a.bound;
+      break;
+    default:
+      bound = 1;
+      break;
+    }
+
+    int precedence = info.precedence;
+    Expression result{operand(a, precedence, false) + " " + spelling.text +
+                          " " + operand(b, precedence, true),
+                      bound, precedence};
+    return reduce(result, EXPRESSION_BOUND);
+  }
+
+  Expression expression(int depth) {
+    if (depth <= 0 || chance(20)) {
+      return leaf();
+    }
+    return chance(15) ? unary(depth) : binary(depth);
+  }
+
+  // A value for a variable to hold
+  Expression value() {
+    return reduce(expression(below(options.max_depth) + 1), VARIABLE_BOUND);
+  }
+
+  void declaration(int indent) { declaration(indent, value()); }
+
+  void declaration(int indent, const Expression &e) {
+    std::string name = fresh('v');
+    line(indent, "int " + name + " = " + e.text + ";");
+    scopes.back().push_back({name, VARIABLE_BOUND, true});
+  }
+
+  // An assignment, or two chained, or 'false' if nothing can be assigned
+  bool assignment(int indent) {
+    std::vector<const Variable *> variables = visible(true);
+    if (variables.empty()) {
+      return false;
+    }
+    const Variable *target = variables[below(variables.size())];
+    const Variable *second = variables[below(variables.size())];
+    std::string targets = target->name + " = ";
+    if (second != target && chance(15)) {
+      targets += second->name + " = ";
+    }
+    line(indent, targets + value().text + ";");
+    return true;
+  }
+
+  // A block, or a single statement that is not a declaration
+  void body(int indent, int nesting) {
+    if (chance(80)) {
+      block(indent, nesting);
+    } else if (!assignment(indent + 1)) {
+      line(indent + 1, expression(2).text + ";");
+    }
+  }
+
+  void block(int indent, int nesting) {
+    line(indent, "{");
+    scopes.emplace_back();
+    statements(indent + 1, nesting + 1);
+    scopes.pop_back();
+    line(indent, "}");
+  }
+
+  void for_loop(int indent, int nesting) {
+    std::string counter = fresh('i');
+    int iterations = below(options.max_iterations) + 1;
+    std::string condition = counter + " < " + std::to_string(iterations);
+
+    scopes.emplace_back();
+    scopes.back().push_back({counter, iterations, false});
+    if (chance(20)) {
+      // Stopping early is still stopping
+      condition += " && " + operand(expression(2), 2, true);
+    }
+    line(indent, "for (int " + counter + " = 0; " + condition + "; " +
+                     counter + " = " + counter + " + 1)");
+    body(indent, nesting);
+    scopes.pop_back();
+  }
+
+  void while_loop(int indent, int nesting) {
+    std::string counter = fresh('w');
+    int iterations = below(options.max_iterations) + 1;
+    line(indent, "int " + counter + " = " + std::to_string(iterations) + ";");
+    scopes.back().push_back({counter, iterations, false});
+
+    line(indent, "while (" + counter + " > 0) {");
+    scopes.emplace_back();
+    line(indent + 1, counter + " = " + counter + " - 1;");
+    statements(indent + 1, nesting + 1);
+    scopes.pop_back();
+    line(indent, "}");
+  }
+
+  void statements(int indent, int nesting) {
+    int count = below(options.max_statements) + 1;
+    for (int i = 0; i < count; ++i) {
+      int kind = below(100);
+      if (kind < 30) {
+        declaration(indent);
+      } else if (kind < 60) {
+        if (!assignment(indent)) {
+          declaration(indent);
+        }
+      } else if (kind < 68) {
+        line(indent, expression(options.max_depth).text + ";");
+      } else if (kind < 98 && nesting < options.max_nesting) {
+        if (kind < 75) {
+          block(indent, nesting);
+        } else if (kind < 88) {
+          for_loop(indent, nesting);
+        } else {
+          while_loop(indent, nesting);
+        }
+      } else if (nesting > 0 && chance(30)) {
+        // Leaves the rest of the function dead
+        line(indent, "return " + expression(2).text + ";");
+        return;
+      }
+    }
+  }
+};
+
+} // namespace
+
+std::string generate_program(std::mt19937 &random,
+                             const GeneratorOptions &options) {
+  return Generator(random, options).program();
+}
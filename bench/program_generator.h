@@ -0,0 +1,52 @@
+#ifndef PROGRAM_GENERATOR_H
+#define PROGRAM_GENERATOR_H
+
+#include <random>
+#include <string>
+
+/*
+Random programs in the subset the compiler accepts, for the fuzzers.
+
+Programs are built from the grammar in parser.h: declarations, assignments,
+expression statements, nested blocks, and 'while' and 'for' loops, with
+every operator at every precedence. Each one is also a well-defined C
+program, so gcc must agree with the compiler about its exit code:
+
+- every variable is declared with a value, and names are never reused;
+- the generator tracks a bound on the magnitude of every subexpression and
+  masks or reduces one ('& 1023', '% 65536') before an operator could
+  overflow with it;
+- divisors are '(e | 1)', which is never 0, and no dividend can be INT_MIN;
+- shift amounts are '(e & 7)', and only masked, non-negative values are
+  shifted left;
+- loops count a variable of their own, that nothing else assigns, to a
+  small constant, so every program stops;
+- assignments are whole statements, so no expression both reads and writes
+  a variable.
+
+Right shifts of negative values are implementation-defined rather than
+undefined, and gcc's choice (arithmetic) is the compiler's.
+
+Some programs also declare thousands of variables before anything else, so
+code for frames over 16 KiB, whose slots are out of reach of a single load
+or store, gets tested along with everything else.
+*/
+
+struct GeneratorOptions {
+  int max_statements = 12; // Per block
+  int max_depth = 4;       // Of expressions
+  int max_nesting = 3;     // Of blocks and loops
+  int max_iterations = 6;  // Of each loop
+
+  // Percentage of programs that first declare LARGE_FRAME_LOCALS variables,
+  // so their frame is too large for the short forms of the prologue and of
+  // slot addresses
+  int large_frame_percent = 5;
+};
+
+constexpr int LARGE_FRAME_LOCALS = 4200;
+
+std::string generate_program(std::mt19937 &random,
+                             const GeneratorOptions &options = {});
+
+#endif
@@ -0,0 +1,182 @@
+#include "ast.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// A left-leaning chain 'x + 1 + 2 + ...' of the given length, the shape the
+// parser builds for long flat expressions
+ExprPtr chain_tree(int terms) {
+  ExprPtr tree = std::make_unique<VariableExpr>("x");
+  for (int i = 1; i < terms; ++i) {
+    tree = std::make_unique<BinaryOpExpr>(OperationType::ADD, std::move(tree),
+                                          std::make_unique<IntLiteralExpr>(i));
+  }
+  return tree;
+}
+
+// A balanced tree of the given depth with a random mix of every node type
+ExprPtr mixed_tree(int depth, std::mt19937 &random) {
+  if (depth == 0) {
+    switch (random() % 3) {
+    case 0:
+      return std::make_unique<IntLiteralExpr>(static_cast<int>(random() % 100));
+    case 1:
+      return std::make_unique<VariableExpr>("x");
+    default:
+      return std::make_unique<TempLoadExpr>(static_cast<int>(random() % 7));
+    }
+  }
+
+  switch (random() % 6) {
+  case 0:
+    return std::make_unique<UnaryOpExpr>(OperationType::BITWISE,
+                                         mixed_tree(depth - 1, random));
+  case 1:
+    return std::make_unique<VariableAssignExpr>("x",
+                                                mixed_tree(depth - 1, random));
+  case 2:
+    return std::make_unique<TempStoreExpr>(static_cast<int>(random() % 7),
+                                           mixed_tree(depth - 1, random));
+  default:
+    return std::make_unique<BinaryOpExpr>(OperationType::MULT,
+                                          mixed_tree(depth - 1, random),
+                                          mixed_tree(depth - 1, random));
+  }
+}
+
+// The pass, written once: counts the nodes, the variable reads and the sum
+// of the literals, walking the tree with an explicit stack. 'Base' decides
+// how each node reaches its visit method
+template <class Base> class NodeStats : public Base {
+public:
+  std::size_t nodes = 0;
+  std::size_t variables = 0;
+  std::int64_t literal_sum = 0;
+
+  void visit(const IntLiteralExpr *expr) {
+    ++nodes;
+    literal_sum += expr->value;
+  }
+  void visit(const VariableExpr *) {
+    ++nodes;
+    ++variables;
+  }
+  void visit(const UnaryOpExpr *expr) {
+    ++nodes;
+    pending.push_back(expr->expr.get());
+  }
+  void visit(const BinaryOpExpr *expr) {
+    ++nodes;
+    pending.push_back(expr->expr_two.get());
+    pending.push_back(expr->expr_one.get());
+  }
+  void visit(const VariableAssignExpr *expr) {
+    ++nodes;
+    pending.push_back(expr->assign_expr.get());
+  }
+  void visit(const TempStoreExpr *expr) {
+    ++nodes;
+    pending.push_back(expr->expr.get());
+  }
+  void visit(const TempLoadExpr *) { ++nodes; }
+
+protected:
+  std::vector<ExprAST *> pending;
+};
+
+// Through the node's virtual accept and then the visitor's virtual visit
+class VirtualStats final : public NodeStats<ExprVisitor> {
+public:
+  void run(ExprAST *root) {
+    pending.push_back(root);
+    while (!pending.empty()) {
+      ExprAST *node = pending.back();
+      pending.pop_back();
+      node->accept(this);
+    }
+  }
+};
+
+// Through StaticVisitor, a switch on the node's kind
+class StaticStats final : public NodeStats<StaticVisitor<StaticStats>> {
+public:
+  void run(ExprAST *root) {
+    pending.push_back(root);
+    while (!pending.empty()) {
+      ExprAST *node = pending.back();
+      pending.pop_back();
+      dispatch(node);
+    }
+  }
+};
+
+struct Result {
+  double ms = 0;
+  std::size_t nodes = 0;
+  std::size_t variables = 0;
+  std::int64_t literal_sum = 0;
+
+  bool operator!=(const Result &other) const {
+    return nodes != other.nodes || variables != other.variables ||
+           literal_sum != other.literal_sum;
+  }
+};
+
+// Average time of a full walk of 'tree'
+template <class Stats> Result time_walks(ExprAST *tree, int iterations) {
+  Result result;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    Stats stats;
+    stats.run(tree);
+    result.nodes = stats.nodes;
+    result.variables = stats.variables;
+    result.literal_sum = stats.literal_sum;
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  result.ms = std::chrono::duration<double, std::milli>(end - start).count() /
+              iterations;
+  return result;
+}
+
+// Walks the tree with both dispatch mechanisms, which must agree
+void run_benchmark(const std::string &name, ExprAST *tree, int iterations) {
+  Result virtual_result = time_walks<VirtualStats>(tree, iterations);
+  Result static_result = time_walks<StaticStats>(tree, iterations);
+
+  if (virtual_result != static_result) {
+    std::cerr << name << ": static dispatch visited a different tree"
+              << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  std::cout << name << ": " << static_result.nodes << " nodes, "
+            << virtual_result.ms << " ms virtual, " << static_result.ms
+            << " ms static (" << virtual_result.ms / static_result.ms
+            << "x)\n";
+}
+
+int main(int argc, char **argv) {
+  int scale = argc > 1 ? std::atoi(argv[1]) : 1;
+  std::mt19937 random(42);
+
+  ExprPtr chain = chain_tree(1000000);
+  run_benchmark("chain 1M terms", chain.get(), 10 * scale);
+
+  ExprPtr mixed = mixed_tree(27, random);
+  run_benchmark("mixed depth 27", mixed.get(), 10 * scale);
+
+  // Small enough to stay in cache, where dispatch is most of the cost
+  ExprPtr small = mixed_tree(14, random);
+  run_benchmark("mixed depth 14", small.get(), 10000 * scale);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,263 @@
+#include "allocation.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+namespace {
+
+// Bytes a thread allocates or frees before adding them to the shared total,
+// so that only about one allocation in this many bytes takes a locked
+// instruction. The limit and the peak are exact to within this per thread
+constexpr std::int64_t UNPUBLISHED_BYTES = 64 << 10;
+
+struct Counters {
+  std::atomic<std::uint64_t> allocations{0};
+  std::atomic<std::uint64_t> bytes_allocated{0};
+  std::atomic<std::uint64_t> bytes_freed{0};
+};
+
+// Each thread counts into a block only it writes, so counting takes no
+// locked instructions. Blocks are kept for the life of the process, linked
+// from 'thread_counters' for allocation_stats to sum
+struct ThreadCounters {
+  Counters subsystems[SUBSYSTEM_COUNT];
+
+  // Bytes allocated less bytes freed on this thread, not yet in live_bytes
+  std::atomic<std::int64_t> unpublished{0};
+
+  ThreadCounters *next = nullptr;
+};
+
+// Counts for threads whose block could not be made, which may race and
+// lose a few
+ThreadCounters shared_counters;
+std::atomic<ThreadCounters *> thread_counters{&shared_counters};
+
+std::atomic<std::int64_t> live_bytes{0};
+std::atomic<std::int64_t> peak_bytes{0};
+
+// 0 for no limit
+std::atomic<std::size_t> memory_limit{0};
+std::atomic<bool> limit_exceeded{false};
+std::atomic<int> exceeded_subsystem{0};
+
+thread_local Subsystem current_subsystem = Subsystem::OTHER;
+thread_local ThreadCounters *local_counters = nullptr;
+
+// This thread's counters. The block is made with malloc on first use, as
+// operator new is what is being counted
+ThreadCounters &local() {
+  if (local_counters == nullptr) {
+    void *block = std::malloc(sizeof(ThreadCounters));
+    if (block == nullptr) {
+      return shared_counters;
+    }
+    local_counters = new (block) ThreadCounters;
+    ThreadCounters *head = thread_counters.load(std::memory_order_relaxed);
+    do {
+      local_counters->next = head;
+    } while (!thread_counters.compare_exchange_weak(
+        head, local_counters, std::memory_order_release,
+        std::memory_order_relaxed));
+  }
+  return *local_counters;
+}
+
+// Only this thread writes its counters, so a plain add is enough
+template <typename T> void add(std::atomic<T> &counter, T amount) {
+  counter.store(counter.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+}
+
+void raise_peak(std::int64_t live) {
+  std::int64_t peak = peak_bytes.load(std::memory_order_relaxed);
+  while (live > peak && !peak_bytes.compare_exchange_weak(
+                            peak, live, std::memory_order_relaxed)) {
+  }
+}
+
+std::size_t usable_size(void *block) {
+#if defined(__APPLE__)
+  return malloc_size(block);
+#else
+  return malloc_usable_size(block);
+#endif
+}
+
+// Counts the block, or frees it and returns nullptr if it takes us over the
+// limit
+void *account(void *block) {
+  auto size = static_cast<std::int64_t>(usable_size(block));
+  ThreadCounters &thread = local();
+  std::int64_t unpublished =
+      thread.unpublished.load(std::memory_order_relaxed) + size;
+
+  if (unpublished >= UNPUBLISHED_BYTES) {
+    auto limit = memory_limit.load(std::memory_order_relaxed);
+    std::int64_t live =
+        live_bytes.fetch_add(unpublished, std::memory_order_relaxed) +
+        unpublished;
+
+    if (limit != 0 && live > static_cast<std::int64_t>(limit)) {
+      live_bytes.fetch_sub(size, std::memory_order_relaxed);
+      thread.unpublished.store(0, std::memory_order_relaxed);
+      std::free(block);
+
+      // Let the caller unwind and report without running into the limit
+      // again
+      exceeded_subsystem.store(static_cast<int>(current_subsystem),
+                               std::memory_order_relaxed);
+      limit_exceeded.store(true, std::memory_order_relaxed);
+      memory_limit.store(0, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    raise_peak(live);
+    unpublished = 0;
+  }
+  thread.unpublished.store(unpublished, std::memory_order_relaxed);
+
+  Counters &counters = thread.subsystems[static_cast<int>(current_subsystem)];
+  add<std::uint64_t>(counters.allocations, 1);
+  add<std::uint64_t>(counters.bytes_allocated, size);
+  return block;
+}
+
+void *allocate(std::size_t size) noexcept {
+  void *block = std::malloc(size == 0 ? 1 : size);
+  return block == nullptr ? nullptr : account(block);
+}
+
+void release(void *block) noexcept {
+  if (block == nullptr) {
+    return;
+  }
+  auto size = static_cast<std::int64_t>(usable_size(block));
+  ThreadCounters &thread = local();
+  std::int64_t unpublished =
+      thread.unpublished.load(std::memory_order_relaxed) - size;
+  if (unpublished <= -UNPUBLISHED_BYTES) {
+    live_bytes.fetch_add(unpublished, std::memory_order_relaxed);
+    unpublished = 0;
+  }
+  thread.unpublished.store(unpublished, std::memory_order_relaxed);
+
+  add<std::uint64_t>(
+      thread.subsystems[static_cast<int>(current_subsystem)].bytes_freed,
+      size);
+  std::free(block);
+}
+
+} // namespace
+
+const char *subsystem_name(Subsystem subsystem) {
+  switch (subsystem) {
+  case Subsystem::OTHER:
+    return "other";
+  case Subsystem::LEXER:
+    return "lexer";
+  case Subsystem::PARSER:
+    return "parser";
+  case Subsystem::AST:
+    return "ast";
+  case Subsystem::OPTIMIZER:
+    return "optimizer";
+  case Subsystem::CODEGEN:
+    return "codegen";
+  }
+  return "unknown";
+}
+
+AllocationScope::AllocationScope(Subsystem subsystem)
+    : previous(current_subsystem) {
+  current_subsystem = subsystem;
+}
+
+AllocationScope::~AllocationScope() { current_subsystem = previous; }
+
+AllocationStats allocation_stats() {
+  AllocationStats stats;
+  stats.live_bytes = live_bytes.load(std::memory_order_relaxed);
+  for (ThreadCounters *thread = thread_counters.load(std::memory_order_acquire);
+       thread != nullptr; thread = thread->next) {
+    for (int i = 0; i < SUBSYSTEM_COUNT; ++i) {
+      const Counters &counters = thread->subsystems[i];
+      stats.subsystems[i].allocations +=
+          counters.allocations.load(std::memory_order_relaxed);
+      stats.subsystems[i].bytes_allocated +=
+          counters.bytes_allocated.load(std::memory_order_relaxed);
+      stats.subsystems[i].bytes_freed +=
+          counters.bytes_freed.load(std::memory_order_relaxed);
+    }
+    stats.live_bytes += thread->unpublished.load(std::memory_order_relaxed);
+  }
+
+  // The peak is only taken as totals are published, so it can trail what
+  // is held now
+  raise_peak(stats.live_bytes);
+  stats.peak_bytes = peak_bytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void set_memory_limit(std::size_t bytes) {
+  limit_exceeded.store(false, std::memory_order_relaxed);
+  memory_limit.store(bytes, std::memory_order_relaxed);
+}
+
+bool memory_limit_exceeded(Subsystem &subsystem) {
+  if (!limit_exceeded.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  subsystem = static_cast<Subsystem>(
+      exceeded_subsystem.load(std::memory_order_relaxed));
+  return true;
+}
+
+void check_memory_limit() {
+  if (limit_exceeded.load(std::memory_order_relaxed)) {
+    throw std::bad_alloc();
+  }
+}
+
+void *operator new(std::size_t size) {
+  void *block = allocate(size);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void *block) noexcept { release(block); }
+
+void operator delete[](void *block) noexcept { release(block); }
+
+void operator delete(void *block, std::size_t) noexcept { release(block); }
+
+void operator delete[](void *block, std::size_t) noexcept { release(block); }
+
+void operator delete(void *block, const std::nothrow_t &) noexcept {
+  release(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept {
+  release(block);
+}
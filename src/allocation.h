@@ -0,0 +1,73 @@
+#ifndef ALLOCATION_H
+#define ALLOCATION_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/*
+Accounting of the compiler's heap memory, by the subsystem that allocated it.
+
+The compiler replaces the global operator new and delete (the plain and
+array forms), so every container, node and string is counted without
+changing its type. Each allocation is charged to the subsystem of the
+innermost AllocationScope on its thread (OTHER outside any), and each free
+to the subsystem whose scope it happens in. Sizes are the allocator's usable
+sizes, so the live total is what malloc actually holds for us. Threads add
+to that total 64 KiB at a time, which keeps counting off the shared cache
+line, so it and the peak are exact to within that per thread.
+
+With a limit set, an allocation that would take the live total over it
+throws std::bad_alloc instead, which the caller can turn into a diagnostic.
+The limit is lifted once hit, so unwinding and reporting the error can
+still allocate. Allocations the limit refuses are not counted.
+*/
+
+enum class Subsystem { OTHER, LEXER, PARSER, AST, OPTIMIZER, CODEGEN };
+
+constexpr int SUBSYSTEM_COUNT = static_cast<int>(Subsystem::CODEGEN) + 1;
+
+const char *subsystem_name(Subsystem subsystem);
+
+// Charges the allocations on this thread to 'subsystem' for its lifetime
+class AllocationScope {
+public:
+  explicit AllocationScope(Subsystem subsystem);
+  ~AllocationScope();
+
+  AllocationScope(const AllocationScope &) = delete;
+  AllocationScope &operator=(const AllocationScope &) = delete;
+
+private:
+  Subsystem previous;
+};
+
+struct AllocationStats {
+  struct Counts {
+    std::uint64_t allocations = 0;
+    std::uint64_t bytes_allocated = 0;
+    std::uint64_t bytes_freed = 0;
+  };
+
+  std::array<Counts, SUBSYSTEM_COUNT> subsystems;
+
+  // Bytes held right now and at most so far
+  std::int64_t live_bytes = 0;
+  std::int64_t peak_bytes = 0;
+};
+
+AllocationStats allocation_stats();
+
+// Caps the live total at 'bytes', or lifts the cap for 0
+void set_memory_limit(std::size_t bytes);
+
+// Whether an allocation has been refused by the limit, and in which
+// subsystem
+bool memory_limit_exceeded(Subsystem &subsystem);
+
+// Throws std::bad_alloc if an allocation has been refused by the limit.
+// Streams catch the exception and only set their badbit, so anything built
+// through one checks this before it is used
+void check_memory_limit();
+
+#endif
@@ -1,7 +1,13 @@
 #include "ast.h"
 
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <ostream>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
 
 std::string type_to_string(VariableType variable_type) {
   switch (variable_type) {
@@ -13,3 +19,90 @@ std::string type_to_string(VariableType variable_type) {
 
   throw std::runtime_error("Invalid type to convert to string");
 }
+
+void destroy_children(ExprAST *node) {
+  // Shared per thread so freeing a tree does not allocate a vector per node
+  thread_local std::vector<ExprPtr> detached;
+  thread_local bool draining = false;
+
+  node->take_children(detached);
+
+  // Nodes freed by the loop below land here again, with their children
+  // already detached onto the same stack
+  if (draining) {
+    return;
+  }
+
+  draining = true;
+  while (!detached.empty()) {
+    ExprPtr child = std::move(detached.back());
+    detached.pop_back();
+
+    // The child is freed at the end of this iteration with no children left.
+    // Interned children are shared and stay whole, their factory frees them
+    if (child != nullptr && !child->interned) {
+      child->take_children(detached);
+    }
+  }
+  draining = false;
+}
+
+void ExprWorklist::run(Item root, ExprVisitor *visitor, std::ostream &out) {
+  drain(std::move(root), [visitor](ExprAST *expr) { expr->accept(visitor); },
+        out);
+}
+
+void ExprWorklist::schedule(std::initializer_list<Item> sequence) {
+  // The worklist is a stack, so push in reverse to run in order
+  for (auto it = std::rbegin(sequence); it != std::rend(sequence); ++it) {
+    pending.push_back(*it);
+  }
+}
+
+void for_each_statement(StmtAST *statement,
+                        const std::function<void(StmtAST *)> &visit) {
+  std::vector<StmtAST *> pending{statement};
+
+  while (!pending.empty()) {
+    StmtAST *current = pending.back();
+    pending.pop_back();
+    visit(current);
+
+    if (current->kind == StmtKind::BLOCK) {
+      auto *block = static_cast<BlockStmt *>(current);
+      // Pushed in reverse so they are visited in order
+      for (auto it = block->body.rbegin(); it != block->body.rend(); ++it) {
+        pending.push_back(it->get());
+      }
+    } else if (current->kind == StmtKind::WHILE) {
+      pending.push_back(static_cast<WhileStmt *>(current)->body.get());
+    }
+  }
+}
+
+void for_each_expression(StmtAST *statement,
+                         const std::function<void(ExprPtr &)> &visit) {
+  for_each_statement(statement, [&](StmtAST *nested) {
+    ExprPtr *expr = nullptr;
+    switch (nested->kind) {
+    case StmtKind::VARIABLE_DECL:
+      expr = &static_cast<VariableDeclStmt *>(nested)->decl_expr;
+      break;
+    case StmtKind::RETURN:
+      expr = &static_cast<ReturnStmt *>(nested)->expr;
+      break;
+    case StmtKind::EXPR:
+      expr = &static_cast<ExprStmt *>(nested)->expr;
+      break;
+    case StmtKind::WHILE:
+      expr = &static_cast<WhileStmt *>(nested)->cond;
+      break;
+    case StmtKind::BLOCK:
+      break;
+    }
+
+    if (expr != nullptr && *expr != nullptr) {
+      visit(*expr);
+    }
+  });
+}
@@ -3,10 +3,16 @@
 
 #include "lex.h"
 
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
 #include <memory>
 #include <optional>
+#include <ostream>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -17,11 +23,15 @@ struct VariableExpr;
 struct UnaryOpExpr;
 struct BinaryOpExpr;
 struct VariableAssignExpr;
+struct TempStoreExpr;
+struct TempLoadExpr;
 
 class StmtVisitor;
 struct VariableDeclStmt;
 struct ReturnStmt;
 struct ExprStmt;
+struct BlockStmt;
+struct WhileStmt;
 
 class DeclVisitor;
 struct FunctionDecl;
@@ -61,8 +71,36 @@ enum class OperationType {
   BITWISE_SHIFT_RIGHT
 };
 
+// Number of OperationType values, for tables indexed by operator (see
+// operators.h)
+constexpr int OPERATION_TYPE_COUNT =
+    static_cast<int>(OperationType::BITWISE_SHIFT_RIGHT) + 1;
+
 std::string type_to_string(VariableType variable_type);
 
+// What each node is, so a pass can switch on it (see StaticVisitor) rather
+// than go through a virtual call or a chain of dynamic_casts
+enum class ExprKind {
+  INT_LITERAL,
+  VARIABLE,
+  UNARY_OP,
+  BINARY_OP,
+  VARIABLE_ASSIGN,
+  TEMP_STORE,
+  TEMP_LOAD
+};
+
+enum class StmtKind { VARIABLE_DECL, RETURN, EXPR, BLOCK, WHILE };
+
+// 'node' as a T (a node type, possibly const), or nullptr if it is null or
+// another kind of node. Compares kinds, so it is a load and a branch where a
+// dynamic_cast would walk the type hierarchy
+template <class T, class Node> T *node_cast(Node *node) {
+  return node != nullptr && node->kind == std::remove_const_t<T>::KIND
+             ? static_cast<T *>(node)
+             : nullptr;
+}
+
 // Visitor object for expressions ('a + b', 'x', etc.)
 class ExprVisitor {
 public:
@@ -73,6 +111,8 @@ public:
   virtual void visit(const UnaryOpExpr *expr) = 0;
   virtual void visit(const BinaryOpExpr *expr) = 0;
   virtual void visit(const VariableAssignExpr *expr) = 0;
+  virtual void visit(const TempStoreExpr *expr) = 0;
+  virtual void visit(const TempLoadExpr *expr) = 0;
 };
 
 // Visitor for statements ('return', 'if', variable declarations, etc.)
@@ -83,6 +123,8 @@ public:
   virtual void visit(const VariableDeclStmt *stmt) = 0;
   virtual void visit(const ReturnStmt *stmt) = 0;
   virtual void visit(const ExprStmt *stmt) = 0;
+  virtual void visit(const BlockStmt *stmt) = 0;
+  virtual void visit(const WhileStmt *stmt) = 0;
 };
 
 // Visitor for declarations (func(..., ..., ...), etc.)
@@ -93,50 +135,246 @@ public:
   virtual void visit(const FunctionDecl *decl) = 0;
 };
 
+struct ExprAST;
+
+// Owning pointer to an expression. Nodes interned by an ExprFactory belong
+// to the factory and may have several parents, so deleting through an
+// ExprPtr only frees nodes that are not interned (and only destroys placed
+// ones, see ExprAST::placed)
+struct ExprDeleter {
+  ExprDeleter() = default;
+
+  // Lets std::make_unique results convert to ExprPtr
+  template <class T> ExprDeleter(const std::default_delete<T> &) {}
+
+  void operator()(ExprAST *expr) const;
+};
+
+using ExprPtr = std::unique_ptr<ExprAST, ExprDeleter>;
+
 // Base struct for expression nodes
 struct ExprAST {
+  // Structural hash of the subtree as it was built. Passes that later
+  // replace children (see cse.h) leave the hashes above them stale, so only
+  // interned nodes, which are never rewritten, can rely on it
+  std::size_t hash = 0;
+
+  // Set for nodes owned and shared by an ExprFactory (see ast_factory.h).
+  // Interned nodes are immutable and only have interned children
+  bool interned = false;
+
+  // Set for nodes constructed in memory someone else owns, like a tree read
+  // from a file (see ast_serialization.h). Deleting one only destroys it,
+  // and the owner of the memory frees it
+  bool placed = false;
+
+  const ExprKind kind;
+
+  explicit ExprAST(ExprKind kind) : kind(kind) {}
   virtual ~ExprAST() = default;
   virtual void accept(ExprVisitor *visitor) = 0;
+
+  // Moves the node's children into 'out'. Nodes with children call
+  // destroy_children from their destructors so that freeing a very deep tree
+  // never nests destructor calls on the native stack
+  virtual void take_children(std::vector<ExprPtr> &/*out*/) {}
+};
+
+inline void ExprDeleter::operator()(ExprAST *expr) const {
+  if (expr->interned) {
+    return;
+  }
+  if (expr->placed) {
+    expr->~ExprAST();
+    return;
+  }
+  delete expr;
+}
+
+// Mixes 'value' into a structural hash
+inline std::size_t combine_hash(std::size_t seed, std::size_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+inline std::size_t child_hash(const ExprAST *expr) {
+  return expr != nullptr ? expr->hash : 0;
+}
+
+// Frees every descendant of 'node' iteratively, leaving it childless
+void destroy_children(ExprAST *node);
+
+// Explicit-stack driver for expression visitors. Rather than recursing into
+// their children, visit() methods schedule them along with the text to write
+// between them, and run() walks the whole tree in a loop
+class ExprWorklist {
+public:
+  // A child expression to visit, a deferred action to run, or (when both are
+  // empty) text to write
+  struct Item {
+    ExprAST *expr;
+    std::string text;
+    std::function<void()> action;
+
+    Item(ExprAST *expr) : expr(expr) {};
+    Item(std::string text) : expr(nullptr), text(std::move(text)) {};
+    Item(const char *text) : expr(nullptr), text(text) {};
+    Item(std::function<void()> action)
+        : expr(nullptr), action(std::move(action)) {};
+  };
+
+  // Visits 'root' (or runs it, for an action) and everything scheduled
+  // beneath it, writing text to 'out'
+  void run(Item root, ExprVisitor *visitor, std::ostream &out);
+
+  // Like run, but visits through visitor->dispatch (see StaticVisitor)
+  // instead of a virtual accept
+  template <class Visitor>
+  void run_static(Item root, Visitor *visitor, std::ostream &out);
+
+  // Schedules items to run in the given order once the current visit returns
+  void schedule(std::initializer_list<Item> sequence);
+
+private:
+  std::vector<Item> pending;
+
+  template <class Visit>
+  void drain(Item root, Visit visit, std::ostream &out);
+};
+
+// Explicit-stack driver for passes that rewrite an expression tree, or
+// compute something for it, bottom up. Like StaticVisitor, it switches on
+// each node's kind and calls 'Derived' directly.
+//
+// Derived gives a leave overload per node type, called once the node's
+// operands are done with their results, always in source order, and
+// returning the node's own. A rewrite uses ExprPtr results: a tree that
+// replaces the node, or nullptr to keep it (see replace_children). Derived
+// may also hide the hooks below, which do nothing by default
+template <class Derived, class Result = ExprPtr> class ExprRewriter {
+public:
+  // Walks the tree under 'root' and returns the root's result. A root given
+  // as a plain pointer reaches enter with a null slot
+  Result walk(ExprPtr &root) { return walk(root.get(), &root); }
+  Result walk(ExprAST *root) { return walk(root, nullptr); }
+
+  // Walks 'root' and replaces it with the result, if there is one
+  void rewrite(ExprPtr &root) {
+    Result replacement = walk(root);
+    if (replacement != nullptr) {
+      root = std::move(replacement);
+    }
+  }
+
+  // Runs before the operands of 'expr', held by 'slot'. Returning true
+  // finishes the node with 'result' instead, skipping its operands
+  bool enter(ExprAST * /*expr*/, ExprPtr * /*slot*/, Result & /*result*/) {
+    return false;
+  }
+
+  // Runs between the operands of 'expr', given the result of the first.
+  // Returning true finishes the node with that result instead, skipping the
+  // second operand
+  bool between(BinaryOpExpr * /*expr*/, Result & /*first*/) { return false; }
+
+  // Walks the right operand first, against evaluation order
+  static constexpr bool RIGHT_TO_LEFT = false;
+
+private:
+  Result walk(ExprAST *root, ExprPtr *slot);
 };
 
 // Int literal node
 struct IntLiteralExpr : public ExprAST {
+  static constexpr ExprKind KIND = ExprKind::INT_LITERAL;
+
   int value;
 
-  explicit IntLiteralExpr(int value) : value(value) {};
+  explicit IntLiteralExpr(int value) : ExprAST(KIND), value(value) {
+    hash = structural_hash(value);
+  };
+
+  static std::size_t structural_hash(int value) {
+    return combine_hash(1, std::hash<int>{}(value));
+  }
 
   void accept(ExprVisitor *visitor) { visitor->visit(this); }
 };
 
 // Variable node as an *expression* (like 'return x')
 struct VariableExpr : public ExprAST {
+  static constexpr ExprKind KIND = ExprKind::VARIABLE;
+
   std::string name;
 
-  explicit VariableExpr(std::string name) : name(std::move(name)) {};
+  // Dense index of the declaration this refers to, set by the resolver (see
+  // resolver.h) and -1 until then
+  int slot = -1;
+
+  explicit VariableExpr(std::string name)
+      : ExprAST(KIND), name(std::move(name)) {
+    hash = structural_hash(this->name);
+  };
+
+  static std::size_t structural_hash(const std::string &name) {
+    return combine_hash(2, std::hash<std::string>{}(name));
+  }
 
   void accept(ExprVisitor *visitor) { visitor->visit(this); }
 };
 
 // Unary Operation node
 struct UnaryOpExpr : public ExprAST {
+  static constexpr ExprKind KIND = ExprKind::UNARY_OP;
+
   OperationType op;
-  std::unique_ptr<ExprAST> expr;
+  ExprPtr expr;
+
+  UnaryOpExpr(OperationType op, ExprPtr expr)
+      : ExprAST(KIND), op(op), expr(std::move(expr)) {
+    hash = structural_hash(op, this->expr.get());
+  };
+
+  static std::size_t structural_hash(OperationType op, const ExprAST *expr) {
+    return combine_hash(combine_hash(3, static_cast<std::size_t>(op)),
+                        child_hash(expr));
+  }
 
-  UnaryOpExpr(OperationType op, std::unique_ptr<ExprAST> expr)
-      : op(op), expr(std::move(expr)) {};
+  ~UnaryOpExpr() { destroy_children(this); }
+
+  void take_children(std::vector<ExprPtr> &out) {
+    out.push_back(std::move(expr));
+  }
 
   void accept(ExprVisitor *visitor) { visitor->visit(this); };
 };
 
 // Binary Operation node
 struct BinaryOpExpr : public ExprAST {
+  static constexpr ExprKind KIND = ExprKind::BINARY_OP;
+
   OperationType op;
-  std::unique_ptr<ExprAST> expr_one;
-  std::unique_ptr<ExprAST> expr_two;
+  ExprPtr expr_one;
+  ExprPtr expr_two;
+
+  BinaryOpExpr(OperationType op, ExprPtr expr_one, ExprPtr expr_two)
+      : ExprAST(KIND), op(op), expr_one(std::move(expr_one)),
+        expr_two(std::move(expr_two)) {
+    hash = structural_hash(op, this->expr_one.get(), this->expr_two.get());
+  };
+
+  static std::size_t structural_hash(OperationType op, const ExprAST *expr_one,
+                                     const ExprAST *expr_two) {
+    std::size_t seed = combine_hash(4, static_cast<std::size_t>(op));
+    return combine_hash(combine_hash(seed, child_hash(expr_one)),
+                        child_hash(expr_two));
+  }
+
+  ~BinaryOpExpr() { destroy_children(this); }
 
-  BinaryOpExpr(OperationType op, std::unique_ptr<ExprAST> expr_one,
-               std::unique_ptr<ExprAST> expr_two)
-      : op(op), expr_one(std::move(expr_one)), expr_two(std::move(expr_two)) {};
+  void take_children(std::vector<ExprPtr> &out) {
+    out.push_back(std::move(expr_one));
+    out.push_back(std::move(expr_two));
+  }
 
   void accept(ExprVisitor *visitor) { visitor->visit(this); };
 };
@@ -144,39 +382,148 @@ struct BinaryOpExpr : public ExprAST {
 // Variable assignment node
 // x = 2, a = b * 3, y = (b = 3) // 2, etc.
 struct VariableAssignExpr : public ExprAST {
+  static constexpr ExprKind KIND = ExprKind::VARIABLE_ASSIGN;
+
   std::string var_name;
-  std::unique_ptr<ExprAST> assign_expr;
+  ExprPtr assign_expr;
+
+  // Slot of the assigned variable, like VariableExpr::slot
+  int slot = -1;
+
+  VariableAssignExpr(std::string var_name, ExprPtr assign_expr)
+      : ExprAST(KIND), var_name(var_name),
+        assign_expr(std::move(assign_expr)) {
+    hash = structural_hash(this->var_name, this->assign_expr.get());
+  };
+
+  static std::size_t structural_hash(const std::string &var_name,
+                                     const ExprAST *assign_expr) {
+    return combine_hash(
+        combine_hash(5, std::hash<std::string>{}(var_name)),
+        child_hash(assign_expr));
+  }
+
+  ~VariableAssignExpr() { destroy_children(this); }
 
-  VariableAssignExpr(std::string var_name, std::unique_ptr<ExprAST> assign_expr)
-      : var_name(var_name), assign_expr(std::move(assign_expr)) {};
+  void take_children(std::vector<ExprPtr> &out) {
+    out.push_back(std::move(assign_expr));
+  }
 
   void accept(ExprVisitor *visitor) { visitor->visit(this); }
 };
 
+// Temporaries are introduced by optimization passes (see cse.h), never by
+// the parser. A function has NUM_TEMPS of them, each holding one value
+constexpr int NUM_TEMPS = 7;
+
+// Evaluates 'expr' and also keeps its value in temporary 'temp'
+struct TempStoreExpr : public ExprAST {
+  static constexpr ExprKind KIND = ExprKind::TEMP_STORE;
+
+  int temp;
+  ExprPtr expr;
+
+  TempStoreExpr(int temp, ExprPtr expr)
+      : ExprAST(KIND), temp(temp), expr(std::move(expr)) {
+    hash = combine_hash(combine_hash(6, temp), child_hash(this->expr.get()));
+  };
+
+  ~TempStoreExpr() { destroy_children(this); }
+
+  void take_children(std::vector<ExprPtr> &out) {
+    out.push_back(std::move(expr));
+  }
+
+  void accept(ExprVisitor *visitor) { visitor->visit(this); }
+};
+
+// The value last stored in temporary 'temp'
+struct TempLoadExpr : public ExprAST {
+  static constexpr ExprKind KIND = ExprKind::TEMP_LOAD;
+
+  int temp;
+
+  explicit TempLoadExpr(int temp) : ExprAST(KIND), temp(temp) {
+    hash = combine_hash(7, temp);
+  };
+
+  void accept(ExprVisitor *visitor) { visitor->visit(this); }
+};
+
+// Calls 'visit' on every node of 'expr', parents before children, without
+// recursion
+template <class Visit> void for_each_node(const ExprAST *expr, Visit visit) {
+  std::vector<const ExprAST *> pending{expr};
+
+  while (!pending.empty()) {
+    const ExprAST *node = pending.back();
+    pending.pop_back();
+    if (node == nullptr) {
+      continue;
+    }
+
+    visit(node);
+    switch (node->kind) {
+    case ExprKind::UNARY_OP:
+      pending.push_back(static_cast<const UnaryOpExpr *>(node)->expr.get());
+      break;
+    case ExprKind::BINARY_OP: {
+      auto *binary = static_cast<const BinaryOpExpr *>(node);
+      pending.push_back(binary->expr_one.get());
+      pending.push_back(binary->expr_two.get());
+      break;
+    }
+    case ExprKind::VARIABLE_ASSIGN:
+      pending.push_back(
+          static_cast<const VariableAssignExpr *>(node)->assign_expr.get());
+      break;
+    case ExprKind::TEMP_STORE:
+      pending.push_back(static_cast<const TempStoreExpr *>(node)->expr.get());
+      break;
+    default:
+      break;
+    }
+  }
+}
+
 // Base struct for statement nodes
 struct StmtAST {
+  // Where the statement starts in the source, for diagnostics of later passes
+  int line = 0;
+  int column = 0;
+
+  const StmtKind kind;
+
+  explicit StmtAST(StmtKind kind) : kind(kind) {}
   virtual ~StmtAST() = default;
   virtual void accept(StmtVisitor *visitor) = 0;
 };
 
 // Variable declaration node
 struct VariableDeclStmt : public StmtAST {
+  static constexpr StmtKind KIND = StmtKind::VARIABLE_DECL;
+
   VariableType type;
   std::string name;
-  std::unique_ptr<ExprAST> decl_expr;
+  ExprPtr decl_expr;
+
+  // Slot the resolver numbered this declaration with
+  int slot = -1;
 
-  VariableDeclStmt(VariableType type, std::string name,
-                   std::unique_ptr<ExprAST> decl_expr)
-      : type(type), name(std::move(name)), decl_expr(std::move(decl_expr)) {};
+  VariableDeclStmt(VariableType type, std::string name, ExprPtr decl_expr)
+      : StmtAST(KIND), type(type), name(std::move(name)),
+        decl_expr(std::move(decl_expr)) {};
 
   void accept(StmtVisitor *visitor) { visitor->visit(this); }
 };
 
 // Return statement node
 struct ReturnStmt : public StmtAST {
-  std::unique_ptr<ExprAST> expr;
+  static constexpr StmtKind KIND = StmtKind::RETURN;
 
-  explicit ReturnStmt(std::unique_ptr<ExprAST> expr) : expr(std::move(expr)) {};
+  ExprPtr expr;
+
+  explicit ReturnStmt(ExprPtr expr) : StmtAST(KIND), expr(std::move(expr)) {};
 
   void accept(StmtVisitor *visitor) { visitor->visit(this); }
 };
@@ -184,13 +531,244 @@ struct ReturnStmt : public StmtAST {
 // An expression statement, like a = 2 or a = b + 2, or even 2 + 2
 // Inherently statements, but effectively expressions
 struct ExprStmt : public StmtAST {
-  std::unique_ptr<ExprAST> expr;
+  static constexpr StmtKind KIND = StmtKind::EXPR;
+
+  ExprPtr expr;
 
-  ExprStmt(std::unique_ptr<ExprAST> expr) : expr(std::move(expr)) {}
+  ExprStmt(ExprPtr expr) : StmtAST(KIND), expr(std::move(expr)) {}
 
   void accept(StmtVisitor *visitor) { visitor->visit(this); };
 };
 
+// A braced list of statements, which opens a scope
+// { int a = 2; b = a; }
+struct BlockStmt : public StmtAST {
+  static constexpr StmtKind KIND = StmtKind::BLOCK;
+
+  std::vector<std::unique_ptr<StmtAST>> body;
+
+  explicit BlockStmt(std::vector<std::unique_ptr<StmtAST>> body)
+      : StmtAST(KIND), body(std::move(body)) {};
+
+  void accept(StmtVisitor *visitor) { visitor->visit(this); }
+};
+
+// Loop node. The parser turns 'for' loops into these too (see parser.h), and
+// always gives them a block body, which is a scope of its own
+// while (a < 10) { a = a + 1; }
+struct WhileStmt : public StmtAST {
+  static constexpr StmtKind KIND = StmtKind::WHILE;
+
+  ExprPtr cond;
+  std::unique_ptr<BlockStmt> body;
+
+  WhileStmt(ExprPtr cond, std::unique_ptr<BlockStmt> body)
+      : StmtAST(KIND), cond(std::move(cond)), body(std::move(body)) {};
+
+  void accept(StmtVisitor *visitor) { visitor->visit(this); }
+};
+
+// Compile-time counterpart of ExprVisitor and StmtVisitor, using CRTP.
+// 'Derived' declares a visit overload per node type, and dispatch picks the
+// one for a node by switching on its kind. That is one direct call instead of
+// the virtual accept and virtual visit, and the compiler may inline it, so a
+// pass written once this way is devirtualized. A class can implement the
+// virtual visitors with the same methods as well; if it is final, dispatch
+// still binds them directly.
+// Only the dispatch overloads a pass calls are instantiated, so a pass over
+// expressions alone need not visit statements
+template <class Derived, class Result = void> class StaticVisitor {
+public:
+  Result dispatch(const ExprAST *expr) {
+    Derived &self = static_cast<Derived &>(*this);
+    switch (expr->kind) {
+    case ExprKind::INT_LITERAL:
+      return self.visit(static_cast<const IntLiteralExpr *>(expr));
+    case ExprKind::VARIABLE:
+      return self.visit(static_cast<const VariableExpr *>(expr));
+    case ExprKind::UNARY_OP:
+      return self.visit(static_cast<const UnaryOpExpr *>(expr));
+    case ExprKind::BINARY_OP:
+      return self.visit(static_cast<const BinaryOpExpr *>(expr));
+    case ExprKind::VARIABLE_ASSIGN:
+      return self.visit(static_cast<const VariableAssignExpr *>(expr));
+    case ExprKind::TEMP_STORE:
+      return self.visit(static_cast<const TempStoreExpr *>(expr));
+    case ExprKind::TEMP_LOAD:
+      return self.visit(static_cast<const TempLoadExpr *>(expr));
+    }
+
+    throw std::runtime_error("Invalid expression kind");
+  }
+
+  Result dispatch(const StmtAST *stmt) {
+    Derived &self = static_cast<Derived &>(*this);
+    switch (stmt->kind) {
+    case StmtKind::VARIABLE_DECL:
+      return self.visit(static_cast<const VariableDeclStmt *>(stmt));
+    case StmtKind::RETURN:
+      return self.visit(static_cast<const ReturnStmt *>(stmt));
+    case StmtKind::EXPR:
+      return self.visit(static_cast<const ExprStmt *>(stmt));
+    case StmtKind::BLOCK:
+      return self.visit(static_cast<const BlockStmt *>(stmt));
+    case StmtKind::WHILE:
+      return self.visit(static_cast<const WhileStmt *>(stmt));
+    }
+
+    throw std::runtime_error("Invalid statement kind");
+  }
+};
+
+template <class Visitor>
+void ExprWorklist::run_static(Item root, Visitor *visitor, std::ostream &out) {
+  drain(std::move(root), [visitor](ExprAST *expr) { visitor->dispatch(expr); },
+        out);
+}
+
+template <class Visit>
+void ExprWorklist::drain(Item root, Visit visit, std::ostream &out) {
+  // Only drain what this call scheduled, so a visit may safely run a nested
+  // walk of its own
+  std::size_t base = pending.size();
+  pending.push_back(std::move(root));
+
+  while (pending.size() > base) {
+    Item item = std::move(pending.back());
+    pending.pop_back();
+
+    if (item.expr != nullptr) {
+      visit(item.expr);
+    } else if (item.action) {
+      item.action();
+    } else {
+      out << item.text;
+    }
+  }
+}
+
+template <class Derived, class Result>
+Result ExprRewriter<Derived, Result>::walk(ExprAST *root, ExprPtr *slot) {
+  // 'stage' counts the operands already pushed, and each finished node
+  // leaves its result in 'results'
+  struct Frame {
+    ExprAST *expr;
+    ExprPtr *slot;
+    int stage;
+  };
+
+  Derived &self = static_cast<Derived &>(*this);
+  std::vector<Frame> stack{{root, slot, 0}};
+  std::vector<Result> results;
+
+  auto take_result = [&results] {
+    Result result = std::move(results.back());
+    results.pop_back();
+    return result;
+  };
+
+  while (!stack.empty()) {
+    Frame &frame = stack.back();
+    ExprAST *expr = frame.expr;
+
+    if (frame.stage == 0) {
+      Result result{};
+      if (self.enter(expr, frame.slot, result)) {
+        stack.pop_back();
+        results.push_back(std::move(result));
+        continue;
+      }
+    }
+
+    // Pushes the only operand of 'node', or finishes the node once it is done
+    auto one_operand = [&](auto *node, ExprPtr &operand) {
+      if (frame.stage == 0) {
+        frame.stage = 1;
+        stack.push_back({operand.get(), &operand, 0});
+        return;
+      }
+      stack.pop_back();
+      Result operand_result = take_result();
+      results.push_back(self.leave(node, std::move(operand_result)));
+    };
+
+    switch (expr->kind) {
+    case ExprKind::INT_LITERAL:
+      stack.pop_back();
+      results.push_back(self.leave(static_cast<IntLiteralExpr *>(expr)));
+      break;
+    case ExprKind::VARIABLE:
+      stack.pop_back();
+      results.push_back(self.leave(static_cast<VariableExpr *>(expr)));
+      break;
+    case ExprKind::TEMP_LOAD:
+      stack.pop_back();
+      results.push_back(self.leave(static_cast<TempLoadExpr *>(expr)));
+      break;
+    case ExprKind::UNARY_OP: {
+      auto *unary = static_cast<UnaryOpExpr *>(expr);
+      one_operand(unary, unary->expr);
+      break;
+    }
+    case ExprKind::VARIABLE_ASSIGN: {
+      auto *assign = static_cast<VariableAssignExpr *>(expr);
+      one_operand(assign, assign->assign_expr);
+      break;
+    }
+    case ExprKind::TEMP_STORE: {
+      auto *store = static_cast<TempStoreExpr *>(expr);
+      one_operand(store, store->expr);
+      break;
+    }
+    case ExprKind::BINARY_OP: {
+      auto *binary = static_cast<BinaryOpExpr *>(expr);
+      constexpr bool reversed = Derived::RIGHT_TO_LEFT;
+      ExprPtr &first = reversed ? binary->expr_two : binary->expr_one;
+      ExprPtr &second = reversed ? binary->expr_one : binary->expr_two;
+
+      if (frame.stage == 0) {
+        frame.stage = 1;
+        stack.push_back({first.get(), &first, 0});
+        break;
+      }
+      if (frame.stage == 1) {
+        frame.stage = 2;
+        if (self.between(binary, results.back())) {
+          stack.pop_back();
+        } else {
+          stack.push_back({second.get(), &second, 0});
+        }
+        break;
+      }
+      stack.pop_back();
+
+      Result second_result = take_result();
+      Result first_result = take_result();
+      if (reversed) {
+        results.push_back(self.leave(binary, std::move(second_result),
+                                     std::move(first_result)));
+      } else {
+        results.push_back(self.leave(binary, std::move(first_result),
+                                     std::move(second_result)));
+      }
+      break;
+    }
+    }
+  }
+
+  return take_result();
+}
+
+// Calls 'visit' on 'statement' and every statement nested in it, in source
+// order
+void for_each_statement(StmtAST *statement,
+                        const std::function<void(StmtAST *)> &visit);
+
+// Calls 'visit' on the root of every expression in 'statement' and the
+// statements nested in it, in source order
+void for_each_expression(StmtAST *statement,
+                         const std::function<void(ExprPtr &)> &visit);
+
 struct DeclAST {
   virtual ~DeclAST() = default;
   virtual void accept(DeclVisitor *visitor) = 0;
@@ -203,6 +781,9 @@ struct FunctionDecl : public DeclAST {
   std::vector<std::unique_ptr<VariableDeclStmt>> parameters;
   std::vector<std::unique_ptr<StmtAST>> body;
 
+  // Number of slots numbered by the resolver, one per declaration in the body
+  int slot_count = 0;
+
   FunctionDecl(std::string name, VariableType return_type,
                std::vector<std::unique_ptr<VariableDeclStmt>> params,
                std::vector<std::unique_ptr<StmtAST>> body)
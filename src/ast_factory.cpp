@@ -0,0 +1,236 @@
+#include "ast_factory.h"
+#include "allocation.h"
+#include "ast.h"
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace {
+
+bool is_interned(const ExprPtr &expr) {
+  return expr != nullptr && expr->interned;
+}
+
+// Another owning pointer to an interned node, which never frees it
+ExprPtr alias(const ExprPtr &expr) {
+  return ExprPtr(expr.get());
+}
+
+} // namespace
+
+ExprFactory::~ExprFactory() {
+  // Parents were built after their children and still look at them while
+  // being freed, so free the newest nodes first
+  while (!owned.empty()) {
+    owned.pop_back();
+  }
+}
+
+template <class T, class Match>
+T *ExprFactory::find(std::size_t hash, Match matches) {
+  auto range = interned.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    auto *node = node_cast<T>(it->second);
+    if (node != nullptr && matches(node)) {
+      return node;
+    }
+  }
+  return nullptr;
+}
+
+ExprPtr ExprFactory::keep(ExprAST *node, bool children_interned) {
+  ++allocated;
+  if (!hash_cons || !children_interned) {
+    return ExprPtr(node);
+  }
+
+  node->interned = true;
+  owned.emplace_back(node);
+  interned.emplace(node->hash, node);
+  return ExprPtr(node);
+}
+
+ExprPtr ExprFactory::literal(int value) {
+  ++requested;
+  AllocationScope allocation_scope(Subsystem::AST);
+  if (hash_cons) {
+    auto *found = find<IntLiteralExpr>(
+        IntLiteralExpr::structural_hash(value),
+        [&](const IntLiteralExpr *node) { return node->value == value; });
+    if (found != nullptr) {
+      return ExprPtr(found);
+    }
+  }
+
+  return keep(new IntLiteralExpr(value), true);
+}
+
+ExprPtr ExprFactory::variable(std::string name) {
+  ++requested;
+  AllocationScope allocation_scope(Subsystem::AST);
+  if (hash_cons) {
+    auto *found = find<VariableExpr>(
+        VariableExpr::structural_hash(name),
+        [&](const VariableExpr *node) { return node->name == name; });
+    if (found != nullptr) {
+      return ExprPtr(found);
+    }
+  }
+
+  return keep(new VariableExpr(std::move(name)), true);
+}
+
+ExprPtr ExprFactory::unary(OperationType op, ExprPtr expr) {
+  ++requested;
+  AllocationScope allocation_scope(Subsystem::AST);
+  bool children_interned = is_interned(expr);
+  if (hash_cons && children_interned) {
+    auto *found = find<UnaryOpExpr>(
+        UnaryOpExpr::structural_hash(op, expr.get()),
+        [&](const UnaryOpExpr *node) {
+          return node->op == op && node->expr == expr;
+        });
+    if (found != nullptr) {
+      return ExprPtr(found);
+    }
+  }
+
+  return keep(new UnaryOpExpr(op, std::move(expr)), children_interned);
+}
+
+ExprPtr ExprFactory::binary(OperationType op, ExprPtr expr_one,
+                            ExprPtr expr_two) {
+  ++requested;
+  AllocationScope allocation_scope(Subsystem::AST);
+  bool children_interned = is_interned(expr_one) && is_interned(expr_two);
+  if (hash_cons && children_interned) {
+    auto *found = find<BinaryOpExpr>(
+        BinaryOpExpr::structural_hash(op, expr_one.get(), expr_two.get()),
+        [&](const BinaryOpExpr *node) {
+          return node->op == op && node->expr_one == expr_one &&
+                 node->expr_two == expr_two;
+        });
+    if (found != nullptr) {
+      return ExprPtr(found);
+    }
+  }
+
+  return keep(new BinaryOpExpr(op, std::move(expr_one), std::move(expr_two)),
+              children_interned);
+}
+
+ExprPtr ExprFactory::assign(std::string var_name, ExprPtr assign_expr) {
+  ++requested;
+  AllocationScope allocation_scope(Subsystem::AST);
+  bool children_interned = is_interned(assign_expr);
+  if (hash_cons && children_interned) {
+    auto *found = find<VariableAssignExpr>(
+        VariableAssignExpr::structural_hash(var_name, assign_expr.get()),
+        [&](const VariableAssignExpr *node) {
+          return node->var_name == var_name &&
+                 node->assign_expr == assign_expr;
+        });
+    if (found != nullptr) {
+      return ExprPtr(found);
+    }
+  }
+
+  return keep(new VariableAssignExpr(std::move(var_name),
+                                     std::move(assign_expr)),
+              children_interned);
+}
+
+ExprPtr copy_node(const ExprAST *node) {
+  if (node == nullptr || !node->interned) {
+    throw std::runtime_error("Only interned nodes can be copied");
+  }
+
+  switch (node->kind) {
+  case ExprKind::INT_LITERAL:
+    return std::make_unique<IntLiteralExpr>(
+        static_cast<const IntLiteralExpr *>(node)->value);
+  case ExprKind::VARIABLE: {
+    auto *variable = static_cast<const VariableExpr *>(node);
+    auto copy = std::make_unique<VariableExpr>(variable->name);
+    copy->slot = variable->slot;
+    return copy;
+  }
+  case ExprKind::UNARY_OP: {
+    auto *unary = static_cast<const UnaryOpExpr *>(node);
+    return std::make_unique<UnaryOpExpr>(unary->op, alias(unary->expr));
+  }
+  case ExprKind::BINARY_OP: {
+    auto *binary = static_cast<const BinaryOpExpr *>(node);
+    return std::make_unique<BinaryOpExpr>(binary->op, alias(binary->expr_one),
+                                          alias(binary->expr_two));
+  }
+  case ExprKind::VARIABLE_ASSIGN: {
+    auto *assign = static_cast<const VariableAssignExpr *>(node);
+    auto copy = std::make_unique<VariableAssignExpr>(
+        assign->var_name, alias(assign->assign_expr));
+    copy->slot = assign->slot;
+    return copy;
+  }
+  default:
+    throw std::runtime_error("Unknown interned expression node");
+  }
+}
+
+ExprPtr replace_children(ExprAST *node, ExprPtr first, ExprPtr second) {
+  // Nothing changes, so an interned node need not be copied either
+  if (first == nullptr && second == nullptr) {
+    return nullptr;
+  }
+
+  ExprPtr copy;
+  if (node->interned) {
+    copy = copy_node(node);
+    node = copy.get();
+  }
+
+  switch (node->kind) {
+  case ExprKind::UNARY_OP:
+    if (first != nullptr) {
+      static_cast<UnaryOpExpr *>(node)->expr = std::move(first);
+    }
+    break;
+  case ExprKind::BINARY_OP: {
+    auto *binary = static_cast<BinaryOpExpr *>(node);
+    if (first != nullptr) {
+      binary->expr_one = std::move(first);
+    }
+    if (second != nullptr) {
+      binary->expr_two = std::move(second);
+    }
+    break;
+  }
+  case ExprKind::VARIABLE_ASSIGN:
+    if (first != nullptr) {
+      static_cast<VariableAssignExpr *>(node)->assign_expr = std::move(first);
+    }
+    break;
+  default:
+    break;
+  }
+
+  return copy;
+}
+
+ExprPtr take_only_child(ExprAST *node) {
+  ExprPtr *child = nullptr;
+  switch (node->kind) {
+  case ExprKind::UNARY_OP:
+    child = &static_cast<UnaryOpExpr *>(node)->expr;
+    break;
+  case ExprKind::VARIABLE_ASSIGN:
+    child = &static_cast<VariableAssignExpr *>(node)->assign_expr;
+    break;
+  default:
+    throw std::runtime_error("Expected a node with a single child");
+  }
+
+  return node->interned ? alias(*child) : std::move(*child);
+}
@@ -0,0 +1,79 @@
+#ifndef AST_FACTORY_H
+#define AST_FACTORY_H
+
+#include "ast.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+Builds expression nodes for the parser, optionally hash-consing them.
+
+With hash-consing off every call allocates a fresh node owned by the tree it
+is put in, exactly like constructing the node directly. With it on, the
+factory keeps one canonical node per distinct subtree: a request whose
+operator, value or name and children match a node built before returns that
+node again, so structurally equal subtrees share one node and the function
+becomes a DAG. Children are interned before their parents, so matching only
+compares them by address and two interned nodes are structurally equal
+exactly when they are the same node.
+
+Interned nodes are marked 'interned', owned by the factory and freed with it,
+so the trees built from them must not outlive it. They are immutable: a pass
+that rewrites a tree must replace a shared node by a copy of its own (see
+copy_node) rather than change it in place.
+*/
+class ExprFactory {
+public:
+  explicit ExprFactory(bool hash_cons = false) : hash_cons(hash_cons) {};
+
+  ~ExprFactory();
+
+  ExprFactory(const ExprFactory &) = delete;
+  ExprFactory &operator=(const ExprFactory &) = delete;
+
+  ExprPtr literal(int value);
+  ExprPtr variable(std::string name);
+  ExprPtr unary(OperationType op, ExprPtr expr);
+  ExprPtr binary(OperationType op, ExprPtr expr_one, ExprPtr expr_two);
+  ExprPtr assign(std::string var_name, ExprPtr assign_expr);
+
+  // Nodes asked for, and nodes actually allocated to answer them
+  std::size_t nodes_requested() const { return requested; }
+  std::size_t nodes_allocated() const { return allocated; }
+
+private:
+  bool hash_cons;
+  std::size_t requested = 0;
+  std::size_t allocated = 0;
+
+  // Canonical nodes by structural hash, and ownership of all of them in
+  // the order they were built
+  std::unordered_multimap<std::size_t, ExprAST *> interned;
+  std::vector<std::unique_ptr<ExprAST>> owned;
+
+  // Returns the interned node with 'hash' that 'matches' accepts, if any
+  template <class T, class Match> T *find(std::size_t hash, Match matches);
+
+  // Takes ownership of a new node, interning it if its children are
+  ExprPtr keep(ExprAST *node, bool children_interned);
+};
+
+// Returns a private, mutable copy of the interned 'node'. The copy shares
+// the node's (interned) children
+ExprPtr copy_node(const ExprAST *node);
+
+// Gives 'node' the non-null children among 'first' and 'second' (in
+// evaluation order), changing it in place unless it is interned. Returns the
+// copy made in that case, which has to replace the node, or nullptr. With
+// no new children, nothing is copied
+ExprPtr replace_children(ExprAST *node, ExprPtr first, ExprPtr second);
+
+// Detaches the single child of a unary or assignment 'node' so it can take
+// the node's place. An interned node keeps its child, which is shared anyway
+ExprPtr take_only_child(ExprAST *node);
+
+#endif
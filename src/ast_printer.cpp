@@ -1,5 +1,6 @@
 #include "ast_printer.h"
 #include "ast.h"
+#include "operators.h"
 
 #include <cstddef>
 #include <iostream>
@@ -22,96 +23,46 @@ void AstPrinter::visit(const VariableExpr *expr) {
   std::cout << " VariableExpr " << expr->name;
 }
 
+void AstPrinter::print_expression(ExprAST *expr) {
+  worklist.run_static(expr, this, std::cout);
+}
+
 void AstPrinter::visit(const UnaryOpExpr *expr) {
-  switch (expr->op) {
-  case OperationType::NEGATE:
-    std::cout << "Negate";
-    break;
-  case OperationType::BITWISE:
-    std::cout << "Bitwise";
-    break;
-  case OperationType::LOGIC_NEGATE:
-    std::cout << "Logical Negation";
-    break;
-  default:
+  const OperatorInfo &info = operator_info(expr->op);
+  if (!info.unary) {
     throw std::runtime_error("Expected a unary operation");
   }
+  std::cout << info.unary_name;
 
-  expr->expr->accept(this);
+  worklist.schedule({expr->expr.get()});
 }
 
 void AstPrinter::visit(const BinaryOpExpr *expr) {
-  expr->expr_one->accept(this);
-
-  switch (expr->op) {
-  case OperationType::ADD:
-    std::cout << " Add ";
-    break;
-  case OperationType::NEGATE:
-    std::cout << " Subtract ";
-    break;
-  case OperationType::MULT:
-    std::cout << " Multiply ";
-    break;
-  case OperationType::DIVIDE:
-    std::cout << " Divide ";
-    break;
-  case OperationType::AND:
-    std::cout << " And ";
-    break;
-  case OperationType::OR:
-    std::cout << " Or ";
-    break;
-  case OperationType::EQUAL:
-    std::cout << " Equal ";
-    break;
-  case OperationType::NOT_EQUAL:
-    std::cout << " Not Equal ";
-    break;
-  case OperationType::LESS_THAN:
-    std::cout << " Less Than ";
-    break;
-  case OperationType::LESS_THAN_EQUAL:
-    std::cout << " Less Than or Equa l";
-    break;
-  case OperationType::GREATER_THAN:
-    std::cout << " Greater Than ";
-    break;
-  case OperationType::GREATER_THAN_EQUAL:
-    std::cout << " Greater Than or Equal ";
-    break;
-  case OperationType::MODULO:
-    std::cout << " Modulo ";
-    break;
-  case OperationType::BITWISE_AND:
-    std::cout << " Bitwise And ";
-    break;
-  case OperationType::BITWISE_OR:
-    std::cout << " Bitwise Or ";
-    break;
-  case OperationType::BITWISE_XOR:
-    std::cout << " Bitwise Xor ";
-    break;
-  case OperationType::BITWISE_SHIFT_LEFT:
-    std::cout << " Bitwise Shift Left ";
-    break;
-  case OperationType::BITWISE_SHIFT_RIGHT:
-    std::cout << " Bitwise Shift Right ";
-    break;
-  default:
+  const OperatorInfo &info = operator_info(expr->op);
+  if (info.precedence == 0) {
     throw std::runtime_error("Expected a binary operation");
   }
+  std::string op_name = " " + std::string(info.name) + " ";
 
-  expr->expr_two->accept(this);
+  worklist.schedule({expr->expr_one.get(), op_name, expr->expr_two.get()});
 }
 
 void AstPrinter::visit(const VariableAssignExpr *expr) {
   print_indent();
   std::cout << "VariableAssignment " << expr->var_name << " = ";
 
-  expr->assign_expr->accept(this);
+  worklist.schedule({expr->assign_expr.get(), "\n"});
+}
+
+void AstPrinter::visit(const TempStoreExpr *expr) {
+  std::cout << "TempStore t" << expr->temp << " = ";
 
-  std::cout << '\n';
+  worklist.schedule({expr->expr.get()});
+}
+
+void AstPrinter::visit(const TempLoadExpr *expr) {
+  print_indent();
+  std::cout << " TempLoad t" << expr->temp;
 }
 
 void AstPrinter::visit(const ReturnStmt *stmt) {
@@ -119,7 +70,7 @@ void AstPrinter::visit(const ReturnStmt *stmt) {
   std::cout << "ReturnStmt ";
 
   ++indentation;
-  stmt->expr->accept(this);
+  print_expression(stmt->expr.get());
   --indentation;
 
   std::cout << '\n';
@@ -131,7 +82,7 @@ void AstPrinter::visit(const VariableDeclStmt *stmt) {
             << stmt->name << " = ";
 
   if (stmt->decl_expr != nullptr) {
-    stmt->decl_expr->accept(this);
+    print_expression(stmt->decl_expr.get());
   } else {
     std::cout << "init";
   }
@@ -143,9 +94,33 @@ void AstPrinter::visit(const ExprStmt *stmt) {
   print_indent();
   std::cout << "ExprStmt ";
 
-  stmt->expr->accept(this);
+  print_expression(stmt->expr.get());
+
+  std::cout << '\n';
+}
+
+void AstPrinter::visit(const BlockStmt *stmt) {
+  print_indent();
+  std::cout << "BlockStmt:\n";
+
+  ++indentation;
+  for (const auto &statement : stmt->body) {
+    dispatch(statement.get());
+  }
+  --indentation;
+}
+
+void AstPrinter::visit(const WhileStmt *stmt) {
+  print_indent();
+  std::cout << "WhileStmt ";
+
+  print_expression(stmt->cond.get());
 
   std::cout << '\n';
+
+  ++indentation;
+  dispatch(stmt->body.get());
+  --indentation;
 }
 
 void AstPrinter::visit(const FunctionDecl *decl) {
@@ -162,7 +137,7 @@ void AstPrinter::visit(const FunctionDecl *decl) {
 
   ++indentation;
   for (int i = 0; i < decl->body.size(); ++i) {
-    decl->body[i]->accept(this);
+    dispatch(decl->body[i].get());
   }
   --indentation;
 
@@ -1,3 +1,6 @@
+#ifndef AST_PRINTER_H
+#define AST_PRINTER_H
+
 #include "ast.h"
 
 #include <cstdio>
@@ -10,7 +13,10 @@
 //     [](int i) -> std::string { return std::to_string(i); },
 // };
 
-class AstPrinter : public ExprVisitor, public StmtVisitor, public DeclVisitor {
+class AstPrinter final : public ExprVisitor,
+                          public StmtVisitor,
+                          public DeclVisitor,
+                          public StaticVisitor<AstPrinter> {
 public:
   // Method to start the printing process
   void print_from_root(DeclAST *root_node) { root_node->accept(this); }
@@ -21,11 +27,15 @@ public:
   void visit(const UnaryOpExpr *expr) override;
   void visit(const BinaryOpExpr *expr) override;
   void visit(const VariableAssignExpr *expr) override;
+  void visit(const TempStoreExpr *expr) override;
+  void visit(const TempLoadExpr *expr) override;
 
   // Fulfilling the StmtVisitor contract
   void visit(const VariableDeclStmt *stmt) override;
   void visit(const ReturnStmt *stmt) override;
   void visit(const ExprStmt *stmt) override;
+  void visit(const BlockStmt *stmt) override;
+  void visit(const WhileStmt *stmt) override;
 
   // Fulfilling the DeclVisitor contract
   void visit(const FunctionDecl *decl) override;
@@ -33,6 +43,14 @@ public:
 private:
   int indentation = 0;
 
+  // Expression children are walked through this instead of recursion
+  ExprWorklist worklist;
+
+  // Helper to print an expression tree without recursing per level
+  void print_expression(ExprAST *expr);
+
   // Helper to print indents to make tree structure clearer
   void print_indent();
 };
+
+#endif
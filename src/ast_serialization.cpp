@@ -0,0 +1,640 @@
+#include "ast_serialization.h"
+#include "ast.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char AST_MAGIC[8] = {'C', 'C', 'A', 'S', 'T', '\0', '\r', '\n'};
+
+// Reads back as this only in the byte order the file was written in
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// Bumped whenever the layout of any section changes
+constexpr std::uint32_t AST_VERSION = 1;
+
+// Index of no node, for absent expressions
+constexpr std::int32_t NONE = -1;
+
+struct FileHeader {
+  char magic[8];
+  std::uint32_t byte_order;
+  std::uint32_t version;
+
+  std::uint32_t symbol_count;
+  std::uint32_t symbol_bytes;
+  std::uint32_t expr_count;
+  std::uint32_t stmt_count;
+  std::uint32_t list_count;
+
+  // The function: its name (a symbol), return type, and the ranges of the
+  // statement lists holding its parameters and its body
+  std::int32_t name;
+  std::uint32_t return_type;
+  std::int32_t parameters;
+  std::int32_t parameter_count;
+  std::int32_t body;
+  std::int32_t body_count;
+};
+
+// Literal: first is the value. Variable: first is a symbol. Unary: first is
+// the operand. Binary: first and second are the operands. Assignment: first
+// is a symbol and second the value
+struct ExprRecord {
+  std::uint8_t kind;
+  std::uint8_t op;
+  std::uint16_t reserved;
+  std::int32_t first;
+  std::int32_t second;
+};
+
+// Declaration: type, symbol and expr (the initializer, or NONE). Return and
+// expression statements: expr. Block: its statements are the list range.
+// While: expr is the condition, and the list range holds the body
+struct StmtRecord {
+  std::uint8_t kind;
+  std::uint8_t type;
+  std::uint16_t reserved;
+  std::int32_t line;
+  std::int32_t column;
+  std::int32_t symbol;
+  std::int32_t expr;
+  std::int32_t list;
+  std::int32_t list_count;
+};
+
+static_assert(sizeof(FileHeader) % 4 == 0 && sizeof(ExprRecord) % 4 == 0 &&
+                  sizeof(StmtRecord) % 4 == 0,
+              "Sections must keep the 4-byte alignment of the ones after");
+
+// Flattens a function into the sections of the file
+class AstWriter {
+public:
+  std::vector<std::string> symbols;
+  std::vector<ExprRecord> exprs;
+  std::vector<StmtRecord> stmts;
+  std::vector<std::int32_t> lists;
+
+  std::int32_t symbol(const std::string &name) {
+    auto found = symbol_index.find(name);
+    if (found != symbol_index.end()) {
+      return found->second;
+    }
+
+    auto index = static_cast<std::int32_t>(symbols.size());
+    symbols.push_back(name);
+    symbol_index.emplace(name, index);
+    return index;
+  }
+
+  // Writes the subtree in post-order without recursion, so arbitrarily deep
+  // expressions can be written. Returns the index of its root
+  std::int32_t expression(const ExprAST *root) {
+    if (root == nullptr) {
+      return NONE;
+    }
+
+    std::vector<std::pair<const ExprAST *, bool>> pending{{root, false}};
+    std::vector<std::int32_t> written;
+
+    while (!pending.empty()) {
+      auto [node, children_written] = pending.back();
+      pending.pop_back();
+
+      if (!children_written) {
+        pending.push_back({node, true});
+        // Pushed in reverse, so they are written in order
+        if (node->kind == ExprKind::BINARY_OP) {
+          auto *binary = static_cast<const BinaryOpExpr *>(node);
+          pending.push_back({binary->expr_two.get(), false});
+          pending.push_back({binary->expr_one.get(), false});
+        } else if (node->kind == ExprKind::UNARY_OP) {
+          pending.push_back(
+              {static_cast<const UnaryOpExpr *>(node)->expr.get(), false});
+        } else if (node->kind == ExprKind::VARIABLE_ASSIGN) {
+          pending.push_back(
+              {static_cast<const VariableAssignExpr *>(node)->assign_expr.get(),
+               false});
+        }
+        continue;
+      }
+
+      ExprRecord record{};
+      record.kind = static_cast<std::uint8_t>(node->kind);
+      switch (node->kind) {
+      case ExprKind::INT_LITERAL:
+        record.first = static_cast<const IntLiteralExpr *>(node)->value;
+        break;
+      case ExprKind::VARIABLE:
+        record.first = symbol(static_cast<const VariableExpr *>(node)->name);
+        break;
+      case ExprKind::UNARY_OP:
+        record.op = static_cast<std::uint8_t>(
+            static_cast<const UnaryOpExpr *>(node)->op);
+        record.first = pop(written);
+        break;
+      case ExprKind::BINARY_OP:
+        record.op = static_cast<std::uint8_t>(
+            static_cast<const BinaryOpExpr *>(node)->op);
+        record.second = pop(written);
+        record.first = pop(written);
+        break;
+      case ExprKind::VARIABLE_ASSIGN:
+        record.first =
+            symbol(static_cast<const VariableAssignExpr *>(node)->var_name);
+        record.second = pop(written);
+        break;
+      case ExprKind::TEMP_STORE:
+      case ExprKind::TEMP_LOAD:
+        throw std::runtime_error(
+            "Trees with temporaries cannot be written as AST files");
+      }
+
+      written.push_back(static_cast<std::int32_t>(exprs.size()));
+      exprs.push_back(record);
+    }
+
+    return written.back();
+  }
+
+  std::int32_t statement(const StmtAST *stmt) {
+    StmtRecord record{};
+    record.kind = static_cast<std::uint8_t>(stmt->kind);
+    record.line = stmt->line;
+    record.column = stmt->column;
+    record.symbol = NONE;
+    record.expr = NONE;
+    record.list = NONE;
+
+    switch (stmt->kind) {
+    case StmtKind::VARIABLE_DECL: {
+      auto *decl = static_cast<const VariableDeclStmt *>(stmt);
+      record.type = static_cast<std::uint8_t>(decl->type);
+      record.symbol = symbol(decl->name);
+      record.expr = expression(decl->decl_expr.get());
+      break;
+    }
+    case StmtKind::RETURN:
+      record.expr = expression(static_cast<const ReturnStmt *>(stmt)->expr.get());
+      break;
+    case StmtKind::EXPR:
+      record.expr = expression(static_cast<const ExprStmt *>(stmt)->expr.get());
+      break;
+    case StmtKind::BLOCK: {
+      std::vector<std::int32_t> body;
+      for (const auto &nested : static_cast<const BlockStmt *>(stmt)->body) {
+        body.push_back(statement(nested.get()));
+      }
+      std::tie(record.list, record.list_count) = list(body);
+      break;
+    }
+    case StmtKind::WHILE: {
+      auto *loop = static_cast<const WhileStmt *>(stmt);
+      std::tie(record.list, record.list_count) =
+          list({statement(loop->body.get())});
+      record.expr = expression(loop->cond.get());
+      break;
+    }
+    }
+
+    stmts.push_back(record);
+    return static_cast<std::int32_t>(stmts.size() - 1);
+  }
+
+  // Appends a statement list, returning where it starts and its length
+  std::pair<std::int32_t, std::int32_t>
+  list(const std::vector<std::int32_t> &indices) {
+    auto start = static_cast<std::int32_t>(lists.size());
+    lists.insert(lists.end(), indices.begin(), indices.end());
+    return {start, static_cast<std::int32_t>(indices.size())};
+  }
+
+private:
+  std::unordered_map<std::string, std::int32_t> symbol_index;
+
+  static std::int32_t pop(std::vector<std::int32_t> &written) {
+    std::int32_t index = written.back();
+    written.pop_back();
+    return index;
+  }
+};
+
+template <class T> void write_section(std::ostream &out, const std::vector<T> &items) {
+  out.write(reinterpret_cast<const char *>(items.data()),
+            static_cast<std::streamsize>(items.size() * sizeof(T)));
+}
+
+// A read-only private mapping of a whole file, unmapped when destroyed
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &file_path) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open AST file");
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+      close(fd);
+      throw std::runtime_error("Failed to read AST file");
+    }
+    size = static_cast<std::size_t>(status.st_size);
+
+    if (size > 0) {
+      void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Failed to map AST file");
+      }
+      data = static_cast<const std::byte *>(mapped);
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data != nullptr) {
+      munmap(const_cast<std::byte *>(data), size);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const std::byte *data = nullptr;
+  std::size_t size = 0;
+};
+
+[[noreturn]] void invalid(const char *what) {
+  throw std::runtime_error(std::string("Invalid AST file: ") + what);
+}
+
+// Bytes an expression node of 'kind' takes in the node storage, rounded up
+// so the next one is aligned
+std::size_t node_size(ExprKind kind) {
+  std::size_t size = 0;
+  switch (kind) {
+  case ExprKind::INT_LITERAL:
+    size = sizeof(IntLiteralExpr);
+    break;
+  case ExprKind::VARIABLE:
+    size = sizeof(VariableExpr);
+    break;
+  case ExprKind::UNARY_OP:
+    size = sizeof(UnaryOpExpr);
+    break;
+  case ExprKind::BINARY_OP:
+    size = sizeof(BinaryOpExpr);
+    break;
+  case ExprKind::VARIABLE_ASSIGN:
+    size = sizeof(VariableAssignExpr);
+    break;
+  default:
+    invalid("unknown expression kind");
+  }
+
+  constexpr std::size_t alignment = alignof(std::max_align_t);
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Rebuilds the function from the sections of a mapped file
+class AstReader {
+public:
+  AstReader(const MappedFile &file) {
+    if (file.size < sizeof(FileHeader)) {
+      invalid("too short");
+    }
+    std::memcpy(&header, file.data, sizeof(FileHeader));
+    if (std::memcmp(header.magic, AST_MAGIC, sizeof(AST_MAGIC)) != 0) {
+      invalid("wrong magic number");
+    }
+    if (header.byte_order != BYTE_ORDER_MARK) {
+      invalid("written on a machine of another byte order");
+    }
+    if (header.version != AST_VERSION) {
+      throw std::runtime_error("AST file has version " +
+                               std::to_string(header.version) +
+                               ", expected " + std::to_string(AST_VERSION));
+    }
+
+    // Every section is 4-byte aligned in the file, and the mapping is page
+    // aligned, so the records can be read in place
+    std::uint64_t expected = sizeof(FileHeader) +
+                             (std::uint64_t{header.symbol_count} + 1) * 4 +
+                             std::uint64_t{header.expr_count} * sizeof(ExprRecord) +
+                             std::uint64_t{header.stmt_count} * sizeof(StmtRecord) +
+                             std::uint64_t{header.list_count} * 4 +
+                             header.symbol_bytes;
+    if (file.size != expected) {
+      invalid("section sizes do not match the file size");
+    }
+
+    const std::byte *cursor = file.data + sizeof(FileHeader);
+    symbol_offsets = reinterpret_cast<const std::uint32_t *>(cursor);
+    cursor += (header.symbol_count + 1) * 4;
+    exprs = reinterpret_cast<const ExprRecord *>(cursor);
+    cursor += header.expr_count * sizeof(ExprRecord);
+    stmts = reinterpret_cast<const StmtRecord *>(cursor);
+    cursor += header.stmt_count * sizeof(StmtRecord);
+    lists = reinterpret_cast<const std::int32_t *>(cursor);
+    cursor += header.list_count * 4;
+    symbol_bytes = reinterpret_cast<const char *>(cursor);
+  }
+
+  LoadedAst read() {
+    LoadedAst loaded;
+
+    // Nodes not yet given to a parent. Declared after 'loaded', so whatever
+    // is left here is destroyed before the storage is freed, even when
+    // reading fails
+    std::vector<ExprPtr> expr_roots(header.expr_count);
+    std::vector<std::unique_ptr<StmtAST>> stmt_roots(header.stmt_count);
+
+    place_expressions(loaded.storage, expr_roots);
+    read_statements(expr_roots, stmt_roots);
+
+    std::vector<std::unique_ptr<VariableDeclStmt>> parameters;
+    for (std::int32_t index : list(header.parameters, header.parameter_count)) {
+      std::unique_ptr<StmtAST> parameter = take(stmt_roots, index);
+      if (parameter->kind != StmtKind::VARIABLE_DECL) {
+        invalid("parameter is not a declaration");
+      }
+      parameters.emplace_back(
+          static_cast<VariableDeclStmt *>(parameter.release()));
+    }
+
+    std::vector<std::unique_ptr<StmtAST>> body;
+    for (std::int32_t index : list(header.body, header.body_count)) {
+      body.push_back(take(stmt_roots, index));
+    }
+
+    loaded.function = std::make_unique<FunctionDecl>(
+        symbol(header.name), variable_type(header.return_type),
+        std::move(parameters), std::move(body));
+    return loaded;
+  }
+
+private:
+  FileHeader header;
+  const std::uint32_t *symbol_offsets = nullptr;
+  const ExprRecord *exprs = nullptr;
+  const StmtRecord *stmts = nullptr;
+  const std::int32_t *lists = nullptr;
+  const char *symbol_bytes = nullptr;
+
+  std::string symbol(std::int32_t index) const {
+    if (index < 0 || static_cast<std::uint32_t>(index) >= header.symbol_count) {
+      invalid("symbol out of range");
+    }
+    std::uint32_t begin = symbol_offsets[index];
+    std::uint32_t end = symbol_offsets[index + 1];
+    if (begin > end || end > header.symbol_bytes) {
+      invalid("symbol offsets out of order");
+    }
+    return std::string(symbol_bytes + begin, end - begin);
+  }
+
+  static VariableType variable_type(std::uint32_t type) {
+    if (type > static_cast<std::uint32_t>(VariableType::VOID)) {
+      invalid("unknown type");
+    }
+    return static_cast<VariableType>(type);
+  }
+
+  static OperationType operation(std::uint8_t op) {
+    if (op >= OPERATION_TYPE_COUNT) {
+      invalid("unknown operator");
+    }
+    return static_cast<OperationType>(op);
+  }
+
+  // The statement indices of a list range
+  std::vector<std::int32_t> list(std::int32_t start, std::int32_t count) const {
+    if (count == 0) {
+      return {};
+    }
+    if (start < 0 || count < 0 ||
+        static_cast<std::uint64_t>(start) + count > header.list_count) {
+      invalid("statement list out of range");
+    }
+    return std::vector<std::int32_t>(lists + start, lists + start + count);
+  }
+
+  // Takes node 'index' for a parent built from a later record. Each node
+  // has at most one parent, and only earlier nodes can be children
+  template <class Node>
+  static Node take(std::vector<Node> &roots, std::int32_t index,
+                   std::int32_t parent) {
+    if (index < 0 || index >= parent) {
+      invalid("child does not come before its parent");
+    }
+    return take(roots, index);
+  }
+
+  template <class Node>
+  static Node take(std::vector<Node> &roots, std::int32_t index) {
+    if (index < 0 || static_cast<std::size_t>(index) >= roots.size() ||
+        roots[index] == nullptr) {
+      invalid("node missing or used twice");
+    }
+    return std::move(roots[index]);
+  }
+
+  ExprPtr optional_expression(std::vector<ExprPtr> &expr_roots,
+                              std::int32_t index) {
+    return index == NONE ? nullptr
+                         : take(expr_roots, index,
+                                static_cast<std::int32_t>(header.expr_count));
+  }
+
+  // Constructs every expression node in one block of 'storage', in the
+  // order of their records
+  void place_expressions(std::unique_ptr<std::byte[]> &storage,
+                         std::vector<ExprPtr> &roots) {
+    std::size_t total = 0;
+    for (std::uint32_t i = 0; i < header.expr_count; ++i) {
+      total += node_size(static_cast<ExprKind>(exprs[i].kind));
+    }
+    storage = std::make_unique<std::byte[]>(std::max<std::size_t>(total, 1));
+
+    std::byte *next = storage.get();
+    for (std::uint32_t i = 0; i < header.expr_count; ++i) {
+      const ExprRecord &record = exprs[i];
+      auto index = static_cast<std::int32_t>(i);
+      auto kind = static_cast<ExprKind>(record.kind);
+
+      ExprAST *node = nullptr;
+      switch (kind) {
+      case ExprKind::INT_LITERAL:
+        node = new (next) IntLiteralExpr(record.first);
+        break;
+      case ExprKind::VARIABLE:
+        node = new (next) VariableExpr(symbol(record.first));
+        break;
+      case ExprKind::UNARY_OP: {
+        OperationType op = operation(record.op);
+        node = new (next) UnaryOpExpr(op, take(roots, record.first, index));
+        break;
+      }
+      case ExprKind::BINARY_OP: {
+        OperationType op = operation(record.op);
+        ExprPtr expr_one = take(roots, record.first, index);
+        ExprPtr expr_two = take(roots, record.second, index);
+        node = new (next)
+            BinaryOpExpr(op, std::move(expr_one), std::move(expr_two));
+        break;
+      }
+      case ExprKind::VARIABLE_ASSIGN: {
+        std::string name = symbol(record.first);
+        node = new (next)
+            VariableAssignExpr(std::move(name), take(roots, record.second, index));
+        break;
+      }
+      default:
+        invalid("unknown expression kind");
+      }
+
+      node->placed = true;
+      roots[i] = ExprPtr(node);
+      next += node_size(kind);
+    }
+  }
+
+  void read_statements(std::vector<ExprPtr> &expr_roots,
+                       std::vector<std::unique_ptr<StmtAST>> &roots) {
+    for (std::uint32_t i = 0; i < header.stmt_count; ++i) {
+      const StmtRecord &record = stmts[i];
+      auto index = static_cast<std::int32_t>(i);
+
+      std::unique_ptr<StmtAST> stmt;
+      switch (static_cast<StmtKind>(record.kind)) {
+      case StmtKind::VARIABLE_DECL:
+        stmt = std::make_unique<VariableDeclStmt>(
+            variable_type(record.type), symbol(record.symbol),
+            optional_expression(expr_roots, record.expr));
+        break;
+      case StmtKind::RETURN:
+        stmt = std::make_unique<ReturnStmt>(
+            optional_expression(expr_roots, record.expr));
+        break;
+      case StmtKind::EXPR:
+        stmt = std::make_unique<ExprStmt>(
+            optional_expression(expr_roots, record.expr));
+        break;
+      case StmtKind::BLOCK: {
+        std::vector<std::unique_ptr<StmtAST>> body;
+        for (std::int32_t nested : list(record.list, record.list_count)) {
+          body.push_back(take(roots, nested, index));
+        }
+        stmt = std::make_unique<BlockStmt>(std::move(body));
+        break;
+      }
+      case StmtKind::WHILE: {
+        std::vector<std::int32_t> body = list(record.list, record.list_count);
+        if (body.size() != 1) {
+          invalid("loop without exactly one body");
+        }
+        std::unique_ptr<StmtAST> block = take(roots, body[0], index);
+        if (block->kind != StmtKind::BLOCK) {
+          invalid("loop body is not a block");
+        }
+        stmt = std::make_unique<WhileStmt>(
+            optional_expression(expr_roots, record.expr),
+            std::unique_ptr<BlockStmt>(static_cast<BlockStmt *>(block.release())));
+        break;
+      }
+      default:
+        invalid("unknown statement kind");
+      }
+
+      stmt->line = record.line;
+      stmt->column = record.column;
+      roots[i] = std::move(stmt);
+    }
+  }
+};
+
+} // namespace
+
+void write_ast(const FunctionDecl *function, std::ostream &out) {
+  AstWriter writer;
+
+  FileHeader header{};
+  std::memcpy(header.magic, AST_MAGIC, sizeof(AST_MAGIC));
+  header.byte_order = BYTE_ORDER_MARK;
+  header.version = AST_VERSION;
+  header.name = writer.symbol(function->name);
+  header.return_type = static_cast<std::uint32_t>(function->return_type);
+
+  std::vector<std::int32_t> parameters;
+  for (const auto &parameter : function->parameters) {
+    parameters.push_back(writer.statement(parameter.get()));
+  }
+  std::vector<std::int32_t> body;
+  for (const auto &stmt : function->body) {
+    body.push_back(writer.statement(stmt.get()));
+  }
+  std::tie(header.parameters, header.parameter_count) = writer.list(parameters);
+  std::tie(header.body, header.body_count) = writer.list(body);
+
+  std::vector<std::uint32_t> symbol_offsets{0};
+  std::string symbol_bytes;
+  for (const std::string &name : writer.symbols) {
+    symbol_bytes += name;
+    symbol_offsets.push_back(static_cast<std::uint32_t>(symbol_bytes.size()));
+  }
+
+  header.symbol_count = static_cast<std::uint32_t>(writer.symbols.size());
+  header.symbol_bytes = static_cast<std::uint32_t>(symbol_bytes.size());
+  header.expr_count = static_cast<std::uint32_t>(writer.exprs.size());
+  header.stmt_count = static_cast<std::uint32_t>(writer.stmts.size());
+  header.list_count = static_cast<std::uint32_t>(writer.lists.size());
+
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  write_section(out, symbol_offsets);
+  write_section(out, writer.exprs);
+  write_section(out, writer.stmts);
+  write_section(out, writer.lists);
+  out.write(symbol_bytes.data(),
+            static_cast<std::streamsize>(symbol_bytes.size()));
+}
+
+void write_ast(const FunctionDecl *function, const std::string &file_path) {
+  std::ofstream out(file_path, std::ios::binary);
+  if (!out) {
+    throw std::runtime_error("Failed to open AST file for writing");
+  }
+  write_ast(function, out);
+  if (!out) {
+    throw std::runtime_error("Failed to write AST file");
+  }
+}
+
+bool is_ast_file(const std::string &file_path) {
+  std::ifstream in(file_path, std::ios::binary);
+  char magic[sizeof(AST_MAGIC)];
+  return in.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, AST_MAGIC, sizeof(AST_MAGIC)) == 0;
+}
+
+LoadedAst read_ast(const std::string &file_path) {
+  MappedFile file(file_path);
+  return AstReader(file).read();
+}
@@ -0,0 +1,56 @@
+#ifndef AST_SERIALIZATION_H
+#define AST_SERIALIZATION_H
+
+#include "ast.h"
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string>
+
+/*
+A binary file format for parsed functions, so compiling the same source
+again (with other flags or backends) can skip lexing and parsing.
+
+The file is a fixed header followed by flat sections: the offsets of each
+symbol into the symbol bytes, one fixed-size record per expression node,
+one per statement, the lists of statements in each block, the function's
+parameters and body, and the symbol bytes themselves. Every name (variables
+and the function) is stored once in the symbol section and referred to by
+index. Nodes refer to their children by index, and children always come
+before their parents, so a tree is rebuilt in one pass over each section.
+Numbers are stored in the byte order of the machine that wrote the file,
+which the header records along with a version. Files of another byte order
+or version are rejected rather than converted.
+
+Only parsed trees can be written: temporaries (see cse.h) are rejected, and
+resolved slots are not kept. A shared (hash-consed) subtree is written once
+per place it appears.
+
+Loading maps the file into memory and constructs every expression node in
+one block of storage instead of allocating each one. Statements, which are
+few, are allocated as usual.
+*/
+
+// Writes 'function' to 'out' in the format above, throwing
+// std::runtime_error for trees it cannot hold
+void write_ast(const FunctionDecl *function, std::ostream &out);
+void write_ast(const FunctionDecl *function, const std::string &file_path);
+
+// Whether the file at 'file_path' starts like an AST file
+bool is_ast_file(const std::string &file_path);
+
+// A function read back by read_ast. Its expression nodes are marked
+// 'placed' and live in 'storage', so they are only destroyed when deleted
+// and the storage frees them. 'storage' is declared first so it is freed
+// after the function; a tree moved out of here must not outlive it either
+struct LoadedAst {
+  std::unique_ptr<std::byte[]> storage;
+  std::unique_ptr<FunctionDecl> function;
+};
+
+// Reads a function written by write_ast, throwing std::runtime_error if the
+// file cannot be mapped or is not a valid AST file of this version
+LoadedAst read_ast(const std::string &file_path);
+
+#endif
@@ -0,0 +1,254 @@
+#include "bytecode.h"
+#include "ast.h"
+#include "operators.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+using Item = ExprWorklist::Item;
+
+} // namespace
+
+std::string opcode_to_string(Opcode op) {
+  switch (op) {
+  case Opcode::LOAD_CONST:
+    return "LOAD_CONST";
+  case Opcode::MOVE:
+    return "MOVE";
+  case Opcode::NEGATE:
+    return "NEGATE";
+  case Opcode::BITWISE:
+    return "BITWISE";
+  case Opcode::LOGIC_NEGATE:
+    return "LOGIC_NEGATE";
+  case Opcode::BOOL:
+    return "BOOL";
+  case Opcode::ADD:
+    return "ADD";
+  case Opcode::SUBTRACT:
+    return "SUBTRACT";
+  case Opcode::MULT:
+    return "MULT";
+  case Opcode::DIVIDE:
+    return "DIVIDE";
+  case Opcode::MODULO:
+    return "MODULO";
+  case Opcode::BITWISE_AND:
+    return "BITWISE_AND";
+  case Opcode::BITWISE_OR:
+    return "BITWISE_OR";
+  case Opcode::BITWISE_XOR:
+    return "BITWISE_XOR";
+  case Opcode::SHIFT_LEFT:
+    return "SHIFT_LEFT";
+  case Opcode::SHIFT_RIGHT:
+    return "SHIFT_RIGHT";
+  case Opcode::EQUAL:
+    return "EQUAL";
+  case Opcode::NOT_EQUAL:
+    return "NOT_EQUAL";
+  case Opcode::LESS_THAN:
+    return "LESS_THAN";
+  case Opcode::LESS_THAN_EQUAL:
+    return "LESS_THAN_EQUAL";
+  case Opcode::GREATER_THAN:
+    return "GREATER_THAN";
+  case Opcode::GREATER_THAN_EQUAL:
+    return "GREATER_THAN_EQUAL";
+  case Opcode::JUMP:
+    return "JUMP";
+  case Opcode::JUMP_IF_ZERO:
+    return "JUMP_IF_ZERO";
+  case Opcode::JUMP_IF_NOT_ZERO:
+    return "JUMP_IF_NOT_ZERO";
+  case Opcode::RETURN:
+    return "RETURN";
+  }
+
+  return "UNKNOWN";
+}
+
+BytecodeFunction BytecodeCompiler::compile(const FunctionDecl *decl) {
+  visit(decl);
+
+  BytecodeFunction result = std::move(function);
+  function = BytecodeFunction();
+  return result;
+}
+
+int BytecodeCompiler::variable_register(int slot) {
+  if (slot < 0 || slot >= local_count) {
+    throw std::runtime_error("Use of a variable that was not resolved");
+  }
+
+  return slot;
+}
+
+int BytecodeCompiler::emit(Opcode op, std::int32_t a, std::int32_t b,
+                           std::int32_t c) {
+  function.code.emplace_back(op, a, b, c);
+  function.positions.push_back(position);
+  return static_cast<int>(function.code.size()) - 1;
+}
+
+void BytecodeCompiler::push_temporary() {
+  ++top;
+  function.register_count = std::max(function.register_count, top + 1);
+}
+
+void BytecodeCompiler::compile_expression(ExprAST *expr) {
+  worklist.run(expr, this, no_text);
+}
+
+void BytecodeCompiler::visit(const IntLiteralExpr *expr) {
+  emit(Opcode::LOAD_CONST, top, expr->value);
+}
+
+void BytecodeCompiler::visit(const UnaryOpExpr *expr) {
+  const OperatorInfo &info = operator_info(expr->op);
+  if (!info.unary) {
+    throw std::runtime_error("Expected a unary operation");
+  }
+  Opcode op = info.unary_opcode;
+
+  int dest = top;
+  worklist.schedule({expr->expr.get(), Item([this, op, dest] {
+                       emit(op, dest, dest);
+                     })});
+}
+
+// Children are scheduled on the worklist rather than visited directly. The
+// left operand is computed into 'top' and the right one into the register
+// above it, unless it is a variable, which is then read in place
+void BytecodeCompiler::visit(const BinaryOpExpr *expr) {
+  int dest = top;
+
+  const OperatorInfo &info = operator_info(expr->op);
+  if (info.short_circuit) {
+    // Short circuit: once the left side decides, its truth value is already
+    // the result, so jump past the right side with it
+    Opcode skip = info.opcode;
+    auto jump = std::make_shared<int>();
+
+    worklist.schedule({expr->expr_one.get(), Item([this, dest, skip, jump] {
+                         emit(Opcode::BOOL, dest, dest);
+                         *jump = emit(skip, 0, dest);
+                       }),
+                       expr->expr_two.get(), Item([this, dest, jump] {
+                         emit(Opcode::BOOL, dest, dest);
+                         function.code[*jump].a =
+                             static_cast<std::int32_t>(function.code.size());
+                       })});
+    return;
+  }
+
+  if (info.precedence == 0) {
+    throw std::runtime_error("Expected a binary operation");
+  }
+  Opcode op = info.opcode;
+
+  if (auto *variable = node_cast<const VariableExpr>(expr->expr_two.get())) {
+    int rhs = variable_register(variable->slot);
+    worklist.schedule({expr->expr_one.get(), Item([this, op, dest, rhs] {
+                         emit(op, dest, dest, rhs);
+                       })});
+    return;
+  }
+
+  worklist.schedule({expr->expr_one.get(), Item([this] { push_temporary(); }),
+                     expr->expr_two.get(), Item([this, op, dest] {
+                       --top;
+                       emit(op, dest, dest, dest + 1);
+                     })});
+}
+
+void BytecodeCompiler::visit(const VariableExpr *expr) {
+  emit(Opcode::MOVE, top, variable_register(expr->slot));
+}
+
+void BytecodeCompiler::visit(const VariableAssignExpr *expr) {
+  int variable = variable_register(expr->slot);
+  int dest = top;
+
+  // The assigned value is also the value of the expression
+  worklist.schedule({expr->assign_expr.get(), Item([this, variable, dest] {
+                       emit(Opcode::MOVE, variable, dest);
+                     })});
+}
+
+void BytecodeCompiler::visit(const TempStoreExpr *expr) {
+  int temp = temp_base + expr->temp;
+  int dest = top;
+
+  worklist.schedule({expr->expr.get(), Item([this, temp, dest] {
+                       emit(Opcode::MOVE, temp, dest);
+                     })});
+}
+
+void BytecodeCompiler::visit(const TempLoadExpr *expr) {
+  emit(Opcode::MOVE, top, temp_base + expr->temp);
+}
+
+void BytecodeCompiler::visit(const VariableDeclStmt *stmt) {
+  int local = variable_register(stmt->slot);
+  if (stmt->decl_expr != nullptr) {
+    compile_expression(stmt->decl_expr.get());
+    emit(Opcode::MOVE, local, top);
+  } else {
+    emit(Opcode::LOAD_CONST, local, 0);
+  }
+}
+
+void BytecodeCompiler::visit(const ReturnStmt *stmt) {
+  compile_expression(stmt->expr.get());
+  emit(Opcode::RETURN, 0, top);
+}
+
+void BytecodeCompiler::visit(const ExprStmt *stmt) {
+  compile_expression(stmt->expr.get());
+}
+
+void BytecodeCompiler::visit(const BlockStmt *stmt) {
+  for (const auto &statement : stmt->body) {
+    position.line = statement->line;
+    statement->accept(this);
+  }
+}
+
+void BytecodeCompiler::visit(const WhileStmt *stmt) {
+  // Test at the bottom, like AstAssembly, entered by jumping to it
+  int entry = emit(Opcode::JUMP, 0);
+  int body = static_cast<int>(function.code.size());
+  stmt->body->accept(this);
+
+  function.code[entry].a = static_cast<int>(function.code.size());
+  position.line = stmt->line;
+  compile_expression(stmt->cond.get());
+  emit(Opcode::JUMP_IF_NOT_ZERO, body, top);
+}
+
+void BytecodeCompiler::visit(const FunctionDecl *decl) {
+  function.name = decl->name;
+  local_count = decl->slot_count;
+
+  // The registers of TempStoreExpr temporaries come right after the last
+  // local, followed by the expression temporaries
+  temp_base = local_count;
+  top = temp_base + NUM_TEMPS;
+  function.register_count = top + 1;
+
+  for (std::size_t i = 0; i < decl->body.size(); ++i) {
+    position = {static_cast<int>(i), decl->body[i]->line};
+    decl->body[i]->accept(this);
+  }
+  position = {};
+
+  // Reaching the end of main returns 0
+  emit(Opcode::LOAD_CONST, top, 0);
+  emit(Opcode::RETURN, 0, top);
+}
@@ -0,0 +1,155 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "ast.h"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+Register-based bytecode for running a function in-process (see
+interpreter.h). Every local gets its own register, the slot the resolver
+gave it (see resolver.h), then come the registers of TempStoreExpr
+temporaries, and
+expression temporaries are allocated above those like a stack. Values are 32-bit ints with the same wrapping, shift and division
+behaviour as the code AstAssembly generates.
+
+Operands per opcode, where rX names a register:
+
+LOAD_CONST    ra = b                (b is the constant)
+MOVE          ra = rb
+NEGATE..BOOL  ra = op rb            (BOOL is rb != 0)
+ADD..GE       ra = rb op rc
+JUMP          goto a
+JUMP_IF_ZERO  if rb == 0 goto a     (JUMP_IF_NOT_ZERO likewise)
+RETURN        return rb
+*/
+enum class Opcode : std::uint8_t {
+  LOAD_CONST,
+  MOVE,
+
+  NEGATE,
+  BITWISE,
+  LOGIC_NEGATE,
+  BOOL,
+
+  ADD,
+  SUBTRACT,
+  MULT,
+  DIVIDE,
+  MODULO,
+  BITWISE_AND,
+  BITWISE_OR,
+  BITWISE_XOR,
+  SHIFT_LEFT,
+  SHIFT_RIGHT,
+  EQUAL,
+  NOT_EQUAL,
+  LESS_THAN,
+  LESS_THAN_EQUAL,
+  GREATER_THAN,
+  GREATER_THAN_EQUAL,
+
+  JUMP,
+  JUMP_IF_ZERO,
+  JUMP_IF_NOT_ZERO,
+  RETURN
+};
+
+// Number of Opcode values, for tables indexed by opcode
+constexpr int OPCODE_COUNT = static_cast<int>(Opcode::RETURN) + 1;
+
+struct Instruction {
+  Opcode op;
+  std::int32_t a = 0;
+  std::int32_t b = 0;
+  std::int32_t c = 0;
+
+  Instruction(Opcode op, std::int32_t a, std::int32_t b = 0,
+              std::int32_t c = 0)
+      : op(op), a(a), b(b), c(c) {};
+};
+
+// Where an instruction came from: the index in FunctionDecl::body of the
+// top-level statement it belongs to (-1 for the return of 0 that ends every
+// function) and the line of the innermost statement around it
+struct SourcePosition {
+  int statement = -1;
+  int line = 0;
+};
+
+struct BytecodeFunction {
+  std::string name;
+  std::vector<Instruction> code;
+  int register_count = 0;
+
+  // One per instruction, for mapping profiles back to the source
+  std::vector<SourcePosition> positions;
+};
+
+std::string opcode_to_string(Opcode op);
+
+// Lowers a resolved function to bytecode. Like AstAssembly, errors are
+// thrown as std::runtime_error
+class BytecodeCompiler : public ExprVisitor,
+                         public StmtVisitor,
+                         public DeclVisitor {
+public:
+  BytecodeFunction compile(const FunctionDecl *decl);
+
+  // Fulfilling ExprVisitor contract
+  void visit(const IntLiteralExpr *expr) override;
+  void visit(const UnaryOpExpr *expr) override;
+  void visit(const BinaryOpExpr *expr) override;
+  void visit(const VariableExpr *expr) override;
+  void visit(const VariableAssignExpr *expr) override;
+  void visit(const TempStoreExpr *expr) override;
+  void visit(const TempLoadExpr *expr) override;
+
+  // Fulfilling the StmtVisitor contract
+  void visit(const VariableDeclStmt *stmt) override;
+  void visit(const ReturnStmt *stmt) override;
+  void visit(const ExprStmt *stmt) override;
+  void visit(const BlockStmt *stmt) override;
+  void visit(const WhileStmt *stmt) override;
+
+  // Fulfilling the DeclVisitor contract
+  void visit(const FunctionDecl *decl) override;
+
+private:
+  BytecodeFunction function;
+
+  // Number of local registers, one per resolver slot
+  int local_count = 0;
+
+  // Register of TempStoreExpr temporary 0
+  int temp_base = 0;
+
+  // Expressions leave their value in register 'top', the current top of the
+  // temporary stack that starts right above the locals and temporaries
+  int top = 0;
+
+  // Recorded with every instruction emitted
+  SourcePosition position;
+
+  // Expression children are walked through this instead of recursion. No
+  // text is scheduled, so the walk writes to a stream with no buffer
+  ExprWorklist worklist;
+  std::ostream no_text{nullptr};
+
+  // Register of a resolved variable, throws for an unresolved slot
+  int variable_register(int slot);
+
+  // Appends an instruction and returns its index, for patching jumps
+  int emit(Opcode op, std::int32_t a, std::int32_t b = 0, std::int32_t c = 0);
+
+  // Makes 'top' one higher, tracking how many registers the function needs
+  void push_temporary();
+
+  // Emits code leaving the value of 'expr' in register 'top'
+  void compile_expression(ExprAST *expr);
+};
+
+#endif
@@ -1,13 +1,130 @@
 #include "codegen.h"
+#include "allocation.h"
 #include "ast.h"
+#include "operators.h"
+#include "profile.h"
+#include "trace.h"
 
+#include <cstddef>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <ostream>
+#include <sstream>
 #include <stack>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <iostream>
+#include <vector>
+
+namespace {
+
+using Item = ExprWorklist::Item;
+
+// Longest && / || chain emitted without branches. Every comparison in such a
+// chain is evaluated, so beyond a few the short circuit is cheaper
+constexpr int MAX_COMPARE_CHAIN = 4;
+
+// Condition code that holds after 'cmp lhs, rhs' when 'lhs op rhs' is true,
+// or nullptr if op is not a relational operator
+const char *condition_code(OperationType op) {
+  return operator_info(op).condition;
+}
+
+const char *invert_condition(const std::string &code) {
+  if (code == "eq") return "ne";
+  if (code == "ne") return "eq";
+  if (code == "lt") return "ge";
+  if (code == "ge") return "lt";
+  if (code == "gt") return "le";
+  return "gt";
+}
+
+// NZCV flags a skipped ccmp sets so that 'code' reads as 'value'
+int flags_for(const std::string &code, bool value) {
+  const int Z = 4, N = 8;
+
+  if (code == "eq" || code == "le") return value ? Z : 0;
+  if (code == "ne" || code == "gt") return value ? 0 : Z;
+  if (code == "lt") return value ? N : 0;
+  return value ? 0 : N;
+}
+
+// Bytes a local of the given type takes in the frame
+int type_size(VariableType type) {
+  switch (type) {
+  case VariableType::INT:
+    return 4;
+  default:
+    throw std::runtime_error("Variables cannot have type " +
+                             type_to_string(type));
+  }
+}
+
+// Moves a 32-bit constant into 'reg'. mov only encodes 16 significant bits,
+// so other values set the upper half with a movk
+std::string load_constant(const std::string &reg, int value) {
+  if (value >= -65536 && value <= 65535) {
+    return "\n\tmov\t" + reg + ", #" + std::to_string(value);
+  }
+
+  unsigned int bits = static_cast<unsigned int>(value);
+  return "\n\tmov\t" + reg + ", #" + std::to_string(bits & 0xffff) +
+         "\n\tmovk\t" + reg + ", #" + std::to_string(bits >> 16) +
+         ", lsl #16";
+}
+
+// A 32-bit load or store of a local. ldr/str encode offsets up to 4095
+// words, farther slots are addressed through x16
+std::string slot_access(const std::string &op, const std::string &reg,
+                        int offset) {
+  if (offset <= 4095 * 4) {
+    return "\n\t" + op + "\t" + reg + ", [fp, #" + std::to_string(offset) +
+           "]";
+  }
+
+  return "\n\tadd\tx16, fp, #" + std::to_string(offset >> 12) +
+         ", lsl #12\n\t" + op + "\t" + reg + ", [x16, #" +
+         std::to_string(offset & 0xfff) + "]";
+}
+
+bool is_logical(OperationType op) { return operator_info(op).short_circuit; }
+
+const IntLiteralExpr *as_literal(const ExprAST *expr) {
+  return node_cast<const IntLiteralExpr>(expr);
+}
+
+// Whether the code for 'expr' already leaves exactly 0 or 1 in w0
+bool produces_boolean(const ExprAST *expr) {
+  if (auto *binary = node_cast<const BinaryOpExpr>(expr)) {
+    return operator_info(binary->op).boolean;
+  }
+  auto *unary = node_cast<const UnaryOpExpr>(expr);
+  return unary != nullptr && unary->op == OperationType::LOGIC_NEGATE;
+}
+
+// Operands that load straight into a register and have no side effects
+bool is_simple_operand(const ExprAST *expr) {
+  return as_literal(expr) != nullptr ||
+         node_cast<const VariableExpr>(expr) != nullptr;
+}
+
+// A simple operand, or a relational operator between two of them
+bool is_simple_comparison(const ExprAST *expr) {
+  auto *binary = node_cast<const BinaryOpExpr>(expr);
+  if (binary != nullptr && condition_code(binary->op) != nullptr) {
+    return is_simple_operand(binary->expr_one.get()) &&
+           is_simple_operand(binary->expr_two.get());
+  }
+  return is_simple_operand(expr);
+}
+
+// Each nested capture of subtree code is a nested worklist walk on the native
+// stack, so only this many are nested, and deeper subtrees are not memoized
+constexpr int MAX_CAPTURE_DEPTH = 16;
+
+} // namespace
 
 std::string AstAssembly::label_gen() {
   std::string base_label = "_label_";
@@ -17,35 +134,359 @@ std::string AstAssembly::label_gen() {
 
 void AstAssembly::generate(DeclAST *root_node, std::string asm_file_name) {
   // std::string asm_file_path = std::string("../tests/").append(asm_file_name);
-  asm_file.open(asm_file_name);
+  std::ofstream asm_file(asm_file_name);
+  generate(root_node, asm_file);
+}
 
+void AstAssembly::generate(DeclAST *root_node, std::ostream &out) {
+  asm_out = &out;
   root_node->accept(this);
+  asm_out = nullptr;
+}
+
+void AstAssembly::begin_function(const FunctionDecl *decl, std::ostream &out) {
+  asm_out = &out;
+  emit_prologue(decl);
+  asm_out = nullptr;
+}
+
+void AstAssembly::generate_statement(StmtAST *stmt, std::ostream &out) {
+  asm_out = &out;
+  dispatch(stmt);
+  asm_out = nullptr;
+}
 
-  asm_file.close();
+void AstAssembly::end_function(const FunctionDecl *decl, std::ostream &out) {
+  asm_out = &out;
+  emit_implicit_return(decl);
+  asm_out = nullptr;
+}
+
+void AstAssembly::declare_variable(const VariableDeclStmt *decl) {
+  if (decl->slot < 0) {
+    throw std::runtime_error("Variable '" + decl->name +
+                             "' was declared without being resolved");
+  }
+  if (decl->slot >= static_cast<int>(slot_offsets.size())) {
+    slot_offsets.resize(decl->slot + 1, -1);
+  }
+
+  // Keep each slot aligned to its own size
+  int size = type_size(decl->type);
+  stack_index = (stack_index + size - 1) / size * size;
+  slot_offsets[decl->slot] = FRAME_RECORD_SIZE + stack_index;
+  stack_index += size;
+
+  // Fold the new slot into the running signature of the frame layout
+  std::size_t slot_hash = std::hash<std::string>{}(decl->name) ^
+                          (std::hash<int>{}(decl->slot) << 2) ^
+                          std::hash<int>{}(stack_index) ^
+                          (std::hash<int>{}(size) << 1);
+  frame_hash ^= slot_hash + 0x9e3779b97f4a7c15 + (frame_hash << 6) +
+                (frame_hash >> 2);
+}
+
+int AstAssembly::variable_offset(int slot) {
+  if (slot < 0 || slot >= static_cast<int>(slot_offsets.size()) ||
+      slot_offsets[slot] < 0) {
+    throw std::runtime_error("Use of a variable slot that was not declared");
+  }
+
+  return slot_offsets[slot];
+}
+
+void AstAssembly::generate_expression(ExprAST *expr) {
+  worklist.run_static(expr, this, *asm_out);
+}
+
+void AstAssembly::generate_branch(ExprAST *expr, const std::string &label) {
+  worklist.run_static(
+      Item([this, expr, label] { schedule_branch(expr, label, true); }), this,
+      *asm_out);
+}
+
+bool AstAssembly::emit_memoized(const ExprAST *expr) {
+  if (!expr->interned) {
+    return false;
+  }
+
+  auto found = subtree_code.find(expr);
+  if (found != subtree_code.end()) {
+    *asm_out << found->second;
+    return true;
+  }
+
+  // Visited again by the capture below, this time to generate the code
+  if (expr == capturing) {
+    capturing = nullptr;
+    return false;
+  }
+  if (capture_depth == MAX_CAPTURE_DEPTH) {
+    return false;
+  }
+
+  std::ostringstream code;
+  std::ostream *out = asm_out;
+  int first_label = label_num;
+
+  asm_out = &code;
+  capturing = expr;
+  ++capture_depth;
+  worklist.run_static(const_cast<ExprAST *>(expr), this, code);
+  --capture_depth;
+  asm_out = out;
+
+  // Code defining labels must not be repeated
+  if (label_num == first_label) {
+    subtree_code.emplace(expr, code.str());
+  }
+  *asm_out << code.str();
+  return true;
+}
+
+void AstAssembly::schedule_branch(ExprAST *expr, const std::string &label,
+                                  bool jump_if) {
+  // A logical negation only swaps which outcome takes the branch
+  auto *unary = node_cast<UnaryOpExpr>(expr);
+  while (unary != nullptr && unary->op == OperationType::LOGIC_NEGATE) {
+    expr = unary->expr.get();
+    jump_if = !jump_if;
+    unary = node_cast<UnaryOpExpr>(expr);
+  }
+
+  if (auto *literal = as_literal(expr)) {
+    if ((literal->value != 0) == jump_if) {
+      worklist.schedule({"\n\tb\t" + label});
+    }
+    return;
+  }
+
+  auto *binary = node_cast<BinaryOpExpr>(expr);
+  if (binary != nullptr && condition_code(binary->op) != nullptr) {
+    std::string code = condition_code(binary->op);
+    if (!jump_if) {
+      code = invert_condition(code);
+    }
+    schedule_compare(binary, "\n\tb." + code + "\t" + label);
+    return;
+  }
+
+  if (binary != nullptr && is_logical(binary->op)) {
+    ExprAST *lhs = binary->expr_one.get();
+    ExprAST *rhs = binary->expr_two.get();
+    bool is_or = binary->op == OperationType::OR;
+
+    if (instrumented) {
+      // Counts the evaluation, and sends the left side through a counter
+      // when it decides on its own, on to wherever it would have gone
+      int site = branch_sites.at(binary);
+      std::string decided_label = label_gen();
+      std::string continue_label = label_gen();
+      std::string decided = "\n\tb\t" + continue_label + "\n" + decided_label +
+                            ":" + count(short_circuit_counter(site));
+      if (is_or == jump_if) {
+        decided += "\n\tb\t" + label;
+      }
+
+      worklist.schedule({count(reached_counter(site)),
+                         Item([this, lhs, decided_label, is_or] {
+                           schedule_branch(lhs, decided_label, is_or);
+                         }),
+                         Item([this, rhs, label, jump_if] {
+                           schedule_branch(rhs, label, jump_if);
+                         }),
+                         decided + "\n" + continue_label + ":"});
+      return;
+    }
+
+    if (is_or == jump_if) {
+      // Either side on its own decides to take the branch
+      worklist.schedule(
+          {Item([this, lhs, label, jump_if] {
+             schedule_branch(lhs, label, jump_if);
+           }),
+           Item([this, rhs, label, jump_if] {
+             schedule_branch(rhs, label, jump_if);
+           })});
+    } else {
+      // The left side on its own can only decide not to take it, skipping
+      // the right side
+      std::string skip_label = label_gen();
+      worklist.schedule(
+          {Item([this, lhs, skip_label, is_or] {
+             schedule_branch(lhs, skip_label, is_or);
+           }),
+           Item([this, rhs, label, jump_if] {
+             schedule_branch(rhs, label, jump_if);
+           }),
+           "\n" + skip_label + ":"});
+    }
+    return;
+  }
+
+  // Masking with a single bit tests that bit directly
+  if (binary != nullptr && binary->op == OperationType::BITWISE_AND) {
+    ExprAST *operands[] = {binary->expr_one.get(), binary->expr_two.get()};
+    for (int i = 0; i < 2; ++i) {
+      auto *mask = as_literal(operands[i]);
+      if (mask != nullptr && mask->value > 0 &&
+          (mask->value & (mask->value - 1)) == 0) {
+        std::string test = jump_if ? "tbnz" : "tbz";
+        worklist.schedule({operands[1 - i],
+                           "\n\t" + test + "\tw0, #" +
+                               std::to_string(__builtin_ctz(mask->value)) +
+                               ", " + label});
+        return;
+      }
+    }
+  }
+
+  std::string test = jump_if ? "cbnz" : "cbz";
+  worklist.schedule({expr, "\n\t" + test + "\tw0, " + label});
+}
+
+void AstAssembly::schedule_compare(const BinaryOpExpr *expr,
+                                   const std::string &then) {
+  // Small literals on the right are encoded in the compare itself, which
+  // saves saving the left side around the second operand
+  if (auto *literal = as_literal(expr->expr_two.get())) {
+    if (literal->value >= 0 && literal->value <= 4095) {
+      worklist.schedule({expr->expr_one.get(),
+                         "\n\tcmp\tw0, #" + std::to_string(literal->value) +
+                             then});
+      return;
+    }
+    if (literal->value < 0 && literal->value >= -4095) {
+      worklist.schedule({expr->expr_one.get(),
+                         "\n\tcmn\tw0, #" + std::to_string(-literal->value) +
+                             then});
+      return;
+    }
+  }
+
+  worklist.schedule({expr->expr_one.get(), "\n\tstr\tw0, [sp, #-16]!",
+                     expr->expr_two.get(),
+                     "\n\tldr\tw1, [sp], #16\n\tcmp\tw1, w0" + then});
+}
+
+void AstAssembly::schedule_truth_value(ExprAST *expr) {
+  if (produces_boolean(expr)) {
+    worklist.schedule({expr});
+  } else {
+    worklist.schedule({expr, "\n\tcmp\tw0, #0\n\tcset\tw0, ne"});
+  }
+}
+
+bool AstAssembly::emit_compare_chain(const BinaryOpExpr *expr) {
+  // Walk down the left spine. Every right operand has to be a simple
+  // comparison, since it is evaluated even when the left side decides
+  std::vector<const BinaryOpExpr *> links;
+  const ExprAST *first = expr;
+  for (;;) {
+    auto *link = node_cast<const BinaryOpExpr>(first);
+    if (link == nullptr || !is_logical(link->op)) {
+      break;
+    }
+    if (links.size() + 1 >= MAX_COMPARE_CHAIN ||
+        !is_simple_comparison(link->expr_two.get())) {
+      return false;
+    }
+    links.push_back(link);
+    first = link->expr_one.get();
+  }
+  if (!is_simple_comparison(first)) {
+    return false;
+  }
+
+  std::string code;
+  auto load = [&](const ExprAST *operand, const char *reg) {
+    if (auto *literal = as_literal(operand)) {
+      code += load_constant(reg, literal->value);
+    } else {
+      auto *variable = static_cast<const VariableExpr *>(operand);
+      code += slot_access("ldr", reg, variable_offset(variable->slot));
+    }
+  };
+
+  // Emits one comparison and returns the condition that holds when it is
+  // true. After the first, each one is a ccmp that only compares when the
+  // chain is still undecided and otherwise forces the chain's outcome
+  std::string condition;
+  auto compare = [&](const ExprAST *comparison, OperationType link_op) {
+    const ExprAST *lhs = comparison;
+    const ExprAST *rhs = nullptr;
+    std::string result = "ne";
+
+    auto *relational = node_cast<const BinaryOpExpr>(comparison);
+    if (relational != nullptr && condition_code(relational->op) != nullptr) {
+      lhs = relational->expr_one.get();
+      rhs = relational->expr_two.get();
+      result = condition_code(relational->op);
+    }
+
+    load(lhs, "w1");
+
+    int immediate_limit = condition.empty() ? 4095 : 31;
+    std::string operand = "#0";
+    if (rhs != nullptr) {
+      auto *literal = as_literal(rhs);
+      if (literal != nullptr && literal->value >= 0 &&
+          literal->value <= immediate_limit) {
+        operand = "#" + std::to_string(literal->value);
+      } else {
+        load(rhs, "w2");
+        operand = "w2";
+      }
+    }
+
+    if (condition.empty()) {
+      code += "\n\tcmp\tw1, " + operand;
+    } else {
+      bool is_or = link_op == OperationType::OR;
+      std::string guard = is_or ? invert_condition(condition) : condition;
+      code += "\n\tccmp\tw1, " + operand + ", #" +
+              std::to_string(flags_for(result, is_or)) + ", " + guard;
+    }
+    condition = result;
+  };
+
+  compare(first, OperationType::AND);
+  for (auto it = links.rbegin(); it != links.rend(); ++it) {
+    compare((*it)->expr_two.get(), (*it)->op);
+  }
+
+  *asm_out << code << "\n\tcset\tw0, " << condition;
+  return true;
 }
 
 void AstAssembly::visit(const IntLiteralExpr *expr) {
-  asm_file << "\n\tmov\tx0, #" << std::to_string(expr->value);
+  *asm_out << load_constant("w0", expr->value);
 }
 
 void AstAssembly::visit(const UnaryOpExpr *expr) {
-  expr->expr->accept(this);
-  asm_file << "\n\t";
-
-  switch (expr->op) {
-  case OperationType::NEGATE:
-    asm_file << "neg\tx0, x0";
-    break;
-  case OperationType::BITWISE:
-    asm_file << "mvn\tx0, x0";
-    break;
-  case OperationType::LOGIC_NEGATE:
-    asm_file << "cmp\tx0, #0";
-    asm_file << "\n\tcset\tx0, EQ";
-    break;
-  default:
+  if (emit_memoized(expr)) {
+    return;
+  }
+
+  // Negating a comparison just tests the opposite condition
+  if (expr->op == OperationType::LOGIC_NEGATE) {
+    auto *relational = node_cast<const BinaryOpExpr>(expr->expr.get());
+    if (relational != nullptr && condition_code(relational->op) != nullptr) {
+      schedule_compare(relational,
+                       "\n\tcset\tw0, " +
+                           std::string(invert_condition(
+                               condition_code(relational->op))));
+      return;
+    }
+  }
+
+  const OperatorInfo &info = operator_info(expr->op);
+  if (!info.unary) {
     throw std::runtime_error("Expected a unary operation");
   }
+  std::string op_code = "\n\t" + std::string(info.unary_instructions);
+
+  worklist.schedule({expr->expr.get(), op_code});
 }
 
 // Optimization idea: Somehow find out how many binary operations there are and
@@ -54,219 +495,362 @@ void AstAssembly::visit(const UnaryOpExpr *expr) {
 // aligned. So, if there were two operations and the program allocated 16 bytes,
 // there wouldn't be wasted space. Currently for every push onto the stack the
 // program wastes 8 bytes since it must stay 16-byte aligned
+//
+// Children are scheduled on the worklist rather than visited directly, so the
+// code for each operand is emitted in between the surrounding snippets below
+// without recursing once per tree level
 void AstAssembly::visit(const BinaryOpExpr *expr) {
-  // Compute the first expression
-  expr->expr_one->accept(this);
-
-  // Determine the operation and combine the two expressions
-
-  if (expr->op == OperationType::ADD || expr->op == OperationType::NEGATE ||
-      expr->op == OperationType::MULT || expr->op == OperationType::DIVIDE ||
-      expr->op == OperationType::BITWISE_AND ||
-      expr->op == OperationType::BITWISE_OR ||
-      expr->op == OperationType::BITWISE_XOR ||
-      expr->op == OperationType::MODULO) {
-    // Compute the second expression and save it to x0
-    asm_file << "\n\tstr\tx0, [sp, #-16]!";
-    expr->expr_two->accept(this);
-
-    asm_file << "\n\tldr\tx1, [sp], #16";
-
-    asm_file << "\n\t";
-    switch (expr->op) {
-    case OperationType::ADD:
-      asm_file << "add\t";
-      break;
-    case OperationType::NEGATE:
-      asm_file << "sub\t";
-      break;
-    case OperationType::MULT:
-      asm_file << "mul\t";
-      break;
-    case OperationType::DIVIDE:
-      asm_file << "sdiv\t";
-      break;
-    case OperationType::BITWISE_AND:
-      asm_file << "and\t";
-      break;
-    case OperationType::BITWISE_OR:
-      asm_file << "orr\t";
-      break;
-    case OperationType::BITWISE_XOR:
-      asm_file << "eor\t";
-      break;
-    case OperationType::MODULO:
-      asm_file << "sdiv\tx2, x1, x0\n\t";
-      asm_file << "msub\tx0, x0, x2, x1";
-      return;
-    default:
-      __builtin_unreachable();
-    }
-
-    asm_file << "x0, x1, x0";
-  } else if (expr->op == OperationType::EQUAL ||
-             expr->op == OperationType::NOT_EQUAL ||
-             expr->op == OperationType::LESS_THAN ||
-             expr->op == OperationType::LESS_THAN_EQUAL ||
-             expr->op == OperationType::GREATER_THAN ||
-             expr->op == OperationType::GREATER_THAN_EQUAL) {
-    // Compute the second expression and save it to x0
-    asm_file << "\n\tstr\tx0, [sp, #-16]!";
-    expr->expr_two->accept(this);
-
-    asm_file << "\n\tldr\tx1, [sp], #16";
+  if (emit_memoized(expr)) {
+    return;
+  }
 
-    asm_file << "cmp\tx1, x0\n\t";
+  const OperatorInfo &info = operator_info(expr->op);
+  if (info.precedence == 0) {
+    throw std::runtime_error("Expected a binary operation");
+  }
 
-    switch (expr->op) {
-    case OperationType::EQUAL:
-      asm_file << "cset\tx0, eq";
-      break;
-    case OperationType::NOT_EQUAL:
-      asm_file << "cset\tx0, ne";
-      break;
-    case OperationType::LESS_THAN:
-      asm_file << "cset\tx0, lt";
-      break;
-    case OperationType::GREATER_THAN:
-      asm_file << "cset\tx0, gt";
-      break;
-    case OperationType::LESS_THAN_EQUAL:
-      asm_file << "cset\tx0, le";
-      break;
-    case OperationType::GREATER_THAN_EQUAL:
-      asm_file << "cset\tx0, ge";
-      break;
-    default:
-      __builtin_unreachable();
+  if (info.condition != nullptr) {
+    schedule_compare(expr, "\n\tcset\tw0, " + std::string(info.condition));
+  } else if (info.short_circuit) {
+    const BranchProfile::Site *site = measured(expr);
+    bool predictable = site != nullptr && site->reached > 0 &&
+                       (site->bias() >= PREDICTABLE_BIAS ||
+                        site->bias() <= 1 - PREDICTABLE_BIAS);
+
+    // Comparisons between variables and literals are cheap and have no side
+    // effects, so a short chain of them is evaluated without branching,
+    // unless the profile shows the branch goes the same way nearly always.
+    // An instrumented build always branches, to count where
+    if (!instrumented && !predictable && emit_compare_chain(expr)) {
+      return;
     }
-  } else if (expr->op == OperationType::OR || expr->op == OperationType::AND) {
+
     // OR and AND are special operations. They follow "short circuiting" rules,
     // meaning that for OR: if the first statement is true, ignore the second
     // one, for AND: if the first statement is false, ignore the second one.
-    // That's why the second expression calculation logic had to be moved inside
-    // each block. Some programs *expect* the second expression to not be
-    // executed in certain scenarios (e.g. a function that modifies state)
-    std::string circuit_fail_label = label_gen();
+    // Some programs *expect* the second expression to not be executed in
+    // certain scenarios (e.g. a function that modifies state).
+    //
+    // The first expression is lowered straight to compare-and-branch, jumping
+    // to the label that sets the known result. Only the second expression's
+    // truth value is ever materialized in w0
+    ExprAST *lhs = expr->expr_one.get();
+    ExprAST *rhs = expr->expr_two.get();
+    bool is_or = expr->op == OperationType::OR;
+
+    std::string circuit_label = label_gen();
     std::string end_label = label_gen();
+    std::string known = is_or ? "\n\tmov\tw0, #1" : "\n\tmov\tw0, #0";
+
+    // With a profile, whichever way the site went more often falls through
+    // and the other way moves out of line
+    std::string rhs_code;
+    if (site != nullptr && out_of_line && site->bias() > 0.5 &&
+        capture_truth_value(rhs, rhs_code)) {
+      cold_code +=
+          "\n" + circuit_label + ":" + rhs_code + "\n\tb\t" + end_label;
+      worklist.schedule({Item([this, lhs, circuit_label, is_or] {
+                           schedule_branch(lhs, circuit_label, !is_or);
+                         }),
+                         known + "\n" + end_label + ":"});
+      return;
+    }
+    if (site != nullptr && out_of_line && site->bias() <= 0.5) {
+      cold_code += "\n" + circuit_label + ":" + known + "\n\tb\t" + end_label;
+      worklist.schedule({Item([this, lhs, circuit_label, is_or] {
+                           schedule_branch(lhs, circuit_label, is_or);
+                         }),
+                         Item([this, rhs] { schedule_truth_value(rhs); }),
+                         "\n" + end_label + ":"});
+      return;
+    }
 
-    switch (expr->op) {
-    case OperationType::OR:
-      asm_file << "\n\tcmp\tx0, #0";
-      asm_file << "\n\tb.eq\t" +
-                      circuit_fail_label; // MAKE A LABEL GENERATING FUNCTION -
-                                          // Duplicate labels are not allowed
-      asm_file << "\n\tmov\tx0, #1";
-      asm_file << "\n\tb\t" + end_label;
-      asm_file << "\n" + circuit_fail_label + ":";
+    std::string reached;
+    std::string decided;
+    if (instrumented) {
+      reached = count(reached_counter(branch_sites.at(expr)));
+      decided = count(short_circuit_counter(branch_sites.at(expr)));
+    }
 
-      // Only compute the second expression here - this is critical for short
-      // circuiting
-      asm_file << "\n\tmov\tx0, ";
-      expr->expr_two->accept(this);
+    std::string short_circuit = "\n\tb\t" + end_label;
+    short_circuit += "\n" + circuit_label + ":" + decided + known;
+    short_circuit += "\n" + end_label + ":";
+
+    worklist.schedule({reached,
+                       Item([this, lhs, circuit_label, is_or] {
+                         schedule_branch(lhs, circuit_label, is_or);
+                       }),
+                       Item([this, rhs] { schedule_truth_value(rhs); }),
+                       short_circuit});
+  } else {
+    // Save the first expression while the second one is computed into w0
+    std::string op_code = "\n\tldr\tw1, [sp], #16\n\t";
+    op_code += info.instructions;
+
+    worklist.schedule({expr->expr_one.get(), "\n\tstr\tw0, [sp, #-16]!",
+                       expr->expr_two.get(), op_code});
+  }
+}
 
-      asm_file << "\n\tcmp\tx0, #0";
-      asm_file << "\n\tcset\tx0, ne";
+void AstAssembly::visit(const VariableExpr *expr) {
+  // Fetch the variable and move its data into w0
+  int var_address_offset = variable_offset(expr->slot);
+  *asm_out << slot_access("ldr", "w0", var_address_offset);
+}
 
-      asm_file << "\n" + end_label + ":";
+void AstAssembly::visit(const VariableAssignExpr *expr) {
+  if (emit_memoized(expr)) {
+    return;
+  }
 
-      break;
-    case OperationType::AND:
-      asm_file << "\n\tcmp\tx0, #0";
-      asm_file << "\n\tb.ne\t" + circuit_fail_label;
-      asm_file << "\n\tmov\tx0, #0";
-      asm_file << "\n\tb\t" + end_label;
-      asm_file << "\n" + circuit_fail_label + ":";
+  int var_address_offset = variable_offset(expr->slot);
 
-      // Compute the second expression (short circuit failure)
-      asm_file << "\n\tmov\tx0, ";
-      expr->expr_two->accept(this);
+  // Store the assignment expression result in w0, then store it in the stack
+  worklist.schedule({expr->assign_expr.get(),
+                     slot_access("str", "w0", var_address_offset)});
+}
 
-      asm_file << "\n\tcmp\tx0, #0";
-      asm_file << "\n\tcset\tx0, ne";
+// Temporaries live in w9-w15, which nothing else in the generated code uses
+void AstAssembly::visit(const TempStoreExpr *expr) {
+  worklist.schedule({expr->expr.get(), "\n\tmov\tw" +
+                                           std::to_string(9 + expr->temp) +
+                                           ", w0"});
+}
 
-      asm_file << "\n" + end_label + ":";
+void AstAssembly::visit(const TempLoadExpr *expr) {
+  *asm_out << "\n\tmov\tw0, w" << 9 + expr->temp;
+}
 
-      break;
-    default:
-      __builtin_unreachable();
-    }
-  } else if (expr->op == OperationType::BITWISE_SHIFT_LEFT ||
-             expr->op == OperationType::BITWISE_SHIFT_RIGHT) {
-    // Compute the second expression and save it to x0
-    asm_file << "\n\tstr\tx0, [sp, #-16]!";
-    expr->expr_two->accept(this);
-
-    asm_file << "\n\tldr\tx1, [sp], #16";
-
-    asm_file << "\n\t";
-    switch (expr->op) {
-    case OperationType::BITWISE_SHIFT_LEFT:
-      asm_file << "lsl\tx0, x1, x0";
-      break;
-    case OperationType::BITWISE_SHIFT_RIGHT:
-      asm_file << "asr\tx0, x1, x0";
-      break;
-    default:
-      __builtin_unreachable();
-    }
+void AstAssembly::visit(const VariableDeclStmt *stmt) {
+  // Visit the variable assignment expression and store w0 in the new slot,
+  // or store zero for a declaration without an initializer. The variable is
+  // only declared afterwards, so it is not in scope in its own initializer
+  std::string value = "wzr";
+  if (stmt->decl_expr != nullptr) {
+    generate_expression(stmt->decl_expr.get());
+    value = "w0";
   }
+  declare_variable(stmt);
+  *asm_out << slot_access("str", value, variable_offset(stmt->slot));
 }
 
-void AstAssembly::visit(const VariableExpr *expr) {
-  // Fetch the variable and move its data into x0
-  int var_address_offset = stack_variables[expr->name];
-  asm_file << "\n\tldr\tx0, [fp, #" << var_address_offset << "]";
+void AstAssembly::visit(const ExprStmt *stmt) {
+  generate_expression(stmt->expr.get());
 }
 
-void AstAssembly::visit(const VariableAssignExpr *expr) {
-  int var_address_offset = stack_variables[expr->var_name];
-
-  // Store the assignment expression result in x0, then store it in the stack
-  expr->assign_expr->accept(this);
-  asm_file << "\n\tstr\tx0, [fp, #-" << var_address_offset << "]";
+void AstAssembly::visit(const BlockStmt *stmt) {
+  for (const auto &statement : stmt->body) {
+    dispatch(statement.get());
+  }
 }
 
-void AstAssembly::visit(const VariableDeclStmt *stmt) {
-  // Check if the variable is already declared in the stack
-  if (stack_variables.find(stmt->name) != stack_variables.end()) {
-    throw std::runtime_error("Attempted to declare variable '" + stmt->name +
-                             "' multiple times");
+void AstAssembly::visit(const WhileStmt *stmt) {
+  // The test sits below the body, which the loop is entered by jumping over,
+  // so every iteration only takes the one branch back up
+  std::string body_label = label_gen();
+  std::string test_label = label_gen();
+
+  auto *always = as_literal(stmt->cond.get());
+  if (always == nullptr || always->value == 0) {
+    *asm_out << "\n\tb\t" << test_label;
   }
+  *asm_out << "\n" << body_label << ":";
 
-  // Visit the variable assignment expression and push it to x0
-  stmt->decl_expr->accept(this);
-  asm_file << "\n\tstr\tx0, [sp, #-16]!";
-  stack_index -= STACK_DIFFERENCE;
-  stack_variables[stmt->name] = stack_index;
-}
+  dispatch(stmt->body.get());
 
-void AstAssembly::visit(const ExprStmt *stmt) {
-  stmt->expr->accept(this);
+  *asm_out << "\n" << test_label << ":";
+  generate_branch(stmt->cond.get(), body_label);
 }
 
 void AstAssembly::visit(const ReturnStmt *stmt) {
-  // Move the return expression into x0
-  stmt->expr->accept(this);
+  // Move the return expression into w0
+  generate_expression(stmt->expr.get());
+  emit_epilogue();
+}
 
+void AstAssembly::emit_epilogue() {
   // Function epilogue
-  // Restore the stack pointer to what it was before the function call and restore the old frame pointer
-  asm_file << "\n\tmov\tsp, fp";
-  asm_file << "\n\tldr\tfp, [sp], #" << STACK_DIFFERENCE;
+  // Restore the old frame pointer and the stack pointer from before the
+  // function call, which were both saved in the frame record
+  if (has_frame) {
+    *asm_out << "\n\tldr\tx16, [fp, #8]";
+    *asm_out << "\n\tldr\tfp, [fp]";
+    *asm_out << "\n\tmov\tsp, x16";
+  }
 
-  asm_file << "\n\tret";
+  *asm_out << "\n\tret";
 }
 
-void AstAssembly::visit(const FunctionDecl *decl) {
-  asm_file << "\t.globl _" << decl->name << "\n_" << decl->name << ":";
-  
+void AstAssembly::emit_implicit_return(const FunctionDecl *decl) {
+  // Running off the end of a function returns 0, as the interpreter does
+  // and as C does for main
+  if (decl->body.empty() || decl->body.back()->kind != StmtKind::RETURN) {
+    *asm_out << "\n\tmov\tw0, #0";
+    emit_epilogue();
+  }
+}
+
+void AstAssembly::emit_prologue(const FunctionDecl *decl) {
+  // An instrumented function is called by the main emit_profile_writer adds
+  if (instrumented) {
+    *asm_out << "_" << decl->name << "_instrumented:";
+  } else {
+    *asm_out << "\t.globl _" << decl->name << "\n_" << decl->name << ":";
+  }
+
   // Function prologue
-  // Push the current frame pointer to the stack and load the stack pointer (pointing to the top of the stack) as the new frame pointer
+  // Reserve room for every local, then push a frame record of the current
+  // frame pointer and the caller's stack pointer and load the stack pointer
+  // (pointing to the record) as the new frame pointer. Locals sit above the
+  // record at positive offsets, and the epilogue doesn't depend on the size
   stack_index = 0;
-  asm_file << "\n\tstr\tfp, [sp, #-16]!";
-  asm_file << "\n\tmov\tfp, sp";
+  slot_offsets.clear();
+  subtree_code.clear();
+  capturing = nullptr;
+  capture_depth = 0;
+
+  // Every declaration gets its own slot, including those in nested scopes
+  int locals_size = 0;
+  for (const auto &stmt : decl->body) {
+    for_each_statement(stmt.get(), [&](StmtAST *nested) {
+      if (auto *var = node_cast<const VariableDeclStmt>(nested)) {
+        int size = type_size(var->type);
+        locals_size = (locals_size + size - 1) / size * size + size;
+      }
+    });
+  }
+  // The stack pointer has to stay 16-byte aligned
+  locals_size = (locals_size + 15) & ~15;
+
+  // Returns differ with and without a frame, so it is part of the signature
+  has_frame = locals_size > 0;
+  frame_hash = has_frame ? 1 : 0;
+  if (!has_frame) {
+    return;
+  }
+
+  *asm_out << "\n\tmov\tx16, sp";
+  if (locals_size >= 4096) {
+    *asm_out << "\n\tsub\tsp, sp, #" << (locals_size >> 12) << ", lsl #12";
+  }
+  if ((locals_size & 0xfff) != 0) {
+    *asm_out << "\n\tsub\tsp, sp, #" << (locals_size & 0xfff);
+  }
+  *asm_out << "\n\tstp\tfp, x16, [sp, #-16]!";
+  *asm_out << "\n\tmov\tfp, sp";
+}
+
+void AstAssembly::visit(const FunctionDecl *decl) {
+  TraceSpan span("codegen", "phase");
+  AllocationScope allocation_scope(Subsystem::CODEGEN);
+
+  branch_sites.clear();
+  if (instrumented || profile != nullptr) {
+    branch_sites = number_branch_sites(decl);
+  }
+  if (profile != nullptr && profile->sites.size() != branch_sites.size()) {
+    throw std::runtime_error(
+        "The profile has " + std::to_string(profile->sites.size()) +
+        " && and || sites, but the function has " +
+        std::to_string(branch_sites.size()));
+  }
+  cold_code.clear();
+  out_of_line = profile != nullptr && !decl->body.empty() &&
+                decl->body.back()->kind == StmtKind::RETURN;
+
+  emit_prologue(decl);
+  if (instrumented) {
+    *asm_out << count(PROFILE_ENTRY_COUNTER);
+  }
 
   for (int i = 0; i < decl->body.size(); ++i) {
-    decl->body[i]->accept(this);
+    dispatch(decl->body[i].get());
+  }
+  emit_implicit_return(decl);
+
+  *asm_out << cold_code;
+  if (instrumented) {
+    emit_profile_writer(decl);
+  }
+}
+
+std::string AstAssembly::count(int index) const {
+  // x16 and x17 are only used within single statements' code otherwise,
+  // see slot_access
+  int offset = index * 8;
+  std::string code = "\n\tadrp\tx17, _profile_counters@PAGE"
+                     "\n\tadd\tx17, x17, _profile_counters@PAGEOFF";
+  if (offset > 4095 * 8) {
+    code += "\n\tadd\tx17, x17, #" + std::to_string(offset >> 12) + ", lsl #12";
+    offset &= 0xfff;
   }
+  return code + "\n\tldr\tx16, [x17, #" + std::to_string(offset) +
+         "]\n\tadd\tx16, x16, #1\n\tstr\tx16, [x17, #" +
+         std::to_string(offset) + "]";
+}
+
+const BranchProfile::Site *AstAssembly::measured(const ExprAST *expr) const {
+  if (profile == nullptr) {
+    return nullptr;
+  }
+  return &profile->sites[branch_sites.at(expr)];
+}
+
+bool AstAssembly::capture_truth_value(ExprAST *expr, std::string &code) {
+  if (capture_depth == MAX_CAPTURE_DEPTH) {
+    return false;
+  }
+
+  std::ostringstream captured;
+  std::ostream *out = asm_out;
+
+  asm_out = &captured;
+  ++capture_depth;
+  worklist.run_static(Item([this, expr] { schedule_truth_value(expr); }),
+                      this, captured);
+  --capture_depth;
+  asm_out = out;
+
+  code = captured.str();
+  return true;
+}
+
+void AstAssembly::emit_profile_writer(const FunctionDecl *decl) {
+  int counters =
+      PROFILE_HEADER_COUNTERS + 2 * static_cast<int>(branch_sites.size());
+
+  // The table, headed by the magic and the number of sites
+  *asm_out << "\n\t.data\n\t.p2align\t3\n_profile_counters:"
+           << "\n\t.quad\t" << PROFILE_MAGIC << "\n\t.quad\t"
+           << branch_sites.size() << "\n\t.space\t"
+           << 8 * (counters - 2) << "\n_profile_file:\n\t.asciz\t\""
+           << PROFILE_FILE_NAME << "\"\n_profile_mode:\n\t.asciz\t\"wb\""
+           << "\n\t.text";
+
+  // main keeps the function's result on the stack while it writes the
+  // table with fopen, fwrite and fclose, then returns it. Nothing is
+  // written if the file cannot be opened
+  *asm_out << "\n\t.globl _" << decl->name << "\n_" << decl->name << ":"
+           << "\n\tstp\tfp, lr, [sp, #-16]!"
+           << "\n\tmov\tfp, sp"
+           << "\n\tbl\t_" << decl->name << "_instrumented"
+           << "\n\tstr\tx0, [sp, #-16]!"
+           << "\n\tadrp\tx0, _profile_file@PAGE"
+           << "\n\tadd\tx0, x0, _profile_file@PAGEOFF"
+           << "\n\tadrp\tx1, _profile_mode@PAGE"
+           << "\n\tadd\tx1, x1, _profile_mode@PAGEOFF"
+           << "\n\tbl\t_fopen"
+           << "\n\tcbz\tx0, _profile_written"
+           << "\n\tstr\tx0, [sp, #-16]!"
+           << "\n\tmov\tx3, x0"
+           << "\n\tadrp\tx0, _profile_counters@PAGE"
+           << "\n\tadd\tx0, x0, _profile_counters@PAGEOFF"
+           << "\n\tmov\tx1, #8" << load_constant("w2", counters)
+           << "\n\tbl\t_fwrite"
+           << "\n\tldr\tx0, [sp], #16"
+           << "\n\tbl\t_fclose"
+           << "\n_profile_written:"
+           << "\n\tldr\tx0, [sp], #16"
+           << "\n\tldp\tfp, lr, [sp], #16"
+           << "\n\tret";
 }
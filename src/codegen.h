@@ -1,12 +1,50 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
 #include "ast.h"
+#include "profile.h"
 
+#include <cstddef>
 #include <fstream>
 #include <memory>
+#include <ostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
-class AstAssembly : public ExprVisitor, public StmtVisitor, public DeclVisitor {
+class AstAssembly final : public ExprVisitor,
+                           public StmtVisitor,
+                           public DeclVisitor,
+                           public StaticVisitor<AstAssembly> {
 public:
   void generate(DeclAST *root_node, std::string asm_file_name);
+  void generate(DeclAST *root_node, std::ostream &out);
+
+  // Entry points for emitting a function one statement at a time, so callers
+  // (see incremental.h) can reuse code for statements that did not change.
+  // begin_function resets the frame, generate_statement appends one statement
+  // and end_function returns 0 if the last statement does not return
+  void begin_function(const FunctionDecl *decl, std::ostream &out);
+  void generate_statement(StmtAST *stmt, std::ostream &out);
+  void end_function(const FunctionDecl *decl, std::ostream &out);
+
+  // Allocates stack space for the variable of a resolved declaration
+  // without emitting any code, used when the code declaring it is reused
+  // instead of regenerated
+  void declare_variable(const VariableDeclStmt *decl);
+
+  // Identifies the variables and slots declared so far in the function. Code
+  // for a statement only depends on its own tokens and this signature
+  std::size_t frame_signature() const { return frame_hash; }
+
+  // An instrumented function counts how each && and || goes and writes the
+  // counts out when main returns. A profile read from those counts (which
+  // has to outlive generate) lays each of them out for the outcome it saw
+  // most. Both only apply to whole functions given to generate
+  void set_instrumented(bool enabled) { instrumented = enabled; }
+  void set_profile(const BranchProfile *branch_profile) {
+    profile = branch_profile;
+  }
 
   // Fulfilling ExprVisitor contract
   void visit(const IntLiteralExpr *expr) override;
@@ -14,25 +52,125 @@ public:
   void visit(const BinaryOpExpr *expr) override;
   void visit(const VariableExpr *expr) override;
   void visit(const VariableAssignExpr *expr) override;
+  void visit(const TempStoreExpr *expr) override;
+  void visit(const TempLoadExpr *expr) override;
 
   // Fulfilling the StmtVisitor contract
   void visit(const VariableDeclStmt *stmt) override;
   void visit(const ReturnStmt *stmt) override;
   void visit(const ExprStmt *stmt) override;
+  void visit(const BlockStmt *stmt) override;
+  void visit(const WhileStmt *stmt) override;
 
   // Fulfilling the DeclVisitor contract
   void visit(const FunctionDecl *decl) override;
 
 private:
-  std::ofstream asm_file;
+  // Where code is currently written, the assembly file or a statement buffer
+  std::ostream *asm_out = nullptr;
+
+  // Never reset, so labels stay unique across everything one instance emits
   int label_num = 0;
 
 
-  // Keep track of variables in current stack frame
-  std::unordered_map<std::string, int> stack_variables;
+  // Profile-guided lowering of && and || (see profile.h)
+  bool instrumented = false;
+  const BranchProfile *profile = nullptr;
+
+  // Number of each && and || node of the function being generated
+  std::unordered_map<const ExprAST *, int> branch_sites;
+
+  // Code the profile moved out of line, emitted after the function. Only
+  // done when the function ends in a return, so nothing falls into it
+  std::string cold_code;
+  bool out_of_line = false;
+
+  // Frame offset of each resolver slot (see resolver.h), or -1 before its
+  // declaration. Locals are packed by size above the frame record in
+  // declaration order, and stack_index counts the bytes used
+  std::vector<int> slot_offsets;
   int stack_index = 0;
-  int STACK_DIFFERENCE = 16;
+  int FRAME_RECORD_SIZE = 16;
+
+  // A function without locals is a leaf that never touches fp, so it gets
+  // no frame record and its prologue and epilogue are empty
+  bool has_frame = true;
+
+  // Running hash of the declared variables, see frame_signature
+  std::size_t frame_hash = 0;
+
+  // Expression children are walked through this instead of recursion
+  ExprWorklist worklist;
+
+  // Code emitted for interned subtrees (see ast_factory.h), written again
+  // wherever the same node appears. Only valid while every declared slot
+  // keeps its offset, so it is cleared with the frame
+  std::unordered_map<const ExprAST *, std::string> subtree_code;
+
+  // The node whose code is being captured, and how many captures are nested
+  const ExprAST *capturing = nullptr;
+  int capture_depth = 0;
+
+  // For an interned 'expr', writes its memoized code, generating and
+  // capturing it first if needed. Returns false if 'expr' has to be visited
+  // as usual instead
+  bool emit_memoized(const ExprAST *expr);
 
   // Helper function to generate unique labels
   std::string label_gen();
+
+  // Frame offset of a declared slot, throws for one never declared
+  int variable_offset(int slot);
+
+  // Emits code leaving the value of 'expr' in x0
+  void generate_expression(ExprAST *expr);
+
+  // Emits code that branches to 'label' when 'expr' is non-zero, see
+  // schedule_branch
+  void generate_branch(ExprAST *expr, const std::string &label);
+
+  // Condition lowering. These schedule code on the worklist instead of
+  // emitting it, so they may only be called while an expression is walked
+
+  // Schedules code that branches to 'label' when 'expr' is non-zero (or zero
+  // when jump_if is false) and falls through otherwise, without ever
+  // materializing the intermediate booleans
+  void schedule_branch(ExprAST *expr, const std::string &label, bool jump_if);
+
+  // Schedules a compare of the operands of a relational expression followed
+  // by 'then', which can use the flags through condition_code(expr->op)
+  void schedule_compare(const BinaryOpExpr *expr, const std::string &then);
+
+  // Schedules code leaving 0 or 1 in x0 for the truth value of 'expr'
+  void schedule_truth_value(ExprAST *expr);
+
+  // Emits a short && / || chain of comparisons between variables and
+  // literals as a branchless cmp/ccmp sequence. Returns false, emitting
+  // nothing, if the expression does not have that shape
+  bool emit_compare_chain(const BinaryOpExpr *expr);
+
+  // Emits the function label and prologue and resets the frame
+  void emit_prologue(const FunctionDecl *decl);
+
+  // Emits the code restoring the caller's frame and returning
+  void emit_epilogue();
+
+  // Emits a return of 0 after the body, unless it ends in a return
+  void emit_implicit_return(const FunctionDecl *decl);
+
+  // Code adding one to the profile counter at 'index'
+  std::string count(int index) const;
+
+  // The profile's counts for a && or || node, or nullptr without a profile
+  const BranchProfile::Site *measured(const ExprAST *expr) const;
+
+  // Emits the code for 'expr' through a walk of its own and returns it
+  // instead, or returns false if captures are nested too deeply already
+  bool capture_truth_value(ExprAST *expr, std::string &code);
+
+  // Emits the table of profile counters and a main that calls the
+  // instrumented function and then writes the table to PROFILE_FILE_NAME
+  void emit_profile_writer(const FunctionDecl *decl);
 };
+
+#endif
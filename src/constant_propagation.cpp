@@ -0,0 +1,327 @@
+#include "constant_propagation.h"
+#include "ast.h"
+#include "ast_factory.h"
+#include "operators.h"
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// The value of a unary operator applied to a literal, as w0 would hold it
+std::int32_t fold_unary(OperationType op, std::int32_t value) {
+  switch (op) {
+  case OperationType::NEGATE:
+    return wrap(0u - static_cast<std::uint32_t>(value));
+  case OperationType::BITWISE:
+    return ~value;
+  case OperationType::LOGIC_NEGATE:
+    return value == 0;
+  default:
+    throw std::runtime_error("Expected a unary operation");
+  }
+}
+
+// The value of a binary operator applied to two literals, as w0 would hold it
+std::int32_t fold_binary(OperationType op, std::int32_t lhs, std::int32_t rhs) {
+  auto x = static_cast<std::uint32_t>(lhs);
+  auto y = static_cast<std::uint32_t>(rhs);
+
+  switch (op) {
+  case OperationType::ADD:
+    return wrap(x + y);
+  case OperationType::NEGATE:
+    return wrap(x - y);
+  case OperationType::MULT:
+    return wrap(x * y);
+  case OperationType::DIVIDE:
+    return divide(lhs, rhs);
+  case OperationType::MODULO:
+    return modulo(lhs, rhs);
+  case OperationType::BITWISE_AND:
+    return lhs & rhs;
+  case OperationType::BITWISE_OR:
+    return lhs | rhs;
+  case OperationType::BITWISE_XOR:
+    return lhs ^ rhs;
+  case OperationType::BITWISE_SHIFT_LEFT:
+    return wrap(x << (y & 31));
+  case OperationType::BITWISE_SHIFT_RIGHT:
+    return lhs >> (y & 31);
+  case OperationType::EQUAL:
+    return lhs == rhs;
+  case OperationType::NOT_EQUAL:
+    return lhs != rhs;
+  case OperationType::LESS_THAN:
+    return lhs < rhs;
+  case OperationType::LESS_THAN_EQUAL:
+    return lhs <= rhs;
+  case OperationType::GREATER_THAN:
+    return lhs > rhs;
+  case OperationType::GREATER_THAN_EQUAL:
+    return lhs >= rhs;
+  case OperationType::AND:
+    return lhs != 0 && rhs != 0;
+  case OperationType::OR:
+    return lhs != 0 || rhs != 0;
+  default:
+    throw std::runtime_error("Expected a binary operation");
+  }
+}
+
+const IntLiteralExpr *as_literal(const ExprAST *expr) {
+  return node_cast<const IntLiteralExpr>(expr);
+}
+
+// The current form of the operand whose result is 'result'
+const ExprAST *operand(const ExprPtr &result, const ExprPtr &original) {
+  return result != nullptr ? result.get() : original.get();
+}
+
+class ConstantPropagation : public ExprRewriter<ConstantPropagation> {
+public:
+  // Variables are tracked by the 'slot_count' slots of a resolved function
+  ConstantPropagation(bool track_variables, int slot_count)
+      : track_variables(track_variables), known(slot_count, false),
+        values(slot_count, 0) {};
+
+  void propagate_statement(StmtAST *statement);
+
+  int replaced = 0;
+
+private:
+  // Off for a lone statement, where nothing is known about variables
+  bool track_variables;
+
+  // Whether each slot is known to hold a constant, and which
+  std::vector<bool> known;
+  std::vector<int> values;
+
+  // Slots written on each enclosing right side of && or || that only runs
+  // sometimes
+  std::vector<std::vector<int>> regions;
+
+  // Folds an expression tree in evaluation order, replacing 'root' if the
+  // whole tree changes
+  void propagate_expression(ExprPtr &root) { rewrite(root); }
+
+  // Each returns the literal or the copy replacing the node, if any
+  friend class ExprRewriter<ConstantPropagation>;
+  ExprPtr leave(IntLiteralExpr *) { return nullptr; }
+  ExprPtr leave(VariableExpr *variable);
+  ExprPtr leave(UnaryOpExpr *unary, ExprPtr child);
+  ExprPtr leave(BinaryOpExpr *binary, ExprPtr lhs, ExprPtr rhs);
+  ExprPtr leave(VariableAssignExpr *assign, ExprPtr child);
+  ExprPtr leave(TempStoreExpr *, ExprPtr) { throw on_temporaries(); }
+  ExprPtr leave(TempLoadExpr *) { throw on_temporaries(); }
+
+  // Decides a && or || by its left side where it can, and otherwise opens a
+  // region for its right side when that may not run
+  bool between(BinaryOpExpr *binary, ExprPtr &lhs);
+
+  // Whether the left side 'lhs' of the && or || 'binary' leaves the right
+  // side running only sometimes
+  static bool opens_region(const BinaryOpExpr *binary, const ExprPtr &lhs) {
+    return operator_info(binary->op).short_circuit &&
+           as_literal(operand(lhs, binary->expr_one)) == nullptr;
+  }
+
+  static std::runtime_error on_temporaries() {
+    return std::runtime_error("Constant propagation ran on temporaries");
+  }
+
+  // Records that 'slot' now holds the value of 'value'
+  void write_variable(int slot, const ExprAST *value);
+
+  // Forgets the values of the variables 'statement' writes
+  void forget_written(StmtAST *statement);
+
+  // Whether 'expr' may name a variable that is not declared. In a resolved
+  // function none does, and a lone statement is not resolved yet
+  bool may_name_undeclared(const ExprAST *expr) const;
+
+  ExprPtr literal(int value) {
+    ++replaced;
+    return std::make_unique<IntLiteralExpr>(value);
+  }
+};
+
+void ConstantPropagation::propagate_statement(StmtAST *statement) {
+  switch (statement->kind) {
+  case StmtKind::VARIABLE_DECL: {
+    auto *decl = static_cast<VariableDeclStmt *>(statement);
+    if (decl->decl_expr != nullptr) {
+      propagate_expression(decl->decl_expr);
+    }
+    if (track_variables) {
+      // A declaration without an initializer stores zero
+      known[decl->slot] = false;
+      if (decl->decl_expr == nullptr) {
+        known[decl->slot] = true;
+        values[decl->slot] = 0;
+      } else if (auto *value = as_literal(decl->decl_expr.get())) {
+        known[decl->slot] = true;
+        values[decl->slot] = value->value;
+      }
+    }
+    break;
+  }
+  case StmtKind::RETURN: {
+    auto *ret = static_cast<ReturnStmt *>(statement);
+    if (ret->expr != nullptr) {
+      propagate_expression(ret->expr);
+    }
+    break;
+  }
+  case StmtKind::EXPR:
+    propagate_expression(static_cast<ExprStmt *>(statement)->expr);
+    break;
+  case StmtKind::BLOCK:
+    for (auto &nested : static_cast<BlockStmt *>(statement)->body) {
+      propagate_statement(nested.get());
+    }
+    break;
+  case StmtKind::WHILE: {
+    // The loop is walked once, knowing only what holds on every iteration,
+    // and what it writes is unknown after it as well
+    auto *loop = static_cast<WhileStmt *>(statement);
+    forget_written(loop);
+    propagate_expression(loop->cond);
+    propagate_statement(loop->body.get());
+    forget_written(loop);
+    break;
+  }
+  }
+}
+
+void ConstantPropagation::forget_written(StmtAST *statement) {
+  if (!track_variables) {
+    return;
+  }
+
+  for_each_statement(statement, [&](StmtAST *nested) {
+    if (auto *decl = node_cast<VariableDeclStmt>(nested)) {
+      known[decl->slot] = false;
+    }
+  });
+  for_each_expression(statement, [&](ExprPtr &expr) {
+    for_each_node(expr.get(), [&](const ExprAST *node) {
+      if (auto *assign = node_cast<const VariableAssignExpr>(node)) {
+        known[assign->slot] = false;
+      }
+    });
+  });
+}
+
+ExprPtr ConstantPropagation::leave(VariableExpr *variable) {
+  if (track_variables && known[variable->slot]) {
+    return literal(values[variable->slot]);
+  }
+  return nullptr;
+}
+
+ExprPtr ConstantPropagation::leave(UnaryOpExpr *unary, ExprPtr child) {
+  auto *value = as_literal(operand(child, unary->expr));
+  if (value != nullptr) {
+    return literal(fold_unary(unary->op, value->value));
+  }
+  return replace_children(unary, std::move(child), nullptr);
+}
+
+bool ConstantPropagation::between(BinaryOpExpr *binary, ExprPtr &lhs) {
+  if (!operator_info(binary->op).short_circuit) {
+    return false;
+  }
+
+  auto *value = as_literal(operand(lhs, binary->expr_one));
+  if (value == nullptr) {
+    // The right side runs exactly when a known left side says so, and
+    // sometimes when it is not known
+    regions.emplace_back();
+    return false;
+  }
+
+  // A left side that decides the result leaves the right side dead
+  bool decides = (value->value != 0) == (binary->op == OperationType::OR);
+  if (!decides || may_name_undeclared(binary->expr_two.get())) {
+    return false;
+  }
+  lhs = literal(value->value != 0);
+  return true;
+}
+
+ExprPtr ConstantPropagation::leave(BinaryOpExpr *binary, ExprPtr lhs,
+                                   ExprPtr rhs) {
+  if (opens_region(binary, lhs)) {
+    // Variables written there may or may not hold the new value
+    std::vector<int> written = std::move(regions.back());
+    regions.pop_back();
+    for (int slot : written) {
+      known[slot] = false;
+      if (!regions.empty()) {
+        regions.back().push_back(slot);
+      }
+    }
+  }
+
+  auto *lhs_value = as_literal(operand(lhs, binary->expr_one));
+  auto *rhs_value = as_literal(operand(rhs, binary->expr_two));
+  if (lhs_value != nullptr && rhs_value != nullptr) {
+    return literal(
+        fold_binary(binary->op, lhs_value->value, rhs_value->value));
+  }
+  return replace_children(binary, std::move(lhs), std::move(rhs));
+}
+
+ExprPtr ConstantPropagation::leave(VariableAssignExpr *assign, ExprPtr child) {
+  write_variable(assign->slot, operand(child, assign->assign_expr));
+  return replace_children(assign, std::move(child), nullptr);
+}
+
+void ConstantPropagation::write_variable(int slot, const ExprAST *value) {
+  if (!track_variables) {
+    return;
+  }
+
+  if (!regions.empty()) {
+    regions.back().push_back(slot);
+  }
+
+  known[slot] = false;
+  if (auto *literal = as_literal(value)) {
+    known[slot] = true;
+    values[slot] = literal->value;
+  }
+}
+
+bool ConstantPropagation::may_name_undeclared(const ExprAST *expr) const {
+  if (track_variables) {
+    return false;
+  }
+
+  bool names = false;
+  for_each_node(expr, [&](const ExprAST *node) {
+    names = names || node->kind == ExprKind::VARIABLE ||
+            node->kind == ExprKind::VARIABLE_ASSIGN;
+  });
+  return names;
+}
+
+} // namespace
+
+int propagate_constants(FunctionDecl *function) {
+  ConstantPropagation propagation(true, function->slot_count);
+  for (auto &statement : function->body) {
+    propagation.propagate_statement(statement.get());
+  }
+  return propagation.replaced;
+}
+
+int propagate_constants(StmtAST *statement) {
+  ConstantPropagation propagation(false, 0);
+  propagation.propagate_statement(statement);
+  return propagation.replaced;
+}
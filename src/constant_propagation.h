@@ -0,0 +1,36 @@
+#ifndef CONSTANT_PROPAGATION_H
+#define CONSTANT_PROPAGATION_H
+
+#include "ast.h"
+
+/*
+Constant propagation and folding.
+
+Statements are walked in evaluation order, remembering which variables hold
+a known constant: one declared or assigned a literal (or nothing, which
+stores zero). Reads of those variables become literals, and unary and binary
+expressions whose operands are all literals are replaced by their value,
+computed with the same 32-bit semantics as the generated code (wrapping
+arithmetic, x / 0 == 0, x % 0 == x, shift amounts modulo 32).
+
+A && or || whose left side is a known literal loses the right side if it
+decides the result. In a lone statement, which is not resolved yet, it is
+kept if it names any variable, as that may be an error to report. Variables
+written on a right side that only runs sometimes are not known afterwards,
+and neither are those a loop writes, in it or after it.
+
+Shared (hash-consed) nodes are never changed in place. A node that needs new
+children is replaced by a copy (see ast_factory.h).
+
+Both functions return the number of subexpressions replaced.
+*/
+
+// Propagates known variables through the whole body, which must be resolved
+// (see resolver.h)
+int propagate_constants(FunctionDecl *function);
+
+// Only folds within the statement, knowing nothing about variables, so its
+// code stays independent of the statements around it (see incremental.h)
+int propagate_constants(StmtAST *statement);
+
+#endif
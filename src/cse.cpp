@@ -0,0 +1,514 @@
+#include "cse.h"
+#include "ast.h"
+#include "ast_factory.h"
+#include "operators.h"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Identifies a unary or binary expression by its operator and the value
+// numbers of its operands (rhs is -1 for unary operators)
+struct ExpressionKey {
+  bool binary;
+  OperationType op;
+  int lhs;
+  int rhs;
+
+  bool operator==(const ExpressionKey &other) const {
+    return binary == other.binary && op == other.op && lhs == other.lhs &&
+           rhs == other.rhs;
+  }
+};
+
+struct ExpressionKeyHash {
+  std::size_t operator()(const ExpressionKey &key) const {
+    std::size_t hash = std::hash<int>{}(static_cast<int>(key.op) * 2 +
+                                        (key.binary ? 1 : 0));
+    hash = hash * 31 + std::hash<int>{}(key.lhs);
+    return hash * 31 + std::hash<int>{}(key.rhs);
+  }
+};
+
+// The value number of a subtree, and whether computing it has no side
+// effects
+struct Numbered {
+  int value;
+  bool pure;
+};
+
+class ValueNumbering : public ExprRewriter<ValueNumbering, Numbered> {
+public:
+  // Variables are told apart by the 'slot_count' slots of a resolved tree
+  explicit ValueNumbering(int slot_count) : variables(slot_count, -1) {};
+
+  // Numbers the expressions of one statement, continuing from the state the
+  // previous statements left
+  void number_statement(StmtAST *statement);
+
+  // Gives temporaries to the values worth sharing and rewrites the tree.
+  // Returns the number of subexpressions replaced
+  int rewrite();
+
+private:
+  // A node walked, found through the slot holding it. The slot lies inside
+  // the parent node, so if the parent is interned and gets copied (see
+  // ast_factory.h), the slot moves into the copy
+  struct Node {
+    ExprPtr *slot;
+    int parent;
+    bool shared; // The node or one of its ancestors is interned
+    bool unshared = false;
+    bool remapped = false;
+    const ExprAST *original = nullptr;
+    ExprAST *copy = nullptr;
+  };
+
+  // The first computation of a value, and the later ones that reuse it
+  struct Definition {
+    int node;
+    int value;
+    int clock;
+    std::vector<int> uses;
+    bool undone = false;
+    int temp = -1;
+  };
+
+  struct Use {
+    int node;
+    int definition;
+    int clock;
+    bool undone = false;
+  };
+
+  // What happened, in order, so the events inside a subtree can be undone
+  // once the whole subtree turns out to be reusable
+  struct Event {
+    bool is_use;
+    int index;
+  };
+
+  // The right side of && or ||, which is not always evaluated
+  struct Region {
+    std::vector<int> made_available;
+    std::vector<int> written;
+  };
+
+  int next_value = 0;
+
+  // Position in evaluation order, for the live ranges of shared values
+  int clock = 0;
+
+  std::unordered_map<int, int> constants;
+
+  // Value number of each slot, -1 until it is first read or written
+  std::vector<int> variables;
+  std::unordered_map<ExpressionKey, int, ExpressionKeyHash> expressions;
+
+  // Definition of each value that has been computed and can be reused
+  std::unordered_map<int, int> available;
+
+  std::vector<Node> nodes;
+  std::vector<Definition> definitions;
+  std::vector<Use> uses;
+  std::vector<Event> events;
+  std::vector<Region> regions;
+
+  int constant_value(int constant);
+  int variable_value(int slot);
+  int expression_value(const ExpressionKey &key);
+
+  // Nodes being walked, innermost last, with the number of events before
+  // each of them
+  struct Open {
+    int node;
+    std::size_t mark;
+  };
+  std::vector<Open> open;
+
+  // Numbers an expression tree in evaluation order and returns its value
+  int number_expression(ExprPtr &root) {
+    return root != nullptr ? walk(root).value : next_value++;
+  }
+
+  // The walk of number_expression. enter records each node as reached
+  // through its slot, and each leave numbers one
+  friend class ExprRewriter<ValueNumbering, Numbered>;
+  bool enter(ExprAST *expr, ExprPtr *slot, Numbered &result);
+  bool between(BinaryOpExpr *binary, Numbered &lhs);
+  Numbered leave(IntLiteralExpr *literal);
+  Numbered leave(VariableExpr *variable);
+  Numbered leave(UnaryOpExpr *unary, Numbered operand);
+  Numbered leave(BinaryOpExpr *binary, Numbered lhs, Numbered rhs);
+  Numbered leave(VariableAssignExpr *assign, Numbered value);
+  Numbered leave(TempStoreExpr *, Numbered) { throw on_temporaries(); }
+  Numbered leave(TempLoadExpr *) { throw on_temporaries(); }
+
+  static std::runtime_error on_temporaries() {
+    return std::runtime_error(
+        "Common subexpression elimination ran on temporaries");
+  }
+
+  // Called once the operands of the unary or binary expression 'node' are
+  // numbered. Either reuses an available value or defines a new one
+  void finish_expression(int node, std::size_t mark, const ExpressionKey &key,
+                         bool pure);
+
+  void undo_events(std::size_t mark);
+
+  void enter_region();
+  void leave_region();
+
+  // Makes nothing available across the boundary of 'loop' and gives the
+  // variables it writes new numbers
+  void forget_loop(WhileStmt *loop);
+
+  // The slot currently holding 'node', following copies of its parent
+  ExprPtr *current_slot(int node);
+
+  // Like current_slot, but first copies the interned ancestors of 'node', so
+  // that replacing it changes no shared node
+  ExprPtr *writable_slot(int node);
+};
+
+// The slot in 'copy' matching 'slot' in the node it was copied from
+ExprPtr *matching_slot(const ExprAST *original, ExprAST *copy,
+                       const ExprPtr *slot) {
+  switch (original->kind) {
+  case ExprKind::BINARY_OP: {
+    auto *binary = static_cast<const BinaryOpExpr *>(original);
+    auto *binary_copy = static_cast<BinaryOpExpr *>(copy);
+    return slot == &binary->expr_one ? &binary_copy->expr_one
+                                     : &binary_copy->expr_two;
+  }
+  case ExprKind::UNARY_OP:
+    return &static_cast<UnaryOpExpr *>(copy)->expr;
+  case ExprKind::VARIABLE_ASSIGN:
+    return &static_cast<VariableAssignExpr *>(copy)->assign_expr;
+  default:
+    throw std::runtime_error("Copied node has no children");
+  }
+}
+
+int ValueNumbering::constant_value(int constant) {
+  auto found = constants.find(constant);
+  if (found != constants.end()) {
+    return found->second;
+  }
+  return constants[constant] = next_value++;
+}
+
+int ValueNumbering::variable_value(int slot) {
+  if (variables[slot] < 0) {
+    variables[slot] = next_value++;
+  }
+  return variables[slot];
+}
+
+int ValueNumbering::expression_value(const ExpressionKey &key) {
+  auto found = expressions.find(key);
+  if (found != expressions.end()) {
+    return found->second;
+  }
+  return expressions[key] = next_value++;
+}
+
+void ValueNumbering::number_statement(StmtAST *statement) {
+  switch (statement->kind) {
+  case StmtKind::VARIABLE_DECL: {
+    auto *decl = static_cast<VariableDeclStmt *>(statement);
+    variables[decl->slot] = decl->decl_expr != nullptr
+                                ? number_expression(decl->decl_expr)
+                                : constant_value(0);
+    break;
+  }
+  case StmtKind::RETURN:
+    number_expression(static_cast<ReturnStmt *>(statement)->expr);
+    break;
+  case StmtKind::EXPR:
+    number_expression(static_cast<ExprStmt *>(statement)->expr);
+    break;
+  case StmtKind::BLOCK:
+    // A variable declared in the block has a slot of its own even where it
+    // hides an outer one, so the outer one keeps its number
+    for (auto &nested : static_cast<BlockStmt *>(statement)->body) {
+      number_statement(nested.get());
+    }
+    break;
+  case StmtKind::WHILE: {
+    // The condition runs before the body on every iteration, so its values
+    // are available there, but nothing is shared into or out of the loop
+    auto *loop = static_cast<WhileStmt *>(statement);
+    forget_loop(loop);
+    number_expression(loop->cond);
+    number_statement(loop->body.get());
+    forget_loop(loop);
+    break;
+  }
+  }
+}
+
+void ValueNumbering::forget_loop(WhileStmt *loop) {
+  available.clear();
+
+  // Variables the loop writes hold a different value on each iteration
+  for_each_statement(loop, [&](StmtAST *nested) {
+    if (auto *decl = node_cast<VariableDeclStmt>(nested)) {
+      variables[decl->slot] = next_value++;
+    }
+  });
+  for_each_expression(loop, [&](ExprPtr &expr) {
+    for_each_node(expr.get(), [&](const ExprAST *node) {
+      if (auto *assign = node_cast<const VariableAssignExpr>(node)) {
+        variables[assign->slot] = next_value++;
+      }
+    });
+  });
+}
+
+bool ValueNumbering::enter(ExprAST *expr, ExprPtr *slot,
+                           Numbered & /*result*/) {
+  int parent = open.empty() ? -1 : open.back().node;
+  bool shared = expr->interned || (parent >= 0 && nodes[parent].shared);
+  nodes.push_back({slot, parent, shared});
+  open.push_back({static_cast<int>(nodes.size()) - 1, events.size()});
+  return false;
+}
+
+bool ValueNumbering::between(BinaryOpExpr *binary, Numbered & /*lhs*/) {
+  if (operator_info(binary->op).short_circuit) {
+    enter_region();
+  }
+  return false;
+}
+
+Numbered ValueNumbering::leave(IntLiteralExpr *literal) {
+  open.pop_back();
+  return {constant_value(literal->value), true};
+}
+
+Numbered ValueNumbering::leave(VariableExpr *variable) {
+  open.pop_back();
+  return {variable_value(variable->slot), true};
+}
+
+Numbered ValueNumbering::leave(UnaryOpExpr *unary, Numbered operand) {
+  Open node = open.back();
+  open.pop_back();
+
+  ExpressionKey key{false, unary->op, operand.value, -1};
+  finish_expression(node.node, node.mark, key, operand.pure);
+  return {expression_value(key), operand.pure};
+}
+
+Numbered ValueNumbering::leave(BinaryOpExpr *binary, Numbered lhs,
+                               Numbered rhs) {
+  if (operator_info(binary->op).short_circuit) {
+    leave_region();
+  }
+  Open node = open.back();
+  open.pop_back();
+
+  // 'b + a' is the value 'a + b' already computed
+  ExpressionKey key{true, binary->op, lhs.value, rhs.value};
+  if (operator_info(binary->op).commutative && key.lhs > key.rhs) {
+    std::swap(key.lhs, key.rhs);
+  }
+  finish_expression(node.node, node.mark, key, lhs.pure && rhs.pure);
+  return {expression_value(key), lhs.pure && rhs.pure};
+}
+
+Numbered ValueNumbering::leave(VariableAssignExpr *assign, Numbered value) {
+  open.pop_back();
+
+  // The variable now holds the assigned value, which is also the value of
+  // the assignment. Writing is a side effect, so it is never reused
+  variables[assign->slot] = value.value;
+  if (!regions.empty()) {
+    regions.back().written.push_back(assign->slot);
+  }
+  return {value.value, false};
+}
+
+void ValueNumbering::finish_expression(int node, std::size_t mark,
+                                       const ExpressionKey &key, bool pure) {
+  int value = expression_value(key);
+  auto found = available.find(value);
+
+  if (found != available.end()) {
+    // Only reuse a value where computing it has no side effects to lose
+    if (!pure) {
+      return;
+    }
+
+    // Nothing inside the subtree is computed anymore
+    undo_events(mark);
+
+    int definition = found->second;
+    uses.push_back({node, definition, clock++});
+    definitions[definition].uses.push_back(static_cast<int>(uses.size()) - 1);
+    events.push_back({true, static_cast<int>(uses.size()) - 1});
+    return;
+  }
+
+  int definition = static_cast<int>(definitions.size());
+  definitions.push_back({node, value, clock++, {}});
+  events.push_back({false, definition});
+
+  available[value] = definition;
+  if (!regions.empty()) {
+    regions.back().made_available.push_back(value);
+  }
+}
+
+void ValueNumbering::undo_events(std::size_t mark) {
+  while (events.size() > mark) {
+    Event event = events.back();
+    events.pop_back();
+
+    if (event.is_use) {
+      Use &use = uses[event.index];
+      use.undone = true;
+      definitions[use.definition].uses.pop_back();
+    } else {
+      Definition &definition = definitions[event.index];
+      definition.undone = true;
+
+      auto found = available.find(definition.value);
+      if (found != available.end() && found->second == event.index) {
+        available.erase(found);
+      }
+    }
+  }
+}
+
+void ValueNumbering::enter_region() { regions.emplace_back(); }
+
+void ValueNumbering::leave_region() {
+  Region region = std::move(regions.back());
+  regions.pop_back();
+
+  // Values first computed in the region may not have been computed at all
+  for (int value : region.made_available) {
+    available.erase(value);
+  }
+
+  // A variable written in the region holds one of two values afterwards
+  for (int slot : region.written) {
+    variables[slot] = next_value++;
+    if (!regions.empty()) {
+      regions.back().written.push_back(slot);
+    }
+  }
+}
+
+ExprPtr *ValueNumbering::current_slot(int node) {
+  Node &entry = nodes[node];
+  if (!entry.remapped && entry.parent >= 0 &&
+      nodes[entry.parent].copy != nullptr) {
+    const Node &parent = nodes[entry.parent];
+    entry.slot = matching_slot(parent.original, parent.copy, entry.slot);
+    entry.remapped = true;
+  }
+  return entry.slot;
+}
+
+ExprPtr *ValueNumbering::writable_slot(int node) {
+  // Ancestors not yet looked at, stopping where nothing above is interned.
+  // Each is visited once, so copying costs no more than the nodes copied
+  std::vector<int> path;
+  for (int parent = nodes[node].parent;
+       parent >= 0 && nodes[parent].shared && !nodes[parent].unshared;
+       parent = nodes[parent].parent) {
+    path.push_back(parent);
+  }
+
+  // Top down, so each slot is looked up in its parent's copy
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    Node &entry = nodes[*it];
+    ExprPtr *slot = current_slot(*it);
+    if ((*slot)->interned) {
+      entry.original = slot->get();
+      *slot = copy_node(slot->get());
+      entry.copy = slot->get();
+    }
+    entry.unshared = true;
+  }
+
+  return current_slot(node);
+}
+
+int ValueNumbering::rewrite() {
+  // Linear scan over the live ranges of the shared values, from their
+  // definition to their last use. Definitions are already in clock order
+  std::vector<int> free_temps;
+  for (int temp = NUM_TEMPS - 1; temp >= 0; --temp) {
+    free_temps.push_back(temp);
+  }
+  std::vector<std::pair<int, int>> active;
+
+  for (Definition &definition : definitions) {
+    if (definition.undone || definition.uses.empty()) {
+      continue;
+    }
+
+    for (std::size_t i = 0; i < active.size();) {
+      if (active[i].first < definition.clock) {
+        free_temps.push_back(active[i].second);
+        active[i] = active.back();
+        active.pop_back();
+      } else {
+        ++i;
+      }
+    }
+
+    if (free_temps.empty()) {
+      continue;
+    }
+
+    definition.temp = free_temps.back();
+    free_temps.pop_back();
+    active.push_back({uses[definition.uses.back()].clock, definition.temp});
+  }
+
+  int replaced = 0;
+  for (const Use &use : uses) {
+    int temp = definitions[use.definition].temp;
+    if (!use.undone && temp >= 0) {
+      *writable_slot(use.node) = std::make_unique<TempLoadExpr>(temp);
+      ++replaced;
+    }
+  }
+
+  for (Definition &definition : definitions) {
+    if (!definition.undone && definition.temp >= 0) {
+      // Descendants are rewritten first, as definitions are in post-order
+      ExprPtr *slot = writable_slot(definition.node);
+      *slot = std::make_unique<TempStoreExpr>(definition.temp, std::move(*slot));
+    }
+  }
+
+  return replaced;
+}
+
+} // namespace
+
+int eliminate_common_subexpressions(FunctionDecl *function) {
+  ValueNumbering numbering(function->slot_count);
+  for (auto &statement : function->body) {
+    numbering.number_statement(statement.get());
+  }
+  return numbering.rewrite();
+}
+
+int eliminate_common_subexpressions(StmtAST *statement, int slot_count) {
+  ValueNumbering numbering(slot_count);
+  numbering.number_statement(statement);
+  return numbering.rewrite();
+}
@@ -0,0 +1,42 @@
+#ifndef CSE_H
+#define CSE_H
+
+#include "ast.h"
+
+/*
+Common subexpression elimination by local value numbering.
+
+Expressions are numbered in evaluation order, so two subexpressions share a
+value number only if they are certain to compute the same value. A variable's
+number is that of the value last assigned to it, so every write through
+VariableAssignExpr invalidates what was computed from the old value. The
+right side of && and || is only evaluated sometimes, so values first computed
+there are forgotten afterwards, and variables written there get a fresh number.
+Likewise no value is shared into or out of a loop, and variables the loop
+writes get fresh numbers at both ends. Inside, the condition, then the body
+are numbered once, as straight-line code.
+
+When a pure unary or binary subexpression repeats a value that is still
+available, it is replaced by a TempLoadExpr, and the first computation is
+wrapped in a TempStoreExpr. Temporaries are given out by a linear scan over
+the values' live ranges. A value that finds no free temporary is computed
+again at each use instead.
+
+Shared (hash-consed) nodes are never changed in place. Rewriting below one
+first copies the interned nodes on the path from the statement down to it, so
+only that one occurrence changes.
+
+Variables are told apart by their slots, so the tree must be resolved (see
+resolver.h), and must not already contain temporaries. Both functions
+return the number of subexpressions replaced.
+*/
+
+// Shares values across the statements of the body
+int eliminate_common_subexpressions(FunctionDecl *function);
+
+// Only shares values within the statement, so its code stays independent of
+// the statements around it (see incremental.h). Its slots are below
+// 'slot_count'
+int eliminate_common_subexpressions(StmtAST *statement, int slot_count);
+
+#endif
@@ -0,0 +1,299 @@
+#include "dead_code.h"
+#include "ast.h"
+#include "ast_factory.h"
+#include "operators.h"
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Whether evaluating 'expr' does anything but compute its value
+bool has_side_effects(const ExprAST *expr) {
+  bool found = false;
+  for_each_node(expr, [&](const ExprAST *node) {
+    found = found || node->kind == ExprKind::VARIABLE_ASSIGN;
+  });
+  return found;
+}
+
+class DeadCodeElimination : public ExprRewriter<DeadCodeElimination> {
+public:
+  explicit DeadCodeElimination(FunctionDecl *function)
+      : function(function), live(function->slot_count, false),
+        referenced(function->slot_count, false) {};
+
+  int run();
+
+private:
+  FunctionDecl *function;
+  int removed = 0;
+
+  // Slots a later read may see the current value of
+  std::vector<bool> live;
+
+  // Slots named anywhere in the function
+  std::vector<bool> referenced;
+
+  // Slots made dead on each enclosing right side of && or ||, which are live
+  // again once it is left, as it may not have run
+  std::vector<std::vector<int>> regions;
+
+  // Whether each assignment being walked stores a value nothing reads
+  std::vector<bool> dead_assignments;
+
+  // Removes what is dead from a list of statements, walking it backwards
+  // from the liveness after it, and updates 'live' to before it. Removed
+  // statements are dropped from the list
+  void sweep_statements(std::vector<std::unique_ptr<StmtAST>> &body);
+
+  // Whether the statement should be removed altogether
+  bool sweep_statement(StmtAST *statement);
+
+  void sweep_loop(WhileStmt *loop);
+
+  // Removes dead assignments from 'root' and updates 'live' to before it
+  void sweep_expression(ExprPtr &root) { rewrite(root); }
+
+  // Expressions are walked against evaluation order, so each node is left
+  // with the liveness from before its operands. Each returns the tree
+  // replacing the node, if any
+  friend class ExprRewriter<DeadCodeElimination>;
+  static constexpr bool RIGHT_TO_LEFT = true;
+  bool enter(ExprAST *expr, ExprPtr *slot, ExprPtr &result);
+  bool between(BinaryOpExpr *binary, ExprPtr &rhs);
+  ExprPtr leave(IntLiteralExpr *) { return nullptr; }
+  ExprPtr leave(VariableExpr *variable);
+  ExprPtr leave(UnaryOpExpr *unary, ExprPtr child);
+  ExprPtr leave(BinaryOpExpr *binary, ExprPtr lhs, ExprPtr rhs);
+  ExprPtr leave(VariableAssignExpr *assign, ExprPtr child);
+  ExprPtr leave(TempStoreExpr *, ExprPtr) { throw on_temporaries(); }
+  ExprPtr leave(TempLoadExpr *) { throw on_temporaries(); }
+
+  static std::runtime_error on_temporaries() {
+    return std::runtime_error("Dead code elimination ran on temporaries");
+  }
+
+  // Marks a read of 'slot'
+  void use(int slot) { live[slot] = true; }
+
+  // Marks a write of 'slot', which ends its liveness
+  void kill(int slot);
+};
+
+void DeadCodeElimination::kill(int slot) {
+  if (live[slot] && !regions.empty()) {
+    regions.back().push_back(slot);
+  }
+  live[slot] = false;
+}
+
+int DeadCodeElimination::run() {
+  for (auto &statement : function->body) {
+    for_each_expression(statement.get(), [&](ExprPtr &expr) {
+      for_each_node(expr.get(), [&](const ExprAST *node) {
+        if (auto *variable = node_cast<const VariableExpr>(node)) {
+          referenced[variable->slot] = true;
+        } else if (auto *assign = node_cast<const VariableAssignExpr>(node)) {
+          referenced[assign->slot] = true;
+        }
+      });
+    });
+  }
+
+  // Nothing is live at the end, where the function returns
+  sweep_statements(function->body);
+  return removed;
+}
+
+void DeadCodeElimination::sweep_statements(
+    std::vector<std::unique_ptr<StmtAST>> &body) {
+  // Nothing after a return runs
+  for (std::size_t i = 0; i < body.size(); ++i) {
+    if (body[i]->kind == StmtKind::RETURN) {
+      removed += static_cast<int>(body.size() - i - 1);
+      body.resize(i + 1);
+      break;
+    }
+  }
+
+  // Removed statements are left null and compacted afterwards
+  for (std::size_t i = body.size(); i-- > 0;) {
+    if (sweep_statement(body[i].get())) {
+      body[i] = nullptr;
+      ++removed;
+    }
+  }
+
+  std::size_t kept = 0;
+  for (auto &statement : body) {
+    if (statement != nullptr) {
+      body[kept++] = std::move(statement);
+    }
+  }
+  body.resize(kept);
+}
+
+bool DeadCodeElimination::sweep_statement(StmtAST *statement) {
+  switch (statement->kind) {
+  case StmtKind::RETURN: {
+    auto *ret = static_cast<ReturnStmt *>(statement);
+    live.assign(live.size(), false);
+    if (ret->expr != nullptr) {
+      sweep_expression(ret->expr);
+    }
+    return false;
+  }
+  case StmtKind::EXPR: {
+    auto *stmt = static_cast<ExprStmt *>(statement);
+    if (!has_side_effects(stmt->expr.get())) {
+      return true;
+    }
+
+    sweep_expression(stmt->expr);
+    return !has_side_effects(stmt->expr.get());
+  }
+  case StmtKind::VARIABLE_DECL: {
+    auto *decl = static_cast<VariableDeclStmt *>(statement);
+    bool dead = !live[decl->slot];
+    kill(decl->slot);
+
+    if (dead && !referenced[decl->slot] &&
+        (decl->decl_expr == nullptr ||
+         !has_side_effects(decl->decl_expr.get()))) {
+      return true;
+    }
+
+    if (decl->decl_expr == nullptr) {
+      return false;
+    }
+    if (dead && !has_side_effects(decl->decl_expr.get())) {
+      decl->decl_expr = nullptr;
+      ++removed;
+      return false;
+    }
+
+    sweep_expression(decl->decl_expr);
+    if (dead && !has_side_effects(decl->decl_expr.get())) {
+      decl->decl_expr = nullptr;
+      ++removed;
+    }
+    return false;
+  }
+  case StmtKind::BLOCK: {
+    auto *block = static_cast<BlockStmt *>(statement);
+    sweep_statements(block->body);
+    return block->body.empty();
+  }
+  case StmtKind::WHILE: {
+    // A loop whose condition is false from the start never runs its body
+    auto *loop = static_cast<WhileStmt *>(statement);
+    auto *cond = node_cast<const IntLiteralExpr>(loop->cond.get());
+    if (cond != nullptr && cond->value == 0) {
+      return true;
+    }
+    sweep_loop(loop);
+    return false;
+  }
+  }
+
+  return false;
+}
+
+void DeadCodeElimination::sweep_loop(WhileStmt *loop) {
+  // Rather than iterating to a fixed point, a slot read anywhere in the loop
+  // counts as live all through it, on top of what is live after it. That
+  // overestimates liveness, which only keeps more stores
+  std::vector<bool> outside = live;
+  for_each_expression(loop, [&](ExprPtr &expr) {
+    for_each_node(expr.get(), [&](const ExprAST *node) {
+      if (auto *variable = node_cast<const VariableExpr>(node)) {
+        outside[variable->slot] = true;
+      }
+    });
+  });
+
+  auto merge_outside = [&] {
+    for (std::size_t slot = 0; slot < live.size(); ++slot) {
+      if (outside[slot]) {
+        live[slot] = true;
+      }
+    }
+  };
+
+  // The body is followed by the test, and the test by the body or the code
+  // after the loop
+  live = outside;
+  sweep_statements(loop->body->body);
+  merge_outside();
+  sweep_expression(loop->cond);
+  merge_outside();
+}
+
+bool DeadCodeElimination::enter(ExprAST *expr, ExprPtr * /*slot*/,
+                                ExprPtr & /*result*/) {
+  switch (expr->kind) {
+  case ExprKind::BINARY_OP:
+    if (operator_info(static_cast<BinaryOpExpr *>(expr)->op).short_circuit) {
+      regions.emplace_back();
+    }
+    break;
+  case ExprKind::VARIABLE_ASSIGN: {
+    int slot = static_cast<VariableAssignExpr *>(expr)->slot;
+    dead_assignments.push_back(!live[slot]);
+    kill(slot);
+    break;
+  }
+  default:
+    break;
+  }
+  return false;
+}
+
+bool DeadCodeElimination::between(BinaryOpExpr *binary, ExprPtr & /*rhs*/) {
+  if (operator_info(binary->op).short_circuit) {
+    // The right side may not have run, so what it made dead is live again
+    // before it
+    std::vector<int> revived = std::move(regions.back());
+    regions.pop_back();
+    for (int slot : revived) {
+      live[slot] = true;
+    }
+  }
+  return false;
+}
+
+ExprPtr DeadCodeElimination::leave(VariableExpr *variable) {
+  use(variable->slot);
+  return nullptr;
+}
+
+ExprPtr DeadCodeElimination::leave(UnaryOpExpr *unary, ExprPtr child) {
+  return replace_children(unary, std::move(child), nullptr);
+}
+
+ExprPtr DeadCodeElimination::leave(BinaryOpExpr *binary, ExprPtr lhs,
+                                   ExprPtr rhs) {
+  return replace_children(binary, std::move(lhs), std::move(rhs));
+}
+
+ExprPtr DeadCodeElimination::leave(VariableAssignExpr *assign, ExprPtr child) {
+  bool dead = dead_assignments.back();
+  dead_assignments.pop_back();
+  if (!dead) {
+    return replace_children(assign, std::move(child), nullptr);
+  }
+
+  // The assigned value stays, as the enclosing expression may use it
+  ++removed;
+  return child != nullptr ? std::move(child) : take_only_child(assign);
+}
+
+} // namespace
+
+int eliminate_dead_code(FunctionDecl *function) {
+  return DeadCodeElimination(function).run();
+}
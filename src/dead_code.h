@@ -0,0 +1,31 @@
+#ifndef DEAD_CODE_H
+#define DEAD_CODE_H
+
+#include "ast.h"
+
+/*
+Dead code and dead store elimination.
+
+Statements after a return are never reached and are removed, as are
+expression statements without side effects, like '2 + 2;', whose value is
+never used, empty blocks and loops whose condition is the literal 0.
+
+Stores are found dead by liveness: walking the body backwards (and each
+expression against evaluation order), a variable is live where a later read
+may see its current value. The right side of && and || may not run, so it
+cannot end a variable's liveness. Neither can a loop: a variable read
+anywhere in it is taken to be live all through it. An assignment to a
+variable that is not live is replaced by its right-hand side, whose value
+the enclosing expression may still use, and a declaration of one loses an
+initializer without side effects. A declaration of a variable that is named
+nowhere else is removed outright.
+
+The function must be resolved (see resolver.h), so liveness is tracked per
+slot and a shadowed variable is told apart from the one it hides. Shared
+(hash-consed) nodes are copied rather than changed (see ast_factory.h).
+
+Returns the number of statements and stores removed.
+*/
+int eliminate_dead_code(FunctionDecl *function);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef DIAGNOSTIC_H
+#define DIAGNOSTIC_H
+
+#include <string>
+#include <utility>
+
+// An error found in the source, reported together with all the others once
+// the compiler has gone as far as it can
+struct Diagnostic {
+  int line;
+  int column;
+  std::string message;
+
+  Diagnostic(int line, int column, std::string message)
+      : line(line), column(column), message(std::move(message)) {};
+};
+
+#endif
@@ -0,0 +1,517 @@
+#include "incremental.h"
+#include "ast.h"
+#include "codegen.h"
+#include "constant_propagation.h"
+#include "cse.h"
+#include "lex.h"
+#include "parser.h"
+#include "resolver.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+namespace {
+
+std::size_t hash_combine(std::size_t seed, std::size_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+}
+
+// Hashes what a token means, not where it is, so moved code still matches
+std::size_t hash_token(const Token &token) {
+  std::size_t hash = std::hash<int>{}(static_cast<int>(token.token_type));
+
+  if (const int *value = std::get_if<int>(&token.literal)) {
+    hash = hash_combine(hash, std::hash<int>{}(*value));
+  } else if (const auto *name = std::get_if<std::string_view>(&token.literal)) {
+    hash = hash_combine(hash, std::hash<std::string_view>{}(*name));
+  }
+
+  return hash;
+}
+
+std::size_t hash_tokens(const std::vector<Token> &tokens, int start, int end) {
+  std::size_t hash = 0;
+  for (int i = start; i < end; ++i) {
+    hash = hash_combine(hash, hash_token(tokens[i]));
+  }
+
+  return hash;
+}
+
+int count_newlines(const std::string &source, int begin, int end) {
+  return static_cast<int>(
+      std::count(source.begin() + begin, source.begin() + end, '\n'));
+}
+
+// 1-based column of a byte offset, found by scanning back to its line start
+int column_at(const std::string &source, int offset) {
+  int line_start = offset;
+  while (line_start > 0 && source[line_start - 1] != '\n') {
+    --line_start;
+  }
+
+  return offset - line_start + 1;
+}
+
+// Whether two adjacent characters might lex as a single token, in which case
+// a re-lexed region cannot simply be spliced next to its neighbour
+bool could_merge(char before, char after) {
+  if (std::isalnum(static_cast<unsigned char>(before)) &&
+      std::isalnum(static_cast<unsigned char>(after))) {
+    return true;
+  }
+
+  std::string_view double_starts = "!<>&|=";
+  std::string_view double_ends = "=<>&|";
+  return double_starts.find(before) != std::string_view::npos &&
+         double_ends.find(after) != std::string_view::npos;
+}
+
+// Folds constants and shares subexpressions within each statement of the
+// body marked fresh. CSE tells variables apart by slot, so each is resolved
+// first, in the scope the statements before it leave. After an error the
+// rest are left alone: generate() runs into it again and reports it
+void optimize_statements(FunctionDecl *function,
+                         const std::vector<bool> &fresh) {
+  Resolver resolver;
+  resolver.begin_function(function);
+
+  try {
+    for (std::size_t i = 0; i < fresh.size(); ++i) {
+      StmtAST *statement = function->body[i].get();
+      if (!fresh[i]) {
+        resolver.declare_statement(statement);
+        continue;
+      }
+
+      resolver.resolve_statement(statement);
+      propagate_constants(statement);
+      eliminate_common_subexpressions(statement, function->slot_count);
+    }
+  } catch (const std::runtime_error &) {
+  }
+}
+
+} // namespace
+
+bool IncrementalCompiler::compile(std::string new_source) {
+  TraceSpan span("incremental compile", "phase");
+
+  stats = Stats();
+  diagnostics.clear();
+
+  try {
+    relex(std::move(new_source));
+  } catch (const LexError &e) {
+    // The kept tokens may no longer match the source, so lex it all again
+    // next time
+    has_tokens = false;
+    function.reset();
+    diagnostics.emplace_back(e.line, e.column, e.what());
+    return false;
+  }
+  stats.total_tokens = static_cast<int>(tokens.size());
+
+  int body_start = 0;
+  std::vector<StatementRange> ranges;
+  if (!split_body(body_start, ranges)) {
+    // Not a single well-formed function, let the parser explain why
+    parse_fully();
+    function.reset();
+    return false;
+  }
+
+  std::size_t new_header_hash = hash_tokens(tokens, 0, body_start);
+  stats.total_statements = static_cast<int>(ranges.size());
+
+  if (function == nullptr || new_header_hash != header_hash) {
+    stats.full_parse = true;
+    stats.reparsed_statements = stats.total_statements;
+
+    if (!parse_fully()) {
+      function.reset();
+      return false;
+    }
+  } else if (!reparse_body(ranges)) {
+    // A changed statement does not parse, report it like a full compile would
+    parse_fully();
+    function.reset();
+    return false;
+  }
+
+  header_hash = new_header_hash;
+  body_hashes.clear();
+  for (const StatementRange &range : ranges) {
+    body_hashes.push_back(range.hash);
+  }
+
+  if (function->body.size() != ranges.size()) {
+    diagnostics.emplace_back(1, 1, "Failed to match statements to the source");
+    function.reset();
+    return false;
+  }
+
+  if (!generate(ranges)) {
+    // Statements after the error were not optimized, so parse them all
+    // again next time
+    function.reset();
+    return false;
+  }
+  return true;
+}
+
+void IncrementalCompiler::relex(std::string new_source) {
+  if (!has_tokens) {
+    source = std::move(new_source);
+    tokens = lex(source);
+    has_tokens = true;
+    stats.relexed_tokens = static_cast<int>(tokens.size());
+    return;
+  }
+
+  // The damaged region is whatever lies between the common prefix and suffix
+  int old_size = static_cast<int>(source.size());
+  int new_size = static_cast<int>(new_source.size());
+  int shorter = std::min(old_size, new_size);
+
+  int prefix = 0;
+  while (prefix < shorter && source[prefix] == new_source[prefix]) {
+    ++prefix;
+  }
+
+  int suffix = 0;
+  while (suffix < shorter - prefix &&
+         source[old_size - 1 - suffix] == new_source[new_size - 1 - suffix]) {
+    ++suffix;
+  }
+
+  int old_damage_end = old_size - suffix;
+  int delta = new_size - old_size;
+
+  // Tokens touching the damage, including ones merely adjacent to it, are
+  // re-lexed. Everything before 'first' and from 'after' on is kept
+  auto first = std::lower_bound(
+      tokens.begin(), tokens.end(), prefix, [](const Token &token, int pos) {
+        return token.offset + token.length < pos;
+      });
+  auto after = std::upper_bound(
+      first, tokens.end(), old_damage_end,
+      [](int pos, const Token &token) { return pos < token.offset; });
+
+  int lex_begin = prefix;
+  if (first != tokens.end()) {
+    lex_begin = std::min(first->offset, prefix);
+  }
+
+  int old_lex_end = old_damage_end;
+  if (after != first) {
+    old_lex_end = std::max(old_lex_end, (after - 1)->offset + (after - 1)->length);
+  }
+  int new_lex_end = old_lex_end + delta;
+
+  // Line number at lex_begin, counted from the last kept token
+  int line = 1;
+  int line_from = 0;
+  if (first != tokens.begin()) {
+    line = (first - 1)->line;
+    line_from = (first - 1)->offset;
+  }
+  line += count_newlines(source, line_from, lex_begin);
+
+  int old_newlines = count_newlines(source, lex_begin, old_lex_end);
+  source = std::move(new_source);
+  int line_delta = count_newlines(source, lex_begin, new_lex_end) - old_newlines;
+
+  std::vector<Token> relexed = lex_range(source, lex_begin, new_lex_end, line);
+  stats.relexed_tokens = static_cast<int>(relexed.size());
+
+  // A re-lexed token running straight into a kept one might really be a
+  // single token, so start over rather than guess
+  if (after != tokens.end() && new_lex_end == after->offset + delta &&
+      new_lex_end > 0 &&
+      could_merge(source[new_lex_end - 1], source[new_lex_end])) {
+    tokens = lex(source);
+    stats.relexed_tokens = static_cast<int>(tokens.size());
+    return;
+  }
+
+  std::size_t first_index = first - tokens.begin();
+  std::size_t after_index = after - tokens.begin();
+  std::size_t kept_index = first_index + relexed.size();
+
+  tokens.erase(tokens.begin() + first_index, tokens.begin() + after_index);
+  tokens.insert(tokens.begin() + first_index, relexed.begin(), relexed.end());
+
+  // Shift the kept tail. Only tokens on the same line as the end of the edit
+  // can have moved columns
+  int edited_line = kept_index < tokens.size() ? tokens[kept_index].line : 0;
+  for (std::size_t i = kept_index; i < tokens.size(); ++i) {
+    Token &token = tokens[i];
+
+    token.offset += delta;
+    if (token.line == edited_line) {
+      token.column = column_at(source, token.offset);
+    }
+    token.line += line_delta;
+  }
+
+  // Identifier views still point into the old buffer
+  for (Token &token : tokens) {
+    if (std::holds_alternative<std::string_view>(token.literal)) {
+      token.literal =
+          std::string_view(source).substr(token.offset, token.length);
+    }
+  }
+}
+
+bool IncrementalCompiler::split_body(int &body_start,
+                                     std::vector<StatementRange> &ranges) {
+  int token_count = static_cast<int>(tokens.size());
+
+  int brace = 0;
+  while (brace < token_count &&
+         tokens[brace].token_type != TokenType::OPEN_BRACE) {
+    ++brace;
+  }
+
+  if (brace == token_count) {
+    return false;
+  }
+
+  body_start = brace + 1;
+
+  // A statement ends at a ';' or a closing '}' at the top level of the body,
+  // but not at the ';'s inside a for loop's parentheses
+  int depth = 0;
+  int parens = 0;
+  int start = body_start;
+  for (int i = body_start; i < token_count; ++i) {
+    switch (tokens[i].token_type) {
+    case TokenType::OPEN_PAREN:
+      ++parens;
+      break;
+    case TokenType::CLOSE_PAREN:
+      --parens;
+      break;
+    case TokenType::OPEN_BRACE:
+      ++depth;
+      break;
+    case TokenType::CLOSE_BRACE:
+      if (depth == 0) {
+        return start == i;
+      }
+
+      if (--depth == 0) {
+        ranges.push_back({start, i + 1, hash_tokens(tokens, start, i + 1)});
+        start = i + 1;
+      }
+      break;
+    case TokenType::SEMICOLON:
+      if (depth == 0 && parens <= 0) {
+        ranges.push_back({start, i + 1, hash_tokens(tokens, start, i + 1)});
+        start = i + 1;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  return false;
+}
+
+bool IncrementalCompiler::parse_fully() {
+  Parser parser(tokens);
+  function = parser.parse();
+  diagnostics = parser.get_diagnostics();
+
+  if (!diagnostics.empty()) {
+    return false;
+  }
+
+  optimize_statements(function.get(),
+                      std::vector<bool>(function->body.size(), true));
+  return true;
+}
+
+bool IncrementalCompiler::reparse_body(
+    const std::vector<StatementRange> &ranges) {
+  std::size_t old_count = function->body.size();
+  std::size_t new_count = ranges.size();
+
+  // Statements before and after the edit line up one to one, so only the
+  // ones in between need to be matched by hash
+  std::size_t head = 0;
+  std::size_t tail = 0;
+  match_ends(body_hashes, ranges, head, tail);
+
+  // Previous statements by hash. Several statements can share one
+  std::unordered_multimap<std::size_t, std::unique_ptr<StmtAST>> previous;
+  for (std::size_t i = head; i < old_count - tail; ++i) {
+    previous.emplace(body_hashes[i], std::move(function->body[i]));
+  }
+
+  std::vector<std::unique_ptr<StmtAST>> body;
+  body.reserve(new_count);
+
+  // Whether each statement of the new body was parsed now
+  std::vector<bool> fresh(new_count, false);
+
+  for (std::size_t i = 0; i < head; ++i) {
+    body.push_back(std::move(function->body[i]));
+  }
+
+  Parser parser(tokens);
+  for (std::size_t i = head; i < new_count - tail; ++i) {
+    const StatementRange &range = ranges[i];
+
+    auto reused = previous.find(range.hash);
+    if (reused != previous.end()) {
+      body.push_back(std::move(reused->second));
+      previous.erase(reused);
+      continue;
+    }
+
+    int end = 0;
+    try {
+      body.push_back(parser.parse_statement_at(range.start, end));
+    } catch (const std::runtime_error &e) {
+      return false;
+    }
+
+    if (end != range.end) {
+      return false;
+    }
+
+    fresh[i] = true;
+    ++stats.reparsed_statements;
+  }
+
+  for (std::size_t i = old_count - tail; i < old_count; ++i) {
+    body.push_back(std::move(function->body[i]));
+  }
+
+  function->body = std::move(body);
+  optimize_statements(function.get(), fresh);
+  return true;
+}
+
+void IncrementalCompiler::match_ends(const std::vector<std::size_t> &old_hashes,
+                                     const std::vector<StatementRange> &ranges,
+                                     std::size_t &head, std::size_t &tail) {
+  std::size_t old_count = old_hashes.size();
+  std::size_t new_count = ranges.size();
+
+  head = 0;
+  while (head < old_count && head < new_count &&
+         old_hashes[head] == ranges[head].hash) {
+    ++head;
+  }
+
+  tail = 0;
+  while (tail < old_count - head && tail < new_count - head &&
+         old_hashes[old_count - 1 - tail] == ranges[new_count - 1 - tail].hash) {
+    ++tail;
+  }
+}
+
+bool IncrementalCompiler::generate(const std::vector<StatementRange> &ranges) {
+  std::size_t old_count = generated.size();
+  std::size_t new_count = ranges.size();
+
+  std::size_t head = 0;
+  std::size_t tail = 0;
+  match_ends(generated_hashes, ranges, head, tail);
+
+  // Code from the middle of the previous compile, looked up by key. Code
+  // before and after the edit is checked positionally instead
+  std::unordered_multimap<std::size_t, std::size_t> middle;
+  for (std::size_t j = head; j < old_count - tail; ++j) {
+    middle.emplace(generated[j].key, j);
+  }
+
+  std::vector<GeneratedStatement> next_generated;
+  std::vector<std::size_t> next_hashes;
+  next_generated.reserve(new_count);
+  next_hashes.reserve(new_count);
+
+  // Statements are resolved as they are regenerated, in the scope of the
+  // ones before them. Reused code was generated with the same frame
+  // signature, so the names it uses are still declared the same way
+  Resolver resolver;
+  resolver.begin_function(function.get());
+
+  std::ostringstream out;
+  codegen.begin_function(function.get(), out);
+
+  for (std::size_t i = 0; i < new_count; ++i) {
+    StmtAST *statement = function->body[i].get();
+    std::size_t key = hash_combine(ranges[i].hash, codegen.frame_signature());
+
+    // Each piece of previous code is used at most once, so labels inside it
+    // are never emitted twice
+    std::size_t reuse = old_count;
+    if (i < head) {
+      reuse = i;
+    } else if (i >= new_count - tail) {
+      reuse = i - new_count + old_count;
+    } else {
+      auto match = middle.find(key);
+      if (match != middle.end()) {
+        reuse = match->second;
+        middle.erase(match);
+      }
+    }
+
+    try {
+      if (reuse < old_count && generated[reuse].key == key) {
+        out << generated[reuse].code;
+
+        resolver.declare_statement(statement);
+        for_each_statement(statement, [&](StmtAST *nested) {
+          if (auto *decl = node_cast<VariableDeclStmt>(nested)) {
+            codegen.declare_variable(decl);
+          }
+        });
+
+        next_generated.push_back(std::move(generated[reuse]));
+      } else {
+        std::ostringstream statement_code;
+        resolver.resolve_statement(statement);
+        codegen.generate_statement(statement, statement_code);
+        ++stats.regenerated_statements;
+
+        next_generated.push_back({key, statement_code.str()});
+        out << next_generated.back().code;
+      }
+    } catch (const std::runtime_error &e) {
+      const Token &at = tokens[ranges[i].start];
+      diagnostics.emplace_back(at.line, at.column, e.what());
+
+      // Some previous code was already moved out, so start over next time
+      generated.clear();
+      generated_hashes.clear();
+      return false;
+    }
+
+    next_hashes.push_back(ranges[i].hash);
+  }
+  codegen.end_function(function.get(), out);
+
+  generated = std::move(next_generated);
+  generated_hashes = std::move(next_hashes);
+  assembly = out.str();
+
+  return true;
+}
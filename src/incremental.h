@@ -0,0 +1,123 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "ast.h"
+#include "codegen.h"
+#include "diagnostic.h"
+#include "lex.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+Recompiles the same file after small edits without redoing the whole
+pipeline. Each call to compile() diffs the new source against the previous
+buffer and only:
+
+- re-lexes the tokens overlapping the changed bytes, splicing them into the
+  previous token stream
+- re-parses statements of FunctionDecl::body whose token-range hash is new,
+  moving unchanged statement subtrees over from the previous tree
+- resolves (see resolver.h) and regenerates assembly for statements whose
+  hash or frame layout changed, reusing the cached code of every other
+  statement
+
+A changed function header, or any syntax error, falls back to a full parse so
+diagnostics are exactly those of a normal compile.
+
+Constants are only folded and common subexpressions only shared within each
+statement (see constant_propagation.h and cse.h), so the code of a statement
+never depends on the statements around it. CSE tells variables apart by
+resolver slot, so a re-parsed statement is resolved before it is optimized,
+and once more when its code is generated, as slots move when declarations
+before it change. A compile that fails to resolve or generate code keeps no
+tree, as statements after the error were left unoptimized, and the next one
+parses the whole body again. A block or loop is a single
+statement of the body, along with everything nested in it, and loops are not
+optimized (see loop_optimization.h), as that moves code out of them.
+*/
+class IncrementalCompiler {
+public:
+  // What the last compile() had to redo, for tooling and benchmarks
+  struct Stats {
+    bool full_parse = false;
+    int relexed_tokens = 0;
+    int total_tokens = 0;
+    int reparsed_statements = 0;
+    int regenerated_statements = 0;
+    int total_statements = 0;
+  };
+
+  // Compiles the new contents of the file. Returns false if there were
+  // errors, which are then left in get_diagnostics()
+  bool compile(std::string new_source);
+
+  const std::string &get_assembly() const { return assembly; }
+  const std::vector<Diagnostic> &get_diagnostics() const { return diagnostics; }
+  const Stats &get_stats() const { return stats; }
+
+private:
+  // Token range and content hash of one statement of the function body
+  struct StatementRange {
+    int start;
+    int end;
+    std::size_t hash;
+  };
+
+  std::string source;
+  std::vector<Token> tokens;
+  bool has_tokens = false;
+
+  std::unique_ptr<FunctionDecl> function;
+  std::size_t header_hash = 0;
+
+  // Token-range hash of each statement in function->body
+  std::vector<std::size_t> body_hashes;
+
+  // Kept across compiles so generated labels never collide with cached code
+  AstAssembly codegen;
+
+  // Code generated for one statement. The key combines the statement hash
+  // with the frame layout it was generated in
+  struct GeneratedStatement {
+    std::size_t key;
+    std::string code;
+  };
+
+  // Code for each statement of the last successful compile, and the
+  // statements' token-range hashes
+  std::vector<GeneratedStatement> generated;
+  std::vector<std::size_t> generated_hashes;
+
+  std::string assembly;
+  std::vector<Diagnostic> diagnostics;
+  Stats stats;
+
+  // Brings 'tokens' up to date with the new source, re-lexing only the
+  // damaged region when there is a previous token stream
+  void relex(std::string new_source);
+
+  // Splits the body into statement ranges. Returns false if the token stream
+  // is not a single well-formed function, leaving the parser to report it
+  bool split_body(int &body_start, std::vector<StatementRange> &ranges);
+
+  // Parses the whole stream from scratch, recording any diagnostics
+  bool parse_fully();
+
+  // Rebuilds the body, reusing the previous statements with matching hashes
+  bool reparse_body(const std::vector<StatementRange> &ranges);
+
+  // Regenerates the assembly, reusing cached code where possible
+  bool generate(const std::vector<StatementRange> &ranges);
+
+  // Counts how many statements at the start and end of the body are
+  // unchanged, comparing previous statement hashes with the new ranges
+  static void match_ends(const std::vector<std::size_t> &old_hashes,
+                         const std::vector<StatementRange> &ranges,
+                         std::size_t &head, std::size_t &tail);
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "interpreter.h"
+#include "bytecode.h"
+#include "operators.h"
+
+#include <csignal>
+#include <cstdint>
+#include <vector>
+
+#include <sys/time.h>
+
+// Dispatch jumps straight from one handler to the next through labels as
+// values where the compiler supports them, and falls back to a switch loop
+#if defined(__GNUC__)
+#define INTERPRETER_COMPUTED_GOTO 1
+#else
+#define INTERPRETER_COMPUTED_GOTO 0
+#endif
+
+namespace {
+
+// An instruction with its handler resolved ahead of time (direct threading)
+struct ThreadedInstruction {
+  const void *handler;
+  Opcode op;
+  std::int32_t a;
+  std::int32_t b;
+  std::int32_t c;
+};
+
+// The instruction a profiled run is executing, or -1 outside of one, and
+// the sample counts the SIGPROF handler adds to
+volatile std::sig_atomic_t profiled_instruction = -1;
+std::uint64_t *profile_samples = nullptr;
+
+void take_sample(int) {
+  if (profile_samples != nullptr && profiled_instruction >= 0) {
+    ++profile_samples[profiled_instruction];
+  }
+}
+
+// A profiled run stores the index of each instruction before running it,
+// which the plain one compiles away
+template <bool PROFILED> std::int32_t run(const BytecodeFunction &function) {
+#if INTERPRETER_COMPUTED_GOTO
+  // Indexed by Opcode, so this has to follow the enum's order
+  static const void *const handlers[] = {
+      &&do_LOAD_CONST,   &&do_MOVE,
+      &&do_NEGATE,       &&do_BITWISE,
+      &&do_LOGIC_NEGATE, &&do_BOOL,
+      &&do_ADD,          &&do_SUBTRACT,
+      &&do_MULT,         &&do_DIVIDE,
+      &&do_MODULO,       &&do_BITWISE_AND,
+      &&do_BITWISE_OR,   &&do_BITWISE_XOR,
+      &&do_SHIFT_LEFT,   &&do_SHIFT_RIGHT,
+      &&do_EQUAL,        &&do_NOT_EQUAL,
+      &&do_LESS_THAN,    &&do_LESS_THAN_EQUAL,
+      &&do_GREATER_THAN, &&do_GREATER_THAN_EQUAL,
+      &&do_JUMP,         &&do_JUMP_IF_ZERO,
+      &&do_JUMP_IF_NOT_ZERO, &&do_RETURN};
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == OPCODE_COUNT,
+                "Every opcode needs a handler");
+#endif
+
+  std::vector<ThreadedInstruction> code;
+  code.reserve(function.code.size());
+  for (const Instruction &instruction : function.code) {
+    const void *handler = nullptr;
+#if INTERPRETER_COMPUTED_GOTO
+    handler = handlers[static_cast<int>(instruction.op)];
+#endif
+    code.push_back({handler, instruction.op, instruction.a, instruction.b,
+                    instruction.c});
+  }
+
+  std::vector<std::int32_t> registers(function.register_count);
+  std::int32_t *r = registers.data();
+  const ThreadedInstruction *ip = code.data();
+
+#define PUBLISH()                                                              \
+  if constexpr (PROFILED) {                                                    \
+    profiled_instruction = static_cast<std::sig_atomic_t>(ip - code.data());   \
+  }
+
+#if INTERPRETER_COMPUTED_GOTO
+#define CASE(name) do_##name:
+#define DISPATCH()                                                             \
+  PUBLISH();                                                                   \
+  goto *ip->handler
+#else
+#define CASE(name) case Opcode::name:
+#define DISPATCH() continue
+#endif
+#define NEXT()                                                                 \
+  ++ip;                                                                        \
+  DISPATCH()
+
+#define UNARY(name, expression)                                                \
+  CASE(name) {                                                                 \
+    std::int32_t x = r[ip->b];                                                 \
+    r[ip->a] = (expression);                                                   \
+    NEXT();                                                                    \
+  }
+
+#define BINARY(name, expression)                                               \
+  CASE(name) {                                                                 \
+    std::int32_t x = r[ip->b];                                                 \
+    std::int32_t y = r[ip->c];                                                 \
+    r[ip->a] = (expression);                                                   \
+    NEXT();                                                                    \
+  }
+
+#if INTERPRETER_COMPUTED_GOTO
+  DISPATCH();
+#else
+  for (;;) {
+    PUBLISH();
+    switch (ip->op) {
+#endif
+
+  CASE(LOAD_CONST) {
+    r[ip->a] = ip->b;
+    NEXT();
+  }
+  CASE(MOVE) {
+    r[ip->a] = r[ip->b];
+    NEXT();
+  }
+
+  UNARY(NEGATE, wrap(0u - static_cast<std::uint32_t>(x)))
+  UNARY(BITWISE, ~x)
+  UNARY(LOGIC_NEGATE, x == 0)
+  UNARY(BOOL, x != 0)
+
+  BINARY(ADD, wrap(static_cast<std::uint32_t>(x) + static_cast<std::uint32_t>(y)))
+  BINARY(SUBTRACT, wrap(static_cast<std::uint32_t>(x) - static_cast<std::uint32_t>(y)))
+  BINARY(MULT, wrap(static_cast<std::uint32_t>(x) * static_cast<std::uint32_t>(y)))
+  BINARY(DIVIDE, divide(x, y))
+  BINARY(MODULO, modulo(x, y))
+  BINARY(BITWISE_AND, x & y)
+  BINARY(BITWISE_OR, x | y)
+  BINARY(BITWISE_XOR, x ^ y)
+  // Like lsl and asr on w registers, shift amounts are taken modulo 32
+  BINARY(SHIFT_LEFT, wrap(static_cast<std::uint32_t>(x) << (y & 31)))
+  BINARY(SHIFT_RIGHT, x >> (y & 31))
+  BINARY(EQUAL, x == y)
+  BINARY(NOT_EQUAL, x != y)
+  BINARY(LESS_THAN, x < y)
+  BINARY(LESS_THAN_EQUAL, x <= y)
+  BINARY(GREATER_THAN, x > y)
+  BINARY(GREATER_THAN_EQUAL, x >= y)
+
+  CASE(JUMP) {
+    ip = code.data() + ip->a;
+    DISPATCH();
+  }
+  CASE(JUMP_IF_ZERO) {
+    if (r[ip->b] == 0) {
+      ip = code.data() + ip->a;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  CASE(JUMP_IF_NOT_ZERO) {
+    if (r[ip->b] != 0) {
+      ip = code.data() + ip->a;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  CASE(RETURN) { return r[ip->b]; }
+
+#if !INTERPRETER_COMPUTED_GOTO
+    }
+  }
+#endif
+
+#undef BINARY
+#undef UNARY
+#undef NEXT
+#undef DISPATCH
+#undef CASE
+#undef PUBLISH
+}
+
+} // namespace
+
+std::int32_t interpret(const BytecodeFunction &function) {
+  return run<false>(function);
+}
+
+std::int32_t interpret_profiled(const BytecodeFunction &function,
+                                int interval_us,
+                                std::vector<std::uint64_t> &samples) {
+  samples.assign(function.code.size(), 0);
+  profile_samples = samples.data();
+
+  struct sigaction action = {};
+  action.sa_handler = take_sample;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  struct sigaction previous;
+  sigaction(SIGPROF, &action, &previous);
+
+  itimerval timer = {};
+  timer.it_interval.tv_sec = interval_us / 1000000;
+  timer.it_interval.tv_usec = interval_us % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+
+  std::int32_t result = run<true>(function);
+
+  // A signal already due arrives as setitimer returns, while the handler
+  // is still ours
+  itimerval stopped = {};
+  setitimer(ITIMER_PROF, &stopped, nullptr);
+  sigaction(SIGPROF, &previous, nullptr);
+
+  profiled_instruction = -1;
+  profile_samples = nullptr;
+  return result;
+}
@@ -0,0 +1,22 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include "bytecode.h"
+
+#include <cstdint>
+#include <vector>
+
+// Runs a compiled function in-process and returns its result. Arithmetic
+// matches the generated AArch64 code, including division by zero giving 0,
+// so the result equals the exit code of the native program
+std::int32_t interpret(const BytecodeFunction &function);
+
+// Runs the function like interpret while a SIGPROF timer samples it every
+// 'interval_us' microseconds of CPU time. samples[i] is set to how often
+// the timer found instruction i running (see BytecodeFunction::positions
+// for where it came from). Replaces any SIGPROF handler for the duration
+std::int32_t interpret_profiled(const BytecodeFunction &function,
+                                int interval_us,
+                                std::vector<std::uint64_t> &samples);
+
+#endif
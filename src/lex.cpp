@@ -1,9 +1,19 @@
 #include "lex.h"
+#include "allocation.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
 #include <fstream>
-#include <iostream>
+#include <future>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
 #include <vector>
 
 bool is_numeric(char token) {
@@ -14,21 +24,21 @@ bool is_numeric(char token) {
   return false;
 }
 
-int lex_int(int *file_index, std::ifstream &file) {
-  int cur_index = *file_index + 1;
+// Lexes the digits at 'file_index' into 'num', returning false if they do
+// not fit in an int
+bool lex_int(int *file_index, std::string_view source, int &num) {
   int init_file_index = *file_index;
-  while (is_numeric(file.peek())) {
-    cur_index++;
+  while (*file_index + 1 < static_cast<int>(source.size()) &&
+         is_numeric(source[*file_index + 1])) {
     (*file_index)++;
-    file.get();
   }
 
-  file.seekg(init_file_index);
-  std::string num;
-  num.resize(cur_index - init_file_index);
-  file.read(&num[0], cur_index - init_file_index);
+  // from_chars parses straight out of the buffer without building a string
+  const char *end = source.data() + *file_index + 1;
+  auto [ptr, ec] =
+      std::from_chars(source.data() + init_file_index, end, num);
 
-  return std::stoi(num);
+  return ec == std::errc() && ptr == end;
 }
 
 bool is_alphabetic(char token) {
@@ -39,47 +49,152 @@ bool is_alphabetic(char token) {
   return false;
 }
 
-std::string lex_word(int *file_index, std::ifstream &file) {
-  int cur_index = *file_index + 1;
+std::string_view lex_word(int *file_index, std::string_view source) {
   int init_file_index = *file_index;
-  while (is_alphabetic(file.peek())) {
-    cur_index++;
+  while (*file_index + 1 < static_cast<int>(source.size()) &&
+         is_alphabetic(source[*file_index + 1])) {
     (*file_index)++;
-    file.get();
   }
 
-  file.seekg(init_file_index);
-  std::string word;
-  word.resize(cur_index - init_file_index);
-  file.read(&word[0], cur_index - init_file_index);
-
-  return word;
+  return source.substr(init_file_index, *file_index - init_file_index + 1);
 }
 
-bool lex_double(char check_char, int *file_index, std::ifstream &file) {
-  if (file.peek() == check_char) {
+bool lex_double(char check_char, int *file_index, std::string_view source) {
+  if (*file_index + 1 < static_cast<int>(source.size()) &&
+      source[*file_index + 1] == check_char) {
     (*file_index)++;
-    file.get();
     return true;
   }
 
   return false;
 }
 
-std::vector<Token> lex(const std::string &file_path) {
-  std::ifstream c_file(file_path);
-  std::vector<Token> file_tokens;
-  int file_index = 0;
+std::string read_source(const std::string &file_path) {
+  AllocationScope allocation_scope(Subsystem::LEXER);
+  std::ifstream c_file(file_path, std::ios::binary);
 
   if (c_file.bad() || c_file.fail()) {
     throw std::runtime_error("Failed to open source file");
   }
 
-  while (c_file) {
-    char cur_char = c_file.get();
+  std::ostringstream contents;
+  contents << c_file.rdbuf();
+
+  return contents.str();
+}
+
+std::vector<Token> lex(std::string_view source) {
+  return lex_range(source, 0, static_cast<int>(source.size()), 1);
+}
+
+namespace {
+
+// Whether no token can span 'index - 1' and 'index'. Whitespace belongs to
+// no token, and ';' is never the start of a two character one
+bool is_chunk_boundary(std::string_view source, std::size_t index) {
+  char before = source[index - 1];
+  return before == ' ' || before == '\n' || before == '\t' ||
+         before == '\r' || before == ';';
+}
+
+} // namespace
 
-    if (cur_char == EOF) { // End of file, return collected tokens
+std::vector<Token> lex_parallel(std::string_view source, unsigned threads,
+                                std::size_t min_chunk_size) {
+  TraceSpan span("lex_parallel", "phase");
+  AllocationScope allocation_scope(Subsystem::LEXER);
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = static_cast<unsigned>(
+      std::min<std::size_t>(threads, source.size() / min_chunk_size));
+  if (threads <= 1) {
+    return lex(source);
+  }
+
+  // Chunk i is source[bounds[i], bounds[i + 1]). Each split moves forward
+  // from its even share to the next boundary, and a chunk without one
+  // merges into the next
+  std::vector<std::size_t> bounds{0};
+  for (unsigned i = 1; i < threads; ++i) {
+    std::size_t split =
+        std::max(bounds.back() + 1, source.size() / threads * i);
+    while (split < source.size() && !is_chunk_boundary(source, split)) {
+      ++split;
+    }
+    if (split >= source.size()) {
       break;
+    }
+    bounds.push_back(split);
+  }
+  bounds.push_back(source.size());
+  std::size_t chunks = bounds.size() - 1;
+
+  // A chunk's tokens start on the line after every newline before it
+  std::vector<std::future<int>> newline_counts;
+  for (std::size_t i = 0; i + 1 < chunks; ++i) {
+    newline_counts.push_back(std::async(std::launch::async, [&, i] {
+      TraceSpan count_span("count newlines", "phase");
+      return static_cast<int>(std::count(source.begin() + bounds[i],
+                                         source.begin() + bounds[i + 1], '\n'));
+    }));
+  }
+  std::vector<int> first_lines{1};
+  for (std::future<int> &count : newline_counts) {
+    first_lines.push_back(first_lines.back() + count.get());
+  }
+
+  std::vector<std::future<std::vector<Token>>> lexed;
+  for (std::size_t i = 0; i < chunks; ++i) {
+    lexed.push_back(std::async(std::launch::async, [&, i] {
+      return lex_range(source, static_cast<int>(bounds[i]),
+                       static_cast<int>(bounds[i + 1]), first_lines[i]);
+    }));
+  }
+
+  std::vector<std::vector<Token>> parts;
+  std::size_t total = 0;
+  for (std::future<std::vector<Token>> &part : lexed) {
+    parts.push_back(part.get());
+    total += parts.back().size();
+  }
+
+  std::vector<Token> tokens;
+  tokens.reserve(total);
+  for (std::vector<Token> &part : parts) {
+    tokens.insert(tokens.end(), std::make_move_iterator(part.begin()),
+                  std::make_move_iterator(part.end()));
+  }
+  return tokens;
+}
+
+std::vector<Token> lex_range(std::string_view source, int begin, int end,
+                             int line) {
+  TraceSpan span("lex", "phase");
+  AllocationScope allocation_scope(Subsystem::LEXER);
+
+  std::vector<Token> file_tokens;
+  int file_index = begin;
+
+  // The helpers treat the end of the view as the end of input
+  source = source.substr(0, end);
+
+  // Start of the current line, kept with 'line' for diagnostics
+  int line_start = begin;
+  while (line_start > 0 && source[line_start - 1] != '\n') {
+    --line_start;
+  }
+
+  while (file_index < static_cast<int>(source.size())) {
+    char cur_char = source[file_index];
+    int token_start = file_index;
+    int token_column = file_index - line_start + 1;
+    std::size_t token_count = file_tokens.size();
+
+    if (cur_char == '\n') {
+      ++line;
+      line_start = file_index + 1;
     } else if (!is_alphabetic(cur_char) &&
                !is_numeric(cur_char)) { // Single and double character tokens
       switch (cur_char) {
@@ -117,7 +232,7 @@ std::vector<Token> lex(const std::string &file_path) {
         file_tokens.push_back(Token(TokenType::BITWISE, std::monostate()));
         break;
       case '!':
-        if (lex_double('=', &file_index, c_file)) {
+        if (lex_double('=', &file_index, source)) {
           file_tokens.push_back(Token(TokenType::NOT_EQUAL, std::monostate()));
           break;
         }
@@ -125,11 +240,11 @@ std::vector<Token> lex(const std::string &file_path) {
         file_tokens.push_back(Token(TokenType::LOGIC_NEGATE, std::monostate()));
         break;
       case '<':
-        if (lex_double('=', &file_index, c_file)) {
+        if (lex_double('=', &file_index, source)) {
           file_tokens.push_back(
               Token(TokenType::LESS_THAN_EQUAL, std::monostate()));
           break;
-        } else if (lex_double('<', &file_index, c_file)) {
+        } else if (lex_double('<', &file_index, source)) {
           file_tokens.push_back(
               Token(TokenType::BITWISE_LEFT_SHIFT, std::monostate()));
           break;
@@ -138,11 +253,11 @@ std::vector<Token> lex(const std::string &file_path) {
         file_tokens.push_back(Token(TokenType::LESS_THAN, std::monostate()));
         break;
       case '>':
-        if (lex_double('=', &file_index, c_file)) {
+        if (lex_double('=', &file_index, source)) {
           file_tokens.push_back(
               Token(TokenType::GREATER_THAN_EQUAL, std::monostate()));
           break;
-        } else if (lex_double('>', &file_index, c_file)) {
+        } else if (lex_double('>', &file_index, source)) {
           file_tokens.push_back(
               Token(TokenType::BITWISE_RIGHT_SHIFT, std::monostate()));
           break;
@@ -151,7 +266,7 @@ std::vector<Token> lex(const std::string &file_path) {
         file_tokens.push_back(Token(TokenType::GREATER_THAN, std::monostate()));
         break;
       case '&':
-        if (lex_double('&', &file_index, c_file)) {
+        if (lex_double('&', &file_index, source)) {
           file_tokens.push_back(Token(TokenType::AND, std::monostate()));
           break;
         }
@@ -159,7 +274,7 @@ std::vector<Token> lex(const std::string &file_path) {
         file_tokens.push_back(Token(TokenType::BITWISE_AND, std::monostate()));
         break;
       case '|':
-        if (lex_double('|', &file_index, c_file)) {
+        if (lex_double('|', &file_index, source)) {
           file_tokens.push_back(Token(TokenType::OR, std::monostate()));
           break;
         }
@@ -167,7 +282,7 @@ std::vector<Token> lex(const std::string &file_path) {
         file_tokens.push_back(Token(TokenType::BITWISE_OR, std::monostate()));
         break;
       case '=':
-        if (lex_double('=', &file_index, c_file)) {
+        if (lex_double('=', &file_index, source)) {
           file_tokens.push_back(Token(TokenType::EQUAL, std::monostate()));
           break;
         }
@@ -182,10 +297,17 @@ std::vector<Token> lex(const std::string &file_path) {
         break;
       }
     } else if (is_numeric(cur_char)) { // Integer literals
-      int int_literal = lex_int(&file_index, c_file);
+      int int_literal;
+      if (!lex_int(&file_index, source, int_literal)) {
+        throw LexError(line, token_column,
+                       "Lexer Error: Integer literal '" +
+                           std::string(source.substr(
+                               token_start, file_index - token_start + 1)) +
+                           "' is out of range");
+      }
       file_tokens.push_back(Token(TokenType::INT, int_literal));
     } else if (is_alphabetic(cur_char) || is_alphabetic(cur_char)) {
-      std::string word = lex_word(&file_index, c_file);
+      std::string_view word = lex_word(&file_index, source);
 
       if (word == "return") {
         file_tokens.push_back(Token(TokenType::RETURN, std::monostate()));
@@ -193,11 +315,23 @@ std::vector<Token> lex(const std::string &file_path) {
         file_tokens.push_back(Token(TokenType::INT_TYPE, std::monostate()));
       } else if (word == "void") {
         file_tokens.push_back(Token(TokenType::VOID_TYPE, std::monostate()));
+      } else if (word == "while") {
+        file_tokens.push_back(Token(TokenType::WHILE, std::monostate()));
+      } else if (word == "for") {
+        file_tokens.push_back(Token(TokenType::FOR, std::monostate()));
       } else {
         file_tokens.push_back(Token(TokenType::IDENTIFIER, word));
       }
     }
 
+    // Every token starts on the line it was found on
+    if (file_tokens.size() > token_count) {
+      file_tokens.back().line = line;
+      file_tokens.back().column = token_column;
+      file_tokens.back().offset = token_start;
+      file_tokens.back().length = file_index - token_start + 1;
+    }
+
     ++file_index;
   }
 
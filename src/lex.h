@@ -1,11 +1,16 @@
 #ifndef LEX_H
 #define LEX_H
 
+#include <cstddef>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
-using TokenValue = std::variant<std::monostate, int, std::string>;
+// Identifier payloads are views into the source buffer returned by
+// read_source, so that buffer must outlive every token lexed from it
+using TokenValue = std::variant<std::monostate, int, std::string_view>;
 
 enum class TokenType {
   // Single character tokens
@@ -46,17 +51,65 @@ enum class TokenType {
   // Keywords
   RETURN,
   INT_TYPE,
-  VOID_TYPE
+  VOID_TYPE,
+  WHILE,
+  FOR
 };
 
+// Number of TokenType values, for tables indexed by token type
+constexpr int TOKEN_TYPE_COUNT = static_cast<int>(TokenType::FOR) + 1;
+
 struct Token {
   TokenType token_type;
   TokenValue literal;
 
+  // 1-based source position of the token's first character
+  int line = 0;
+  int column = 0;
+
+  // Byte range of the token in the source buffer
+  int offset = 0;
+  int length = 0;
+
   Token(TokenType token_type, TokenValue literal)
       : token_type(token_type), literal(literal) {};
 };
 
-std::vector<Token> lex(const std::string &file_path);
+// A source the lexer cannot turn into tokens, such as an integer literal
+// too large for an int. 'line' and 'column' are where the offending token
+// starts
+struct LexError : std::runtime_error {
+  int line;
+  int column;
+
+  LexError(int line, int column, const std::string &message)
+      : std::runtime_error(message), line(line), column(column) {};
+};
+
+// Reads the whole source file into memory so tokens can reference it
+std::string read_source(const std::string &file_path);
+
+// Throws LexError for a source that does not lex
+std::vector<Token> lex(std::string_view source);
+
+// Smallest chunk lex_parallel gives a thread, below which starting it costs
+// more than lexing the chunk serially
+constexpr std::size_t LEX_MIN_CHUNK_SIZE = 1 << 20;
+
+// Same tokens as lex, lexing chunks of a large source on up to 'threads'
+// threads (by default one per core). Chunks are split after whitespace or a
+// ';', which no token spans, and each chunk's line numbers start from the
+// newlines counted before it, so the result is identical to lex's. Sources
+// too small to be worth splitting are lexed serially. Tests pass a smaller
+// 'min_chunk_size' to split small sources many ways
+std::vector<Token>
+lex_parallel(std::string_view source, unsigned threads = 0,
+             std::size_t min_chunk_size = LEX_MIN_CHUNK_SIZE);
+
+// Lexes only source[begin, end), which must start and end on token
+// boundaries. 'line' is the line number at 'begin'. Tokens keep offsets into
+// the whole buffer, so the result can be spliced into a full token stream
+std::vector<Token> lex_range(std::string_view source, int begin, int end,
+                             int line);
 
 #endif
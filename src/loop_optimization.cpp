@@ -0,0 +1,505 @@
+#include "loop_optimization.h"
+#include "ast.h"
+#include "ast_factory.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+int wrap_multiply(int a, int b) {
+  return static_cast<int>(static_cast<std::uint32_t>(a) *
+                          static_cast<std::uint32_t>(b));
+}
+
+ExprPtr make_variable(const std::string &name, int slot) {
+  auto variable = std::make_unique<VariableExpr>(name);
+  variable->slot = slot;
+  return variable;
+}
+
+// Matches 'i = i + c', 'i = c + i' and 'i = i - c', giving the slot of 'i'
+// and what it is stepped by
+bool match_increment(const ExprAST *expr, int &slot, int &step) {
+  auto *assign = node_cast<const VariableAssignExpr>(expr);
+  if (assign == nullptr) {
+    return false;
+  }
+  auto *binary = node_cast<const BinaryOpExpr>(assign->assign_expr.get());
+  if (binary == nullptr) {
+    return false;
+  }
+
+  auto *lhs_variable = node_cast<const VariableExpr>(binary->expr_one.get());
+  auto *rhs_variable = node_cast<const VariableExpr>(binary->expr_two.get());
+  auto *lhs_literal = node_cast<const IntLiteralExpr>(binary->expr_one.get());
+  auto *rhs_literal = node_cast<const IntLiteralExpr>(binary->expr_two.get());
+
+  slot = assign->slot;
+  if (lhs_variable != nullptr && lhs_variable->slot == slot &&
+      rhs_literal != nullptr) {
+    if (binary->op == OperationType::ADD) {
+      step = rhs_literal->value;
+      return true;
+    }
+    if (binary->op == OperationType::NEGATE) {
+      step = wrap_multiply(rhs_literal->value, -1);
+      return true;
+    }
+  }
+  if (binary->op == OperationType::ADD && rhs_variable != nullptr &&
+      rhs_variable->slot == slot && lhs_literal != nullptr) {
+    step = lhs_literal->value;
+    return true;
+  }
+
+  return false;
+}
+
+// Matches 'i * k' and 'k * i' for a literal k, giving k
+bool match_product(const ExprAST *expr, int slot, int &factor) {
+  auto *binary = node_cast<const BinaryOpExpr>(expr);
+  if (binary == nullptr || binary->op != OperationType::MULT) {
+    return false;
+  }
+
+  const ExprAST *operands[] = {binary->expr_one.get(), binary->expr_two.get()};
+  for (int i = 0; i < 2; ++i) {
+    auto *variable = node_cast<const VariableExpr>(operands[i]);
+    auto *literal = node_cast<const IntLiteralExpr>(operands[1 - i]);
+    if (variable != nullptr && variable->slot == slot && literal != nullptr) {
+      factor = literal->value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether two side-effect free trees compute the same value
+bool same_value(const ExprAST *a, const ExprAST *b) {
+  std::vector<std::pair<const ExprAST *, const ExprAST *>> pending{{a, b}};
+
+  while (!pending.empty()) {
+    auto [x, y] = pending.back();
+    pending.pop_back();
+    if (x == y) {
+      continue;
+    }
+    if (x == nullptr || y == nullptr || x->kind != y->kind) {
+      return false;
+    }
+
+    switch (x->kind) {
+    case ExprKind::INT_LITERAL:
+      if (static_cast<const IntLiteralExpr *>(x)->value !=
+          static_cast<const IntLiteralExpr *>(y)->value) {
+        return false;
+      }
+      break;
+    case ExprKind::VARIABLE:
+      if (static_cast<const VariableExpr *>(x)->slot !=
+          static_cast<const VariableExpr *>(y)->slot) {
+        return false;
+      }
+      break;
+    case ExprKind::UNARY_OP: {
+      auto *unary = static_cast<const UnaryOpExpr *>(x);
+      auto *other = static_cast<const UnaryOpExpr *>(y);
+      if (other->op != unary->op) {
+        return false;
+      }
+      pending.push_back({unary->expr.get(), other->expr.get()});
+      break;
+    }
+    case ExprKind::BINARY_OP: {
+      auto *binary = static_cast<const BinaryOpExpr *>(x);
+      auto *other = static_cast<const BinaryOpExpr *>(y);
+      if (other->op != binary->op) {
+        return false;
+      }
+      pending.push_back({binary->expr_one.get(), other->expr_one.get()});
+      pending.push_back({binary->expr_two.get(), other->expr_two.get()});
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Builds a copy of a side-effect free tree, bottom up
+struct Cloner : ExprRewriter<Cloner> {
+  ExprPtr leave(IntLiteralExpr *literal) {
+    return std::make_unique<IntLiteralExpr>(literal->value);
+  }
+  ExprPtr leave(VariableExpr *variable) {
+    return make_variable(variable->name, variable->slot);
+  }
+  ExprPtr leave(UnaryOpExpr *unary, ExprPtr operand) {
+    return std::make_unique<UnaryOpExpr>(unary->op, std::move(operand));
+  }
+  ExprPtr leave(BinaryOpExpr *binary, ExprPtr lhs, ExprPtr rhs) {
+    return std::make_unique<BinaryOpExpr>(binary->op, std::move(lhs),
+                                          std::move(rhs));
+  }
+  ExprPtr leave(VariableAssignExpr *, ExprPtr) { throw with_side_effects(); }
+  ExprPtr leave(TempStoreExpr *, ExprPtr) { throw with_side_effects(); }
+  ExprPtr leave(TempLoadExpr *) { throw with_side_effects(); }
+
+  static std::runtime_error with_side_effects() {
+    return std::runtime_error("Only side-effect free trees can be cloned");
+  }
+};
+
+// A tree of its own with the same value as the side-effect free 'expr'. An
+// interned tree is shared instead, as it never changes
+ExprPtr clone(ExprAST *expr) {
+  if (expr->interned) {
+    return ExprPtr(expr);
+  }
+  return Cloner().walk(expr);
+}
+
+// The walk of rewrite below
+class Replacer : public ExprRewriter<Replacer> {
+public:
+  explicit Replacer(const std::function<ExprPtr(ExprAST *)> &replace)
+      : replace(replace) {};
+
+  bool enter(ExprAST *expr, ExprPtr * /*slot*/, ExprPtr &result) {
+    result = replace(expr);
+    return result != nullptr;
+  }
+
+  ExprPtr leave(IntLiteralExpr *) { return nullptr; }
+  ExprPtr leave(VariableExpr *) { return nullptr; }
+  ExprPtr leave(UnaryOpExpr *unary, ExprPtr child) {
+    return replace_children(unary, std::move(child), nullptr);
+  }
+  ExprPtr leave(BinaryOpExpr *binary, ExprPtr lhs, ExprPtr rhs) {
+    return replace_children(binary, std::move(lhs), std::move(rhs));
+  }
+  ExprPtr leave(VariableAssignExpr *assign, ExprPtr child) {
+    return replace_children(assign, std::move(child), nullptr);
+  }
+  ExprPtr leave(TempStoreExpr *, ExprPtr) { throw on_temporaries(); }
+  ExprPtr leave(TempLoadExpr *) { throw on_temporaries(); }
+
+private:
+  const std::function<ExprPtr(ExprAST *)> &replace;
+
+  static std::runtime_error on_temporaries() {
+    return std::runtime_error("Loop optimization ran on temporaries");
+  }
+};
+
+// Replaces every outermost node of 'root' that 'replace' returns a new tree
+// for. Shared nodes on the path down to a replaced one are copied, so only
+// this occurrence changes
+void rewrite(ExprPtr &root,
+             const std::function<ExprPtr(ExprAST *)> &replace) {
+  Replacer(replace).rewrite(root);
+}
+
+// What is known of a subtree of the loop being optimized
+struct Facts {
+  bool invariant;
+  bool reads_variable;
+  std::size_t hash;
+};
+
+// The walk of LoopOptimizer::analyze, which skips subtrees already in
+// 'facts' and adds every other node to it
+class FactFinder : public ExprRewriter<FactFinder, Facts> {
+public:
+  FactFinder(const std::vector<int> &writes,
+             std::unordered_map<const ExprAST *, Facts> &facts)
+      : writes(writes), facts(facts) {};
+
+  bool enter(ExprAST *expr, ExprPtr * /*slot*/, Facts &result) {
+    auto it = facts.find(expr);
+    if (it == facts.end()) {
+      return false;
+    }
+    result = it->second;
+    return true;
+  }
+
+  Facts leave(IntLiteralExpr *literal) {
+    return record(literal, {true, false,
+                            IntLiteralExpr::structural_hash(literal->value)});
+  }
+  Facts leave(VariableExpr *variable) {
+    // Hashed by slot, as a shadowed variable has the same name
+    return record(variable,
+                  {writes[variable->slot] == 0, true,
+                   combine_hash(2, static_cast<std::size_t>(variable->slot))});
+  }
+  Facts leave(UnaryOpExpr *unary, Facts operand) {
+    std::size_t seed = combine_hash(3, static_cast<std::size_t>(unary->op));
+    return record(unary, {operand.invariant, operand.reads_variable,
+                          combine_hash(seed, operand.hash)});
+  }
+  Facts leave(BinaryOpExpr *binary, Facts lhs, Facts rhs) {
+    std::size_t seed = combine_hash(4, static_cast<std::size_t>(binary->op));
+    return record(binary, {lhs.invariant && rhs.invariant,
+                           lhs.reads_variable || rhs.reads_variable,
+                           combine_hash(combine_hash(seed, lhs.hash),
+                                        rhs.hash)});
+  }
+  Facts leave(VariableAssignExpr *assign, Facts) {
+    return record(assign, {false, false, 0});
+  }
+  Facts leave(TempStoreExpr *store, Facts) {
+    return record(store, {false, false, 0});
+  }
+  Facts leave(TempLoadExpr *load) { return record(load, {false, false, 0}); }
+
+private:
+  const std::vector<int> &writes;
+  std::unordered_map<const ExprAST *, Facts> &facts;
+
+  Facts record(const ExprAST *node, Facts known) {
+    facts[node] = known;
+    return known;
+  }
+};
+
+class LoopOptimizer {
+public:
+  explicit LoopOptimizer(FunctionDecl *function) : function(function) {};
+
+  int run() {
+    optimize_statements(function->body);
+    return replaced;
+  }
+
+private:
+  FunctionDecl *function;
+  int replaced = 0;
+
+  // Numbers the names of new variables, which cannot clash with the
+  // program's own as they are not identifiers
+  int next_name = 0;
+
+  // Optimizes the loops in the list, and those nested in them, adding what
+  // is taken out of each just before it
+  void optimize_statements(std::vector<std::unique_ptr<StmtAST>> &body);
+
+  // Each adds the declarations to run before 'loop' to 'preheader'
+  void reduce_strength(WhileStmt *loop,
+                       std::vector<std::unique_ptr<StmtAST>> &preheader);
+  void hoist_invariants(WhileStmt *loop,
+                        std::vector<std::unique_ptr<StmtAST>> &preheader);
+
+  // How many times each slot is written or declared in the loop
+  std::vector<int> count_writes(WhileStmt *loop) const;
+
+  // Facts of 'expr' and of every node below it, memoized in 'facts'
+  const Facts &
+  analyze(ExprAST *expr, const std::vector<int> &writes,
+          std::unordered_map<const ExprAST *, Facts> &facts) const {
+    FactFinder(writes, facts).walk(expr);
+    return facts.at(expr);
+  }
+
+  // Declares a new variable initialized to 'init' in 'preheader', at the
+  // position of 'loop'
+  VariableDeclStmt *
+  declare_variable(const char *prefix, ExprPtr init, const WhileStmt *loop,
+                   std::vector<std::unique_ptr<StmtAST>> &preheader);
+};
+
+void LoopOptimizer::optimize_statements(
+    std::vector<std::unique_ptr<StmtAST>> &body) {
+  std::vector<std::unique_ptr<StmtAST>> optimized;
+  optimized.reserve(body.size());
+
+  for (auto &statement : body) {
+    if (auto *block = node_cast<BlockStmt>(statement.get())) {
+      optimize_statements(block->body);
+    } else if (auto *loop = node_cast<WhileStmt>(statement.get())) {
+      // Inner loops first, so what they hoist can move out further
+      optimize_statements(loop->body->body);
+      reduce_strength(loop, optimized);
+      hoist_invariants(loop, optimized);
+    }
+    optimized.push_back(std::move(statement));
+  }
+
+  body = std::move(optimized);
+}
+
+std::vector<int> LoopOptimizer::count_writes(WhileStmt *loop) const {
+  std::vector<int> writes(function->slot_count, 0);
+
+  for_each_statement(loop, [&](StmtAST *statement) {
+    if (auto *decl = node_cast<VariableDeclStmt>(statement)) {
+      ++writes[decl->slot];
+    }
+  });
+  for_each_expression(loop, [&](ExprPtr &expr) {
+    for_each_node(expr.get(), [&](const ExprAST *node) {
+      if (auto *assign = node_cast<const VariableAssignExpr>(node)) {
+        ++writes[assign->slot];
+      }
+    });
+  });
+
+  return writes;
+}
+
+VariableDeclStmt *LoopOptimizer::declare_variable(
+    const char *prefix, ExprPtr init, const WhileStmt *loop,
+    std::vector<std::unique_ptr<StmtAST>> &preheader) {
+  auto decl = std::make_unique<VariableDeclStmt>(
+      VariableType::INT, prefix + std::to_string(next_name++),
+      std::move(init));
+  decl->slot = function->slot_count++;
+  decl->line = loop->line;
+  decl->column = loop->column;
+
+  VariableDeclStmt *declared = decl.get();
+  preheader.push_back(std::move(decl));
+  return declared;
+}
+
+void LoopOptimizer::reduce_strength(
+    WhileStmt *loop, std::vector<std::unique_ptr<StmtAST>> &preheader) {
+  std::vector<std::unique_ptr<StmtAST>> &body = loop->body->body;
+
+  // The variables this adds are never induction variables themselves, so
+  // the counts of the others stay right
+  std::vector<int> writes = count_writes(loop);
+
+  for (std::size_t i = 0; i < body.size(); ++i) {
+    auto *update = node_cast<ExprStmt>(body[i].get());
+    int slot;
+    int step;
+    if (update == nullptr || !match_increment(update->expr.get(), slot, step) ||
+        writes[slot] != 1) {
+      continue;
+    }
+    const std::string &name =
+        static_cast<const VariableAssignExpr *>(update->expr.get())->var_name;
+
+    // Which products are used before the update (the condition included)
+    // and which after it, by factor. Common subexpression elimination
+    // already computes a product once on each side, so reducing it only
+    // pays, trading two multiplies for one add, if it is used on both
+    std::map<int, std::pair<bool, bool>> uses;
+    auto find_uses = [&](ExprAST *expr, bool after) {
+      for_each_node(expr, [&](const ExprAST *node) {
+        int factor;
+        if (match_product(node, slot, factor)) {
+          (after ? uses[factor].second : uses[factor].first) = true;
+        }
+      });
+    };
+    find_uses(loop->cond.get(), false);
+    for (std::size_t j = 0; j < body.size(); ++j) {
+      for_each_expression(body[j].get(), [&](ExprPtr &expr) {
+        find_uses(expr.get(), j > i);
+      });
+    }
+
+    std::vector<std::unique_ptr<StmtAST>> steps;
+    for (auto [factor, sides] : uses) {
+      if (!sides.first || !sides.second) {
+        continue;
+      }
+
+      VariableDeclStmt *reduced = declare_variable(
+          "iv.",
+          std::make_unique<BinaryOpExpr>(
+              OperationType::MULT, make_variable(name, slot),
+              std::make_unique<IntLiteralExpr>(factor)),
+          loop, preheader);
+
+      for_each_expression(loop, [&](ExprPtr &expr) {
+        rewrite(expr, [&](ExprAST *node) -> ExprPtr {
+          int matched;
+          if (!match_product(node, slot, matched) || matched != factor) {
+            return nullptr;
+          }
+          ++replaced;
+          return make_variable(reduced->name, reduced->slot);
+        });
+      });
+
+      // Stepped along with the induction variable, so it keeps its value
+      auto assign = std::make_unique<VariableAssignExpr>(
+          reduced->name, std::make_unique<BinaryOpExpr>(
+                             OperationType::ADD,
+                             make_variable(reduced->name, reduced->slot),
+                             std::make_unique<IntLiteralExpr>(
+                                 wrap_multiply(step, factor))));
+      assign->slot = reduced->slot;
+
+      auto stepped = std::make_unique<ExprStmt>(std::move(assign));
+      stepped->line = update->line;
+      stepped->column = update->column;
+      steps.push_back(std::move(stepped));
+    }
+
+    for (auto &stepped : steps) {
+      body.insert(body.begin() + ++i, std::move(stepped));
+    }
+  }
+}
+
+void LoopOptimizer::hoist_invariants(
+    WhileStmt *loop, std::vector<std::unique_ptr<StmtAST>> &preheader) {
+  std::vector<int> writes = count_writes(loop);
+
+  // Variables holding the hoisted values, by hash of what they hold
+  std::unordered_multimap<std::size_t, VariableDeclStmt *> hoisted;
+
+  for_each_expression(loop, [&](ExprPtr &root) {
+    // Nodes are only looked up before anything under them is rewritten, and
+    // forgotten before the next tree, so a freed node's address is never
+    // mistaken for a new one
+    std::unordered_map<const ExprAST *, Facts> facts;
+
+    rewrite(root, [&](ExprAST *node) -> ExprPtr {
+      if (node->kind != ExprKind::UNARY_OP &&
+          node->kind != ExprKind::BINARY_OP) {
+        return nullptr;
+      }
+      const Facts &known = analyze(node, writes, facts);
+      if (!known.invariant || !known.reads_variable) {
+        return nullptr;
+      }
+
+      VariableDeclStmt *holder = nullptr;
+      auto [first, last] = hoisted.equal_range(known.hash);
+      for (auto it = first; it != last && holder == nullptr; ++it) {
+        if (same_value(it->second->decl_expr.get(), node)) {
+          holder = it->second;
+        }
+      }
+      if (holder == nullptr) {
+        holder = declare_variable("inv.", clone(node), loop, preheader);
+        hoisted.emplace(known.hash, holder);
+      }
+
+      ++replaced;
+      return make_variable(holder->name, holder->slot);
+    });
+  });
+}
+
+} // namespace
+
+int optimize_loops(FunctionDecl *function) {
+  return LoopOptimizer(function).run();
+}
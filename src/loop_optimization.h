@@ -0,0 +1,41 @@
+#ifndef LOOP_OPTIMIZATION_H
+#define LOOP_OPTIMIZATION_H
+
+#include "ast.h"
+
+/*
+Loop-invariant code motion and strength reduction of induction variables.
+
+There is no goto, break or continue, so every loop is a WhileStmt and no CFG
+is needed to find them: the condition is the loop header, it dominates the
+body, and each statement at the top level of the body runs exactly once per
+iteration. Loops are optimized innermost first, and what is taken out of a
+loop is declared as a new variable just before it, where the enclosing loop
+may then take it out further.
+
+A basic induction variable is one whose only write in the loop is a
+statement 'i = i + c' (or 'i - c') at the top level of the body, c being a
+literal. Its products with a literal, 'i * k', are replaced by a variable
+initialized to 'i * k' before the loop and stepped by 'c * k' right after
+'i' is, turning each multiply into a load. Common subexpression elimination
+already computes the product once between writes of 'i', so this is only
+done when it is used both before and after the update, where two multiplies
+per iteration become one add.
+
+An expression is invariant if it has no side effects and reads no variable
+the loop writes or declares. Each largest invariant unary or binary
+subexpression that reads a variable is computed once before the loop, and
+equal ones share that computation. Every expression is safe to evaluate
+early here, as even division by zero has a defined result, and running it
+when the loop does not run only costs time.
+
+The function must be resolved (see resolver.h): the new variables get new
+slots, and the resolved slots tell which reads and writes are of the same
+variable. Shared (hash-consed) nodes are copied rather than changed (see
+ast_factory.h), and the tree must not contain temporaries yet.
+
+Returns the number of subexpressions replaced.
+*/
+int optimize_loops(FunctionDecl *function);
+
+#endif
@@ -1,48 +1,483 @@
+#include "allocation.h"
 #include "ast.h"
+#include "ast_factory.h"
 #include "ast_printer.h"
+#include "ast_serialization.h"
+#include "bytecode.h"
 #include "codegen.h"
+#include "constant_propagation.h"
+#include "cse.h"
+#include "dead_code.h"
+#include "diagnostic.h"
+#include "incremental.h"
+#include "interpreter.h"
 #include "lex.h"
+#include "loop_optimization.h"
 #include "parser.h"
+#include "profile.h"
+#include "resolver.h"
+#include "scheduler.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <new>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
+// CPU time between samples of a --profile run
+constexpr int PROFILE_INTERVAL_US = 1000;
+
+void print_diagnostics(const std::string &source_filename,
+                       const std::vector<Diagnostic> &diagnostics) {
+  for (const Diagnostic &diagnostic : diagnostics) {
+    std::cerr << source_filename << ":" << diagnostic.line << ":"
+              << diagnostic.column << ": error: " << diagnostic.message
+              << std::endl;
+  }
+}
+
+// Prints the static cycle estimate of the generated code, in the spirit of
+// llvm-mca's summary
+void print_cycle_estimate(const CycleEstimate &estimate) {
+  std::cout << "\nInstructions:  " << estimate.instructions
+            << "\nTotal Cycles:  " << estimate.cycles
+            << "\nIPC:           " << std::fixed << std::setprecision(2)
+            << (estimate.cycles > 0
+                    ? static_cast<double>(estimate.instructions) /
+                          estimate.cycles
+                    : 0.0)
+            << "\n\nInstructions  Cycles  Block\n";
+  for (const CycleEstimate::Block &block : estimate.blocks) {
+    std::cout << std::setw(12) << block.instructions << "  " << std::setw(6)
+              << block.cycles << "  " << block.label << "\n";
+  }
+}
+
+// Prints where a --profile run spent its time, hottest first, by the
+// statement of FunctionDecl::body and the source line its samples fell in.
+// 'source' may be empty (for an AST file), leaving out the source text
+void print_profile(const BytecodeFunction &function,
+                   const std::vector<std::uint64_t> &samples,
+                   const std::string &source) {
+  std::map<std::pair<int, int>, std::uint64_t> by_line;
+  std::uint64_t total = 0;
+  for (std::size_t i = 0; i < samples.size(); ++i) {
+    if (samples[i] > 0) {
+      const SourcePosition &position = function.positions[i];
+      by_line[{position.statement, position.line}] += samples[i];
+      total += samples[i];
+    }
+  }
+
+  std::cout << "\nProfile: " << total << " samples, one every "
+            << PROFILE_INTERVAL_US << "us of CPU time\n";
+  if (total == 0) {
+    return;
+  }
+
+  std::vector<std::string> lines;
+  std::istringstream source_lines(source);
+  for (std::string line; std::getline(source_lines, line);) {
+    lines.push_back(std::move(line));
+  }
+
+  std::vector<std::pair<std::pair<int, int>, std::uint64_t>> hottest(
+      by_line.begin(), by_line.end());
+  std::stable_sort(hottest.begin(), hottest.end(),
+                   [](const auto &a, const auto &b) { return a.second > b.second; });
+
+  std::cout << "\n Samples  Percent  Statement  Line\n";
+  for (const auto &[where, count] : hottest) {
+    auto [statement, line] = where;
+    std::cout << std::setw(8) << count << "  " << std::fixed
+              << std::setprecision(1) << std::setw(6)
+              << 100.0 * count / total << "%  " << std::setw(9)
+              << (statement < 0 ? "end" : std::to_string(statement)) << "  "
+              << std::setw(4) << line;
+    if (line >= 1 && line <= static_cast<int>(lines.size())) {
+      std::string text = lines[line - 1];
+      text.erase(0, text.find_first_not_of(" \t"));
+      std::cout << "  " << text;
+    }
+    std::cout << "\n";
+  }
+}
+
+// Recompiles the source every time a line is read from stdin, redoing only
+// the work the edits since the last compile require
+int run_incremental(const std::string &source_filename) {
+  IncrementalCompiler compiler;
+  std::string command;
+
+  do {
+    std::string source;
+    try {
+      source = read_source(source_filename);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Exception caught: '" << e.what() << "'" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool compiled = compiler.compile(std::move(source));
+    auto end = std::chrono::steady_clock::now();
+
+    if (compiled) {
+      std::ofstream asm_file("assembly.s");
+      asm_file << compiler.get_assembly();
+    } else {
+      print_diagnostics(source_filename, compiler.get_diagnostics());
+    }
+
+    const IncrementalCompiler::Stats &stats = compiler.get_stats();
+    std::cerr << "Compiled in "
+              << std::chrono::duration<double, std::micro>(end - start).count()
+              << "us: relexed " << stats.relexed_tokens << "/"
+              << stats.total_tokens << " tokens, reparsed "
+              << stats.reparsed_statements << "/" << stats.total_statements
+              << " statements, regenerated " << stats.regenerated_statements
+              << "/" << stats.total_statements << " statements" << std::endl;
+  } while (std::getline(std::cin, command));
+
+  return EXIT_SUCCESS;
+}
+
+// Writes the recorded spans when main returns, whichever way it returns
+struct TraceWriter {
+  std::string file_path;
+
+  ~TraceWriter() {
+    if (file_path.empty()) {
+      return;
+    }
+    try {
+      write_trace(file_path);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Exception caught: '" << e.what() << "'" << std::endl;
+    }
+  }
+};
+
+// Prints where the compiler's memory went when main returns, for --stats
+struct StatsPrinter {
+  bool enabled = false;
+
+  ~StatsPrinter() {
+    if (!enabled) {
+      return;
+    }
+    AllocationStats stats = allocation_stats();
+    std::cerr << "\nMemory: peak " << stats.peak_bytes << " bytes, live "
+              << stats.live_bytes << " bytes\n\n"
+              << "Subsystem   Allocations       Allocated           Freed\n";
+    for (int i = 0; i < SUBSYSTEM_COUNT; ++i) {
+      const AllocationStats::Counts &counts = stats.subsystems[i];
+      std::cerr << std::left << std::setw(10)
+                << subsystem_name(static_cast<Subsystem>(i)) << std::right
+                << std::setw(13) << counts.allocations << std::setw(16)
+                << counts.bytes_allocated << std::setw(16)
+                << counts.bytes_freed << "\n";
+    }
+    std::cerr << std::flush;
+  }
+};
+
+// Reads a --max-memory size, a byte count with an optional K, M or G suffix,
+// returning 0 if it is not one
+std::size_t parse_memory_size(const std::string &text) {
+  std::size_t digits = text.find_first_not_of("0123456789");
+  if (digits == 0 || text.size() - std::min(digits, text.size()) > 1) {
+    return 0;
+  }
+
+  int shift = 0;
+  if (digits != std::string::npos) {
+    switch (text[digits]) {
+    case 'K':
+      shift = 10;
+      break;
+    case 'M':
+      shift = 20;
+      break;
+    case 'G':
+      shift = 30;
+      break;
+    default:
+      return 0;
+    }
+  }
+
+  std::size_t size = 0;
+  for (std::size_t i = 0; i < std::min(digits, text.size()); ++i) {
+    std::size_t next = size * 10 + (text[i] - '0');
+    if (next / 10 != size) {
+      return 0;
+    }
+    size = next;
+  }
+  if (size > (SIZE_MAX >> shift)) {
+    return 0;
+  }
+  return size << shift;
+}
+
+int compile(int argc, char **argv) {
+  bool incremental = false;
+  bool run_interpreter = false;
+  bool profile = false;
+  bool hash_cons = false;
+  bool schedule = true;
+  bool estimate = false;
+  bool instrument = false;
+  std::string profile_in;
+  std::string ast_out;
+  TraceWriter trace_writer;
+  StatsPrinter stats_printer;
+  std::size_t memory_limit = 0;
+  const char *source_filename = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg == "--incremental") {
+      incremental = true;
+    } else if (arg == "--interpret") {
+      run_interpreter = true;
+    } else if (arg == "--profile") {
+      run_interpreter = true;
+      profile = true;
+    } else if (arg == "--hash-cons") {
+      hash_cons = true;
+    } else if (arg == "--no-schedule") {
+      schedule = false;
+    } else if (arg == "--estimate-cycles") {
+      estimate = true;
+    } else if (arg == "--instrument") {
+      instrument = true;
+    } else if (arg.rfind("--profile-use=", 0) == 0) {
+      profile_in = arg.substr(std::string("--profile-use=").size());
+    } else if (arg.rfind("--emit-ast=", 0) == 0) {
+      ast_out = arg.substr(std::string("--emit-ast=").size());
+    } else if (arg.rfind("--trace-out=", 0) == 0) {
+      trace_writer.file_path = arg.substr(std::string("--trace-out=").size());
+    } else if (arg == "--stats") {
+      stats_printer.enabled = true;
+    } else if (arg.rfind("--max-memory=", 0) == 0) {
+      memory_limit =
+          parse_memory_size(arg.substr(std::string("--max-memory=").size()));
+      if (memory_limit == 0) {
+        std::cerr << "Error: --max-memory takes a size in bytes, with an "
+                     "optional K, M or G suffix"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (source_filename == nullptr) {
+      source_filename = argv[i];
+    } else {
+      source_filename = nullptr;
+      break;
+    }
+  }
+
+  if (source_filename == nullptr) {
     std::cerr << "Error: Must have one argument (the source file)" << std::endl;
     return EXIT_FAILURE;
   }
 
-  std::vector<Token> source_tokens;
-  const char *source_filename = argv[1];
+  if (instrument && !profile_in.empty()) {
+    std::cerr << "Error: --instrument and --profile-use cannot be combined"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
 
-  try {
-    source_tokens = lex(source_filename);
-  } catch (const std::runtime_error &e) {
-    std::cerr << "Exception caught: '" << e.what() << "'" << std::endl;
+  if (!trace_writer.file_path.empty()) {
+    start_tracing();
   }
+  set_memory_limit(memory_limit);
+
+  // A file written by --emit-ast is loaded in place of the source, skipping
+  // the lexer and parser
+  bool precompiled = is_ast_file(source_filename);
+
+  if (incremental) {
+    if (precompiled) {
+      std::cerr << "Error: --incremental needs C source, not an AST file"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    return run_incremental(source_filename);
+  }
+
+  // Tokens hold views into this buffer, so it lives for the whole compile
+  std::string source;
+  std::vector<Token> source_tokens;
 
+  // Shares structurally equal subtrees when asked to, and owns them, so it
+  // has to outlive the tree. A loaded tree's nodes live in 'loaded' instead
+  ExprFactory factory(hash_cons);
+  LoadedAst loaded;
   std::unique_ptr<FunctionDecl> main_func;
-  Parser parser(source_tokens);
 
   try {
-    main_func = parser.parse();
+    TraceSpan span("read input", "phase");
+    if (precompiled) {
+      loaded = read_ast(source_filename);
+      main_func = std::move(loaded.function);
+    } else {
+      source = read_source(source_filename);
+      check_memory_limit();
+      source_tokens = lex_parallel(source);
+    }
+  } catch (const LexError &e) {
+    print_diagnostics(source_filename,
+                      {Diagnostic(e.line, e.column, e.what())});
+    return EXIT_FAILURE;
   } catch (const std::runtime_error &e) {
     std::cerr << "Exception caught: '" << e.what() << "'" << std::endl;
+    return EXIT_FAILURE;
   }
 
-  AstPrinter printer;
-  if (main_func) {
-    printer.print_from_root(main_func.get());
+  if (!precompiled) {
+    Parser parser(source_tokens, factory);
+    main_func = parser.parse();
+
+    // Report every syntax error from the one pass, and never generate code
+    // from a partially parsed tree
+    if (!parser.get_diagnostics().empty()) {
+      print_diagnostics(source_filename, parser.get_diagnostics());
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!ast_out.empty()) {
+    try {
+      write_ast(main_func.get(), ast_out);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Exception caught: '" << e.what() << "'" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Bind every variable to its slot, reporting all undeclared and duplicate
+  // names at once
+  Resolver resolver;
+  bool resolved;
+  {
+    TraceSpan span("resolve", "phase");
+    resolved = resolver.resolve(main_func.get());
   }
+  if (!resolved) {
+    print_diagnostics(source_filename, resolver.get_diagnostics());
+    return EXIT_FAILURE;
+  }
+
+  // Run the program in-process instead of assembling and linking it, with
+  // its result as our exit code. --profile samples it as it runs
+  if (run_interpreter) {
+    try {
+      BytecodeCompiler bytecode_compiler;
+      BytecodeFunction function = bytecode_compiler.compile(main_func.get());
+      if (!profile) {
+        return interpret(function);
+      }
+
+      std::vector<std::uint64_t> samples;
+      std::int32_t result =
+          interpret_profiled(function, PROFILE_INTERVAL_US, samples);
+      print_profile(function, samples, source);
+      return result;
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Exception caught: '" << e.what() << "'" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  AstPrinter printer;
+  printer.print_from_root(main_func.get());
 
   AstAssembly codegen;
   std::string asm_name = "assembly.s";
-  if (main_func) {
-    codegen.generate(main_func.get(), asm_name);
+  BranchProfile branch_profile;
+
+  try {
+    // An instrumented program writes the counts --profile-use reads
+    codegen.set_instrumented(instrument);
+    if (!profile_in.empty()) {
+      branch_profile = read_profile(profile_in);
+      codegen.set_profile(&branch_profile);
+    }
+
+    // Folding makes stores dead, and removing them exposes more to fold, so
+    // both run until neither finds anything
+    {
+      AllocationScope allocation_scope(Subsystem::OPTIMIZER);
+      int changes;
+      do {
+        {
+          TraceSpan span("propagate_constants", "pass");
+          changes = propagate_constants(main_func.get());
+        }
+        TraceSpan span("eliminate_dead_code", "pass");
+        changes += eliminate_dead_code(main_func.get());
+      } while (changes > 0);
+      {
+        TraceSpan span("optimize_loops", "pass");
+        optimize_loops(main_func.get());
+      }
+      {
+        TraceSpan span("eliminate_common_subexpressions", "pass");
+        eliminate_common_subexpressions(main_func.get());
+      }
+    }
+
+    std::ostringstream assembly;
+    codegen.generate(main_func.get(), assembly);
+    std::string code = assembly.str();
+    if (schedule) {
+      TraceSpan span("schedule_instructions", "pass");
+      code = schedule_instructions(code);
+    }
+    check_memory_limit();
+    std::ofstream(asm_name) << code;
+
+    if (estimate) {
+      print_cycle_estimate(estimate_cycles(code));
+    }
+  } catch (const std::runtime_error &e) {
+    std::cerr << "Exception caught: '" << e.what() << "'" << std::endl;
+    return EXIT_FAILURE;
   }
 
+  TraceSpan span("assemble and link", "external");
   system("gcc assembly.s -o out");
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  // A compile that outgrows --max-memory unwinds to here rather than being
+  // killed by the system
+  try {
+    return compile(argc, argv);
+  } catch (const std::bad_alloc &) {
+    Subsystem subsystem;
+    if (memory_limit_exceeded(subsystem)) {
+      std::cerr << "Error: compile exceeded --max-memory (subsystem: "
+                << subsystem_name(subsystem) << ")" << std::endl;
+    } else {
+      std::cerr << "Error: out of memory" << std::endl;
+    }
+    return EXIT_FAILURE;
+  }
 }
@@ -0,0 +1,234 @@
+#ifndef OPERATORS_H
+#define OPERATORS_H
+
+#include "ast.h"
+#include "bytecode.h"
+#include "lex.h"
+
+#include <array>
+#include <cstdint>
+#include <limits>
+
+/*
+Everything the compiler knows about an operator, in one table built at
+compile time.
+
+The parser, the code generators, the printer and the passes used to each
+switch over the operators themselves, so adding one meant finding every
+switch. Now each OperationType has a row in OPERATORS, and a token finds its
+row through a second table generated from the first. Both are plain array
+lookups.
+
+The arithmetic itself stays code: fold_binary in constant_propagation.cpp
+and the interpreter still say what each operator computes, with the helpers
+at the end of this file for the cases where C and AArch64 disagree.
+*/
+
+enum class Associativity { LEFT, RIGHT };
+
+struct OperatorInfo {
+  OperationType op;
+  TokenType token;
+
+  // As a binary operator. A precedence of 0 means it is only unary
+  int precedence = 0;
+  Associativity associativity = Associativity::LEFT;
+  const char *name = nullptr; // As AstPrinter shows it
+
+  // Bytecode computing it, or for && and || the jump that skips the right
+  // side once the left one decides
+  Opcode opcode = Opcode::RETURN;
+
+  // AArch64 code computing 'w0 = w1 op w0', for operators that are not
+  // comparisons or short circuits
+  const char *instructions = nullptr;
+
+  // Condition code that holds after 'cmp lhs, rhs' when 'lhs op rhs' is true,
+  // for the relational operators
+  const char *condition = nullptr;
+
+  // && and ||, whose right side runs only if the left does not decide
+  bool short_circuit = false;
+
+  // 'a op b' is 'b op a', so either order computes the same value
+  bool commutative = false;
+
+  // The result is always 0 or 1
+  bool boolean = false;
+
+  // As a unary operator
+  bool unary = false;
+  const char *unary_name = nullptr;
+  Opcode unary_opcode = Opcode::RETURN;
+  const char *unary_instructions = nullptr; // 'w0 = op w0'
+};
+
+// Binding power of every unary operator, above all binary ones
+constexpr int UNARY_PRECEDENCE = 11;
+
+namespace operator_rows {
+
+constexpr OperatorInfo arithmetic(OperationType op, TokenType token,
+                                  int precedence, const char *name,
+                                  Opcode opcode, const char *instructions,
+                                  bool commutative) {
+  OperatorInfo info{op, token};
+  info.precedence = precedence;
+  info.name = name;
+  info.opcode = opcode;
+  info.instructions = instructions;
+  info.commutative = commutative;
+  return info;
+}
+
+constexpr OperatorInfo relational(OperationType op, TokenType token,
+                                  int precedence, const char *name,
+                                  Opcode opcode, const char *condition,
+                                  bool commutative) {
+  OperatorInfo info{op, token};
+  info.precedence = precedence;
+  info.name = name;
+  info.opcode = opcode;
+  info.condition = condition;
+  info.commutative = commutative;
+  info.boolean = true;
+  return info;
+}
+
+constexpr OperatorInfo logical(OperationType op, TokenType token,
+                               int precedence, const char *name,
+                               Opcode skip) {
+  OperatorInfo info{op, token};
+  info.precedence = precedence;
+  info.name = name;
+  info.opcode = skip;
+  info.short_circuit = true;
+  info.boolean = true;
+  return info;
+}
+
+// Adds the unary form to 'info', which may also be a binary operator
+constexpr OperatorInfo unary(OperatorInfo info, const char *name,
+                             Opcode opcode, const char *instructions) {
+  info.unary = true;
+  info.unary_name = name;
+  info.unary_opcode = opcode;
+  info.unary_instructions = instructions;
+  return info;
+}
+
+} // namespace operator_rows
+
+// One row per OperationType, in its order
+inline constexpr std::array<OperatorInfo, OPERATION_TYPE_COUNT> OPERATORS = [] {
+  using namespace operator_rows;
+  using Op = OperationType;
+  using Token = TokenType;
+
+  return std::array<OperatorInfo, OPERATION_TYPE_COUNT>{
+      unary(arithmetic(Op::NEGATE, Token::NEGATE, 9, "Subtract",
+                       Opcode::SUBTRACT, "sub\tw0, w1, w0", false),
+            "Negate", Opcode::NEGATE, "neg\tw0, w0"),
+      unary(OperatorInfo{Op::BITWISE, Token::BITWISE}, "Bitwise",
+            Opcode::BITWISE, "mvn\tw0, w0"),
+      unary(OperatorInfo{Op::LOGIC_NEGATE, Token::LOGIC_NEGATE},
+            "Logical Negation", Opcode::LOGIC_NEGATE,
+            "cmp\tw0, #0\n\tcset\tw0, EQ"),
+      arithmetic(Op::ADD, Token::ADD, 9, "Add", Opcode::ADD,
+                 "add\tw0, w1, w0", true),
+      arithmetic(Op::MULT, Token::MULT, 10, "Multiply", Opcode::MULT,
+                 "mul\tw0, w1, w0", true),
+      arithmetic(Op::DIVIDE, Token::DIVIDE, 10, "Divide", Opcode::DIVIDE,
+                 "sdiv\tw0, w1, w0", false),
+      logical(Op::AND, Token::AND, 2, "And", Opcode::JUMP_IF_ZERO),
+      logical(Op::OR, Token::OR, 1, "Or", Opcode::JUMP_IF_NOT_ZERO),
+      relational(Op::EQUAL, Token::EQUAL, 6, "Equal", Opcode::EQUAL, "eq",
+                 true),
+      relational(Op::NOT_EQUAL, Token::NOT_EQUAL, 6, "Not Equal",
+                 Opcode::NOT_EQUAL, "ne", true),
+      relational(Op::GREATER_THAN, Token::GREATER_THAN, 7, "Greater Than",
+                 Opcode::GREATER_THAN, "gt", false),
+      relational(Op::LESS_THAN, Token::LESS_THAN, 7, "Less Than",
+                 Opcode::LESS_THAN, "lt", false),
+      relational(Op::GREATER_THAN_EQUAL, Token::GREATER_THAN_EQUAL, 7,
+                 "Greater Than or Equal", Opcode::GREATER_THAN_EQUAL, "ge",
+                 false),
+      relational(Op::LESS_THAN_EQUAL, Token::LESS_THAN_EQUAL, 7,
+                 "Less Than or Equal", Opcode::LESS_THAN_EQUAL, "le", false),
+      arithmetic(Op::MODULO, Token::MODULO, 10, "Modulo", Opcode::MODULO,
+                 "sdiv\tw2, w1, w0\n\tmsub\tw0, w0, w2, w1", false),
+      arithmetic(Op::BITWISE_AND, Token::BITWISE_AND, 5, "Bitwise And",
+                 Opcode::BITWISE_AND, "and\tw0, w1, w0", true),
+      arithmetic(Op::BITWISE_OR, Token::BITWISE_OR, 3, "Bitwise Or",
+                 Opcode::BITWISE_OR, "orr\tw0, w1, w0", true),
+      arithmetic(Op::BITWISE_XOR, Token::BITWISE_XOR, 4, "Bitwise Xor",
+                 Opcode::BITWISE_XOR, "eor\tw0, w1, w0", true),
+      arithmetic(Op::BITWISE_SHIFT_LEFT, Token::BITWISE_LEFT_SHIFT, 8,
+                 "Bitwise Shift Left", Opcode::SHIFT_LEFT, "lsl\tw0, w1, w0",
+                 false),
+      arithmetic(Op::BITWISE_SHIFT_RIGHT, Token::BITWISE_RIGHT_SHIFT, 8,
+                 "Bitwise Shift Right", Opcode::SHIFT_RIGHT,
+                 "asr\tw0, w1, w0", false),
+  };
+}();
+
+constexpr bool rows_in_order() {
+  for (int i = 0; i < OPERATION_TYPE_COUNT; ++i) {
+    if (static_cast<int>(OPERATORS[i].op) != i) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(rows_in_order(), "OPERATORS must follow OperationType's order");
+
+// Row of OPERATORS each token spells, or -1, indexed by TokenType
+inline constexpr std::array<int, TOKEN_TYPE_COUNT> TOKEN_OPERATORS = [] {
+  std::array<int, TOKEN_TYPE_COUNT> rows{};
+  for (int &row : rows) {
+    row = -1;
+  }
+  for (int i = 0; i < OPERATION_TYPE_COUNT; ++i) {
+    rows[static_cast<int>(OPERATORS[i].token)] = i;
+  }
+  return rows;
+}();
+
+constexpr const OperatorInfo &operator_info(OperationType op) {
+  return OPERATORS[static_cast<int>(op)];
+}
+
+// The operator 'type' spells, or nullptr if it is not one
+constexpr const OperatorInfo *token_operator(TokenType type) {
+  int row = TOKEN_OPERATORS[static_cast<int>(type)];
+  return row < 0 ? nullptr : &OPERATORS[row];
+}
+
+// Wrapping 32-bit arithmetic, done on unsigned values to avoid overflow
+constexpr std::int32_t wrap(std::uint32_t value) {
+  return static_cast<std::int32_t>(value);
+}
+
+// sdiv semantics: dividing by zero gives 0 and INT_MIN / -1 wraps
+constexpr std::int32_t divide(std::int32_t lhs, std::int32_t rhs) {
+  if (rhs == 0) {
+    return 0;
+  }
+  if (lhs == std::numeric_limits<std::int32_t>::min() && rhs == -1) {
+    return lhs;
+  }
+  return lhs / rhs;
+}
+
+// sdiv + msub semantics: lhs - (lhs / rhs) * rhs
+constexpr std::int32_t modulo(std::int32_t lhs, std::int32_t rhs) {
+  if (rhs == 0) {
+    return lhs;
+  }
+  if (rhs == -1) {
+    return 0;
+  }
+  return lhs % rhs;
+}
+
+#endif
@@ -1,13 +1,42 @@
 #include "parser.h"
+#include "allocation.h"
 #include "ast.h"
 #include "lex.h"
+#include "operators.h"
+#include "trace.h"
 
+#include <array>
 #include <cstddef>
-#include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 
-std::unique_ptr<FunctionDecl> Parser::parse() { return parse_function(); }
+std::unique_ptr<FunctionDecl> Parser::parse() {
+  TraceSpan span("parse", "phase");
+  AllocationScope allocation_scope(Subsystem::PARSER);
+  return parse_function();
+}
+
+std::unique_ptr<StmtAST> Parser::parse_statement_at(int start, int &end) {
+  TraceSpan span("parse_statement_at", "phase");
+  AllocationScope allocation_scope(Subsystem::PARSER);
+
+  current_token = start;
+  std::size_t first_error = diagnostics.size();
+  auto statement = parse_positioned_statement();
+  end = current_token;
+
+  // Blocks nested in the statement recover from their errors, which are
+  // thrown all the same
+  if (diagnostics.size() > first_error) {
+    std::string message = diagnostics[first_error].message;
+    diagnostics.erase(diagnostics.begin() + first_error, diagnostics.end());
+    throw std::runtime_error(message);
+  }
+
+  return statement;
+}
 
 bool Parser::check(const TokenType &type) {
   if (is_at_end())
@@ -30,21 +59,29 @@ bool Parser::check_next(const TokenType &type) {
   return return_val;
 }
 
-Token Parser::consume(const TokenType &type,
-                      const std::string &error_message = "") {
+const Token &Parser::consume(const TokenType &type,
+                             const std::string &error_message = "") {
   if (check(type))
     return advance();
   throw std::runtime_error(error_message);
 }
 
-Token Parser::advance() {
-  if (!is_at_end())
-    current_token++;
-  return tokens[current_token - 1];
+const Token &Parser::advance() {
+  if (is_at_end())
+    throw std::runtime_error("Syntax Error: Unexpected end of file");
+  return tokens[current_token++];
+}
+
+TokenType Parser::peek_type() { return tokens[current_token].token_type; }
+
+const Token &Parser::peek() {
+  if (is_at_end())
+    throw std::runtime_error("Syntax Error: Unexpected end of file");
+  return tokens[current_token];
 }
 
 bool Parser::check_advance(const TokenType &token_type) {
-  if (token_type == tokens[current_token].token_type) {
+  if (check(token_type)) {
     advance();
 
     return true;
@@ -55,66 +92,54 @@ bool Parser::check_advance(const TokenType &token_type) {
 
 bool Parser::is_at_end() { return current_token >= tokens.size(); }
 
-VariableType Parser::parse_type() {
-  Token type_token = advance();
+void Parser::report_error(const std::string &message) {
+  if (tokens.empty()) {
+    diagnostics.emplace_back(1, 1, message);
+    return;
+  }
+
+  const Token &at = is_at_end() ? tokens.back() : tokens[current_token];
+  diagnostics.emplace_back(at.line, at.column, message);
+}
+
+void Parser::synchronize() {
+  // Blocks opened by the broken statement are skipped as a whole
+  int depth = 0;
+  while (!is_at_end()) {
+    if (depth == 0 && check(TokenType::CLOSE_BRACE)) {
+      return;
+    }
 
-  switch (type_token.token_type) {
-  case TokenType::INT_TYPE:
+    TokenType type = advance().token_type;
+    if (type == TokenType::OPEN_BRACE) {
+      ++depth;
+    } else if (type == TokenType::CLOSE_BRACE && --depth == 0) {
+      return;
+    } else if (type == TokenType::SEMICOLON && depth == 0) {
+      return;
+    }
+  }
+}
+
+VariableType Parser::parse_type() {
+  // Only consume the token once it is known to be a type, so errors point at it
+  if (check(TokenType::INT_TYPE)) {
+    advance();
     return VariableType::INT;
-  case TokenType::VOID_TYPE:
+  } else if (check(TokenType::VOID_TYPE)) {
+    advance();
     return VariableType::VOID;
-  default:
-    throw std::runtime_error("Syntax Error: Expected a type name");
   }
+
+  throw std::runtime_error("Syntax Error: Expected a type name");
 }
 
 OperationType Parser::parse_operator() {
-  Token op_token = advance();
-
-  switch (op_token.token_type) {
-  case TokenType::NEGATE:
-    return OperationType::NEGATE;
-  case TokenType::BITWISE:
-    return OperationType::BITWISE;
-  case TokenType::LOGIC_NEGATE:
-    return OperationType::LOGIC_NEGATE;
-  case TokenType::ADD:
-    return OperationType::ADD;
-  case TokenType::MULT:
-    return OperationType::MULT;
-  case TokenType::DIVIDE:
-    return OperationType::DIVIDE;
-  case TokenType::AND:
-    return OperationType::AND;
-  case TokenType::OR:
-    return OperationType::OR;
-  case TokenType::EQUAL:
-    return OperationType::EQUAL;
-  case TokenType::NOT_EQUAL:
-    return OperationType::NOT_EQUAL;
-  case TokenType::LESS_THAN:
-    return OperationType::LESS_THAN;
-  case TokenType::LESS_THAN_EQUAL:
-    return OperationType::LESS_THAN_EQUAL;
-  case TokenType::GREATER_THAN:
-    return OperationType::GREATER_THAN;
-  case TokenType::GREATER_THAN_EQUAL:
-    return OperationType::GREATER_THAN_EQUAL;
-  case TokenType::MODULO:
-    return OperationType::MODULO;
-  case TokenType::BITWISE_AND:
-    return OperationType::BITWISE_AND;
-  case TokenType::BITWISE_OR:
-    return OperationType::BITWISE_OR;
-  case TokenType::BITWISE_XOR:
-    return OperationType::BITWISE_XOR;
-  case TokenType::BITWISE_LEFT_SHIFT:
-    return OperationType::BITWISE_SHIFT_LEFT;
-  case TokenType::BITWISE_RIGHT_SHIFT:
-    return OperationType::BITWISE_SHIFT_RIGHT;
-  default:
+  const OperatorInfo *info = token_operator(advance().token_type);
+  if (info == nullptr) {
     throw std::runtime_error("Syntax Error: Expected an operator");
   }
+  return info->op;
 }
 
 std::vector<std::unique_ptr<VariableDeclStmt>> Parser::parse_func_parameters() {
@@ -125,9 +150,9 @@ std::vector<std::unique_ptr<VariableDeclStmt>> Parser::parse_func_parameters() {
   if (!check(TokenType::CLOSE_PAREN)) {
     do {
       VariableType param_type = parse_type();
-      Token param_token =
+      const Token &param_token =
           consume(TokenType::IDENTIFIER, "Expected parameter name");
-      std::string param_name = std::get<std::string>(param_token.literal);
+      std::string param_name(std::get<std::string_view>(param_token.literal));
 
       parameters.push_back(
           std::make_unique<VariableDeclStmt>(param_type, param_name, nullptr));
@@ -140,232 +165,171 @@ std::vector<std::unique_ptr<VariableDeclStmt>> Parser::parse_func_parameters() {
   return parameters;
 }
 
-std::unique_ptr<ExprAST> Parser::parse_factor() {
-  std::unique_ptr<ExprAST> factor_expr;
-
-  if (check(TokenType::OPEN_PAREN)) {
-    consume(TokenType::OPEN_PAREN, "Expected an open parenthesis");
-
-    factor_expr = parse_expression();
-    consume(TokenType::CLOSE_PAREN,
-            "Parentheses mismatch on bounded expression");
-  } else if (check(TokenType::NEGATE) || check(TokenType::BITWISE) ||
-             check(TokenType::LOGIC_NEGATE)) {
-    OperationType op = parse_operator();
-    auto factor = parse_factor();
-
-    factor_expr = std::make_unique<UnaryOpExpr>(op, std::move(factor));
-  } else if (check(TokenType::INT)) {
-    Token num = advance();
-
-    factor_expr = std::make_unique<IntLiteralExpr>(std::get<int>(num.literal));
-  } else if (check(TokenType::IDENTIFIER)) {
-    Token var = advance();
-    std::string var_name = std::get<std::string>(var.literal);
-
-    std::cout << var_name << '\n';
-
-    factor_expr = std::make_unique<VariableExpr>(var_name);
-  }
-
-  return factor_expr;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_term() {
-  std::unique_ptr<ExprAST> factor = parse_factor();
-
-  while (check(TokenType::MULT) || check(TokenType::DIVIDE) ||
-         check(TokenType::MODULO)) {
-    std::cout << "Encountered mult\n";
-    OperationType op = parse_operator();
-    auto next_factor = parse_factor();
-
-    factor = std::make_unique<BinaryOpExpr>(op, std::move(factor),
-                                            std::move(next_factor));
-  }
-
-  return factor;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_additive() {
-  std::unique_ptr<ExprAST> term = parse_term();
-
-  while (check(TokenType::ADD) || check(TokenType::NEGATE)) {
-    OperationType op = parse_operator();
-    auto next_term = parse_term();
-
-    term = std::make_unique<BinaryOpExpr>(op, std::move(term),
-                                          std::move(next_term));
-  }
-
-  return term;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_bitshift() {
-  std::unique_ptr<ExprAST> additive_expr = parse_additive();
-
-  while (check(TokenType::BITWISE_LEFT_SHIFT) ||
-         check(TokenType::BITWISE_RIGHT_SHIFT)) {
-    OperationType op = parse_operator();
-    auto next_additive = parse_additive();
-
-    additive_expr = std::make_unique<BinaryOpExpr>(op, std::move(additive_expr),
-                                                   std::move(next_additive));
-  }
-
-  return additive_expr;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_relational() {
-  std::unique_ptr<ExprAST> bitshift_expr = parse_bitshift();
-
-  while (check(TokenType::LESS_THAN) || check(TokenType::GREATER_THAN) ||
-         check(TokenType::LESS_THAN_EQUAL) ||
-         check(TokenType::GREATER_THAN_EQUAL)) {
-    OperationType op = parse_operator();
-    auto next_bitshift = parse_bitshift();
-
-    bitshift_expr = std::make_unique<BinaryOpExpr>(op, std::move(bitshift_expr),
-                                                   std::move(next_bitshift));
-  }
-
-  return bitshift_expr;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_equality() {
-  std::unique_ptr<ExprAST> relational_expr = parse_relational();
-
-  while (check(TokenType::EQUAL) || check(TokenType::NOT_EQUAL)) {
-    OperationType op = parse_operator();
-    auto next_relational = parse_relational();
-
-    relational_expr = std::make_unique<BinaryOpExpr>(
-        op, std::move(relational_expr), std::move(next_relational));
-  }
+namespace {
 
-  return relational_expr;
+// Binding power of a token as a binary operator, from OPERATORS. Zero means
+// the token cannot continue an expression
+int binary_precedence(TokenType type) {
+  const OperatorInfo *info = token_operator(type);
+  return info == nullptr ? 0 : info->precedence;
 }
 
-std::unique_ptr<ExprAST> Parser::parse_bitwise_and() {
-  std::unique_ptr<ExprAST> equality_expr = parse_equality();
-
-  while (check(TokenType::BITWISE_AND)) {
-    OperationType op = parse_operator();
-    auto next_equality = parse_equality();
-
-    equality_expr = std::make_unique<BinaryOpExpr>(op, std::move(equality_expr),
-                                                   std::move(next_equality));
-  }
-
-  return equality_expr;
+bool is_unary_operator(TokenType type) {
+  const OperatorInfo *info = token_operator(type);
+  return info != nullptr && info->unary;
 }
 
-std::unique_ptr<ExprAST> Parser::parse_bitwise_xor() {
-  std::unique_ptr<ExprAST> bitwise_and_expr = parse_bitwise_and();
-
-  while (check(TokenType::BITWISE_XOR)) {
-    OperationType op = parse_operator();
-    auto next_bitand_expr = parse_bitwise_and();
-
-    bitwise_and_expr = std::make_unique<BinaryOpExpr>(
-        op, std::move(bitwise_and_expr), std::move(next_bitand_expr));
+// An operator waiting on the operator stack for its operands to be parsed
+struct PendingOperator {
+  enum class Kind { UNARY, BINARY, ASSIGN, PAREN };
+
+  Kind kind;
+  OperationType op;
+  int precedence;
+  std::string var_name; // Only set for ASSIGN
+};
+
+// Pops the top pending operator and folds it into the operand stack
+void reduce(std::vector<PendingOperator> &operators,
+            std::vector<ExprPtr> &operands, ExprFactory &factory) {
+  PendingOperator pending = std::move(operators.back());
+  operators.pop_back();
+
+  switch (pending.kind) {
+  case PendingOperator::Kind::UNARY: {
+    auto expr = std::move(operands.back());
+    operands.back() = factory.unary(pending.op, std::move(expr));
+    break;
   }
-
-  return bitwise_and_expr;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_bitwise_or() {
-  std::unique_ptr<ExprAST> bitwise_xor_expr = parse_bitwise_xor();
-
-  while (check(TokenType::BITWISE_OR)) {
-    OperationType op = parse_operator();
-    auto next_bitxor_expr = parse_bitwise_xor();
-
-    bitwise_xor_expr = std::make_unique<BinaryOpExpr>(
-        op, std::move(bitwise_xor_expr), std::move(next_bitxor_expr));
+  case PendingOperator::Kind::BINARY: {
+    auto expr_two = std::move(operands.back());
+    operands.pop_back();
+    auto expr_one = std::move(operands.back());
+    operands.back() =
+        factory.binary(pending.op, std::move(expr_one), std::move(expr_two));
+    break;
   }
-
-  return bitwise_xor_expr;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_logical_and() {
-  std::unique_ptr<ExprAST> bitwise_or_expr = parse_bitwise_or();
-
-  while (check(TokenType::AND)) {
-    OperationType op = parse_operator();
-    auto next_bitor_expr = parse_bitwise_or();
-
-    bitwise_or_expr = std::make_unique<BinaryOpExpr>(
-        op, std::move(bitwise_or_expr), std::move(next_bitor_expr));
+  case PendingOperator::Kind::ASSIGN: {
+    auto assign_expr = std::move(operands.back());
+    operands.back() =
+        factory.assign(std::move(pending.var_name), std::move(assign_expr));
+    break;
   }
-
-  return bitwise_or_expr;
-}
-
-std::unique_ptr<ExprAST> Parser::parse_logical_or() {
-  std::unique_ptr<ExprAST> and_expr = parse_logical_and();
-
-  while (check(TokenType::OR)) {
-    OperationType op = parse_operator();
-    auto next_and = parse_logical_and();
-
-    and_expr = std::make_unique<BinaryOpExpr>(op, std::move(and_expr),
-                                              std::move(next_and));
+  case PendingOperator::Kind::PAREN:
+    throw std::runtime_error("Parentheses mismatch on bounded expression");
   }
-
-  return and_expr;
 }
 
-std::unique_ptr<ExprAST> Parser::parse_expression() {
-  std::unique_ptr<ExprAST> expr;
-
-  // TODO: Add check for if the expression is just a reference to a variable
-
-  // TODO: What if the reference is part of a broader expression, like (y *
-  // 2)?
-
-  if (check(TokenType::IDENTIFIER)) {
-    // Expression path for assigning a value to a variable
-    if (check_next(TokenType::ASSIGN)) {
-      Token var = advance();
-      std::string var_name = std::get<std::string>(var.literal);
+} // namespace
+
+ExprPtr Parser::parse_expression() {
+  TraceSpan span("parse_expression", "parse");
+  std::vector<ExprPtr> operands;
+  std::vector<PendingOperator> operators;
+  int open_parens = 0;
+  bool expect_operand = true;
+
+  while (true) {
+    if (expect_operand) {
+      // An assignment may only start an <expr>, so 'a + b = 1' stays invalid
+      bool at_expr_start =
+          operators.empty() ||
+          operators.back().kind == PendingOperator::Kind::PAREN ||
+          operators.back().kind == PendingOperator::Kind::ASSIGN;
+
+      if (check(TokenType::OPEN_PAREN)) {
+        advance();
+        operators.push_back({PendingOperator::Kind::PAREN,
+                             OperationType::ADD, 0, ""});
+        ++open_parens;
+      } else if (!is_at_end() && is_unary_operator(peek_type())) {
+        OperationType op = parse_operator();
+        operators.push_back(
+            {PendingOperator::Kind::UNARY, op, UNARY_PRECEDENCE, ""});
+      } else if (at_expr_start && check(TokenType::IDENTIFIER) &&
+                 check_next(TokenType::ASSIGN)) {
+        const Token &var = advance();
+        std::string var_name(std::get<std::string_view>(var.literal));
+        consume(TokenType::ASSIGN, "Expected assignment operator '='");
+
+        operators.push_back({PendingOperator::Kind::ASSIGN,
+                             OperationType::ADD, 0, std::move(var_name)});
+      } else if (check(TokenType::INT)) {
+        const Token &num = advance();
+        operands.push_back(factory->literal(std::get<int>(num.literal)));
+        expect_operand = false;
+      } else if (check(TokenType::IDENTIFIER)) {
+        const Token &var = advance();
+        std::string var_name(std::get<std::string_view>(var.literal));
+        operands.push_back(factory->variable(std::move(var_name)));
+        expect_operand = false;
+      } else if (operators.empty()) {
+        // No expression at all, callers decide whether that is an error
+        return nullptr;
+      } else {
+        throw std::runtime_error("Syntax Error: Expected an expression");
+      }
 
-      consume(TokenType::ASSIGN, "Expected assignment operator '='");
+      continue;
+    }
 
-      auto assign_expr = parse_expression();
+    int precedence = is_at_end() ? 0 : binary_precedence(peek_type());
+
+    if (precedence > 0) {
+      // A left associative operator reduces the ones of its own precedence
+      // before it is pushed, a right associative one stacks on them
+      OperationType op = parse_operator();
+      int reduced = operator_info(op).associativity == Associativity::LEFT
+                        ? precedence
+                        : precedence + 1;
+      while (!operators.empty() &&
+             (operators.back().kind == PendingOperator::Kind::UNARY ||
+              operators.back().kind == PendingOperator::Kind::BINARY) &&
+             operators.back().precedence >= reduced) {
+        reduce(operators, operands, *factory);
+      }
 
-      if (assign_expr == nullptr) {
-        throw std::runtime_error(
-            "Expected an expression after variable assignment declared");
+      operators.push_back({PendingOperator::Kind::BINARY, op, precedence, ""});
+      expect_operand = true;
+    } else if (open_parens > 0 && check(TokenType::CLOSE_PAREN)) {
+      while (operators.back().kind != PendingOperator::Kind::PAREN) {
+        reduce(operators, operands, *factory);
       }
 
-      expr = std::make_unique<VariableAssignExpr>(var_name,
-                                                  std::move(assign_expr));
+      operators.pop_back();
+      --open_parens;
+      advance();
     } else {
-      expr = parse_logical_or();
+      break;
     }
-  } else {
-    // Expression path for all logical expressions
-    expr = parse_logical_or();
   }
 
-  return expr;
+  while (!operators.empty()) {
+    reduce(operators, operands, *factory);
+  }
+
+  return std::move(operands.back());
 }
 
 std::unique_ptr<StmtAST> Parser::parse_statement() {
-  if (check(TokenType::RETURN)) {
+  if (check(TokenType::OPEN_BRACE)) {
+    return parse_block();
+  } else if (check(TokenType::WHILE)) {
+    return parse_while();
+  } else if (check(TokenType::FOR)) {
+    return parse_for();
+  } else if (check(TokenType::RETURN)) {
     advance(); // Consume the return token
     auto expr = parse_expression();
 
     consume(TokenType::SEMICOLON, "Expected ';' after return value");
     return std::make_unique<ReturnStmt>(std::move(expr));
   } else if (check(TokenType::INT_TYPE)) {
-    std::cout << "Parsing var init\n";
     // TODO: Find a better way to do this with types in general --> what if a
     // user is eventually defining their own custom types?
     VariableType var_type = parse_type();
-    std::string var_name =
-        std::get<std::string>(consume(TokenType::IDENTIFIER).literal);
+    std::string var_name(std::get<std::string_view>(
+        consume(TokenType::IDENTIFIER, "Expected a variable name").literal));
 
     // TODO: How exactly should we handle parsing VariableAssignExpr vs.
     // VariableDeclStmt? One has nullptr as a valid expression
@@ -374,18 +338,20 @@ std::unique_ptr<StmtAST> Parser::parse_statement() {
     // Maybe check if the decl statement even has assignment first (check for
     // equal sign/semicolon)
 
-    std::unique_ptr<ExprAST> expr = nullptr;
+    ExprPtr expr = nullptr;
 
     if (check(TokenType::ASSIGN)) {
       consume(TokenType::ASSIGN);
       expr = parse_expression();
+      if (expr == nullptr) {
+        throw std::runtime_error("Syntax Error: Expected an initializer");
+      }
     }
 
     consume(TokenType::SEMICOLON, "Expected ';' after variable declaration");
     return std::make_unique<VariableDeclStmt>(var_type, var_name,
                                               std::move(expr));
   } else { // Assume it's an expression
-    std::cout << "parsing expr_stmt\n";
     auto expr = parse_expression();
 
     consume(TokenType::SEMICOLON, "Expected ';' after expression");
@@ -398,27 +364,139 @@ std::unique_ptr<StmtAST> Parser::parse_statement() {
   }
 }
 
-std::unique_ptr<FunctionDecl> Parser::parse_function() {
-  VariableType return_type = parse_type();
-  std::string func_name = std::get<std::string>(
-      consume(TokenType::IDENTIFIER,
-              "Incorrect function definition: Check function identifier")
-          .literal);
-  std::vector<std::unique_ptr<VariableDeclStmt>> func_parameters =
-      parse_func_parameters();
-  consume(TokenType::OPEN_BRACE, "Incorrect function definition: Check braces");
+std::unique_ptr<StmtAST> Parser::parse_positioned_statement() {
+  const Token &first = peek();
+  auto statement = parse_statement();
+  statement->line = first.line;
+  statement->column = first.column;
+
+  return statement;
+}
+
+std::vector<std::unique_ptr<StmtAST>> Parser::parse_statements() {
+  TraceSpan span("parse_statements", "parse");
+  std::vector<std::unique_ptr<StmtAST>> body;
+
+  while (!is_at_end() && !check(TokenType::CLOSE_BRACE)) {
+    try {
+      body.push_back(parse_positioned_statement());
+    } catch (const std::runtime_error &e) {
+      report_error(e.what());
+      synchronize();
+    }
+  }
+
+  return body;
+}
+
+std::unique_ptr<BlockStmt> Parser::parse_block() {
+  consume(TokenType::OPEN_BRACE, "Expected '{' to start a block");
+  auto block = std::make_unique<BlockStmt>(parse_statements());
+  consume(TokenType::CLOSE_BRACE, "Expected '}' at the end of a block");
+
+  return block;
+}
+
+std::unique_ptr<BlockStmt> Parser::parse_loop_body() {
+  if (check(TokenType::OPEN_BRACE)) {
+    return parse_block();
+  }
 
+  // A lone statement still gets a scope of its own
   std::vector<std::unique_ptr<StmtAST>> body;
+  body.push_back(parse_positioned_statement());
+  return std::make_unique<BlockStmt>(std::move(body));
+}
+
+std::unique_ptr<StmtAST> Parser::parse_while() {
+  consume(TokenType::WHILE);
+  consume(TokenType::OPEN_PAREN, "Expected '(' after 'while'");
+  ExprPtr cond = parse_expression();
+  if (cond == nullptr) {
+    throw std::runtime_error("Syntax Error: Expected a loop condition");
+  }
+  consume(TokenType::CLOSE_PAREN, "Expected ')' after the loop condition");
+
+  return std::make_unique<WhileStmt>(std::move(cond), parse_loop_body());
+}
 
-  // TODO: Think about how safe this is/isn't: What if the user just forgets the
-  // closing brace? The compiler should throw an error
-  while (!check(TokenType::CLOSE_BRACE)) {
-    auto statement = parse_statement();
-    body.push_back(std::move(statement));
+std::unique_ptr<StmtAST> Parser::parse_for() {
+  const Token &first = consume(TokenType::FOR);
+  consume(TokenType::OPEN_PAREN, "Expected '(' after 'for'");
+
+  // for (init; cond; step) body becomes
+  // { init; while (cond) { body; step; } }, where a missing condition is 1
+  std::vector<std::unique_ptr<StmtAST>> outer;
+  if (!check_advance(TokenType::SEMICOLON)) {
+    if (!check(TokenType::INT_TYPE)) {
+      const Token &init = peek();
+      outer.push_back(std::make_unique<ExprStmt>(parse_expression()));
+      outer.back()->line = init.line;
+      outer.back()->column = init.column;
+      consume(TokenType::SEMICOLON, "Expected ';' after the loop initializer");
+    } else {
+      outer.push_back(parse_positioned_statement());
+    }
+  }
+
+  ExprPtr cond = check(TokenType::SEMICOLON) ? factory->literal(1)
+                                             : parse_expression();
+  consume(TokenType::SEMICOLON, "Expected ';' after the loop condition");
+
+  std::unique_ptr<StmtAST> step;
+  if (!check(TokenType::CLOSE_PAREN)) {
+    const Token &at = peek();
+    step = std::make_unique<ExprStmt>(parse_expression());
+    step->line = at.line;
+    step->column = at.column;
+  }
+  consume(TokenType::CLOSE_PAREN, "Expected ')' after the loop step");
+
+  // The body keeps its own scope, which the step is outside of
+  std::vector<std::unique_ptr<StmtAST>> inner;
+  inner.push_back(parse_loop_body());
+  inner.back()->line = first.line;
+  inner.back()->column = first.column;
+  if (step != nullptr) {
+    inner.push_back(std::move(step));
+  }
+
+  outer.push_back(std::make_unique<WhileStmt>(
+      std::move(cond), std::make_unique<BlockStmt>(std::move(inner))));
+  outer.back()->line = first.line;
+  outer.back()->column = first.column;
+
+  return std::make_unique<BlockStmt>(std::move(outer));
+}
+
+std::unique_ptr<FunctionDecl> Parser::parse_function() {
+  TraceSpan span("parse_function", "parse");
+  VariableType return_type = VariableType::INT;
+  std::string func_name;
+  std::vector<std::unique_ptr<VariableDeclStmt>> func_parameters;
+
+  try {
+    return_type = parse_type();
+    func_name = std::string(std::get<std::string_view>(
+        consume(TokenType::IDENTIFIER,
+                "Incorrect function definition: Check function identifier")
+            .literal));
+    func_parameters = parse_func_parameters();
+    consume(TokenType::OPEN_BRACE,
+            "Incorrect function definition: Check braces");
+  } catch (const std::runtime_error &e) {
+    // Skip the rest of a broken header so the body can still be checked
+    report_error(e.what());
+    while (!is_at_end() && !check_advance(TokenType::OPEN_BRACE)) {
+      advance();
+    }
   }
 
-  consume(TokenType::CLOSE_BRACE,
-          "Incoreect function definition: Check braces");
+  std::vector<std::unique_ptr<StmtAST>> body = parse_statements();
+
+  if (!check_advance(TokenType::CLOSE_BRACE)) {
+    report_error("Incorrect function definition: Missing closing brace");
+  }
 
   return std::make_unique<FunctionDecl>(
       func_name, return_type, std::move(func_parameters), std::move(body));
@@ -1,7 +1,10 @@
 #include "ast.h"
+#include "ast_factory.h"
+#include "diagnostic.h"
 #include "lex.h"
 
 #include <memory>
+#include <string>
 #include <vector>
 
 /*
@@ -10,8 +13,11 @@ Grammer for the parser:
 <program> ::= <function>
 <function> ::= "int" <id> "(" ")" "{" { <statement> } "}"
 <statement> ::= "return" <expr> ";" | <variable_type> <id> [ = <expr> ] ";" |
-<expr> ";" <variable_type> ::= "int"
-";"
+<expr> ";" | <block> | "while" "(" <expr> ")" <statement> |
+"for" "(" [ <variable_type> <id> [ = <expr> ] | <expr> ] ";" [ <expr> ] ";"
+[ <expr> ] ")" <statement>
+<block> ::= "{" { <statement> } "}"
+<variable_type> ::= "int"
 <expr> ::= <id> "=" <expr>  | <logical_or_expr>
 <logical_or_expr> ::= <logical_and_expr> { "||" <logical_and_expr> }
 <logical_and_expr>
@@ -35,18 +41,52 @@ not only might it be left recursive infinitely, but it also doesn't distinguish
 between 1 - 2 - 3 being interpreted as (1 - 2) - 3 (correct) and 1 - (2 - 3)
 (incorrect). It also ensures that unary operations take place before binary
 expressions, as expected.
+
+There is no node for 'for' loops. One is parsed straight into the block
+'{ init; while (cond) { body; step; } }', with 1 for a missing condition,
+which runs the same way since there is no 'continue'. Loop bodies are always
+blocks, so a body without braces still has a scope of its own.
+
+The grammar above describes the language, but parse_expression does not
+mirror it level by level. Each binary level becomes one row of a precedence
+table, and the expression is built with an operator-precedence (shunting-yard)
+loop, so a lone literal no longer walks through eleven nested calls.
 */
 class Parser {
 public:
-  explicit Parser(const std::vector<Token> &tokens)
-      : tokens(std::move(tokens)) {};
+  // The parser only borrows the token stream, which must outlive it
+  explicit Parser(const std::vector<Token> &tokens) : tokens(tokens) {};
+
+  // Builds expression nodes through 'factory', which may hash-cons them.
+  // Trees parsed this way must not outlive the factory (see ast_factory.h)
+  Parser(const std::vector<Token> &tokens, ExprFactory &factory)
+      : tokens(tokens), factory(&factory) {};
 
+  // Parses the whole token stream, recovering from syntax errors where it
+  // can. Any errors are left in get_diagnostics(), and the returned tree must
+  // not be used for codegen if there are some
   std::unique_ptr<FunctionDecl> parse();
 
+  const std::vector<Diagnostic> &get_diagnostics() const {
+    return diagnostics;
+  }
+
+  // Parses the single statement starting at token 'start' and sets 'end' one
+  // past its last token. Unlike parse(), syntax errors are thrown rather than
+  // recovered from. Used to re-parse only the statements an edit touched
+  std::unique_ptr<StmtAST> parse_statement_at(int start, int &end);
+
 private:
-  std::vector<Token> tokens;
+  const std::vector<Token> &tokens;
   int current_token = 0;
 
+  // Expression nodes come from the caller's factory, or a plain one
+  ExprFactory own_factory;
+  ExprFactory *factory = &own_factory;
+
+  // Syntax errors collected during panic-mode recovery
+  std::vector<Diagnostic> diagnostics;
+
   /* Helper functions */
 
   // Helper to check the type of the current token without consuming it
@@ -57,10 +97,18 @@ private:
 
   // Helper to consume the current token, throws an error if it's not of the
   // passed (assumed to be correct) type
-  Token consume(const TokenType &type, const std::string &error_message);
+  const Token &consume(const TokenType &type,
+                       const std::string &error_message);
 
   // Helper to advance through the list of tokens
-  Token advance();
+  const Token &advance();
+
+  // Helper to read the current token type without consuming or copying it
+  TokenType peek_type();
+
+  // Helper to read the current token without consuming it, throws an error at
+  // the end of the stream
+  const Token &peek();
 
   // Check the current token and advance if it is valid, return boolean based on
   // result
@@ -69,6 +117,14 @@ private:
   // Helper to check if the list of tokens has been exhausted
   bool is_at_end();
 
+  // Records a syntax error at the current token (or the last one at the end
+  // of the stream)
+  void report_error(const std::string &message);
+
+  // Panic-mode recovery: skips tokens until just past a ';' or up to a '}',
+  // so parsing can resume at the next statement
+  void synchronize();
+
   // Helper to parse VariableTypes from tokens
   VariableType parse_type();
 
@@ -80,44 +136,31 @@ private:
 
   /* Grammar Matching Methods */
 
-  // Corresponds to the 'expr' rule
-  std::unique_ptr<ExprAST> parse_expression();
-
-  // Corresponds to the 'logical_or_expr' role
-  std::unique_ptr<ExprAST> parse_logical_or();
-
-  // Corresponds to the 'logical_and_expr' rule
-  std::unique_ptr<ExprAST> parse_logical_and();
-
-  // Corresponds to the 'bitwise_or_expr' rule
-  std::unique_ptr<ExprAST> parse_bitwise_or();
-
-  // Corresponds to the 'bitwise_xor_expr' rule
-  std::unique_ptr<ExprAST> parse_bitwise_xor();
+  // Corresponds to the 'expr' rule and every binary precedence level below
+  // it. Uses explicit operand/operator stacks driven by a precedence table
+  // keyed by TokenType, so neither long operator chains nor deep nesting
+  // recurse on the native stack
+  ExprPtr parse_expression();
 
-  // Corresponds to the 'bitwise_and_expr' rule
-  std::unique_ptr<ExprAST> parse_bitwise_and();
-
-  // Corresponds to the 'equality_expr' rule
-  std::unique_ptr<ExprAST> parse_equality();
-
-  // Corresponds to the 'relational_expr' rule
-  std::unique_ptr<ExprAST> parse_relational();
+  // Corresponds to the 'statement' rule
+  std::unique_ptr<StmtAST> parse_statement();
 
-  // Corresponds to the 'bitshift_expr' rule
-  std::unique_ptr<ExprAST> parse_bitshift();
+  // Parses statements up to the '}' closing the enclosing block, which is
+  // left for the caller, recovering from syntax errors in each of them
+  std::vector<std::unique_ptr<StmtAST>> parse_statements();
 
-  // Corresponds to the 'additive_expr' rule
-  std::unique_ptr<ExprAST> parse_additive();
+  // Corresponds to the 'block' rule
+  std::unique_ptr<BlockStmt> parse_block();
 
-  // Corresponds to the 'term' rule
-  std::unique_ptr<ExprAST> parse_term();
+  // The statement after a loop header, wrapped in a block if it is not one
+  std::unique_ptr<BlockStmt> parse_loop_body();
 
-  // Corresponds to the 'factor' rule
-  std::unique_ptr<ExprAST> parse_factor();
+  // The 'while' and 'for' loop statements
+  std::unique_ptr<StmtAST> parse_while();
+  std::unique_ptr<StmtAST> parse_for();
 
-  // Corresponds to the 'statement' rule (only return statements for now)
-  std::unique_ptr<StmtAST> parse_statement();
+  // parse_statement, recording where the statement starts on the node
+  std::unique_ptr<StmtAST> parse_positioned_statement();
 
   // Corresponds to the 'function declaration' rule
   std::unique_ptr<FunctionDecl> parse_function();
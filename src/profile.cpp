@@ -0,0 +1,72 @@
+#include "profile.h"
+#include "ast.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+std::unordered_map<const ExprAST *, int>
+number_branch_sites(const FunctionDecl *function) {
+  std::unordered_map<const ExprAST *, int> sites;
+
+  for (const auto &stmt : function->body) {
+    for_each_expression(stmt.get(), [&](ExprPtr &root) {
+      for_each_node(root.get(), [&](const ExprAST *node) {
+        if (node->kind != ExprKind::BINARY_OP) {
+          return;
+        }
+        auto op = static_cast<const BinaryOpExpr *>(node)->op;
+        if (op == OperationType::AND || op == OperationType::OR) {
+          sites.emplace(node, static_cast<int>(sites.size()));
+        }
+      });
+    });
+  }
+
+  return sites;
+}
+
+BranchProfile read_profile(const std::string &file_path) {
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Failed to open profile " + file_path);
+  }
+  std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)),
+                                   std::istreambuf_iterator<char>());
+
+  // Counters are little-endian whatever machine reads them
+  std::size_t count = bytes.size() / 8;
+  auto counter = [&](std::size_t index) {
+    std::uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+      value = value << 8 | bytes[index * 8 + i];
+    }
+    return value;
+  };
+
+  if (bytes.size() % 8 != 0 || count < PROFILE_HEADER_COUNTERS ||
+      counter(0) != PROFILE_MAGIC) {
+    throw std::runtime_error(file_path + " is not a profile");
+  }
+
+  std::uint64_t sites = counter(1);
+  if (sites != (count - PROFILE_HEADER_COUNTERS) / 2 ||
+      (count - PROFILE_HEADER_COUNTERS) % 2 != 0) {
+    throw std::runtime_error("Profile " + file_path + " is truncated");
+  }
+
+  BranchProfile profile;
+  profile.entries = counter(PROFILE_ENTRY_COUNTER);
+  profile.sites.resize(sites);
+  for (std::size_t site = 0; site < sites; ++site) {
+    profile.sites[site].reached = counter(reached_counter(site));
+    profile.sites[site].short_circuited =
+        counter(short_circuit_counter(site));
+  }
+  return profile;
+}
@@ -0,0 +1,74 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "ast.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+Profile-guided lowering of && and ||.
+
+An instrumented build (see AstAssembly::set_instrumented) counts how often
+its function is entered and, for every && and || (a branch site), how
+often the left side is evaluated and how often it decides the result on its
+own. When main returns, the counters are written to PROFILE_FILE_NAME in the
+working directory as little-endian 64-bit words:
+
+  PROFILE_MAGIC, number of sites, entries, then per site: reached, short
+  circuited
+
+Sites are numbered in tree order, so compiling the same source with the
+same flags again finds the same sites, and a profile read back with
+read_profile lets AstAssembly::set_profile lower each site the way its
+counts favour: the outcome taken most often falls through and the other is
+moved out of line, and a site that goes the same way nearly every time
+branches instead of evaluating a branchless compare chain.
+*/
+
+constexpr const char *PROFILE_FILE_NAME = "profile.counts";
+constexpr std::uint64_t PROFILE_MAGIC = 0x31464f5250434343; // "CCCPROF1"
+
+// The magic, the number of sites and the entry count come first
+constexpr int PROFILE_HEADER_COUNTERS = 3;
+constexpr int PROFILE_ENTRY_COUNTER = 2;
+
+// Index of a site's counters in the table
+inline int reached_counter(int site) {
+  return PROFILE_HEADER_COUNTERS + 2 * site;
+}
+inline int short_circuit_counter(int site) { return reached_counter(site) + 1; }
+
+// A site whose left side decides it at least this often, or at most one
+// minus this often, branches predictably
+constexpr double PREDICTABLE_BIAS = 0.9;
+
+struct BranchProfile {
+  struct Site {
+    std::uint64_t reached = 0;
+    std::uint64_t short_circuited = 0;
+
+    // Share of evaluations the left side decided, 0 if never reached
+    double bias() const {
+      return reached == 0 ? 0.0
+                          : static_cast<double>(short_circuited) / reached;
+    }
+  };
+
+  std::uint64_t entries = 0;
+  std::vector<Site> sites;
+};
+
+// Numbers every && and || node of the function by the order a walk of its
+// statements meets them, parents before children. A node shared by hash
+// consing keeps the number of its first appearance
+std::unordered_map<const ExprAST *, int>
+number_branch_sites(const FunctionDecl *function);
+
+// Reads a file written by an instrumented program, throwing
+// std::runtime_error if it cannot be read or is not a profile
+BranchProfile read_profile(const std::string &file_path);
+
+#endif
@@ -0,0 +1,198 @@
+#include "resolver.h"
+#include "ast.h"
+#include "ast_factory.h"
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Binds a reference to 'slot'. 'replacement' is a copy of 'node' made for
+// new children, if any, and is bound instead. An interned node already bound
+// to another slot is copied first. Returns the copy, or nullptr if 'node' was
+// bound in place
+template <class Reference>
+ExprPtr bind(Reference *node, ExprPtr replacement, int slot) {
+  if (replacement != nullptr) {
+    node = static_cast<Reference *>(replacement.get());
+  } else if (node->interned && node->slot != -1 && node->slot != slot) {
+    replacement = copy_node(node);
+    node = static_cast<Reference *>(replacement.get());
+  }
+
+  node->slot = slot;
+  return replacement;
+}
+
+} // namespace
+
+bool Resolver::resolve(FunctionDecl *function) {
+  diagnostics.clear();
+  begin_function(function);
+  resolve_body(function->body);
+
+  return diagnostics.empty();
+}
+
+void Resolver::begin_function(FunctionDecl *function) {
+  this->function = function;
+  function->slot_count = 0;
+  bindings.clear();
+  scopes.clear();
+  enter_scope();
+}
+
+void Resolver::resolve_statement(StmtAST *statement) {
+  std::size_t first_error = diagnostics.size();
+  resolve_nested(statement);
+
+  if (diagnostics.size() > first_error) {
+    std::string message = diagnostics[first_error].message;
+    diagnostics.erase(diagnostics.begin() + first_error, diagnostics.end());
+    throw std::runtime_error(message);
+  }
+}
+
+void Resolver::declare_statement(StmtAST *statement) {
+  switch (statement->kind) {
+  case StmtKind::VARIABLE_DECL:
+    declare(static_cast<VariableDeclStmt *>(statement));
+    break;
+  case StmtKind::BLOCK:
+    enter_scope();
+    for (auto &nested : static_cast<BlockStmt *>(statement)->body) {
+      declare_statement(nested.get());
+    }
+    leave_scope();
+    break;
+  case StmtKind::WHILE:
+    declare_statement(static_cast<WhileStmt *>(statement)->body.get());
+    break;
+  default:
+    break;
+  }
+}
+
+void Resolver::enter_scope() { scopes.emplace_back(); }
+
+void Resolver::leave_scope() {
+  for (const std::string &name : scopes.back()) {
+    bindings[name].pop_back();
+  }
+  scopes.pop_back();
+}
+
+void Resolver::declare(VariableDeclStmt *decl) {
+  std::vector<Binding> &visible = bindings[decl->name];
+  if (!visible.empty() && visible.back().scope == scopes.size() - 1) {
+    throw std::runtime_error("Attempted to declare variable '" + decl->name +
+                             "' multiple times");
+  }
+
+  decl->slot = function->slot_count++;
+  visible.push_back({decl->slot, scopes.size() - 1});
+  scopes.back().push_back(decl->name);
+}
+
+void Resolver::resolve_body(std::vector<std::unique_ptr<StmtAST>> &body) {
+  for (auto &statement : body) {
+    try {
+      resolve_nested(statement.get());
+    } catch (const std::runtime_error &e) {
+      diagnostics.emplace_back(statement->line, statement->column, e.what());
+    }
+  }
+}
+
+void Resolver::resolve_nested(StmtAST *statement) {
+  switch (statement->kind) {
+  case StmtKind::VARIABLE_DECL: {
+    // The variable is declared even if its initializer has an error, so its
+    // later uses are not reported as well
+    auto *decl = static_cast<VariableDeclStmt *>(statement);
+    std::string error;
+    if (decl->decl_expr != nullptr) {
+      try {
+        resolve_expression(decl->decl_expr);
+      } catch (const std::runtime_error &e) {
+        error = e.what();
+      }
+    }
+
+    declare(decl);
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+    break;
+  }
+  case StmtKind::RETURN: {
+    auto *ret = static_cast<ReturnStmt *>(statement);
+    if (ret->expr != nullptr) {
+      resolve_expression(ret->expr);
+    }
+    break;
+  }
+  case StmtKind::EXPR:
+    resolve_expression(static_cast<ExprStmt *>(statement)->expr);
+    break;
+  case StmtKind::BLOCK:
+    enter_scope();
+    resolve_body(static_cast<BlockStmt *>(statement)->body);
+    leave_scope();
+    break;
+  case StmtKind::WHILE: {
+    // The body is still resolved after an error in the condition
+    auto *loop = static_cast<WhileStmt *>(statement);
+    std::string error;
+    try {
+      resolve_expression(loop->cond);
+    } catch (const std::runtime_error &e) {
+      error = e.what();
+    }
+
+    resolve_nested(loop->body.get());
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+    break;
+  }
+  }
+}
+
+int Resolver::lookup(const std::string &name) const {
+  auto found = bindings.find(name);
+  if (found == bindings.end() || found->second.empty()) {
+    throw std::runtime_error("Use of undeclared variable '" + name + "'");
+  }
+
+  return found->second.back().slot;
+}
+
+ExprPtr Resolver::leave(VariableExpr *variable) {
+  return bind(variable, nullptr, lookup(variable->name));
+}
+
+ExprPtr Resolver::leave(UnaryOpExpr *unary, ExprPtr child) {
+  return replace_children(unary, std::move(child), nullptr);
+}
+
+ExprPtr Resolver::leave(BinaryOpExpr *binary, ExprPtr lhs, ExprPtr rhs) {
+  return replace_children(binary, std::move(lhs), std::move(rhs));
+}
+
+ExprPtr Resolver::leave(VariableAssignExpr *assign, ExprPtr child) {
+  ExprPtr copy = replace_children(assign, std::move(child), nullptr);
+  return bind(assign, std::move(copy), lookup(assign->var_name));
+}
+
+ExprPtr Resolver::leave(TempStoreExpr *store, ExprPtr child) {
+  // Temporaries are never interned, so they are changed in place
+  if (child != nullptr) {
+    store->expr = std::move(child);
+  }
+  return nullptr;
+}
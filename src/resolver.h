@@ -0,0 +1,102 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "ast.h"
+#include "diagnostic.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+Name resolution, run between parsing and everything else. Binds each
+variable reference and declaration to a dense slot number once, so codegen
+and the passes after it index flat arrays instead of hashing names.
+
+Declarations are numbered in order from 0, and FunctionDecl::slot_count ends
+up one past the last. A declaration always gets a new slot, even one that
+shadows a variable of an enclosing scope. Names are looked up through a
+stack of scopes: redeclaring a name in the same scope is an error, as is
+naming a variable no enclosing scope declares. A variable is only in scope
+after its declaration, so not in its own initializer. The function body,
+each block and each loop body is a scope. Parameters, which are never
+passed, are not declared at all.
+
+Interned nodes (see ast_factory.h) are bound in place when first reached. A
+shared reference reached again under a different binding is replaced by a
+copy, so code memoized per node stays valid.
+*/
+class Resolver : private ExprRewriter<Resolver> {
+public:
+  // Resolves the whole body, carrying on past errors so every one of them is
+  // reported. Returns false if there were errors, which are left in
+  // get_diagnostics(), and the tree must then not be used further
+  bool resolve(FunctionDecl *function);
+
+  const std::vector<Diagnostic> &get_diagnostics() const {
+    return diagnostics;
+  }
+
+  // Entry points for resolving one statement of the body at a time (see
+  // incremental.h). begin_function resets the scopes, and each statement is
+  // resolved in the scope the ones before it leave. The first error in the
+  // statement is thrown as std::runtime_error
+  void begin_function(FunctionDecl *function);
+  void resolve_statement(StmtAST *statement);
+
+  // Numbers the declarations in 'statement', in the scopes they are in,
+  // without looking at any expression. Used when the code of the statement
+  // is reused instead of regenerated
+  void declare_statement(StmtAST *statement);
+
+private:
+  struct Binding {
+    int slot;
+    std::size_t scope;
+  };
+
+  FunctionDecl *function = nullptr;
+
+  // Visible declarations of each name, innermost last
+  std::unordered_map<std::string, std::vector<Binding>> bindings;
+
+  // Names declared in each open scope, innermost last
+  std::vector<std::vector<std::string>> scopes;
+
+  std::vector<Diagnostic> diagnostics;
+
+  void enter_scope();
+  void leave_scope();
+
+  // Numbers the variable of 'decl' in the innermost scope
+  void declare(VariableDeclStmt *decl);
+
+  // Resolves each statement, recording the errors of each at its position
+  void resolve_body(std::vector<std::unique_ptr<StmtAST>> &body);
+
+  // Resolves one statement, throwing its own errors. Those of statements
+  // nested in it are recorded by resolve_body instead
+  void resolve_nested(StmtAST *statement);
+
+  // Slot of the innermost declaration of 'name', throws if there is none
+  int lookup(const std::string &name) const;
+
+  // Binds every reference in the tree, replacing 'root' if the whole tree
+  // had to be copied
+  void resolve_expression(ExprPtr &root) { rewrite(root); }
+
+  // References are bound as they are left, in evaluation order. Each returns
+  // the copy replacing the node, if any
+  friend class ExprRewriter<Resolver>;
+  ExprPtr leave(IntLiteralExpr *) { return nullptr; }
+  ExprPtr leave(VariableExpr *variable);
+  ExprPtr leave(UnaryOpExpr *unary, ExprPtr child);
+  ExprPtr leave(BinaryOpExpr *binary, ExprPtr lhs, ExprPtr rhs);
+  ExprPtr leave(VariableAssignExpr *assign, ExprPtr child);
+  ExprPtr leave(TempStoreExpr *store, ExprPtr child);
+  ExprPtr leave(TempLoadExpr *) { return nullptr; }
+};
+
+#endif
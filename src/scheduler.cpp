@@ -0,0 +1,847 @@
+#include "scheduler.h"
+#include "allocation.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+enum class Pipe { INTEGER, MULTIPLY, LOAD, STORE, BRANCH };
+
+constexpr int PIPE_KINDS = 5;
+
+// Pipes of each kind, in the order of Pipe
+constexpr std::array<int, PIPE_KINDS> PIPE_COUNT = {2, 1, 1, 1, 1};
+
+// Instructions issued per cycle
+constexpr int ISSUE_WIDTH = 3;
+
+struct OpcodeModel {
+  std::string_view opcode;
+  int latency;
+  Pipe pipe;
+
+  // Cycles the pipe stays busy, more than one only for the divider, which
+  // is not pipelined
+  int occupancy;
+};
+
+// From the Cortex-A72 Software Optimization Guide, for the forms the code
+// generator emits, and the other integer forms gcc emits, so its code can be
+// estimated for comparison. sdiv and udiv take 4 to 12 cycles depending on
+// their operands, the worst case is assumed
+constexpr OpcodeModel OPCODE_MODELS[] = {
+    {"mov", 1, Pipe::INTEGER, 1},    {"movk", 1, Pipe::INTEGER, 1},
+    {"add", 1, Pipe::INTEGER, 1},    {"sub", 1, Pipe::INTEGER, 1},
+    {"and", 1, Pipe::INTEGER, 1},    {"orr", 1, Pipe::INTEGER, 1},
+    {"eor", 1, Pipe::INTEGER, 1},    {"neg", 1, Pipe::INTEGER, 1},
+    {"mvn", 1, Pipe::INTEGER, 1},    {"lsl", 1, Pipe::INTEGER, 1},
+    {"asr", 1, Pipe::INTEGER, 1},    {"cmp", 1, Pipe::INTEGER, 1},
+    {"cmn", 1, Pipe::INTEGER, 1},    {"ccmp", 1, Pipe::INTEGER, 1},
+    {"cset", 1, Pipe::INTEGER, 1},   {"mul", 3, Pipe::MULTIPLY, 1},
+    {"msub", 3, Pipe::MULTIPLY, 1},  {"sdiv", 12, Pipe::MULTIPLY, 12},
+    {"ldr", 4, Pipe::LOAD, 1},       {"ldp", 4, Pipe::LOAD, 1},
+    {"str", 1, Pipe::STORE, 1},      {"stp", 1, Pipe::STORE, 1},
+    {"b", 1, Pipe::BRANCH, 1},       {"cbz", 1, Pipe::BRANCH, 1},
+    {"cbnz", 1, Pipe::BRANCH, 1},    {"ret", 1, Pipe::BRANCH, 1},
+    {"lsr", 1, Pipe::INTEGER, 1},    {"ands", 1, Pipe::INTEGER, 1},
+    {"adds", 1, Pipe::INTEGER, 1},   {"subs", 1, Pipe::INTEGER, 1},
+    {"tst", 1, Pipe::INTEGER, 1},    {"ccmn", 1, Pipe::INTEGER, 1},
+    {"csetm", 1, Pipe::INTEGER, 1},  {"csel", 1, Pipe::INTEGER, 1},
+    {"csinc", 1, Pipe::INTEGER, 1},  {"csinv", 1, Pipe::INTEGER, 1},
+    {"csneg", 1, Pipe::INTEGER, 1},  {"cinc", 1, Pipe::INTEGER, 1},
+    {"cneg", 1, Pipe::INTEGER, 1},   {"sxtb", 1, Pipe::INTEGER, 1},
+    {"sxth", 1, Pipe::INTEGER, 1},   {"sxtw", 1, Pipe::INTEGER, 1},
+    {"uxtb", 1, Pipe::INTEGER, 1},   {"uxth", 1, Pipe::INTEGER, 1},
+    {"sbfx", 1, Pipe::INTEGER, 1},   {"ubfx", 1, Pipe::INTEGER, 1},
+    {"sbfiz", 1, Pipe::INTEGER, 1},  {"ubfiz", 1, Pipe::INTEGER, 1},
+    {"madd", 3, Pipe::MULTIPLY, 1},  {"smull", 3, Pipe::MULTIPLY, 1},
+    {"umull", 3, Pipe::MULTIPLY, 1}, {"smulh", 6, Pipe::MULTIPLY, 4},
+    {"umulh", 6, Pipe::MULTIPLY, 4}, {"udiv", 12, Pipe::MULTIPLY, 12},
+    {"tbz", 1, Pipe::BRANCH, 1},     {"tbnz", 1, Pipe::BRANCH, 1},
+};
+
+// An arithmetic or logic operand shifted by a register shift ("add w0, w1,
+// w2, lsl #2") goes through the multi-cycle pipe, a cycle later
+constexpr int SHIFTED_OPERAND_LATENCY = 2;
+
+// A base register written back by a load or store is ready before the
+// access completes
+constexpr int WRITEBACK_LATENCY = 1;
+
+// A load of what a store just wrote waits for it to reach the store buffer
+constexpr int STORE_TO_LOAD_LATENCY = 1;
+
+// Register numbers beyond x0-x30
+constexpr int SP = 31;
+constexpr int FLAGS = 32;
+constexpr int REGISTER_COUNT = 33;
+
+// The code generator's scratch registers, whose values are renamed, and the
+// registers it never uses, which they are renamed to
+constexpr int SCRATCH_FIRST = 0;
+constexpr int SCRATCH_LAST = 2;
+constexpr int SPARE_FIRST = 3;
+constexpr int SPARE_LAST = 8;
+
+// Memory locations an access may touch. The frame is addressed through fp,
+// and locals sit at offsets from 16 up, above the frame record, one
+// location per word. The stack below them, addressed through sp, is one
+// location. Anything else may alias anything
+constexpr int STACK_LOCATION = -1;
+constexpr int ANY_LOCATION = -2;
+constexpr int FIRST_LOCAL_OFFSET = 16;
+
+enum class Access { NONE, LOAD, STORE };
+
+struct Instruction {
+  // The original line, written back unchanged unless a register is renamed
+  std::string line;
+  std::string opcode;
+  std::vector<std::string> operands;
+
+  // nullptr for anything the model does not know, which is left in place
+  const OpcodeModel *model = nullptr;
+  bool is_branch = false;
+
+  std::vector<int> uses;
+  std::vector<int> defs;
+  std::vector<int> def_latencies;
+
+  Access access = Access::NONE;
+  std::vector<int> locations;
+
+  // Register operands that only name a value defined or used, and so may be
+  // renamed. Tied and implicit operands are not listed
+  int def_operand = -1;
+  std::vector<int> use_operands;
+
+  bool renamed = false;
+};
+
+std::string_view trim(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+// Number of a register operand, or -1 for anything else (including the
+// zero register)
+int register_number(std::string_view operand) {
+  if (operand == "sp") {
+    return SP;
+  }
+  if (operand == "fp") {
+    return 29;
+  }
+  if (operand == "lr") {
+    return 30;
+  }
+  if (operand.size() < 2 || (operand[0] != 'w' && operand[0] != 'x')) {
+    return -1;
+  }
+
+  int number = 0;
+  for (char c : operand.substr(1)) {
+    if (c < '0' || c > '9') {
+      return -1;
+    }
+    number = number * 10 + (c - '0');
+  }
+  return number <= 30 ? number : -1;
+}
+
+int register_size(std::string_view operand) {
+  return operand[0] == 'w' ? 4 : 8;
+}
+
+const OpcodeModel *find_model(std::string_view opcode) {
+  // Conditional branches share the model of b
+  if (opcode.substr(0, 2) == "b.") {
+    opcode = "b";
+  }
+  for (const OpcodeModel &model : OPCODE_MODELS) {
+    if (model.opcode == opcode) {
+      return &model;
+    }
+  }
+  return nullptr;
+}
+
+// Fills in the registers and memory 'instruction' reads and writes from
+// its opcode and operands
+void analyze(Instruction &instruction) {
+  instruction.uses.clear();
+  instruction.defs.clear();
+  instruction.def_latencies.clear();
+  instruction.def_operand = -1;
+  instruction.use_operands.clear();
+  instruction.access = Access::NONE;
+  instruction.locations.clear();
+
+  instruction.model = find_model(instruction.opcode);
+  if (instruction.model == nullptr) {
+    return;
+  }
+
+  const std::string &opcode = instruction.opcode;
+  const std::vector<std::string> &operands = instruction.operands;
+  int latency = instruction.model->latency;
+
+  auto use_operand = [&](int index) {
+    int number = register_number(operands[index]);
+    if (number >= 0) {
+      instruction.uses.push_back(number);
+      instruction.use_operands.push_back(index);
+    }
+  };
+  auto define = [&](int number, int def_latency) {
+    if (number < 0) {
+      return;
+    }
+    instruction.defs.push_back(number);
+    instruction.def_latencies.push_back(def_latency);
+  };
+  auto def_operand = [&](int index) {
+    int number = register_number(operands[index]);
+    if (number >= 0) {
+      define(number, latency);
+      instruction.def_operand = index;
+    }
+  };
+
+  int memory = -1;
+  for (std::size_t i = 0; i < operands.size(); ++i) {
+    if (!operands[i].empty() && operands[i][0] == '[') {
+      memory = static_cast<int>(i);
+      break;
+    }
+  }
+
+  if (opcode == "b" || opcode.substr(0, 2) == "b.") {
+    instruction.is_branch = true;
+    if (opcode != "b") {
+      instruction.uses.push_back(FLAGS);
+    }
+  } else if (opcode == "cbz" || opcode == "cbnz" || opcode == "tbz" ||
+             opcode == "tbnz") {
+    instruction.is_branch = true;
+    use_operand(0);
+  } else if (opcode == "ret") {
+    // Returns the value in w0 to the address in lr
+    instruction.is_branch = true;
+    instruction.uses.push_back(0);
+    instruction.uses.push_back(30);
+  } else if (memory >= 0) {
+    bool load = opcode == "ldr" || opcode == "ldp";
+    instruction.access = load ? Access::LOAD : Access::STORE;
+
+    int size = 0;
+    for (int i = 0; i < memory; ++i) {
+      size += register_size(operands[i]);
+      if (load && memory == 1) {
+        def_operand(i);
+      } else if (load) {
+        define(register_number(operands[i]), latency);
+      } else if (memory == 1) {
+        use_operand(i);
+      } else {
+        instruction.uses.push_back(register_number(operands[i]));
+      }
+    }
+    instruction.uses.erase(
+        std::remove(instruction.uses.begin(), instruction.uses.end(), -1),
+        instruction.uses.end());
+
+    // [base], [base, #offset], [base, #offset]! (pre-indexed) or
+    // [base], #offset (post-indexed, which accesses the base address)
+    std::string_view address = operands[memory];
+    bool pre_indexed = address.back() == '!';
+    bool post_indexed = memory + 1 < static_cast<int>(operands.size());
+    address = address.substr(1, address.find(']') - 1);
+
+    std::size_t comma = address.find(',');
+    int base = register_number(trim(address.substr(0, comma)));
+    int offset = 0;
+    if (comma != std::string_view::npos) {
+      std::string_view immediate = trim(address.substr(comma + 1));
+      if (!immediate.empty() && immediate[0] == '#') {
+        offset = std::stoi(std::string(immediate.substr(1)));
+      }
+    }
+
+    instruction.uses.push_back(base);
+    if (pre_indexed || post_indexed) {
+      define(base, WRITEBACK_LATENCY);
+    }
+
+    if (base == SP) {
+      instruction.locations.push_back(STACK_LOCATION);
+    } else if (base == 29 && offset >= FIRST_LOCAL_OFFSET && size > 0) {
+      for (int word = offset / 4; word <= (offset + size - 1) / 4; ++word) {
+        instruction.locations.push_back(word);
+      }
+    } else {
+      instruction.locations.push_back(ANY_LOCATION);
+    }
+  } else if (opcode == "movk") {
+    // Keeps the lower half of its destination
+    int number = register_number(operands[0]);
+    instruction.uses.push_back(number);
+    define(number, latency);
+  } else if (opcode == "cmp" || opcode == "cmn" || opcode == "ccmp" ||
+             opcode == "ccmn" || opcode == "tst") {
+    use_operand(0);
+    use_operand(1);
+    if (opcode == "ccmp" || opcode == "ccmn") {
+      instruction.uses.push_back(FLAGS);
+    }
+    define(FLAGS, latency);
+  } else {
+    std::string_view last = operands.empty() ? "" : operands.back();
+    std::string_view shift = last.substr(0, 3);
+    if ((shift == "lsl" || shift == "lsr" || shift == "asr") &&
+        operands.size() > 3 &&
+        register_number(operands[operands.size() - 2]) >= 0) {
+      latency = SHIFTED_OPERAND_LATENCY;
+    }
+
+    def_operand(0);
+    for (std::size_t i = 1; i < operands.size(); ++i) {
+      use_operand(static_cast<int>(i));
+    }
+
+    // The conditional selects read the flags, and the s forms write them
+    if (opcode == "cset" || opcode == "csetm" || opcode == "csel" ||
+        opcode == "csinc" || opcode == "csinv" || opcode == "csneg" ||
+        opcode == "cinc" || opcode == "cneg") {
+      instruction.uses.push_back(FLAGS);
+    } else if (opcode == "ands" || opcode == "adds" || opcode == "subs") {
+      define(FLAGS, latency);
+    }
+  }
+}
+
+Instruction parse_instruction(const std::string &line) {
+  Instruction instruction;
+  instruction.line = line;
+
+  std::string_view text = trim(line);
+  std::size_t split = text.find_first_of(" \t");
+  instruction.opcode = std::string(text.substr(0, split));
+
+  // Operands are separated by commas outside brackets
+  if (split != std::string_view::npos) {
+    std::string_view rest = text.substr(split + 1);
+    int depth = 0;
+    std::size_t start = 0;
+    for (std::size_t i = 0; i <= rest.size(); ++i) {
+      if (i == rest.size() || (rest[i] == ',' && depth == 0)) {
+        instruction.operands.emplace_back(trim(rest.substr(start, i - start)));
+        start = i + 1;
+      } else if (rest[i] == '[') {
+        ++depth;
+      } else if (rest[i] == ']') {
+        --depth;
+      }
+    }
+  }
+
+  analyze(instruction);
+  return instruction;
+}
+
+std::string format_instruction(const Instruction &instruction) {
+  if (!instruction.renamed) {
+    return instruction.line;
+  }
+
+  std::string line = "\t" + instruction.opcode;
+  for (std::size_t i = 0; i < instruction.operands.size(); ++i) {
+    line += (i == 0 ? "\t" : ", ") + instruction.operands[i];
+  }
+  return line;
+}
+
+// Gives each scratch register value that dies inside the block a spare
+// register of its own, so reusing the scratch register does not order the
+// instructions around it
+void rename_registers(std::vector<Instruction> &block) {
+  std::array<bool, REGISTER_COUNT> mentioned{};
+  for (const Instruction &instruction : block) {
+    for (int number : instruction.uses) {
+      mentioned[number] = true;
+    }
+    for (int number : instruction.defs) {
+      mentioned[number] = true;
+    }
+  }
+
+  // Index of the last use of the value each spare register holds
+  std::vector<std::pair<int, int>> spares;
+  for (int number = SPARE_FIRST; number <= SPARE_LAST; ++number) {
+    if (!mentioned[number]) {
+      spares.push_back({-1, number});
+    }
+  }
+  if (spares.empty()) {
+    return;
+  }
+
+  int count = static_cast<int>(block.size());
+  for (int i = 0; i < count; ++i) {
+    Instruction &definer = block[i];
+    if (definer.def_operand < 0 || definer.operands[definer.def_operand][0] != 'w') {
+      continue;
+    }
+    int number = register_number(definer.operands[definer.def_operand]);
+    if (number < SCRATCH_FIRST || number > SCRATCH_LAST) {
+      continue;
+    }
+
+    // The value must be overwritten in the block, and only be read through
+    // operands that can be renamed before then
+    int last_use = i;
+    int redefined = -1;
+    bool renamable = true;
+    for (int j = i + 1; j < count && redefined < 0 && renamable; ++j) {
+      const Instruction &user = block[j];
+      int plain_uses = 0;
+      for (int operand : user.use_operands) {
+        if (register_number(user.operands[operand]) == number) {
+          renamable = renamable && user.operands[operand][0] == 'w';
+          ++plain_uses;
+        }
+      }
+      int uses = static_cast<int>(
+          std::count(user.uses.begin(), user.uses.end(), number));
+      if (uses != plain_uses) {
+        renamable = false;
+      }
+      if (uses > 0) {
+        last_use = j;
+      }
+      if (std::find(user.defs.begin(), user.defs.end(), number) !=
+          user.defs.end()) {
+        redefined = j;
+      }
+    }
+    if (!renamable || redefined < 0) {
+      continue;
+    }
+
+    // The spare that has been free the longest, so values sharing one are
+    // far apart
+    auto spare = std::min_element(spares.begin(), spares.end());
+    if (spare->first >= i) {
+      continue;
+    }
+    std::string name = "w" + std::to_string(spare->second);
+    spare->first = last_use;
+
+    definer.operands[definer.def_operand] = name;
+    definer.renamed = true;
+    analyze(definer);
+    for (int j = i + 1; j <= last_use; ++j) {
+      Instruction &user = block[j];
+      for (int operand : user.use_operands) {
+        if (register_number(user.operands[operand]) == number) {
+          user.operands[operand] = name;
+          user.renamed = true;
+        }
+      }
+      analyze(user);
+    }
+  }
+}
+
+struct Dependency {
+  int to;
+  int latency;
+};
+
+// Edges from each instruction to those that have to come after it, with the
+// cycles the later one waits
+std::vector<std::vector<Dependency>>
+build_dependencies(const std::vector<Instruction> &block) {
+  std::vector<std::vector<Dependency>> successors(block.size());
+  auto depend = [&](int from, int to, int latency) {
+    if (from >= 0) {
+      successors[from].push_back({to, latency});
+    }
+  };
+  // Only a load waits for an earlier store, other accesses keep their order
+  auto depend_memory = [&](int from, int to) {
+    if (from >= 0) {
+      bool forwarded = block[from].access == Access::STORE &&
+                       block[to].access == Access::LOAD;
+      depend(from, to, forwarded ? STORE_TO_LOAD_LATENCY : 0);
+    }
+  };
+
+  std::array<int, REGISTER_COUNT> last_def;
+  std::array<int, REGISTER_COUNT> def_latency{};
+  std::array<std::vector<int>, REGISTER_COUNT> uses_since_def;
+  last_def.fill(-1);
+
+  struct Location {
+    int last_store = -1;
+    std::vector<int> loads;
+  };
+  std::unordered_map<int, Location> locations;
+  int last_any = -1;
+  std::vector<int> since_any;
+
+  for (int i = 0; i < static_cast<int>(block.size()); ++i) {
+    const Instruction &instruction = block[i];
+
+    for (int number : instruction.uses) {
+      depend(last_def[number], i, def_latency[number]);
+    }
+    for (std::size_t d = 0; d < instruction.defs.size(); ++d) {
+      int number = instruction.defs[d];
+      depend(last_def[number], i, 0);
+      for (int user : uses_since_def[number]) {
+        if (user != i) {
+          depend(user, i, 0);
+        }
+      }
+      uses_since_def[number].clear();
+      last_def[number] = i;
+      def_latency[number] = instruction.def_latencies[d];
+    }
+    for (int number : instruction.uses) {
+      if (last_def[number] != i) {
+        uses_since_def[number].push_back(i);
+      }
+    }
+
+    if (instruction.access == Access::NONE) {
+      continue;
+    }
+
+    if (instruction.locations[0] == ANY_LOCATION) {
+      for (int earlier : since_any) {
+        depend_memory(earlier, i);
+      }
+      depend_memory(last_any, i);
+      since_any.clear();
+      locations.clear();
+      last_any = i;
+      continue;
+    }
+
+    depend_memory(last_any, i);
+    for (int key : instruction.locations) {
+      Location &location = locations[key];
+      depend_memory(location.last_store, i);
+      if (instruction.access == Access::LOAD) {
+        location.loads.push_back(i);
+      } else {
+        for (int reader : location.loads) {
+          depend(reader, i, 0);
+        }
+        location.loads.clear();
+        location.last_store = i;
+      }
+    }
+    since_any.push_back(i);
+  }
+
+  return successors;
+}
+
+// Tracks when each pipe is next free
+class Pipes {
+public:
+  Pipes() {
+    for (int kind = 0; kind < PIPE_KINDS; ++kind) {
+      free_at[kind].assign(PIPE_COUNT[kind], 0);
+    }
+  }
+
+  // The first cycle from 'cycle' on with a pipe free for 'model'
+  int available(const OpcodeModel &model, int cycle) const {
+    const std::vector<int> &pipes = free_at[static_cast<int>(model.pipe)];
+    return std::max(cycle, *std::min_element(pipes.begin(), pipes.end()));
+  }
+
+  // Occupies a pipe that is free at 'cycle'
+  void issue(const OpcodeModel &model, int cycle) {
+    std::vector<int> &pipes = free_at[static_cast<int>(model.pipe)];
+    *std::min_element(pipes.begin(), pipes.end()) = cycle + model.occupancy;
+  }
+
+private:
+  std::array<std::vector<int>, PIPE_KINDS> free_at;
+};
+
+// List scheduling: each cycle issues up to ISSUE_WIDTH of the instructions
+// whose operands are ready, the ones with the longest path to the end of
+// the block first. The branch ending the block, if any, stays last
+std::vector<Instruction> schedule_block(std::vector<Instruction> block) {
+  rename_registers(block);
+
+  std::vector<Instruction> branch;
+  if (!block.empty() && block.back().is_branch) {
+    branch.push_back(std::move(block.back()));
+    block.pop_back();
+  }
+
+  int count = static_cast<int>(block.size());
+  std::vector<std::vector<Dependency>> successors = build_dependencies(block);
+
+  std::vector<int> height(count, 0);
+  std::vector<int> waiting_on(count, 0);
+  for (int i = count - 1; i >= 0; --i) {
+    height[i] = block[i].model->latency;
+    for (const Dependency &dependency : successors[i]) {
+      height[i] = std::max(height[i], dependency.latency + height[dependency.to]);
+      ++waiting_on[dependency.to];
+    }
+  }
+
+  // Ties go to the earlier instruction, so independent code keeps its order
+  auto lower_priority = [&](int a, int b) {
+    return height[a] != height[b] ? height[a] < height[b] : a > b;
+  };
+  std::priority_queue<int, std::vector<int>, decltype(lower_priority)> ready(
+      lower_priority);
+
+  // Instructions whose dependencies are all issued, by the cycle their
+  // operands are ready
+  using Pending = std::pair<int, int>;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>>
+      pending;
+
+  std::vector<int> earliest(count, 0);
+  for (int i = 0; i < count; ++i) {
+    if (waiting_on[i] == 0) {
+      pending.push({0, i});
+    }
+  }
+
+  std::vector<Instruction> scheduled;
+  scheduled.reserve(block.size() + branch.size());
+  Pipes pipes;
+  int cycle = 0;
+
+  while (static_cast<int>(scheduled.size()) < count) {
+    while (!pending.empty() && pending.top().first <= cycle) {
+      ready.push(pending.top().second);
+      pending.pop();
+    }
+
+    int issued = 0;
+    std::vector<int> blocked;
+    while (issued < ISSUE_WIDTH && !ready.empty()) {
+      int next = ready.top();
+      ready.pop();
+      if (pipes.available(*block[next].model, cycle) > cycle) {
+        blocked.push_back(next);
+        continue;
+      }
+
+      pipes.issue(*block[next].model, cycle);
+      ++issued;
+      for (const Dependency &dependency : successors[next]) {
+        int later = dependency.to;
+        earliest[later] = std::max(earliest[later], cycle + dependency.latency);
+        if (--waiting_on[later] == 0) {
+          if (earliest[later] <= cycle) {
+            ready.push(later);
+          } else {
+            pending.push({earliest[later], later});
+          }
+        }
+      }
+      scheduled.push_back(std::move(block[next]));
+    }
+    for (int next : blocked) {
+      ready.push(next);
+    }
+
+    ++cycle;
+    if (ready.empty() && !pending.empty()) {
+      cycle = std::max(cycle, pending.top().first);
+    }
+  }
+
+  for (Instruction &instruction : branch) {
+    scheduled.push_back(std::move(instruction));
+  }
+  return scheduled;
+}
+
+// Cycles until every result of the block is ready, issuing its
+// instructions in order
+int block_cycles(const std::vector<Instruction> &block) {
+  std::array<int, REGISTER_COUNT> ready{};
+  std::unordered_map<int, int> stored;
+  int any_stored = 0;
+  Pipes pipes;
+
+  int cycle = 0;
+  int issued = 0;
+  int done = 0;
+
+  for (const Instruction &instruction : block) {
+    int start = cycle;
+    for (int number : instruction.uses) {
+      start = std::max(start, ready[number]);
+    }
+    if (instruction.access == Access::LOAD) {
+      for (int key : instruction.locations) {
+        start = std::max(start, key == ANY_LOCATION ? any_stored : stored[key]);
+      }
+      start = std::max(start, any_stored);
+    }
+    start = pipes.available(*instruction.model, start);
+    if (start == cycle && issued == ISSUE_WIDTH) {
+      start = pipes.available(*instruction.model, cycle + 1);
+    }
+
+    if (start > cycle) {
+      cycle = start;
+      issued = 0;
+    }
+    pipes.issue(*instruction.model, cycle);
+    ++issued;
+
+    for (std::size_t d = 0; d < instruction.defs.size(); ++d) {
+      ready[instruction.defs[d]] = cycle + instruction.def_latencies[d];
+    }
+    if (instruction.access == Access::STORE) {
+      for (int key : instruction.locations) {
+        int at = cycle + STORE_TO_LOAD_LATENCY;
+        if (key == ANY_LOCATION) {
+          any_stored = at;
+        } else {
+          stored[key] = at;
+        }
+      }
+    }
+    done = std::max(done, cycle + instruction.model->latency);
+  }
+
+  return done;
+}
+
+std::vector<std::string> split_lines(const std::string &text) {
+  std::vector<std::string> lines;
+  std::size_t start = 0;
+  while (true) {
+    std::size_t end = text.find('\n', start);
+    lines.push_back(text.substr(start, end - start));
+    if (end == std::string::npos) {
+      return lines;
+    }
+    start = end + 1;
+  }
+}
+
+bool is_instruction(const std::string &line) {
+  return line.size() > 1 && line[0] == '\t' && line[1] != '.';
+}
+
+// Splits 'assembly' into basic blocks, passing each to 'visit' along with
+// the label it starts at, if any. Every other line goes to 'other'
+template <class Visit, class Other>
+void for_each_block(const std::string &assembly, Visit visit, Other other) {
+  std::vector<Instruction> block;
+  std::string label;
+
+  auto flush = [&] {
+    if (!block.empty()) {
+      visit(std::move(block), label);
+      block.clear();
+    }
+    label.clear();
+  };
+
+  for (const std::string &line : split_lines(assembly)) {
+    if (!is_instruction(line)) {
+      flush();
+      if (!line.empty() && line.back() == ':') {
+        label = line.substr(0, line.size() - 1);
+      }
+      other(line);
+      continue;
+    }
+
+    Instruction instruction = parse_instruction(line);
+    if (instruction.model == nullptr) {
+      // Unknown instructions stay in place, between blocks
+      flush();
+      other(line);
+      continue;
+    }
+
+    bool ends_block = instruction.is_branch;
+    block.push_back(std::move(instruction));
+    if (ends_block) {
+      flush();
+    }
+  }
+  flush();
+}
+
+} // namespace
+
+std::string schedule_instructions(const std::string &assembly) {
+  AllocationScope allocation_scope(Subsystem::CODEGEN);
+  std::string scheduled;
+  scheduled.reserve(assembly.size());
+  bool first = true;
+
+  auto write = [&](const std::string &line) {
+    if (!first) {
+      scheduled += '\n';
+    }
+    scheduled += line;
+    first = false;
+  };
+
+  for_each_block(
+      assembly,
+      [&](std::vector<Instruction> block, const std::string &) {
+        for (const Instruction &instruction : schedule_block(std::move(block))) {
+          write(format_instruction(instruction));
+        }
+      },
+      write);
+
+  return scheduled;
+}
+
+CycleEstimate estimate_cycles(const std::string &assembly) {
+  CycleEstimate estimate;
+
+  for_each_block(
+      assembly,
+      [&](std::vector<Instruction> block, const std::string &label) {
+        CycleEstimate::Block counted;
+        counted.label = label;
+        counted.instructions = static_cast<int>(block.size());
+        counted.cycles = block_cycles(block);
+
+        estimate.instructions += counted.instructions;
+        estimate.cycles += counted.cycles;
+        estimate.blocks.push_back(std::move(counted));
+      },
+      [](const std::string &) {});
+
+  return estimate;
+}
@@ -0,0 +1,57 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <string>
+#include <vector>
+
+/*
+Instruction scheduling and a static cycle estimate for the emitted AArch64
+assembly, both driven by a latency and issue-pipe model of the Cortex-A72
+(three instructions issued per cycle to two integer pipes and one each for
+multiplies and divides, loads, stores and branches).
+
+The code generator walks the tree in order, so each load sits right before
+its use and results of mul and sdiv are used on the next instruction. The
+scheduler works on the assembly text, one basic block at a time (a block
+ends at a label or a branch), and reorders the instructions into an order
+that hides those latencies:
+
+- Nearly every value passes through w0-w2, which serializes the block on
+  false dependencies. First, each value that is dead by the end of the block
+  is renamed to a register nothing else uses (w3-w8).
+- The block is then list scheduled: among the instructions whose
+  dependencies are met, the one with the longest latency path to the end of
+  the block issues first. Register dependencies include the flags and the
+  stack pointer. Accesses to the same frame slot stay in order, and so do
+  stack pushes and pops. Any other memory access stays in order with all of
+  them.
+
+Branches stay last in their block, and lines that are not instructions
+(labels, directives) stay where they are.
+
+The estimate issues each block's instructions in the order they are written,
+waiting for operands and pipes, and counts the cycles until the last result
+is ready. It is the same on any path through the function, as every block
+is counted once. An out-of-order core hides part of the latency itself, so
+this is an upper bound for the A72 that shows what the order written costs.
+*/
+
+// Returns 'assembly' with the instructions of each basic block reordered
+std::string schedule_instructions(const std::string &assembly);
+
+struct CycleEstimate {
+  struct Block {
+    // The label the block starts at, empty if it follows a branch
+    std::string label;
+    int instructions = 0;
+    int cycles = 0;
+  };
+
+  std::vector<Block> blocks;
+  int instructions = 0;
+  int cycles = 0;
+};
+
+CycleEstimate estimate_cycles(const std::string &assembly);
+
+#endif
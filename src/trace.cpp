@@ -0,0 +1,146 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+std::atomic<bool> trace_enabled{false};
+
+namespace {
+
+struct TraceEvent {
+  const char *name;
+  const char *category;
+  std::int64_t start;
+  std::int64_t duration;
+};
+
+struct TraceBuffer {
+  int thread_id;
+  std::vector<TraceEvent> events;
+
+  // Spans recorded so far, of which the last TRACE_BUFFER_EVENTS are kept
+  std::uint64_t recorded = 0;
+};
+
+// Of start_tracing, in steady_clock nanoseconds. Threads already recording
+// spans may read it while tracing is restarted
+std::atomic<std::int64_t> trace_start{0};
+
+std::int64_t steady_nanoseconds() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Every thread's buffer, owned here so it outlives the thread
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> buffers;
+
+TraceBuffer &thread_buffer() {
+  thread_local TraceBuffer *buffer = nullptr;
+  if (buffer == nullptr) {
+    auto created = std::make_unique<TraceBuffer>();
+    created->events.reserve(TRACE_BUFFER_EVENTS);
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    created->thread_id = static_cast<int>(buffers.size()) + 1;
+    buffer = created.get();
+    buffers.push_back(std::move(created));
+  }
+  return *buffer;
+}
+
+// Microseconds, the unit of the trace format, from nanoseconds
+std::string microseconds(std::int64_t nanoseconds) {
+  std::string text = std::to_string(nanoseconds / 1000) + ".";
+  std::string fraction = std::to_string(nanoseconds % 1000);
+  return text + std::string(3 - fraction.size(), '0') + fraction;
+}
+
+// Span names are literals of ours, but keep the JSON valid regardless
+std::string json_string(const char *text) {
+  std::string quoted = "\"";
+  for (const char *c = text; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') {
+      quoted += '\\';
+    }
+    quoted += *c;
+  }
+  return quoted + "\"";
+}
+
+} // namespace
+
+std::int64_t trace_now() {
+  return steady_nanoseconds() - trace_start.load(std::memory_order_relaxed);
+}
+
+void record_span(const char *name, const char *category, std::int64_t start) {
+  TraceBuffer &buffer = thread_buffer();
+  TraceEvent event{name, category, start, trace_now() - start};
+
+  if (buffer.events.size() < TRACE_BUFFER_EVENTS) {
+    buffer.events.push_back(event);
+  } else {
+    buffer.events[buffer.recorded % TRACE_BUFFER_EVENTS] = event;
+  }
+  ++buffer.recorded;
+}
+
+void start_tracing() {
+  trace_start.store(steady_nanoseconds(), std::memory_order_relaxed);
+  trace_enabled.store(true, std::memory_order_release);
+}
+
+void write_trace(std::ostream &out) {
+  std::lock_guard<std::mutex> lock(buffers_mutex);
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  auto separate = [&] {
+    out << (first ? "\n" : ",\n");
+    first = false;
+  };
+
+  for (const auto &buffer : buffers) {
+    separate();
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+        << buffer->thread_id << ",\"args\":{\"name\":\"thread "
+        << buffer->thread_id << "\"}}";
+
+    for (const TraceEvent &event : buffer->events) {
+      separate();
+      out << "{\"name\":" << json_string(event.name)
+          << ",\"cat\":" << json_string(event.category)
+          << ",\"ph\":\"X\",\"ts\":" << microseconds(event.start)
+          << ",\"dur\":" << microseconds(event.duration)
+          << ",\"pid\":1,\"tid\":" << buffer->thread_id << "}";
+    }
+
+    if (buffer->recorded > TRACE_BUFFER_EVENTS) {
+      separate();
+      out << "{\"name\":\"dropped_spans\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+          << buffer->thread_id << ",\"args\":{\"count\":"
+          << buffer->recorded - TRACE_BUFFER_EVENTS << "}}";
+    }
+  }
+
+  out << "\n]}\n";
+}
+
+void write_trace(const std::string &file_path) {
+  std::ofstream out(file_path);
+  if (!out) {
+    throw std::runtime_error("Failed to open trace file for writing");
+  }
+  write_trace(out);
+}
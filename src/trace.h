@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/*
+Spans of time spent in compiler phases and passes, written out in the Chrome
+trace event format (load the file in chrome://tracing or ui.perfetto.dev).
+
+A TraceSpan covers the scope it is declared in. Tracing is off until
+start_tracing is called, and a span then costs one load and a branch, so
+spans can stay in hot paths. Once on, each thread records its spans into a
+ring buffer of its own without locking, keeping the latest
+TRACE_BUFFER_EVENTS of them. Buffers outlive their threads, so spans of
+worker threads (see lex_parallel) still show up in the trace.
+
+Span names and categories are not copied and must be string literals (or
+otherwise outlive the trace).
+
+Spans are as fine as the parser's entry points: parse_function, each
+parse_statements (one per block) and each parse_expression, which covers a
+whole expression statement or condition rather than each subexpression.
+Lexing, resolution, each pass and codegen get one span each. A large input
+can record more parse spans than a buffer keeps, and the trace then notes
+how many were dropped.
+*/
+
+// Spans kept per thread, older ones are overwritten
+constexpr int TRACE_BUFFER_EVENTS = 1 << 16;
+
+extern std::atomic<bool> trace_enabled;
+
+// Nanoseconds since tracing started
+std::int64_t trace_now();
+
+// Records a finished span on the calling thread
+void record_span(const char *name, const char *category, std::int64_t start);
+
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name, const char *category = "compiler")
+      : name(name), category(category) {
+    // Acquire, so the start time set before tracing was enabled is seen
+    if (trace_enabled.load(std::memory_order_acquire)) {
+      start = trace_now();
+    }
+  }
+
+  ~TraceSpan() {
+    if (start >= 0) {
+      record_span(name, category, start);
+    }
+  }
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+  const char *name;
+  const char *category;
+
+  // -1 if tracing was off when the span began
+  std::int64_t start = -1;
+};
+
+// Turns tracing on, with timestamps counted from now
+void start_tracing();
+
+// Writes every recorded span as Chrome trace JSON. Threads that record
+// spans must have finished or be idle while it runs
+void write_trace(std::ostream &out);
+void write_trace(const std::string &file_path);
+
+#endif
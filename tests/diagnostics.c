@@ -0,0 +1,10 @@
+int main() {
+  int a = 1;
+  int a = 2;
+  int b = b + 1;
+  {
+    int a = 3;
+    c = a;
+  }
+  return d;
+}
@@ -0,0 +1,16 @@
+int main() {
+  int a = 2 * 3;
+  int b = a * a + 3;
+  {
+    int a = b - 1;
+    b = (a + b) * (a + b) % 1000;
+  }
+  int i = 0;
+  int c = (a + b) * (a + b) % 1000;
+  while (i < 4) {
+    int t = c * 3 + i;
+    c = (t + c * 3) % 997;
+    i = i + 1;
+  }
+  return a + b + c;
+}
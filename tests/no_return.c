@@ -0,0 +1,6 @@
+int main() {
+  int x = 3;
+  while (x > 0) {
+    x = x - 1;
+  }
+}